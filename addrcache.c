@@ -0,0 +1,247 @@
+/**
+ * Cache of recently whitelisted addresses.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Implementation notes:
+ *  - Open addressing with linear probing over at most ADDR_CACHE_PROBES slots.
+ *    When all of them are in use, the entry that expires first is replaced, so
+ *    entries are never removed and no tombstones are needed.
+ *  - An address is only in the set once the writer committed the request
+ *    that adds it. Entries remember the sequence number of that request (see
+ *    writer_last_seq) and the cache counts completed requests, which finish
+ *    in order. Until then, other packets with the address must wait for the
+ *    same commit. If a commit fails, it is unknown which addresses are in the
+ *    set, so the cache is cleared.
+ *  - The cache is not thread-safe, every worker has its own cache. The writer
+ *    has another one that only remembers expiry times (addr_cache_extend),
+ *    adding an address again would otherwise overwrite a longer timeout that
+ *    another worker (or response) requested.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dnsallow.h"
+
+/* Maximum number of slots that are inspected for a single address. */
+#define ADDR_CACHE_PROBES   8
+
+struct addr_cache_entry {
+    uint32_t expires;   /* Zero for unused slots. */
+    uint32_t seq;       /* Writer request that adds the address. */
+    uint32_t family;    /* The client group in the upper 16 bits. */
+    union {
+        struct in_addr ip4_addr;
+        struct in6_addr ip6_addr;
+        uint64_t words[2];
+    };
+};
+
+struct addr_cache {
+    struct addr_cache_entry *entries;
+    unsigned mask;      /* Number of entries minus one. */
+    uint32_t committed; /* Number of completed writer requests. */
+    unsigned long hits;
+    unsigned long misses;
+};
+
+static inline uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Copies the address into the key format (unused bytes are zero). */
+static void make_key(struct addr_cache_entry *key, const struct address *addr,
+        unsigned group)
+{
+    key->family = addr->family | group << 16;
+    key->words[0] = key->words[1] = 0;
+    if (addr->family == AF_INET)
+        key->ip4_addr = addr->ip4_addr;
+    else
+        key->ip6_addr = addr->ip6_addr;
+}
+
+static inline unsigned key_hash(const struct addr_cache_entry *key)
+{
+    return mix64(key->words[0] ^ mix64(key->words[1] + key->family));
+}
+
+static inline bool key_equal(const struct addr_cache_entry *a,
+        const struct addr_cache_entry *b)
+{
+    return a->words[0] == b->words[0] && a->words[1] == b->words[1] &&
+        a->family == b->family;
+}
+
+/**
+ * Creates a cache for 'size' addresses (rounded up to a power of two).
+ */
+struct addr_cache *addr_cache_init(unsigned size)
+{
+    struct addr_cache *cache;
+    unsigned n = ADDR_CACHE_PROBES;
+
+    while (n < size)
+        n <<= 1;
+
+    cache = calloc(1, sizeof(*cache));
+    if (!cache)
+        return NULL;
+
+    cache->entries = calloc(n, sizeof(*cache->entries));
+    if (!cache->entries) {
+        free(cache);
+        return NULL;
+    }
+
+    cache->mask = n - 1;
+    return cache;
+}
+
+/* Whether the request with the given sequence number has not completed. */
+static inline bool in_flight(const struct addr_cache *cache, uint32_t seq)
+{
+    return (int32_t)(seq - cache->committed) > 0;
+}
+
+/**
+ * Returns the entry for the key, or the slot where it must be stored (which
+ * may hold another key) and sets 'found' to false.
+ */
+static struct addr_cache_entry *find_entry(struct addr_cache *cache,
+        const struct addr_cache_entry *key, bool *found)
+{
+    struct addr_cache_entry *entry, *victim = NULL;
+    unsigned i, slot = key_hash(key);
+
+    *found = false;
+    for (i = 0; i < ADDR_CACHE_PROBES; i++) {
+        entry = &cache->entries[(slot + i) & cache->mask];
+        /* Slots are never cleared, so the address is not further away. */
+        if (!entry->expires)
+            return entry;
+        if (key_equal(entry, key)) {
+            *found = true;
+            return entry;
+        }
+        /* Prefer expired slots, otherwise the entry that expires first. */
+        if (!victim || entry->expires < victim->expires)
+            victim = entry;
+    }
+    return victim;
+}
+
+/**
+ * Returns ADDR_PRESENT if the address was recently added to the sets of the
+ * client group and at least half of its lifetime remains, or ADDR_PENDING if
+ * the request that adds it was not committed yet. Otherwise it is remembered
+ * to expire 'lifetime' seconds after 'now' and ADDR_MISSING is returned, the
+ * caller must then add (or refresh) the address with writer request 'seq'.
+ */
+enum addr_state addr_cache_check(struct addr_cache *cache,
+        const struct address *addr, unsigned group, uint32_t now,
+        uint32_t lifetime, uint32_t seq)
+{
+    struct addr_cache_entry key, *entry;
+    bool found;
+
+    make_key(&key, addr, group);
+    entry = find_entry(cache, &key, &found);
+
+    if (found) {
+        if (in_flight(cache, entry->seq)) {
+            cache->hits++;
+            return ADDR_PENDING;
+        }
+        if (entry->expires > now && entry->expires - now >= lifetime / 2) {
+            cache->hits++;
+            return ADDR_PRESENT;
+        }
+        /* An entry that is refreshed remains in the set meanwhile. */
+        if (entry->expires <= now)
+            entry->seq = seq;
+        entry->expires = now + lifetime;
+        cache->misses++;
+        return ADDR_MISSING;
+    }
+
+    cache->misses++;
+    *entry = key;
+    entry->expires = now + lifetime;
+    entry->seq = seq;
+    return ADDR_MISSING;
+}
+
+/**
+ * Returns the timeout (in seconds, zero for permanent entries) with which an
+ * address must be added to the sets of a group at 'now', such that an entry
+ * that was added before with a later expiry time is not shortened. The
+ * resulting expiry time is remembered.
+ */
+uint32_t addr_cache_extend(struct addr_cache *cache,
+        const struct address *addr, unsigned group, uint32_t now,
+        uint32_t timeout)
+{
+    struct addr_cache_entry key, *entry;
+    uint32_t expires = timeout ? now + timeout : UINT32_MAX;
+    bool found;
+
+    make_key(&key, addr, group);
+    entry = find_entry(cache, &key, &found);
+
+    if (found && entry->expires > expires) {
+        cache->hits++;
+        expires = entry->expires;
+    } else {
+        if (!found)
+            *entry = key;
+        entry->expires = expires;
+        cache->misses++;
+    }
+    return expires == UINT32_MAX ? 0 : expires - now;
+}
+
+/**
+ * Records that the oldest writer request in flight was completed. If its
+ * commit failed, all addresses are forgotten.
+ */
+void addr_cache_commit(struct addr_cache *cache, bool ok)
+{
+    cache->committed++;
+    if (!ok)
+        memset(cache->entries, 0,
+                (size_t)(cache->mask + 1) * sizeof(*cache->entries));
+}
+
+void addr_cache_stats(const struct addr_cache *cache, unsigned long *hits,
+        unsigned long *misses)
+{
+    *hits = cache->hits;
+    *misses = cache->misses;
+}
+
+void addr_cache_fini(struct addr_cache *cache)
+{
+    free(cache->entries);
+    free(cache);
+}
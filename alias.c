@@ -0,0 +1,217 @@
+/**
+ * Cache of names that were reached through a CNAME from an allowed name.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * If the policy allows X and a response for X contains a CNAME to Y, then Y is
+ * remembered until the CNAME expires such that responses for Y (including
+ * direct queries for Y) are accepted as well. Aliases are remembered per
+ * client group since every group has its own policy.
+ *
+ * Implementation notes:
+ *  - The cache is shared by all workers since a response for Y may arrive on
+ *    another queue than the one for X.
+ *  - Set-associative: a name maps to one bucket of ALIAS_WAYS entries. When a
+ *    bucket is full, the entry that expires first is replaced.
+ *  - Buckets are protected by a fixed number of striped locks.
+ *  - The generation changes whenever a name is added or the cache is cleared,
+ *    such that decisions that depend on the absence of a name can be cached.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "dnsallow.h"
+
+#define ALIAS_WAYS      4
+#define ALIAS_LOCKS     64
+
+struct alias_entry {
+    uint64_t hash;
+    uint32_t expires;   /* Zero for unused entries. */
+    uint8_t group;
+    uint8_t len;
+    char name[255];     /* Lowercase, not NUL-terminated. */
+};
+
+struct alias_cache {
+    struct alias_entry *entries;
+    unsigned bucket_mask;   /* Number of buckets minus one. */
+    pthread_mutex_t locks[ALIAS_LOCKS];
+    atomic_uint generation;
+};
+
+/* Copies the name in lowercase and returns its hash (FNV-1a). */
+static uint64_t normalize(unsigned group, const char *name, char *out,
+        unsigned *len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ group;
+    unsigned i;
+    char c;
+
+    for (i = 0; name[i] && i < 255; i++) {
+        c = name[i];
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        out[i] = c;
+        h = (h ^ (unsigned char)c) * 0x100000001b3ULL;
+    }
+    *len = i;
+    return h;
+}
+
+/**
+ * Creates a cache for at least 'size' names (about 270 bytes per name).
+ */
+struct alias_cache *alias_cache_init(unsigned size)
+{
+    struct alias_cache *cache;
+    unsigned buckets = 1, i;
+
+    while (buckets * ALIAS_WAYS < size)
+        buckets <<= 1;
+
+    cache = calloc(1, sizeof(*cache));
+    if (!cache)
+        return NULL;
+
+    cache->entries = calloc((size_t)buckets * ALIAS_WAYS,
+            sizeof(*cache->entries));
+    if (!cache->entries) {
+        free(cache);
+        return NULL;
+    }
+
+    cache->bucket_mask = buckets - 1;
+    for (i = 0; i < ALIAS_LOCKS; i++)
+        pthread_mutex_init(&cache->locks[i], NULL);
+    return cache;
+}
+
+static inline struct alias_entry *lock_bucket(struct alias_cache *cache,
+        uint64_t hash, pthread_mutex_t **lock)
+{
+    unsigned bucket = hash & cache->bucket_mask;
+
+    *lock = &cache->locks[bucket % ALIAS_LOCKS];
+    pthread_mutex_lock(*lock);
+    return &cache->entries[(size_t)bucket * ALIAS_WAYS];
+}
+
+/**
+ * Remembers that name is an alias of a name that is allowed for a client group
+ * until 'expires'.
+ */
+void alias_cache_add(struct alias_cache *cache, unsigned group,
+        const char *name, uint32_t expires)
+{
+    struct alias_entry *bucket, *victim = NULL;
+    pthread_mutex_t *lock;
+    char key[255];
+    unsigned len, i;
+    uint64_t hash;
+
+    hash = normalize(group, name, key, &len);
+    bucket = lock_bucket(cache, hash, &lock);
+
+    for (i = 0; i < ALIAS_WAYS; i++) {
+        if (bucket[i].expires && bucket[i].hash == hash &&
+                bucket[i].group == group && bucket[i].len == len &&
+                !memcmp(bucket[i].name, key, len)) {
+            if (bucket[i].expires < expires)
+                bucket[i].expires = expires;
+            pthread_mutex_unlock(lock);
+            return;
+        }
+
+        if (!victim || bucket[i].expires < victim->expires)
+            victim = &bucket[i];
+    }
+
+    victim->hash = hash;
+    victim->expires = expires;
+    victim->group = group;
+    victim->len = len;
+    memcpy(victim->name, key, len);
+    pthread_mutex_unlock(lock);
+    atomic_fetch_add(&cache->generation, 1);
+}
+
+/**
+ * Returns true if name is a known (unexpired) alias of a name that is allowed
+ * for the client group.
+ */
+bool alias_cache_check(struct alias_cache *cache, unsigned group,
+        const char *name, uint32_t now)
+{
+    struct alias_entry *bucket;
+    pthread_mutex_t *lock;
+    char key[255];
+    unsigned len, i;
+    uint64_t hash;
+    bool found = false;
+
+    hash = normalize(group, name, key, &len);
+    bucket = lock_bucket(cache, hash, &lock);
+
+    for (i = 0; i < ALIAS_WAYS; i++) {
+        if (bucket[i].expires > now && bucket[i].hash == hash &&
+                bucket[i].group == group && bucket[i].len == len &&
+                !memcmp(bucket[i].name, key, len)) {
+            found = true;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(lock);
+    return found;
+}
+
+/**
+ * Forgets all aliases (for example, after the policy changed).
+ */
+void alias_cache_clear(struct alias_cache *cache)
+{
+    unsigned bucket;
+
+    for (bucket = 0; bucket <= cache->bucket_mask; bucket++) {
+        pthread_mutex_lock(&cache->locks[bucket % ALIAS_LOCKS]);
+        memset(&cache->entries[(size_t)bucket * ALIAS_WAYS], 0,
+                ALIAS_WAYS * sizeof(*cache->entries));
+        pthread_mutex_unlock(&cache->locks[bucket % ALIAS_LOCKS]);
+    }
+    atomic_fetch_add(&cache->generation, 1);
+}
+
+/* Returns a number that changes whenever names are added or removed. */
+uint32_t alias_cache_generation(const struct alias_cache *cache)
+{
+    return atomic_load_explicit(&cache->generation, memory_order_acquire);
+}
+
+void alias_cache_fini(struct alias_cache *cache)
+{
+    unsigned i;
+
+    for (i = 0; i < ALIAS_LOCKS; i++)
+        pthread_mutex_destroy(&cache->locks[i]);
+    free(cache->entries);
+    free(cache);
+}
@@ -0,0 +1,312 @@
+/**
+ * Address sink that adds addresses to pinned BPF maps (see bpf/).
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include "dnsallow.h"
+
+/* Default location of maps pinned by tc (iproute2) for "pinning by name". */
+#define BPF_DEFAULT_PIN_DIR "/sys/fs/bpf/tc/globals"
+
+/* Map names, must match bpf/dnsallow.bpf.c. */
+#define BPF_MAP_IPV4        "dnsallow_v4"
+#define BPF_MAP_IPV6        "dnsallow_v6"
+
+/* Size of maps created by dnsallow (if not loaded with the program first). The
+ * least recently used entries are evicted when a map is full. */
+#define BPF_MAP_ENTRIES     65536
+
+/* Maximum number of addresses per family that are buffered before they are
+ * sent to the kernel (same as for ipset). */
+#define BPF_BATCH_SIZE      256
+
+/* Values are the expiry time (CLOCK_MONOTONIC, as bpf_ktime_get_ns) in ns. */
+#define BPF_NEVER_EXPIRES   UINT64_MAX
+
+struct bpf_batch {
+    const char *name;
+    int fd;
+    unsigned key_size;
+    unsigned count;
+    unsigned char keys[BPF_BATCH_SIZE][16];
+    uint64_t expires[BPF_BATCH_SIZE];
+};
+
+struct bpf_state {
+    struct addr_sink base;
+    bool no_batch;          /* BPF_MAP_UPDATE_BATCH is unsupported. */
+    struct bpf_batch ipv4;
+    struct bpf_batch ipv6;
+    unsigned char packed_keys[BPF_BATCH_SIZE * 16];
+};
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Checks that a pinned map has the expected layout. */
+static bool check_map(int fd, const char *path, unsigned key_size)
+{
+    struct bpf_map_info info;
+    union bpf_attr attr;
+
+    memset(&info, 0, sizeof(info));
+    memset(&attr, 0, sizeof(attr));
+    attr.info.bpf_fd = fd;
+    attr.info.info_len = sizeof(info);
+    attr.info.info = (uintptr_t)&info;
+    if (sys_bpf(BPF_OBJ_GET_INFO_BY_FD, &attr) < 0) {
+        log_error("Cannot query BPF map %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (info.key_size != key_size || info.value_size != sizeof(uint64_t)) {
+        log_error("BPF map %s has key size %u and value size %u, expected "
+                "%u and %zu\n", path, info.key_size, info.value_size,
+                key_size, sizeof(uint64_t));
+        return false;
+    }
+    return true;
+}
+
+/* Opens a pinned map, or creates and pins it if it does not exist yet. */
+static int open_map(const char *dir, const char *name, unsigned key_size)
+{
+    char path[PATH_MAX];
+    union bpf_attr attr;
+    int fd;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path)) {
+        log_error("BPF pin directory is too long\n");
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.pathname = (uintptr_t)path;
+    fd = sys_bpf(BPF_OBJ_GET, &attr);
+    if (fd >= 0) {
+        if (!check_map(fd, path, key_size)) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    if (errno != ENOENT) {
+        log_error("Cannot open BPF map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_LRU_HASH;
+    attr.key_size = key_size;
+    attr.value_size = sizeof(uint64_t);
+    attr.max_entries = BPF_MAP_ENTRIES;
+    strncpy(attr.map_name, name, sizeof(attr.map_name) - 1);
+    fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (fd < 0) {
+        log_error("Cannot create BPF map %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.pathname = (uintptr_t)path;
+    attr.bpf_fd = fd;
+    if (sys_bpf(BPF_OBJ_PIN, &attr) < 0) {
+        log_error("Cannot pin BPF map at %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    log_info("Created BPF map %s\n", path);
+    return fd;
+}
+
+/* Updates the elements one by one (for kernels before 5.6). */
+static bool update_elems(struct bpf_batch *batch)
+{
+    union bpf_attr attr;
+    unsigned i;
+    bool ok = true;
+
+    for (i = 0; i < batch->count; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = batch->fd;
+        attr.key = (uintptr_t)batch->keys[i];
+        attr.value = (uintptr_t)&batch->expires[i];
+        attr.flags = BPF_ANY;
+        if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+            ok = false;
+    }
+    if (!ok)
+        log_error("Failed to add to BPF map %s: %s\n", batch->name,
+                strerror(errno));
+    return ok;
+}
+
+static bool update_batch(struct bpf_state *state, struct bpf_batch *batch)
+{
+    unsigned char *keys = state->packed_keys;
+    union bpf_attr attr;
+    unsigned i;
+    bool ok;
+
+    if (!batch->count)
+        return true;
+    if (state->no_batch) {
+        ok = update_elems(batch);
+        batch->count = 0;
+        return ok;
+    }
+
+    /* The kernel expects the keys to be packed. */
+    for (i = 0; i < batch->count; i++)
+        memcpy(keys + i * batch->key_size, batch->keys[i], batch->key_size);
+
+    memset(&attr, 0, sizeof(attr));
+    attr.batch.map_fd = batch->fd;
+    attr.batch.keys = (uintptr_t)keys;
+    attr.batch.values = (uintptr_t)batch->expires;
+    attr.batch.count = batch->count;
+    attr.batch.elem_flags = BPF_ANY;
+    ok = sys_bpf(BPF_MAP_UPDATE_BATCH, &attr) == 0;
+    /* 524 is ENOTSUPP, returned for maps without batch support. */
+    if (!ok && (errno == EINVAL || errno == ENOTSUP || errno == 524)) {
+        log_info("BPF batch updates are unsupported, using single updates\n");
+        state->no_batch = true;
+        ok = update_elems(batch);
+    } else if (!ok) {
+        log_error("Failed to add to BPF map %s: %s\n", batch->name,
+                strerror(errno));
+    }
+    batch->count = 0;
+    return ok;
+}
+
+static bool bpf_commit(struct addr_sink *base)
+{
+    struct bpf_state *state = (struct bpf_state *)base;
+    bool ok;
+
+    ok = update_batch(state, &state->ipv4);
+    ok = update_batch(state, &state->ipv6) && ok;
+    return ok;
+}
+
+static void bpf_add(struct addr_sink *base, const struct address *addr,
+        uint32_t timeout)
+{
+    struct bpf_state *state = (struct bpf_state *)base;
+    struct bpf_batch *batch;
+
+    switch (addr->family) {
+    case AF_INET:
+        batch = &state->ipv4;
+        break;
+    case AF_INET6:
+        batch = &state->ipv6;
+        break;
+    default:
+        log_error("Unrecognized address family 0x%04x\n", addr->family);
+        return;
+    }
+
+    if (batch->count == BPF_BATCH_SIZE)
+        bpf_commit(base);
+
+    if (addr->family == AF_INET)
+        memcpy(batch->keys[batch->count], &addr->ip4_addr, 4);
+    else
+        memcpy(batch->keys[batch->count], &addr->ip6_addr, 16);
+    batch->expires[batch->count++] = timeout ?
+        monotonic_ns() + (uint64_t)timeout * 1000000000 : BPF_NEVER_EXPIRES;
+}
+
+static void bpf_fini(struct addr_sink *base)
+{
+    struct bpf_state *state = (struct bpf_state *)base;
+
+    bpf_commit(base);
+    close(state->ipv4.fd);
+    close(state->ipv6.fd);
+    free(state);
+}
+
+static const struct sink_ops bpf_ops = {
+    .add        = bpf_add,
+    .commit     = bpf_commit,
+    .fini       = bpf_fini,
+};
+
+/**
+ * Opens the maps that are pinned in 'pin_dir' (NULL for the tc default). Maps
+ * that do not exist yet are created, such that dnsallow can be started before
+ * the enforcing program is loaded. The reference program only knows a single
+ * pair of maps, so client groups are not supported.
+ */
+struct addr_sink *bpf_sink_init(const char *pin_dir, const char *group)
+{
+    struct bpf_state *state;
+
+    if (group) {
+        log_error("The bpf sink does not support client groups\n");
+        return NULL;
+    }
+
+    state = calloc(1, sizeof(*state));
+    if (!state)
+        return NULL;
+    state->base.ops = &bpf_ops;
+    if (!pin_dir)
+        pin_dir = BPF_DEFAULT_PIN_DIR;
+
+    state->ipv4.name = BPF_MAP_IPV4;
+    state->ipv4.key_size = 4;
+    state->ipv4.fd = open_map(pin_dir, BPF_MAP_IPV4, 4);
+    if (state->ipv4.fd < 0)
+        goto err_ipv4;
+
+    state->ipv6.name = BPF_MAP_IPV6;
+    state->ipv6.key_size = 16;
+    state->ipv6.fd = open_map(pin_dir, BPF_MAP_IPV6, 16);
+    if (state->ipv6.fd < 0)
+        goto err_ipv6;
+
+    return &state->base;
+
+err_ipv6:
+    close(state->ipv4.fd);
+err_ipv4:
+    free(state);
+    return NULL;
+}
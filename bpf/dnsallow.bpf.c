@@ -0,0 +1,183 @@
+/**
+ * Reference tc/XDP program that only passes traffic to allowed addresses.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The maps are filled by "dnsallow --sink bpf". Values are the expiry time of
+ * an entry in ns (as bpf_ktime_get_ns), UINT64_MAX for permanent entries.
+ *
+ * Section "tc" filters egress traffic by destination address:
+ *
+ *     tc qdisc add dev eth0 clsact
+ *     tc filter add dev eth0 egress bpf direct-action \
+ *         obj dnsallow.bpf.o sec tc
+ *
+ * Section "xdp" does the same for traffic entering a router on its internal
+ * interface (XDP only sees received packets):
+ *
+ *     ip link set dev lan0 xdp obj dnsallow.bpf.o sec xdp
+ *
+ * The maps are pinned by name. tc pins them in /sys/fs/bpf/tc/globals (the
+ * default for dnsallow), ip in /sys/fs/bpf/xdp/globals (pass that directory
+ * with --sink bpf:DIR). DNS queries are always allowed, such that the
+ * responses can populate the maps.
+ */
+
+#include <stdbool.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/pkt_cls.h>
+#include <linux/udp.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+/* Must match the maps created by bpf.c. */
+#define MAX_ENTRIES     65536
+
+/* 802.1Q and 802.1ad tags that are skipped (as in pcap.c). */
+#define MAX_VLAN_TAGS   2
+
+struct vlan_hdr {
+    __be16 tci;
+    __be16 proto;               /* Of the next header. */
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, MAX_ENTRIES);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} dnsallow_v4 SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, MAX_ENTRIES);
+    __type(key, struct in6_addr);
+    __type(value, __u64);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} dnsallow_v6 SEC(".maps");
+
+/* Returns true if the entry exists and has not expired. */
+static __always_inline bool allowed(void *map, const void *addr)
+{
+    __u64 *expires = bpf_map_lookup_elem(map, addr);
+
+    return expires && *expires > bpf_ktime_get_ns();
+}
+
+/* DNS over UDP or TCP must pass to resolve names in the first place. */
+static __always_inline bool is_dns(void *l4, void *end, __u8 protocol)
+{
+    struct udphdr *udp = l4;    /* Ports are at the same offset for TCP. */
+
+    if (protocol != IPPROTO_UDP && protocol != IPPROTO_TCP)
+        return false;
+    if ((void *)(udp + 1) > end)
+        return false;
+    return udp->dest == bpf_htons(53);
+}
+
+static __always_inline bool is_vlan(__be16 proto)
+{
+    return proto == bpf_htons(ETH_P_8021Q) || proto == bpf_htons(ETH_P_8021AD);
+}
+
+/* Returns true if the Ethernet frame may pass. */
+static __always_inline bool check_packet(void *data, void *end)
+{
+    struct ethhdr *eth = data;
+    struct vlan_hdr *vlan;
+    struct iphdr *ip;
+    struct ipv6hdr *ip6;
+    void *l3;
+    __be16 proto;
+    int i;
+
+    if ((void *)(eth + 1) > end)
+        return false;
+    proto = eth->h_proto;
+    l3 = eth + 1;
+
+    /* XDP sees VLAN tags, tc only if they were not offloaded. */
+#pragma unroll
+    for (i = 0; i < MAX_VLAN_TAGS && is_vlan(proto); i++) {
+        vlan = l3;
+        if ((void *)(vlan + 1) > end)
+            return false;
+        proto = vlan->proto;
+        l3 = vlan + 1;
+    }
+
+    switch (proto) {
+    case bpf_htons(ETH_P_IP):
+        ip = l3;
+        if ((void *)(ip + 1) > end || ip->ihl < 5)
+            return false;
+        if (is_dns((void *)ip + ip->ihl * 4, end, ip->protocol))
+            return true;
+        return allowed(&dnsallow_v4, &ip->daddr);
+    case bpf_htons(ETH_P_IPV6):
+        ip6 = l3;
+        if ((void *)(ip6 + 1) > end)
+            return false;
+        /* Extension headers are not followed, such queries are dropped. */
+        if (is_dns(ip6 + 1, end, ip6->nexthdr))
+            return true;
+        return allowed(&dnsallow_v6, &ip6->daddr);
+    default:
+        /* More tags than supported must not bypass the check. */
+        if (is_vlan(proto))
+            return false;
+        /* ARP, neighbour discovery over other protocols etc. */
+        return true;
+    }
+}
+
+/* Largest headers that check_packet inspects. */
+#define HEADERS_SIZE    (sizeof(struct ethhdr) + \
+        MAX_VLAN_TAGS * sizeof(struct vlan_hdr) + sizeof(struct ipv6hdr) + \
+        sizeof(struct udphdr))
+
+SEC("tc")
+int dnsallow_tc(struct __sk_buff *skb)
+{
+    void *data = (void *)(long)skb->data;
+    void *end = (void *)(long)skb->data_end;
+
+    /* The headers may not be in the linear part of the buffer. */
+    if (data + HEADERS_SIZE > end) {
+        bpf_skb_pull_data(skb, HEADERS_SIZE);
+        data = (void *)(long)skb->data;
+        end = (void *)(long)skb->data_end;
+    }
+    return check_packet(data, end) ? TC_ACT_OK : TC_ACT_SHOT;
+}
+
+SEC("xdp")
+int dnsallow_xdp(struct xdp_md *ctx)
+{
+    void *data = (void *)(long)ctx->data;
+    void *end = (void *)(long)ctx->data_end;
+
+    return check_packet(data, end) ? XDP_PASS : XDP_DROP;
+}
+
+char LICENSE[] SEC("license") = "GPL";
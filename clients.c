@@ -0,0 +1,201 @@
+/**
+ * Policies and sets per group of clients.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * The client file assigns subnets to groups, one per line:
+ *
+ *     PREFIX GROUP POLICY
+ *
+ * Responses to clients in PREFIX (the destination of the response) are
+ * checked against the policy in the file POLICY and their addresses are added
+ * to the sets of GROUP (see sink_init). The longest matching prefix wins.
+ * Every line of a group must name the same policy. Clients outside all
+ * prefixes use the global policy and sets.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "dnsallow.h"
+
+struct client_group {
+    char name[CLIENT_GROUP_NAME_MAX + 1];
+    char *policy_file;
+    struct policy *policy;
+};
+
+struct client_table {
+    struct lpm *lpm;        /* Client prefix to group number. */
+    unsigned ngroups;
+    struct client_group groups[CLIENT_MAX_GROUPS + 1];  /* 0 is unused. */
+};
+
+/* Group names become part of set names, keep them simple. */
+static bool valid_group_name(const char *name)
+{
+    size_t len = strlen(name);
+
+    return len > 0 && len <= CLIENT_GROUP_NAME_MAX &&
+        strspn(name, "abcdefghijklmnopqrstuvwxyz0123456789_-") == len;
+}
+
+/* Returns the number of a group, adding it if necessary (0 on error). */
+static unsigned find_group(struct client_table *table, const char *name,
+        const char *policy_file, const char *filename, unsigned long lineno)
+{
+    struct client_group *group;
+    unsigned i;
+
+    for (i = 1; i <= table->ngroups; i++) {
+        group = &table->groups[i];
+        if (strcmp(group->name, name))
+            continue;
+        if (strcmp(group->policy_file, policy_file)) {
+            log_error("%s:%lu: group %s has another policy\n", filename,
+                    lineno, name);
+            return 0;
+        }
+        return i;
+    }
+
+    if (table->ngroups == CLIENT_MAX_GROUPS) {
+        log_error("%s:%lu: too many groups\n", filename, lineno);
+        return 0;
+    }
+    group = &table->groups[++table->ngroups];
+    strcpy(group->name, name);
+    group->policy_file = strdup(policy_file);
+    if (!group->policy_file) {
+        table->ngroups--;
+        return 0;
+    }
+    return table->ngroups;
+}
+
+static int read_clients(struct client_table *table, const char *filename)
+{
+    char *line = NULL, prefix_str[64], name[64], policy_file[4096];
+    unsigned long lineno = 0;
+    struct address prefix;
+    unsigned len, group;
+    size_t size = 0;
+    FILE *fp;
+    int r = 0;
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        log_error("Cannot open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    while (getline(&line, &size, fp) > 0) {
+        lineno++;
+        if (line[strspn(line, " \t\n")] == '\0' ||
+                line[strspn(line, " \t")] == '#')
+            continue;
+        if (sscanf(line, "%63s %63s %4095s", prefix_str, name,
+                    policy_file) != 3 ||
+                parse_prefix(prefix_str, &prefix, &len) < 0 ||
+                !valid_group_name(name)) {
+            log_error("%s:%lu: invalid client line\n", filename, lineno);
+            r = -1;
+            break;
+        }
+        group = find_group(table, name, policy_file, filename, lineno);
+        if (!group || lpm_add(table->lpm, &prefix, len, group) < 0) {
+            r = -1;
+            break;
+        }
+    }
+    free(line);
+    fclose(fp);
+    return r;
+}
+
+/**
+ * Loads the client file and the policies of all groups. Returns NULL on error.
+ */
+struct client_table *client_table_init(const char *filename)
+{
+    struct client_table *table;
+    unsigned i;
+
+    table = calloc(1, sizeof(*table));
+    if (!table)
+        return NULL;
+    table->lpm = lpm_init();
+    if (!table->lpm || read_clients(table, filename) < 0)
+        goto err;
+    if (lpm_build(table->lpm) < 0) {
+        log_error("Cannot build the client table\n");
+        goto err;
+    }
+
+    for (i = 1; i <= table->ngroups; i++) {
+        table->groups[i].policy = policy_init(table->groups[i].policy_file);
+        if (!table->groups[i].policy)
+            goto err;
+    }
+    return table;
+
+err:
+    client_table_fini(table);
+    return NULL;
+}
+
+/* Returns the group of a client, zero if it is not in any group. */
+unsigned client_lookup(const struct client_table *table,
+        const struct address *client)
+{
+    uint32_t group;
+
+    return lpm_lookup(table->lpm, client, &group) ? group : 0;
+}
+
+/* Returns the policy for a group (1 to client_group_count). */
+struct policy *client_policy(const struct client_table *table, unsigned group)
+{
+    return table->groups[group].policy;
+}
+
+unsigned client_group_count(const struct client_table *table)
+{
+    return table->ngroups;
+}
+
+const char *client_group_name(const struct client_table *table, unsigned group)
+{
+    return table->groups[group].name;
+}
+
+void client_table_fini(struct client_table *table)
+{
+    unsigned i;
+
+    for (i = 1; i <= table->ngroups; i++) {
+        free(table->groups[i].policy_file);
+        if (table->groups[i].policy)
+            policy_fini(table->groups[i].policy);
+    }
+    if (table->lpm)
+        lpm_fini(table->lpm);
+    free(table);
+}
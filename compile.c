@@ -0,0 +1,88 @@
+/**
+ * Compiles a policy file into a binary image for fast loading.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "dnsallow.h"
+
+static void usage(const char *progname)
+{
+    printf("Usage: %s POLICY IMAGE\n"
+           "       %s --verify IMAGE\n"
+           "\n"
+           "Compiles a policy file into a binary image that can be passed\n"
+           "to dnsallow --policy instead of the text file. The image is\n"
+           "written to a temporary file first and then renamed, so a running\n"
+           "dnsallow can be reloaded safely.\n",
+           progname, progname);
+}
+
+static int verify(const char *filename)
+{
+    struct policy *policy;
+    int r;
+
+    policy = policy_init(filename);
+    if (!policy)
+        return 1;
+
+    r = policy_verify_image(policy);
+    if (r < 0)
+        fprintf(stderr, "%s: checksum mismatch or not an image\n", filename);
+    else
+        printf("%s: OK, %u rules\n", filename, policy_rule_count(policy));
+    policy_fini(policy);
+    return r < 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct policy *policy;
+    char tmpname[4096];
+
+    if (argc == 3 && !strcmp(argv[1], "--verify"))
+        return verify(argv[2]);
+
+    if (argc != 3 || argv[1][0] == '-') {
+        usage(argv[0]);
+        return argc == 2 && !strcmp(argv[1], "--help") ? 0 : 1;
+    }
+
+    policy = policy_init(argv[1]);
+    if (!policy)
+        return 1;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp%ld", argv[2], (long)getpid());
+    if (policy_write_image(policy, tmpname) < 0) {
+        unlink(tmpname);
+        policy_fini(policy);
+        return 1;
+    }
+    if (rename(tmpname, argv[2]) < 0) {
+        perror("rename");
+        unlink(tmpname);
+        policy_fini(policy);
+        return 1;
+    }
+
+    printf("Compiled %u rules into %s\n", policy_rule_count(policy), argv[2]);
+    policy_fini(policy);
+    return 0;
+}
@@ -19,6 +19,10 @@
 /**
  * Implementation notes:
  *  - Only QDCOUNT == 1 is accepted.
+ *  - Parsing is split in two steps: parse_dns_view only decodes the question,
+ *    parse_dns_answers the answers once the name has been accepted.
+ *  - CNAME records are only recorded if they continue the chain starting at
+ *    the question name (in order of appearance).
  */
 
 #include <stdint.h>
@@ -29,6 +33,15 @@
 /* The DNS class for the Internet domain. */
 #define DNS_CLASS_IN    0x0001
 
+/* Resource record types. */
+#define DNS_TYPE_A      1
+#define DNS_TYPE_CNAME  5
+#define DNS_TYPE_AAAA   28
+#define DNS_TYPE_ANY    255
+
+/* Response code in the header flags, zero for NOERROR. */
+#define DNS_RCODE_MASK  0x000f
+
 struct dns_header {
     uint16_t id;
     uint16_t flags;
@@ -48,7 +61,7 @@ struct dns_answer {
     char *qname;
     uint16_t type;
     uint16_t data_class;
-    uint16_t ttl;
+    uint32_t ttl;
     uint16_t rdlength;
     char *rdata;
 };
@@ -63,161 +76,172 @@ static void parse_header(const unsigned char *buf, struct dns_header *hdr)
     hdr->arcount = (buf[10] << 8) | buf[11];
 }
 
-/* Tries to parse a name, returning the number of bytes that are consumed by
- * this name on the wire. (0 on failure). */
-static unsigned parse_name(const unsigned char *buf, unsigned buflen,
-        unsigned offset, char *name)
-{
-    unsigned label_length;
-    unsigned namelen = 0, wirelen = 0;
-    const unsigned orig_offset = offset;
-
-    while (offset < buflen) {
-        label_length = buf[offset];
-
-        if (label_length == 0) {
-            /* Reached the root, the last dot should be dropped later. */
-            break;
-        } else if ((label_length & 0xc0) == 0xc0) {  /* compressed name */
-            if (buflen - offset < 2)
-                return 0;
-
-            offset = ((label_length & 0x3f) << 8) | buf[offset + 1];
-            /* Pointers are invalid if they point to newer occurences. */
-            if (offset >= orig_offset)
-                return 0;
-
-            if (wirelen == 0) {
-                /* First pointer: account for the prefix and the pointer. */
-                wirelen = namelen + 2;
-            }
-            continue;
-        } else {
-            offset++;  /* skip label length */
-        }
-
-        if (buflen - offset < label_length || namelen + label_length + 1 > 256)
-            return 0;
-
-        memcpy(name + namelen, buf + offset, label_length);
-        name[namelen + label_length] = '.';
-        namelen += label_length + 1;  /* label plus dot (or length plus name) */
-        offset += label_length;
-    }
-
-    if (namelen > 0) {
-        /* Drop trailing dot. */
-        name[namelen - 1] = '\0';
-        if (strlen(name) != namelen - 1) {
-            /* Reject name with NUL byte which causes string truncation */
-            return 0;
-        }
-        namelen++; /* Account for the zero in the wire format. */
-    }
-    return wirelen ? wirelen : namelen;
-}
-
-/* Parses the name, type and class, returns the offset after that or 0 if the
- * format is invalid. */
-static unsigned parse_entry(const unsigned char *buf, unsigned buflen,
-        unsigned offset, char *name, uint16_t *type, uint16_t *clss)
-{
-    unsigned r;
-
-    r = parse_name(buf, buflen, offset, name);
-    if (r == 0)
-        return 0;
-
-    /* Need room for name, type, class (and more data after that). */
-    if (offset + r + 4 >= buflen)
-        return 0;
-
-    *type = (buf[offset + r] << 8) | buf[offset + r + 1];
-    *clss = (buf[offset + r + 2] << 8) | buf[offset + r + 3];
-    return r + 4;
-}
-
-static struct address *result_add(struct dns_info *info, int family)
+static struct address *result_add(struct dns_info *info, int family,
+        uint32_t ttl)
 {
+    info->ttl[info->count] = ttl;
     struct address *addr = &info->entries[info->count++];
     addr->family = family;
     return addr;
 }
 
 static void parse_rdata(const unsigned char *buf, uint16_t type,
-        unsigned rdlength, struct dns_info *result)
+        unsigned rdlength, uint32_t ttl, struct dns_info *result)
 {
     struct address *addr;
 
     switch (type) {
-    case 1:     /* A */
+    case DNS_TYPE_A:
         if (rdlength != 4)
             return;
 
-        addr = result_add(result, AF_INET);
+        addr = result_add(result, AF_INET, ttl);
         memcpy(&addr->ip4_addr, buf, 4);
         break;
-    case 28:    /* AAAA */
+    case DNS_TYPE_AAAA:
         if (rdlength != 16)
             return;
 
-        addr = result_add(result, AF_INET6);
+        addr = result_add(result, AF_INET6, ttl);
         memcpy(&addr->ip6_addr, buf, 16);
         break;
     }
 }
 
-static int parse_dns(const unsigned char *buf, unsigned buflen, struct dns_info *result)
+/* Records the target of a CNAME (at offset in buf) if the owner name (at
+ * owner) is the last name in the chain. */
+static void parse_cname(const struct dns_view *view, unsigned owner,
+        unsigned offset, unsigned rdlength, uint32_t ttl,
+        struct dns_info *result)
+{
+    char name[DNS_NAME_SIZE];
+    const char *last;
+    unsigned r;
+
+    if (result->cname_count == DNS_MAX_CNAMES)
+        return;
+
+    if (!parse_name(view->buf, view->buflen, owner, name, NULL))
+        return;
+    last = result->cname_count ?
+        result->cnames[result->cname_count - 1] : view->name;
+    /* Both names are lowercase. */
+    if (strcmp(name, last))
+        return;
+
+    r = parse_name(view->buf, view->buflen, offset,
+            result->cnames[result->cname_count], NULL);
+    if (r == 0 || r > rdlength)
+        return;
+
+    result->cname_ttl[result->cname_count++] = ttl;
+}
+
+/**
+ * Parses the header and question of a DNS message (without IP and UDP
+ * headers). Returns 1 if the message is a successful response to an A, AAAA
+ * or ANY query with answers, 0 otherwise. Only the question name is decoded,
+ * the answers are left to parse_dns_answers such that responses for names
+ * that are rejected by the policy are not decoded at all. The view refers to
+ * buf, which must stay valid while the view is in use.
+ */
+int parse_dns_view(const unsigned char *buf, unsigned buflen,
+        struct dns_view *view)
 {
     struct dns_header hdr;
-    unsigned offset, r, i;
-    uint16_t type, clss;
-    char name[256];
+    uint16_t clss;
+    unsigned r;
 
-    memset(result, 0, sizeof(*result));
+    view->name[0] = '\0';
 
     if (buflen <= 12)
         return 0;
 
     parse_header(buf, &hdr);
-    offset = 12;
 
-    /* Can only handle one question for now. */
-    if (hdr.qdcount != 1)
+    /* Can only handle one question for now. Errors (such as NXDOMAIN) and
+     * empty answers do not add addresses. */
+    if (hdr.qdcount != 1 || (hdr.flags & DNS_RCODE_MASK) != 0 ||
+            hdr.ancount == 0)
+        return 0;
+
+    /* Need room for name, type, class (and more data after that). */
+    r = skip_name(buf, buflen, 12);
+    if (r == 0 || 12 + r + 4 >= buflen)
+        return 0;
+
+    view->qtype = (buf[12 + r] << 8) | buf[12 + r + 1];
+    clss = (buf[12 + r + 2] << 8) | buf[12 + r + 3];
+    if (clss != DNS_CLASS_IN)
         return 0;
+    switch (view->qtype) {
+    case DNS_TYPE_A:
+    case DNS_TYPE_AAAA:
+    case DNS_TYPE_ANY:
+        break;
+    default:
+        return 0;
+    }
 
-    /* Parse question (ignore query type). */
-    r = parse_entry(buf, buflen, offset, name, &type, &clss);
-    if (r == 0 || clss != DNS_CLASS_IN || name[0] == '\0')
+    if (parse_name(buf, buflen, 12, view->name, &view->labels) != r) {
+        view->name[0] = '\0';
         return 0;
+    }
 
-    strcpy(result->name, name);
-    offset += r;
+    view->buf = buf;
+    view->buflen = buflen;
+    view->qname = buf + 12;
+    view->qname_len = r;
+    view->ancount = hdr.ancount;
+    view->answers = 12 + r + 4;
+    return 1;
+}
+
+/**
+ * Decodes the addresses and CNAME chain in the answers of a view. Returns 1 if
+ * some addresses were found (see result->count) and 0 otherwise.
+ */
+int parse_dns_answers(const struct dns_view *view, struct dns_info *result)
+{
+    const unsigned char *buf = view->buf;
+    unsigned buflen = view->buflen;
+    unsigned offset = view->answers, owner, rdlength, r, i;
+    uint16_t type, clss;
+    uint32_t ttl;
+
+    result->count = 0;
+    result->cname_count = 0;
 
     /* Parse answers (best effort, return as many valid results as possible). */
-    for (i = 0; i < hdr.ancount; i++) {
-        r = parse_entry(buf, buflen, offset, name, &type, &clss);
-        if (r == 0 || clss != DNS_CLASS_IN)
+    for (i = 0; i < view->ancount; i++) {
+        /* Owner names are only decoded for CNAME records. */
+        r = skip_name(buf, buflen, offset);
+        /* Need room for type, class, TTL and RDLENGTH. */
+        if (r == 0 || buflen - offset - r < 10)
             break;
 
-        /* Skip name, type, class */
+        owner = offset;
         offset += r;
-
-        /* Check for TTL and RDLENGTH */
-        if (offset + 6 > buflen)
+        type = (buf[offset] << 8) | buf[offset + 1];
+        clss = (buf[offset + 2] << 8) | buf[offset + 3];
+        if (clss != DNS_CLASS_IN)
             break;
 
-        /* Skip TTL */
-        offset += 4;
+        ttl = ((uint32_t)buf[offset + 4] << 24) | (buf[offset + 5] << 16) |
+            (buf[offset + 6] << 8) | buf[offset + 7];
+        /* RFC 2181: values with the most significant bit set are zero. */
+        if (ttl & 0x80000000)
+            ttl = 0;
 
-        unsigned rdlength = (buf[offset] << 8) | buf[offset + 1];
-        if (offset + 2 + rdlength > buflen)
+        rdlength = (buf[offset + 8] << 8) | buf[offset + 9];
+        offset += 10;
+        if (rdlength > buflen - offset)
             break;
 
-        /* Skip RDLENGTH */
-        offset += 2;
-
-        parse_rdata(buf + offset, type, rdlength, result);
+        if (type == DNS_TYPE_CNAME)
+            parse_cname(view, owner, offset, rdlength, ttl, result);
+        else
+            parse_rdata(buf + offset, type, rdlength, ttl, result);
         offset += rdlength;
 
         /* Just truncate the number of entries if there are too many. */
@@ -229,31 +253,140 @@ static int parse_dns(const unsigned char *buf, unsigned buflen, struct dns_info
 }
 
 /**
- * Tries to parse the addresses in the answer from a DNS response. If no
- * addresses could be parsed, 0 is returned. A positive number otherwise (check
- * result->count for the exact number of answers).
+ * Parses a DNS message (without IP and UDP headers), see parse_ip_dns.
+ */
+int parse_dns(const unsigned char *buf, unsigned buflen,
+        struct dns_view *view, struct dns_info *result)
+{
+    result->count = 0;
+    result->cname_count = 0;
+
+    if (!parse_dns_view(buf, buflen, view))
+        return 0;
+    return parse_dns_answers(view, result);
+}
+
+/* Mixes 'len' bytes into the fingerprint, eight bytes at a time. */
+static uint64_t fingerprint_range(uint64_t h, const unsigned char *p,
+        unsigned len)
+{
+    uint64_t w;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&w, p, 8);
+        LABEL_HASH_STEP(h, w);
+    }
+    if (len) {
+        w = (uint64_t)len << 56;
+        memcpy(&w, p, len);
+        LABEL_HASH_STEP(h, w);
+    }
+    return h;
+}
+
+/**
+ * Returns a hash of a DNS message (without IP and UDP headers) that covers the
+ * header, question and answers except for the ID and the TTL fields, such that
+ * repeated answers from a resolver cache have the same fingerprint. Names are
+ * skipped rather than decoded. Returns 0 if the message has no answers or is
+ * malformed.
  */
-int parse_ip_dns(const unsigned char *buf, unsigned buflen, struct dns_info *result)
+uint64_t dns_fingerprint(const unsigned char *buf, unsigned buflen,
+        uint64_t seed)
 {
-    unsigned offset;
-    uint8_t protocol;
+    unsigned offset, start, count, n;
+    uint64_t h = seed;
 
-    offset = parse_ip(buf, buflen, &protocol);
-    if (offset == 0)
+    if (buflen <= 12)
         return 0;
+    count = (buf[6] << 8) | buf[7];
+    if (((buf[4] << 8) | buf[5]) != 1 || count == 0)
+        return 0;
+
+    n = skip_name(buf, buflen, 12);
+    if (n == 0 || buflen - 12 - n < 4)
+        return 0;
+    offset = 12 + n + 4;
 
-    switch (protocol) {
-    case 17: /* UDP */
-        if (offset + 8 >= buflen)
+    /* Hash everything from the flags up to the next TTL field. */
+    start = 2;
+    while (count--) {
+        n = skip_name(buf, buflen, offset);
+        if (n == 0 || buflen - offset - n < 10)
             return 0;
+        offset += n + 4;
+        h = fingerprint_range(h, buf + start, offset - start);
+        start = offset + 4;
+        n = (buf[offset + 4] << 8) | buf[offset + 5];
+        if (buflen - offset - 6 < n)
+            return 0;
+        offset += 6 + n;
+    }
+    h = fingerprint_range(h, buf + start, offset - start);
+    h ^= offset;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
 
-        offset += 8;
-        break;
-    default:
+/**
+ * Returns a hash of the ID and question of a DNS message (without IP and UDP
+ * headers), which a response shares with its query. The name is hashed as it
+ * is on the wire (queries may randomize the case, responses copy it). Returns
+ * 0 if the message does not have exactly one question.
+ */
+uint64_t dns_question_hash(const unsigned char *buf, unsigned buflen,
+        uint64_t seed)
+{
+    unsigned n;
+    uint64_t h;
+
+    if (buflen <= 12 || ((buf[4] << 8) | buf[5]) != 1)
+        return 0;
+    n = skip_name(buf, buflen, 12);
+    if (n == 0 || buflen - 12 - n < 4)
+        return 0;
+
+    h = fingerprint_range(seed, buf, 2);
+    h = fingerprint_range(h, buf + 12, n + 4);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+/**
+ * Parses the header and question of a DNS response in an IP packet, see
+ * parse_dns_view.
+ */
+int parse_ip_dns_view(const unsigned char *buf, unsigned buflen,
+        struct dns_view *view)
+{
+    unsigned offset = parse_udp(buf, buflen);
+
+    if (offset == 0) {
+        view->name[0] = '\0';
         return 0;
     }
+    return parse_dns_view(buf + offset, buflen - offset, view);
+}
+
+/**
+ * Tries to parse the addresses in the answer from a DNS response. If no
+ * addresses could be parsed, 0 is returned. A positive number otherwise (check
+ * result->count for the exact number of answers).
+ */
+int parse_ip_dns(const unsigned char *buf, unsigned buflen,
+        struct dns_view *view, struct dns_info *result)
+{
+    unsigned offset = parse_udp(buf, buflen);
 
-    buf += offset;
-    buflen -= offset;
-    return parse_dns(buf, buflen, result);
+    if (offset == 0) {
+        view->name[0] = '\0';
+        result->count = 0;
+        result->cname_count = 0;
+        return 0;
+    }
+    return parse_dns(buf + offset, buflen - offset, view, result);
 }
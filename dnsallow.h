@@ -17,19 +17,70 @@
  */
 
 #include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 
 /* queue.c */
 struct input_queue;
-typedef void packet_callback(const unsigned char *buf, unsigned buflen, void *data);
+/* Functions of an input backend, see queue_fd etc. */
+struct input_ops {
+    int (*fd)(struct input_queue *iq);
+    int (*handle)(struct input_queue *iq);
+    void (*verdict)(struct input_queue *iq, uint32_t pkt_id);
+    bool (*finished)(struct input_queue *iq);   /* NULL if never finished. */
+    void (*fini)(struct input_queue *iq);
+};
+/* Backends (NFQUEUE, replay.c) start with this structure. */
+struct input_queue {
+    const struct input_ops *ops;
+};
+/* Returns true if the verdict for pkt_id is deferred (see queue_verdict). */
+typedef bool packet_callback(const unsigned char *buf, unsigned buflen,
+        uint32_t pkt_id, void *data);
+/* Called after a batch of packets was processed, before they are accepted. */
+typedef void batch_callback(void *data);
+/* Maximum number of packets that a backend passes to the packet callback per
+ * call of queue_handle. */
+#define QUEUE_BATCH_SIZE    64
+
+/* Largest possible IP packet, also the maximum NFQUEUE copy range. */
+#define QUEUE_MAX_COPY_RANGE    0xffff
 
-struct input_queue *queue_init(packet_callback *callback, void *callback_data);
+struct queue_options {
+    unsigned copy_range;    /* Maximum number of bytes copied per packet. */
+    unsigned rcvbuf_size;   /* Netlink receive buffer size (0 for default). */
+    unsigned max_len;       /* Kernel queue length (0 for default). */
+    bool fail_open;         /* Accept packets if the kernel queue is full. */
+};
+
+struct input_queue *queue_init(int queue_num, const struct queue_options *opts,
+        packet_callback *callback, batch_callback *batch_done,
+        void *callback_data);
+int queue_fd(struct input_queue *iq);
 int queue_handle(struct input_queue *iq);
+void queue_verdict(struct input_queue *iq, uint32_t pkt_id);
+bool queue_finished(struct input_queue *iq);
 void queue_fini(struct input_queue *iq);
 
-/* ip.c */
-unsigned parse_ip(const unsigned char *buf, unsigned buflen, uint8_t *protocol);
+/* replay.c */
+struct input_queue *replay_init(const char *filename, bool realtime,
+        packet_callback *callback, batch_callback *batch_done,
+        void *callback_data);
+struct replay_summary;
+struct replay_summary *replay_summary_init(void);
+void replay_summary_add(struct replay_summary *summary, const char *name,
+        bool allowed);
+void replay_summary_print(struct replay_summary *summary);
+void replay_summary_fini(struct replay_summary *summary);
 
-/* dns.c */
+/* pcap.c */
+struct pcap_file;
+struct pcap_file *pcap_open(const char *filename);
+int pcap_next(struct pcap_file *pf, const unsigned char **pkt, unsigned *len,
+        uint64_t *ts);
+void pcap_close(struct pcap_file *pf);
+
+/* ip.c */
 struct address {
     int family;
     union {
@@ -37,26 +88,334 @@ struct address {
         struct in6_addr ip6_addr;
     };
 };
+unsigned parse_ip(const unsigned char *buf, unsigned buflen, uint8_t *protocol);
+unsigned parse_udp(const unsigned char *buf, unsigned buflen);
+void ip_destination(const unsigned char *buf, struct address *addr);
+
+/* lpm.c */
+struct lpm;
+struct lpm *lpm_init(void);
+int lpm_add(struct lpm *lpm, const struct address *prefix, unsigned len,
+        uint32_t value);
+int lpm_build(struct lpm *lpm);
+bool lpm_lookup(const struct lpm *lpm, const struct address *addr,
+        uint32_t *value);
+size_t lpm_memory(const struct lpm *lpm);
+size_t lpm_image_size(const struct lpm *lpm);
+void lpm_write_image(const struct lpm *lpm, void *buf);
+struct lpm *lpm_map(const void *buf, size_t size);
+void lpm_fini(struct lpm *lpm);
+int parse_prefix(const char *str, struct address *prefix, unsigned *len);
+
+/* tcp.c */
+struct tcp_tracker;
+/* Called for every complete DNS message in a TCP stream. */
+typedef void tcp_message_cb(const unsigned char *msg, unsigned len,
+        void *data);
+struct tcp_tracker *tcp_tracker_init(unsigned max_flows, unsigned max_buffers);
+void tcp_track(struct tcp_tracker *tracker, const unsigned char *buf,
+        unsigned buflen, unsigned offset, uint32_t now, tcp_message_cb *cb,
+        void *data);
+void tcp_tracker_stats(const struct tcp_tracker *tracker,
+        unsigned long *messages, unsigned long *evicted);
+void tcp_tracker_fini(struct tcp_tracker *tracker);
+
+/* name.c */
+/* RFC 1035 limits the name to 255 (add one for terminating zero), the decoder
+ * may write up to 32 bytes past that. */
+#define DNS_NAME_SIZE       (256 + 32)
+/* Every label takes at least two bytes of the 255 bytes on the wire. */
+#define DNS_MAX_LABELS      128
+/* Labels of a decoded name, as used by policy_check_labels. */
+struct dns_labels {
+    unsigned count;
+    uint8_t offset[DNS_MAX_LABELS];     /* Start of the label in the name. */
+    uint8_t len[DNS_MAX_LABELS];
+    uint32_t hash[DNS_MAX_LABELS];      /* policy_label_hash of the label. */
+};
+unsigned parse_name(const unsigned char *buf, unsigned buflen,
+        unsigned offset, char *name, struct dns_labels *labels);
+unsigned skip_name(const unsigned char *buf, unsigned buflen, unsigned offset);
+int name_set_decoder(const char *name);
+
+/* dns.c */
+/* A response of which only the header and question have been parsed. */
+struct dns_view {
+    const unsigned char *buf;       /* The DNS message (not copied). */
+    unsigned buflen;
+    const unsigned char *qname;     /* Question name in wire format. */
+    unsigned qname_len;
+    uint16_t qtype;
+    uint16_t ancount;
+    unsigned answers;               /* Offset of the answer section. */
+    char name[DNS_NAME_SIZE];       /* Lowercase question name. */
+    struct dns_labels labels;       /* Labels of the question name. */
+};
+/* Answers of a response, filled by parse_dns_answers. */
 struct dns_info {
-    /* RFC 1035 limits the name to 255 (add one for terminating zero). */
-    char name[256];
     unsigned int count;  /* The number of valid entries. */
     /* In theory about 25 addresses fit in a single UDP/DNS answer, but in
      * practice we will limit ourselves. */
 #define DNS_MAX_ENTRIES 16
     struct address entries[DNS_MAX_ENTRIES];
+    uint32_t ttl[DNS_MAX_ENTRIES];  /* TTL (in seconds) of each entry. */
+    /* Targets of the CNAME chain that starts at name. */
+    unsigned int cname_count;
+#define DNS_MAX_CNAMES 8
+    char cnames[DNS_MAX_CNAMES][DNS_NAME_SIZE];
+    uint32_t cname_ttl[DNS_MAX_CNAMES];
+};
+
+int parse_ip_dns_view(const unsigned char *buf, unsigned buflen,
+        struct dns_view *view);
+int parse_dns_view(const unsigned char *buf, unsigned buflen,
+        struct dns_view *view);
+int parse_dns_answers(const struct dns_view *view, struct dns_info *result);
+int parse_ip_dns(const unsigned char *buf, unsigned buflen,
+        struct dns_view *view, struct dns_info *result);
+int parse_dns(const unsigned char *buf, unsigned buflen,
+        struct dns_view *view, struct dns_info *result);
+uint64_t dns_fingerprint(const unsigned char *buf, unsigned buflen,
+        uint64_t seed);
+uint64_t dns_question_hash(const unsigned char *buf, unsigned buflen,
+        uint64_t seed);
+
+/* addrcache.c */
+struct addr_cache;
+enum addr_state {
+    ADDR_MISSING,       /* Must be added. */
+    ADDR_PENDING,       /* Being added, wait for the commit. */
+    ADDR_PRESENT,       /* In the set. */
 };
+struct addr_cache *addr_cache_init(unsigned size);
+enum addr_state addr_cache_check(struct addr_cache *cache,
+        const struct address *addr, unsigned group, uint32_t now,
+        uint32_t lifetime, uint32_t seq);
+void addr_cache_commit(struct addr_cache *cache, bool ok);
+uint32_t addr_cache_extend(struct addr_cache *cache,
+        const struct address *addr, unsigned group, uint32_t now,
+        uint32_t timeout);
+void addr_cache_stats(const struct addr_cache *cache, unsigned long *hits,
+        unsigned long *misses);
+void addr_cache_fini(struct addr_cache *cache);
 
-int parse_ip_dns(const unsigned char *buf, unsigned buflen, struct dns_info *result);
+/* alias.c */
+struct alias_cache;
+struct alias_cache *alias_cache_init(unsigned size);
+void alias_cache_add(struct alias_cache *cache, unsigned group,
+        const char *name, uint32_t expires);
+bool alias_cache_check(struct alias_cache *cache, unsigned group,
+        const char *name, uint32_t now);
+void alias_cache_clear(struct alias_cache *cache);
+uint32_t alias_cache_generation(const struct alias_cache *cache);
+void alias_cache_fini(struct alias_cache *cache);
+
+/* respcache.c */
+struct resp_cache;
+enum resp_decision {
+    RESP_UNKNOWN,
+    RESP_REJECTED,          /* The name is not allowed. */
+    RESP_ALLOWED,           /* The addresses were added recently. */
+};
+struct resp_cache *resp_cache_init(unsigned size);
+enum resp_decision resp_cache_lookup(struct resp_cache *cache, unsigned group,
+        const unsigned char *msg, unsigned len, uint32_t now,
+        uint32_t policy_gen, uint32_t alias_gen, uint64_t *key);
+void resp_cache_add(struct resp_cache *cache, uint64_t key,
+        enum resp_decision decision, uint32_t expires, uint32_t policy_gen,
+        uint32_t alias_gen, uint32_t seq);
+void resp_cache_commit(struct resp_cache *cache, bool ok);
+void resp_cache_stats(const struct resp_cache *cache, unsigned long *hits,
+        unsigned long *misses);
+void resp_cache_fini(struct resp_cache *cache);
+
+/* querytable.c */
+struct query_table;
+struct query_table *query_table_init(unsigned size, const char *resolvers);
+void query_table_add(struct query_table *table, const unsigned char *buf,
+        unsigned buflen, unsigned offset, uint32_t now);
+bool query_table_match(struct query_table *table, const unsigned char *buf,
+        unsigned buflen, unsigned offset, uint32_t now);
+void query_table_fini(struct query_table *table);
 
 /* policy.c */
 struct policy;
-struct policy *policy_init(void);
+struct policy *policy_init(const char *filename);
 int policy_check(struct policy *policy, const char *dnsname);
+int policy_check_labels(struct policy *policy, const char *name,
+        const struct dns_labels *labels);
+int policy_check_address(struct policy *policy, const char *name,
+        const struct dns_labels *labels, const struct address *addr);
+uint32_t policy_label_hash(const char *label, unsigned len);
+/* Steps of policy_label_hash, shared with the name decoder. */
+#define LABEL_HASH_SEED(len)    (0x9e3779b97f4a7c15ULL ^ (len))
+#define LABEL_HASH_STEP(h, w)   \
+    ((h) = ((h) ^ (w)) * 0xff51afd7ed558ccdULL, (h) ^= (h) >> 32)
+#define LABEL_HASH_FINAL(h)     ((uint32_t)((h) ^ ((h) >> 29)))
+unsigned policy_rule_count(const struct policy *policy);
+int policy_write_image(const struct policy *policy, const char *filename);
+int policy_verify_image(const struct policy *policy);
 void policy_fini(struct policy *policy);
 
+/* clients.c */
+/* Groups are numbered from 1, group 0 are the clients outside all groups. */
+#define CLIENT_MAX_GROUPS       255
+/* Such that "dnsallow-GROUP-ipv4" fits in an ipset name. */
+#define CLIENT_GROUP_NAME_MAX   16
+struct client_table;
+struct client_table *client_table_init(const char *filename);
+unsigned client_lookup(const struct client_table *table,
+        const struct address *client);
+struct policy *client_policy(const struct client_table *table, unsigned group);
+unsigned client_group_count(const struct client_table *table);
+const char *client_group_name(const struct client_table *table, unsigned group);
+void client_table_fini(struct client_table *table);
+
+/* ring.c */
+struct ring;
+struct ring *ring_init(unsigned size, unsigned elem_size);
+unsigned ring_capacity(const struct ring *ring);
+bool ring_push(struct ring *ring, const void *elem);
+bool ring_pop(struct ring *ring, void *elem);
+void ring_fini(struct ring *ring);
+
+/* writer.c */
+struct writer;
+struct writer_channel;
+struct writer *writer_init(unsigned nchannels, unsigned depth, int stop_fd,
+        unsigned tracked, bool stats, const char *sink,
+        const struct client_table *clients, const char *snapshot);
+int writer_start(struct writer *writer);
+void writer_join(struct writer *writer);
+void writer_fini(struct writer *writer);
+struct writer_channel *writer_channel(struct writer *writer, unsigned index);
+int writer_channel_fd(struct writer_channel *ch);
+void writer_channel_clear(struct writer_channel *ch);
+bool writer_submit(struct writer_channel *ch, uint32_t pkt_id,
+        uint64_t received, unsigned group, const char *name,
+        const struct address *addrs, const uint32_t *timeouts, unsigned count);
+void writer_flush(struct writer_channel *ch);
+uint32_t writer_last_seq(const struct writer_channel *ch);
+bool writer_complete(struct writer_channel *ch, uint32_t *pkt_id,
+        uint64_t *received, bool *ok);
+
+/* rcu.c */
+struct rcu_reader {
+    _Atomic unsigned long seen;     /* Zero if offline. */
+    struct rcu_reader *next;
+};
+void rcu_register(struct rcu_reader *reader);
+void rcu_unregister(struct rcu_reader *reader);
+void rcu_quiescent(struct rcu_reader *reader);
+void rcu_offline(struct rcu_reader *reader);
+void rcu_online(struct rcu_reader *reader);
+void rcu_synchronize(void);
+
+/* sink.c */
+struct addr_sink;
+/* Functions of an address sink, see sink_add etc. */
+struct sink_ops {
+    void (*add)(struct addr_sink *sink, const struct address *addr,
+            uint32_t timeout);
+    bool (*commit)(struct addr_sink *sink);
+    void (*fini)(struct addr_sink *sink);
+};
+/* Sinks (ipset.c, nft.c, bpf.c) start with this structure. */
+struct addr_sink {
+    const struct sink_ops *ops;
+};
+/* Large enough for the longest ipset name. */
+#define SINK_SET_NAME_SIZE      32
+bool sink_valid(const char *spec);
+struct addr_sink *sink_init(const char *spec, const char *group);
+void sink_set_name(char *buf, const char *group, const char *family);
+void sink_add(struct addr_sink *sink, const struct address *addr,
+        uint32_t timeout);
+unsigned sink_buffer_add(struct address *addrs, uint32_t *timeouts,
+        unsigned count, const struct address *addr, uint32_t timeout);
+bool sink_commit(struct addr_sink *sink);
+void sink_fini(struct addr_sink *sink);
+
 /* ipset.c */
-struct ipset_state;
-struct ipset_state *ipset_init(void);
-void ipset_add_ip(struct ipset_state *state, struct address *addr);
-void ipset_fini(struct ipset_state *state);
+/* Largest timeout (in seconds) supported by the kernel. */
+#define IPSET_MAX_TIMEOUT   (UINT32_MAX / 1000)
+struct addr_sink *ipset_sink_init(const char *group);
+
+/* nft.c */
+struct addr_sink *nft_sink_init(const char *group);
+
+/* bpf.c */
+struct addr_sink *bpf_sink_init(const char *pin_dir, const char *group);
+
+/* snapshot.c */
+struct snapshot;
+struct snapshot *snapshot_open(const char *filename,
+        const char *const *groups, unsigned ngroups,
+        struct addr_sink *const *restore);
+void snapshot_add(struct snapshot *snap, const struct address *addr,
+        unsigned group, uint32_t timeout, const char *name);
+void snapshot_commit(struct snapshot *snap, unsigned group, bool ok);
+void snapshot_flush(struct snapshot *snap);
+void snapshot_close(struct snapshot *snap);
+
+/* log.c */
+enum log_level {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+};
+/* Messages above this level are discarded. */
+extern enum log_level log_level;
+/* State for rate limiting, one per call site. */
+struct log_site {
+    _Atomic uint32_t window;
+    _Atomic unsigned count;
+    _Atomic unsigned suppressed;
+};
+void log_write(struct log_site *site, enum log_level level,
+        const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void log_hexdump(const void *data, size_t len);
+int log_thread_init(void);
+int log_start(void);
+void log_stop(void);
+
+#define log_msg(level, ...) do { \
+    static struct log_site log_site_; \
+    if ((level) <= log_level) \
+        log_write(&log_site_, level, __VA_ARGS__); \
+} while (0)
+#define log_error(...)      log_msg(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warning(...)    log_msg(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_info(...)       log_msg(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...)      log_msg(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/* stats.c */
+enum stats_counter {
+    STAT_PARSED,
+    STAT_REJECTED,          /* Not allowed by the policy. */
+    STAT_TRUNCATED,         /* Did not fit in the receive buffer. */
+    STAT_PARSE_FAILED,      /* No usable addresses. */
+    STAT_IPSET_FAILED,
+    STAT_TCP_MESSAGES,      /* Reassembled from TCP streams. */
+    STAT_TCP_EVICTED,       /* TCP flows dropped due to resource limits. */
+    STAT_CACHED,            /* Repeated responses, not parsed again. */
+    STAT_FILTERED,          /* Addresses rejected by the address filter. */
+    STAT_UNMATCHED,         /* Responses without an outstanding query. */
+    STAT_QUERY_EVICTED,     /* Queries dropped since the table was full. */
+    STATS_COUNTERS
+};
+enum stats_stage {
+    STAGE_PARSE,
+    STAGE_POLICY,
+    STAGE_IPSET,
+    STAGE_VERDICT,
+    STAGE_LATENCY,          /* From receipt until the verdict. */
+    STATS_STAGES
+};
+int stats_thread_init(void);
+uint64_t stats_now(void);
+void stats_count(enum stats_counter counter, unsigned n);
+void stats_record(enum stats_stage stage, uint64_t start, unsigned n);
+int stats_write(const char *filename);
+void stats_fini(void);
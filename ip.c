@@ -18,6 +18,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include "dnsallow.h"
 
 static bool is_ipv6_extension_header_type(uint8_t type)
@@ -56,12 +57,22 @@ unsigned parse_ip(const unsigned char *buf, unsigned buflen, uint8_t *protocol)
         if (ip_header_size < 20 || ip_header_size >= buflen)
             return 0;
 
+        /* Reject packets that were truncated (by the NFQUEUE copy range). */
+        unsigned total_length = (buf[2] << 8) | buf[3];
+        if (total_length > buflen)
+            return 0;
+
         *protocol = buf[9];
         return ip_header_size;
     } else if (ip_version == 6) { /* IPv6 */
         if (buflen <= 40)
             return 0;
 
+        /* Reject truncated packets (the payload length includes extensions). */
+        unsigned payload_length = (buf[4] << 8) | buf[5];
+        if (40 + payload_length > buflen)
+            return 0;
+
         uint8_t next_header = buf[6];
         unsigned offset = 40;
         /* skip headers as needed. */
@@ -84,3 +95,28 @@ unsigned parse_ip(const unsigned char *buf, unsigned buflen, uint8_t *protocol)
         return 0;
     }
 }
+
+/* Returns the offset of the UDP payload in an IP packet (0 on failure). */
+unsigned parse_udp(const unsigned char *buf, unsigned buflen)
+{
+    unsigned offset;
+    uint8_t protocol;
+
+    offset = parse_ip(buf, buflen, &protocol);
+    if (offset == 0 || protocol != 17 /* UDP */ || offset + 8 >= buflen)
+        return 0;
+    return offset + 8;
+}
+
+/* Copies the destination address of a packet that was accepted by parse_ip. */
+void ip_destination(const unsigned char *buf, struct address *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (buf[0] >> 4 == 4) {
+        addr->family = AF_INET;
+        memcpy(&addr->ip4_addr, buf + 16, 4);
+    } else {
+        addr->family = AF_INET6;
+        memcpy(&addr->ip6_addr, buf + 24, 16);
+    }
+}
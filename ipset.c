@@ -1,5 +1,5 @@
 /**
- * Allows addition of addresses to an ipset which can be used by iptables.
+ * Address sink that adds addresses to an ipset which can be used by iptables.
  * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
 
  * This program is free software: you can redistribute it and/or modify
@@ -24,31 +24,76 @@
 #include <libipset/data.h>
 #include "dnsallow.h"
 
-/* Setname X which can be used in "ipset list X". */
-#define SETNAME_IPV4 "dnsallow-ipv4"
-#define SETNAME_IPV6 "dnsallow-ipv6"
+/* The sets are named "dnsallow-ipv4" and "dnsallow-ipv6" (or
+ * "dnsallow-GROUP-ipv4" etc. for client groups), see "ipset list X". */
+
+/* Maximum number of addresses per family that are buffered before they are
+ * sent to the kernel. */
+#define IPSET_BATCH_SIZE    256
+
+struct ipset_batch {
+    char setname[SINK_SET_NAME_SIZE];
+    int family;                         /* NFPROTO_IPV4 or NFPROTO_IPV6 */
+    const struct ipset_type *type;      /* Resolved once in ipset_init. */
+    unsigned count;
+    struct address addrs[IPSET_BATCH_SIZE];
+    uint32_t timeouts[IPSET_BATCH_SIZE];
+};
 
 struct ipset_state {
+    struct addr_sink base;
     struct ipset_session *session;
+    struct ipset_batch ipv4;
+    struct ipset_batch ipv6;
 };
 
-static bool try_ipset_cmd(struct ipset_session *session, enum ipset_cmd cmd,
-        const char *setname, int family, const void *addr)
+/* Looks up the type of an existing set for add/del commands. This requires a
+ * round trip to the kernel, so it should be done once. */
+static const struct ipset_type *try_ipset_type(struct ipset_session *session,
+        const char *setname)
 {
+    const struct ipset_type *type;
+
     ipset_session_data_set(session, IPSET_SETNAME, setname);
-    if (!ipset_type_get(session, cmd)) {
-        fprintf(stderr, "Cannot find ipset %s: %s\n", setname,
+    type = ipset_type_get(session, IPSET_CMD_ADD);
+    if (!type)
+        log_error("Cannot find ipset %s: %s\n", setname,
                 ipset_session_error(session));
-        return false;
-    }
-    ipset_session_data_set(session, IPSET_OPT_FAMILY, &family);
-    ipset_session_data_set(session, IPSET_OPT_IP, addr);
+    return type;
+}
 
-    if (ipset_cmd(session, cmd, /*lineno*/ 0)) {
-        fprintf(stderr, "Failed to add to set %s: %s\n", setname,
-                ipset_session_error(session));
-        return false;
+/* Queues all buffered addresses in a single (multipart) netlink message. The
+ * message is sent by ipset_commit or when the buffer of the session is full.
+ * Passing a non-zero line number enables aggregation of add commands (as done
+ * by "ipset restore"). */
+static bool try_ipset_add_batch(struct ipset_session *session,
+        struct ipset_batch *batch)
+{
+    unsigned i;
+    const void *addr;
+
+    for (i = 0; i < batch->count; i++) {
+        if (batch->family == NFPROTO_IPV4)
+            addr = &batch->addrs[i].ip4_addr;
+        else
+            addr = &batch->addrs[i].ip6_addr;
+
+        /* The session data is reset after every aggregated command. */
+        ipset_session_data_set(session, IPSET_SETNAME, batch->setname);
+        ipset_session_data_set(session, IPSET_OPT_TYPE, batch->type);
+        ipset_session_data_set(session, IPSET_OPT_FAMILY, &batch->family);
+        ipset_session_data_set(session, IPSET_OPT_IP, addr);
+        /* Existing entries get the new timeout due to IPSET_ENV_EXIST. */
+        ipset_session_data_set(session, IPSET_OPT_TIMEOUT, &batch->timeouts[i]);
+
+        if (ipset_cmd(session, IPSET_CMD_ADD, /*lineno*/ i + 1)) {
+            log_error("Failed to add to set %s: %s\n", batch->setname,
+                    ipset_session_error(session));
+            batch->count = 0;
+            return false;
+        }
     }
+    batch->count = 0;
     return true;
 }
 
@@ -62,37 +107,42 @@ static bool try_ipset_create(struct ipset_session *session, const char *setname,
     ipset_session_data_set(session, IPSET_OPT_TYPENAME, typename);
     type = ipset_type_get(session, IPSET_CMD_CREATE);
     if (type == NULL) {
-        fprintf(stderr, "Cannot find ipset type %s: %s\n", typename,
+        log_error("Cannot find ipset type %s: %s\n", typename,
                 ipset_session_error(session));
         return false;
     }
 
-    timeout = 0; /* timeout support, but default to infinity */
+    /* Enable timeout support, but default to infinity. Timeouts for entries
+     * are given when adding addresses. */
+    timeout = 0;
     ipset_session_data_set(session, IPSET_OPT_TIMEOUT, &timeout);
     ipset_session_data_set(session, IPSET_OPT_TYPE, type);
     ipset_session_data_set(session, IPSET_OPT_FAMILY, &family);
 
     if (ipset_cmd(session, IPSET_CMD_CREATE, /*lineno*/ 0)) {
-        fprintf(stderr, "Failed to create ipset %s: %s\n", setname,
+        log_error("Failed to create ipset %s: %s\n", setname,
                 ipset_session_error(session));
         return false;
     }
     return true;
 }
 
-struct ipset_state *ipset_init(void)
+static const struct sink_ops ipset_ops;
+
+struct addr_sink *ipset_sink_init(const char *group)
 {
     struct ipset_state *state;
 
-    state = malloc(sizeof(*state));
+    state = calloc(1, sizeof(*state));
     if (!state)
         return NULL;
+    state->base.ops = &ipset_ops;
 
     ipset_load_types();
 
     state->session = ipset_session_init(printf);
     if (!state->session) {
-        fprintf(stderr, "Cannot initialize ipset session.\n");
+        log_error("Cannot initialize ipset session.\n");
         goto err_session;
     }
 
@@ -100,12 +150,26 @@ struct ipset_state *ipset_init(void)
      * add an existing rule. */
     ipset_envopt_parse(state->session, IPSET_ENV_EXIST, NULL);
 
-    if (!try_ipset_create(state->session, SETNAME_IPV4, "hash:ip", NFPROTO_IPV4))
+    sink_set_name(state->ipv4.setname, group, "ipv4");
+    sink_set_name(state->ipv6.setname, group, "ipv6");
+    if (!try_ipset_create(state->session, state->ipv4.setname, "hash:ip",
+                NFPROTO_IPV4))
         goto err_set;
-    if (!try_ipset_create(state->session, SETNAME_IPV6, "hash:ip", NFPROTO_IPV6))
+    if (!try_ipset_create(state->session, state->ipv6.setname, "hash:ip",
+                NFPROTO_IPV6))
+        goto err_set;
+
+    state->ipv4.family = NFPROTO_IPV4;
+    state->ipv4.type = try_ipset_type(state->session, state->ipv4.setname);
+    if (!state->ipv4.type)
+        goto err_set;
+
+    state->ipv6.family = NFPROTO_IPV6;
+    state->ipv6.type = try_ipset_type(state->session, state->ipv6.setname);
+    if (!state->ipv6.type)
         goto err_set;
 
-    return state;
+    return &state->base;
 
 err_set:
 err_session:
@@ -114,26 +178,68 @@ err_session:
     return NULL;
 }
 
-void ipset_add_ip(struct ipset_state *state, struct address *addr)
+static bool ipset_commit_ips(struct addr_sink *base);
+
+static void ipset_add_ip(struct addr_sink *base, const struct address *addr,
+        uint32_t timeout)
 {
-    struct ipset_session *session = state->session;
+    struct ipset_state *state = (struct ipset_state *)base;
+    struct ipset_batch *batch;
 
     switch (addr->family) {
     case AF_INET:
-        try_ipset_cmd(session, IPSET_CMD_ADD, SETNAME_IPV4, NFPROTO_IPV4, &addr->ip4_addr);
+        batch = &state->ipv4;
         break;
     case AF_INET6:
-        try_ipset_cmd(session, IPSET_CMD_ADD, SETNAME_IPV6, NFPROTO_IPV6, &addr->ip6_addr);
+        batch = &state->ipv6;
         break;
     default:
-        fprintf(stderr, "Unrecognized address family 0x%04x\n", addr->family);
+        log_error("Unrecognized address family 0x%04x\n", addr->family);
         return;
     }
+
+    if (batch->count == IPSET_BATCH_SIZE)
+        ipset_commit_ips(base);
+
+    batch->timeouts[batch->count] = timeout;
+    batch->addrs[batch->count++] = *addr;
+}
+
+/* Adds all buffered addresses to the sets, using at most one netlink message
+ * per set (unless the addresses do not fit in one message). */
+static bool ipset_commit_ips(struct addr_sink *base)
+{
+    struct ipset_state *state = (struct ipset_state *)base;
+    struct ipset_session *session = state->session;
+    bool ok;
+
+    if (!state->ipv4.count && !state->ipv6.count)
+        return true;
+
+    /* Switching to another set implicitly commits the previous message. */
+    ok = try_ipset_add_batch(session, &state->ipv4);
+    ok = try_ipset_add_batch(session, &state->ipv6) && ok;
+
+    if (ipset_commit(session) < 0) {
+        log_error("Failed to add to set: %s\n",
+                ipset_session_error(session));
+        ok = false;
+    }
     ipset_session_report_reset(session);
+    return ok;
 }
 
-void ipset_fini(struct ipset_state *state)
+static void ipset_fini(struct addr_sink *base)
 {
+    struct ipset_state *state = (struct ipset_state *)base;
+
+    ipset_commit_ips(base);
     ipset_session_fini(state->session);
     free(state);
 }
+
+static const struct sink_ops ipset_ops = {
+    .add        = ipset_add_ip,
+    .commit     = ipset_commit_ips,
+    .fini       = ipset_fini,
+};
@@ -0,0 +1,544 @@
+/**
+ * Asynchronous leveled logging with lazily formatted records.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "dnsallow.h"
+
+/* Number of records per thread. Messages are dropped if the ring is full. */
+#define LOG_RING_SIZE       1024
+/* Maximum number of arguments per message. */
+#define LOG_MAX_ARGS        8
+/* Bytes available for copies of string arguments and hexdump data. */
+#define LOG_DATA_SIZE       160
+/* Time between flushes of the writer (in milliseconds). */
+#define LOG_FLUSH_INTERVAL  20
+/* At most LOG_RATE_BURST messages per call site per LOG_RATE_INTERVAL secs. */
+#define LOG_RATE_BURST      10
+#define LOG_RATE_INTERVAL   5
+
+/* Type of an argument as determined from the conversion specification. */
+enum log_arg_type {
+    ARG_NONE,       /* "%%" */
+    ARG_INT,
+    ARG_LONG,
+    ARG_LLONG,
+    ARG_SIZE,
+    ARG_DOUBLE,
+    ARG_STRING,     /* Copied into the record data. */
+    ARG_POINTER,
+    ARG_INVALID,
+};
+
+union log_arg {
+    unsigned long long u;
+    double d;
+    const void *p;
+    unsigned offset;    /* ARG_STRING: offset in data. */
+};
+
+/**
+ * A message as stored in a ring. Only the format string is referenced (it must
+ * be a literal), arguments are copied such that the message can be formatted
+ * later by the writer thread. A record without format holds hexdump data.
+ */
+struct log_record {
+    const char *fmt;
+    uint8_t level;
+    uint8_t nargs;
+    uint16_t len;           /* Number of bytes used in data. */
+    uint32_t offset;        /* Offset of hexdump data. */
+    union log_arg args[LOG_MAX_ARGS];
+    char data[LOG_DATA_SIZE];
+};
+
+struct log_buffer {
+    struct ring *ring;
+    _Atomic unsigned long dropped;
+    struct log_buffer *next;
+};
+
+enum log_level log_level = LOG_LEVEL_INFO;
+
+/* Ring of the current thread, NULL if messages are written synchronously. */
+static __thread struct log_buffer *thread_buffer;
+
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_buffer *buffers;
+
+static pthread_t writer_thread;
+static _Atomic bool writer_running;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static bool writer_stopping;
+
+/* Output of the writer, written with a single call per flush. */
+static char out_buf[65536];
+static size_t out_len;
+
+/**
+ * Parses the conversion specification at *p (just after the '%') and copies it
+ * (including '%') to spec. Advances *p past the specification. Field widths
+ * and precisions taken from arguments ('*') are not supported.
+ */
+static enum log_arg_type parse_spec(const char **p, char *spec, size_t size)
+{
+    const char *start = *p - 1, *s = *p;
+    enum log_arg_type type = ARG_INT;
+    size_t len;
+
+    while (*s && strchr("-+ #0", *s))
+        s++;
+    while (isdigit((unsigned char)*s) || *s == '.')
+        s++;
+
+    if (*s == 'h') {
+        s += s[1] == 'h' ? 2 : 1;
+    } else if (*s == 'l') {
+        type = s[1] == 'l' ? ARG_LLONG : ARG_LONG;
+        s += s[1] == 'l' ? 2 : 1;
+    } else if (*s == 'z') {
+        type = ARG_SIZE;
+        s++;
+    }
+
+    switch (*s) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+        type = ARG_DOUBLE;
+        break;
+    case 's':
+        type = ARG_STRING;
+        break;
+    case 'p':
+        type = ARG_POINTER;
+        break;
+    case '%':
+        type = ARG_NONE;
+        break;
+    default:
+        *p = *s ? s + 1 : s;
+        return ARG_INVALID;
+    }
+    s++;
+
+    len = s - start;
+    if (len >= size)
+        return ARG_INVALID;
+    memcpy(spec, start, len);
+    spec[len] = '\0';
+    *p = s;
+    return type;
+}
+
+/* Copies the arguments for fmt into a record. */
+static void record_args(struct log_record *rec, const char *fmt, va_list ap)
+{
+    char spec[32];
+    const char *p = fmt, *str;
+    union log_arg *arg;
+    size_t len;
+
+    while ((p = strchr(p, '%')) && rec->nargs < LOG_MAX_ARGS) {
+        p++;
+        arg = &rec->args[rec->nargs];
+        switch (parse_spec(&p, spec, sizeof(spec))) {
+        case ARG_NONE:
+            continue;
+        case ARG_INVALID:
+            return;
+        case ARG_INT:
+            arg->u = va_arg(ap, unsigned);
+            break;
+        case ARG_LONG:
+            arg->u = va_arg(ap, unsigned long);
+            break;
+        case ARG_LLONG:
+            arg->u = va_arg(ap, unsigned long long);
+            break;
+        case ARG_SIZE:
+            arg->u = va_arg(ap, size_t);
+            break;
+        case ARG_DOUBLE:
+            arg->d = va_arg(ap, double);
+            break;
+        case ARG_POINTER:
+            arg->p = va_arg(ap, void *);
+            break;
+        case ARG_STRING:
+            str = va_arg(ap, const char *);
+            if (!str)
+                str = "(null)";
+            /* Long strings are truncated, once full an empty string (the
+             * last terminator) is referenced. */
+            if (rec->len == LOG_DATA_SIZE) {
+                arg->offset = LOG_DATA_SIZE - 1;
+                break;
+            }
+            len = strnlen(str, LOG_DATA_SIZE - 1 - rec->len);
+            arg->offset = rec->len;
+            memcpy(rec->data + rec->len, str, len);
+            rec->data[rec->len + len] = '\0';
+            rec->len += len + 1;
+            break;
+        }
+        rec->nargs++;
+    }
+}
+
+/* Appends formatted output to buf (of the given size) at *pos. */
+static void append(char *buf, size_t size, size_t *pos, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (*pos >= size)
+        return;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf + *pos, size - *pos, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        *pos = *pos + n < size ? *pos + n : size - 1;
+}
+
+/* Formats the hexdump lines of a record. */
+static void format_hexdump(const struct log_record *rec, char *buf,
+        size_t size, size_t *pos)
+{
+    const unsigned char *data = (const unsigned char *)rec->data;
+    unsigned i, j, linelen;
+
+    for (i = 0; i < rec->len; i += 16) {
+        linelen = rec->len - i < 16 ? rec->len - i : 16;
+
+        append(buf, size, pos, "%03x: ", rec->offset + i);
+        for (j = 0; j < linelen; j++)
+            append(buf, size, pos, "%02x ", data[i + j]);
+        for (; j < 16; j++)
+            append(buf, size, pos, "   ");
+        append(buf, size, pos, " ");
+        for (j = 0; j < linelen; j++)
+            append(buf, size, pos, "%c",
+                    isprint(data[i + j]) ? data[i + j] : '.');
+        append(buf, size, pos, "\n");
+    }
+}
+
+/* Formats a record. Returns the length of the output (without terminator). */
+static size_t format_record(const struct log_record *rec, char *buf,
+        size_t size)
+{
+    char spec[32];
+    const char *p = rec->fmt, *next;
+    const union log_arg *arg = rec->args;
+    enum log_arg_type type;
+    size_t pos = 0;
+
+    buf[0] = '\0';
+    if (!p) {
+        format_hexdump(rec, buf, size, &pos);
+        return pos;
+    }
+
+    while ((next = strchr(p, '%'))) {
+        append(buf, size, &pos, "%.*s", (int)(next - p), p);
+        p = next + 1;
+        type = parse_spec(&p, spec, sizeof(spec));
+        if (type == ARG_NONE) {
+            append(buf, size, &pos, "%%");
+            continue;
+        }
+        if (type == ARG_INVALID || arg == rec->args + rec->nargs)
+            return pos;
+
+        switch (type) {
+        case ARG_INT:
+            append(buf, size, &pos, spec, (unsigned)arg->u);
+            break;
+        case ARG_LONG:
+            append(buf, size, &pos, spec, (unsigned long)arg->u);
+            break;
+        case ARG_LLONG:
+            append(buf, size, &pos, spec, arg->u);
+            break;
+        case ARG_SIZE:
+            append(buf, size, &pos, spec, (size_t)arg->u);
+            break;
+        case ARG_DOUBLE:
+            append(buf, size, &pos, spec, arg->d);
+            break;
+        case ARG_POINTER:
+            append(buf, size, &pos, spec, arg->p);
+            break;
+        case ARG_STRING:
+            append(buf, size, &pos, spec, rec->data + arg->offset);
+            break;
+        default:
+            break;
+        }
+        arg++;
+    }
+    append(buf, size, &pos, "%s", p);
+    return pos;
+}
+
+/* Formats a record directly to stderr, for threads without a ring. */
+static void write_record(const struct log_record *rec)
+{
+    char buf[1024];
+    size_t len;
+
+    len = format_record(rec, buf, sizeof(buf));
+    fwrite(buf, 1, len, stderr);
+}
+
+/* Queues a record in the ring of the current thread or writes it. */
+static void submit_record(const struct log_record *rec)
+{
+    struct log_buffer *buffer = thread_buffer;
+
+    if (!buffer ||
+            !atomic_load_explicit(&writer_running, memory_order_relaxed)) {
+        write_record(rec);
+        return;
+    }
+
+    if (!ring_push(buffer->ring, rec))
+        atomic_fetch_add_explicit(&buffer->dropped, 1, memory_order_relaxed);
+}
+
+static void log_record_init(struct log_record *rec, enum log_level level,
+        const char *fmt)
+{
+    rec->fmt = fmt;
+    rec->level = level;
+    rec->nargs = 0;
+    rec->len = 0;
+    rec->offset = 0;
+}
+
+/**
+ * Returns true if a message from this call site may be logged, false if too
+ * many messages were logged recently. The number of suppressed messages is
+ * reported with the first message of the next interval.
+ */
+static bool rate_limit(struct log_site *site, enum log_level level)
+{
+    struct timespec ts;
+    uint32_t now, window;
+    unsigned suppressed;
+    struct log_record rec;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    now = ts.tv_sec;
+    window = atomic_load_explicit(&site->window, memory_order_relaxed);
+    if (now - window >= LOG_RATE_INTERVAL &&
+            atomic_compare_exchange_strong(&site->window, &window, now)) {
+        atomic_store(&site->count, 0);
+        suppressed = atomic_exchange(&site->suppressed, 0);
+        if (suppressed) {
+            log_record_init(&rec, level, "(%u similar messages suppressed)\n");
+            rec.args[rec.nargs++].u = suppressed;
+            submit_record(&rec);
+        }
+    }
+
+    if (atomic_fetch_add(&site->count, 1) >= LOG_RATE_BURST) {
+        atomic_fetch_add(&site->suppressed, 1);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Logs a message. Use the log_* macros instead, which skip disabled levels
+ * and provide the call site for rate limiting. fmt must be a string literal.
+ */
+void log_write(struct log_site *site, enum log_level level,
+        const char *fmt, ...)
+{
+    struct log_record rec;
+    va_list ap;
+
+    if (site && !rate_limit(site, level))
+        return;
+
+    log_record_init(&rec, level, fmt);
+    va_start(ap, fmt);
+    record_args(&rec, fmt, ap);
+    va_end(ap);
+    submit_record(&rec);
+}
+
+/* Logs a hexdump of data at debug level. */
+void log_hexdump(const void *data, size_t len)
+{
+    struct log_record rec;
+    size_t i;
+
+    if (log_level < LOG_LEVEL_DEBUG)
+        return;
+
+    for (i = 0; i < len; i += LOG_DATA_SIZE) {
+        log_record_init(&rec, LOG_LEVEL_DEBUG, NULL);
+        rec.len = len - i < LOG_DATA_SIZE ? len - i : LOG_DATA_SIZE;
+        rec.offset = i;
+        memcpy(rec.data, (const char *)data + i, rec.len);
+        submit_record(&rec);
+    }
+}
+
+/* Formats a record into the output buffer of the writer. */
+static void output_record(const struct log_record *rec)
+{
+    if (sizeof(out_buf) - out_len < 1024) {
+        fwrite(out_buf, 1, out_len, stderr);
+        out_len = 0;
+    }
+    out_len += format_record(rec, out_buf + out_len, 1024);
+}
+
+/* Moves all queued records to the output. */
+static void drain(void)
+{
+    struct log_buffer *buffer;
+    struct log_record rec;
+    unsigned long dropped;
+
+    pthread_mutex_lock(&buffers_lock);
+    for (buffer = buffers; buffer; buffer = buffer->next) {
+        while (ring_pop(buffer->ring, &rec))
+            output_record(&rec);
+
+        dropped = atomic_exchange(&buffer->dropped, 0);
+        if (dropped) {
+            log_record_init(&rec, LOG_LEVEL_WARNING,
+                    "%lu log messages dropped\n");
+            rec.args[rec.nargs++].u = dropped;
+            output_record(&rec);
+        }
+    }
+    pthread_mutex_unlock(&buffers_lock);
+
+    if (out_len) {
+        fwrite(out_buf, 1, out_len, stderr);
+        out_len = 0;
+    }
+}
+
+static void *writer_main(void *data)
+{
+    struct timespec deadline;
+    bool stopping;
+
+    (void)data;
+    pthread_mutex_lock(&writer_lock);
+    for (;;) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!writer_stopping && pthread_cond_timedwait(&writer_cond,
+                    &writer_lock, &deadline) == EINTR)
+            ;
+        stopping = writer_stopping;
+
+        pthread_mutex_unlock(&writer_lock);
+        drain();
+        if (stopping)
+            return NULL;
+        pthread_mutex_lock(&writer_lock);
+    }
+}
+
+/**
+ * Gives the calling thread its own ring such that logging does not block it.
+ * Without it (or before log_start), messages are written synchronously.
+ */
+int log_thread_init(void)
+{
+    struct log_buffer *buffer;
+
+    buffer = calloc(1, sizeof(*buffer));
+    if (!buffer)
+        return -1;
+    buffer->ring = ring_init(LOG_RING_SIZE, sizeof(struct log_record));
+    if (!buffer->ring) {
+        free(buffer);
+        return -1;
+    }
+
+    pthread_mutex_lock(&buffers_lock);
+    buffer->next = buffers;
+    buffers = buffer;
+    pthread_mutex_unlock(&buffers_lock);
+
+    thread_buffer = buffer;
+    return 0;
+}
+
+/* Starts the thread that writes the queued messages. */
+int log_start(void)
+{
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL)) {
+        log_error("Cannot start log writer thread\n");
+        return -1;
+    }
+    atomic_store(&writer_running, true);
+    return 0;
+}
+
+/**
+ * Writes all queued messages and stops the writer. Must only be called when
+ * no other thread logs anymore. Later messages are written synchronously.
+ */
+void log_stop(void)
+{
+    struct log_buffer *buffer;
+
+    if (atomic_load(&writer_running)) {
+        atomic_store(&writer_running, false);
+        pthread_mutex_lock(&writer_lock);
+        writer_stopping = true;
+        pthread_cond_signal(&writer_cond);
+        pthread_mutex_unlock(&writer_lock);
+        pthread_join(writer_thread, NULL);
+    }
+
+    pthread_mutex_lock(&buffers_lock);
+    while ((buffer = buffers)) {
+        buffers = buffer->next;
+        ring_fini(buffer->ring);
+        free(buffer);
+    }
+    pthread_mutex_unlock(&buffers_lock);
+    thread_buffer = NULL;
+}
@@ -0,0 +1,469 @@
+/**
+ * Longest prefix match for IPv4 and IPv6 addresses.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Implementation notes:
+ *  - A multibit trie with a stride of LPM_STRIDE bits, compressed like a
+ *    poptrie: instead of 64 slots, a node has a bitmap of the chunks that have
+ *    a child node and the children are stored consecutively, such that the
+ *    index of a child is found by counting the bits below it. A lookup visits
+ *    at most 6 nodes for IPv4 and 22 for IPv6 without following pointers.
+ *  - The other chunks map to leaves with the value of the longest matching
+ *    prefix. Leaves of a node are also consecutive, a bitmap marks the chunks
+ *    where the value differs from the previous chunk without a child, so runs
+ *    of the same value take a single leaf. The first chunk always starts a
+ *    leaf, so every chunk has one at or below it.
+ *  - Values of shorter prefixes are copied into the leaves of child nodes
+ *    while building, so the first leaf that is reached is the result.
+ *  - Prefixes are collected by lpm_add and compiled at once by lpm_build. The
+ *    table is read-only afterwards and can be shared by threads.
+ *  - The nodes and leaves can be written to an image (see lpm_write_image) and
+ *    used in place by lpm_map, which checks all indices beforehand.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "dnsallow.h"
+
+#define LPM_STRIDE      6
+#define LPM_CHUNKS      (1U << LPM_STRIDE)
+
+/* A leaf without a matching prefix, other leaves store the value plus one. */
+#define LPM_NO_MATCH    0
+
+struct lpm_prefix {
+    uint64_t hi, lo;        /* Address bits, most significant first. */
+    uint8_t len;
+    uint8_t family;         /* Whether the prefix is IPv4 (0) or IPv6 (1). */
+    uint32_t value;
+    unsigned seq;           /* Order of addition, later prefixes win. */
+};
+
+struct lpm_node {
+    uint64_t children;      /* Chunks with a child node. */
+    uint64_t leaves;        /* Chunks where a new leaf starts. */
+    uint32_t child_base;    /* Index of the first child in nodes. */
+    uint32_t leaf_base;     /* Index of the first leaf in leaves. */
+};
+
+/* Start of an image, followed by the nodes and the leaves. */
+struct lpm_image_header {
+    uint32_t node_count;
+    uint32_t leaf_count;
+};
+
+struct lpm {
+    bool mapped;                    /* Nodes and leaves are in an image. */
+    struct lpm_prefix *prefixes;    /* Only until lpm_build. */
+    unsigned prefix_count;
+    unsigned prefix_alloc;
+
+    /* nodes[0] and nodes[1] are the IPv4 and IPv6 roots. */
+    struct lpm_node *nodes;
+    unsigned node_count;
+    unsigned node_alloc;
+    uint32_t *leaves;
+    unsigned leaf_count;
+    unsigned leaf_alloc;
+};
+
+/* Loads an address as a 128-bit number. */
+static inline void make_key(const struct address *addr, uint64_t *hi,
+        uint64_t *lo)
+{
+    const uint8_t *b;
+    unsigned i;
+
+    if (addr->family == AF_INET) {
+        *hi = (uint64_t)ntohl(addr->ip4_addr.s_addr) << 32;
+        *lo = 0;
+        return;
+    }
+    b = addr->ip6_addr.s6_addr;
+    *hi = *lo = 0;
+    for (i = 0; i < 8; i++) {
+        *hi = *hi << 8 | b[i];
+        *lo = *lo << 8 | b[i + 8];
+    }
+}
+
+/* Returns the LPM_STRIDE bits at bit offset 'off' (zero past the end). */
+static inline unsigned chunk(uint64_t hi, uint64_t lo, unsigned off)
+{
+    uint64_t top;
+
+    if (off == 0)
+        top = hi;
+    else if (off < 64)
+        top = hi << off | lo >> (64 - off);
+    else
+        top = lo << (off - 64);
+    return top >> (64 - LPM_STRIDE);
+}
+
+/* Mask for the chunks up to and including 'c'. */
+static inline uint64_t mask_upto(unsigned c)
+{
+    return c == 63 ? ~0ULL : (2ULL << c) - 1;
+}
+
+struct lpm *lpm_init(void)
+{
+    return calloc(1, sizeof(struct lpm));
+}
+
+/**
+ * Adds a prefix (the bits after 'len' are ignored). If the same prefix is
+ * added twice, the last value wins. Returns -1 on error.
+ */
+int lpm_add(struct lpm *lpm, const struct address *prefix, unsigned len,
+        uint32_t value)
+{
+    struct lpm_prefix *p;
+    unsigned width = prefix->family == AF_INET ? 32 : 128;
+    unsigned alloc;
+
+    if (len > width || value == UINT32_MAX)
+        return -1;
+
+    if (lpm->prefix_count == lpm->prefix_alloc) {
+        alloc = lpm->prefix_alloc ? 2 * lpm->prefix_alloc : 64;
+        p = realloc(lpm->prefixes, alloc * sizeof(*p));
+        if (!p)
+            return -1;
+        lpm->prefixes = p;
+        lpm->prefix_alloc = alloc;
+    }
+
+    p = &lpm->prefixes[lpm->prefix_count];
+    make_key(prefix, &p->hi, &p->lo);
+    if (len == 0) {
+        p->hi = p->lo = 0;
+    } else if (len <= 64) {
+        p->hi &= ~0ULL << (64 - len);
+        p->lo = 0;
+    } else if (len < 128) {
+        p->lo &= ~0ULL << (128 - len);
+    }
+    p->len = len;
+    p->family = prefix->family == AF_INET6;
+    p->value = value;
+    p->seq = lpm->prefix_count++;
+    return 0;
+}
+
+static int compare_prefix(const void *a, const void *b)
+{
+    const struct lpm_prefix *x = a, *y = b;
+
+    if (x->family != y->family)
+        return x->family < y->family ? -1 : 1;
+    if (x->hi != y->hi)
+        return x->hi < y->hi ? -1 : 1;
+    if (x->lo != y->lo)
+        return x->lo < y->lo ? -1 : 1;
+    if (x->len != y->len)
+        return x->len < y->len ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int reserve(void **array, unsigned *alloc, unsigned count,
+        unsigned more, size_t size)
+{
+    unsigned n = *alloc ? *alloc : 64;
+    void *p;
+
+    if (count + more <= *alloc)
+        return 0;
+    while (n < count + more)
+        n *= 2;
+    p = realloc(*array, (size_t)n * size);
+    if (!p)
+        return -1;
+    *array = p;
+    *alloc = n;
+    return 0;
+}
+
+/**
+ * Builds the node at 'index' for the (sorted) prefixes that share the first
+ * 'off' bits. 'inherited' is the leaf value of the parent for this subtree.
+ */
+static int build_node(struct lpm *lpm, uint32_t index,
+        const struct lpm_prefix *prefixes, unsigned n, unsigned off,
+        uint32_t inherited)
+{
+    uint32_t leaf[LPM_CHUNKS];
+    struct lpm_prefix *deeper;
+    struct lpm_node node = { 0 };
+    unsigned i, j, c, first, count, ndeeper = 0, child;
+    uint32_t prev = 0;
+    int r = 0;
+
+    for (c = 0; c < LPM_CHUNKS; c++)
+        leaf[c] = inherited;
+
+    /* Prefixes that end in this node, shorter ones first. */
+    for (i = off; i <= off + LPM_STRIDE; i++) {
+        for (j = 0; j < n; j++) {
+            if (prefixes[j].len != i)
+                continue;
+            count = 1U << (off + LPM_STRIDE - i);
+            first = chunk(prefixes[j].hi, prefixes[j].lo, off) & ~(count - 1);
+            for (c = first; c < first + count; c++)
+                leaf[c] = prefixes[j].value + 1;
+        }
+    }
+
+    /* The others continue in child nodes, grouped by chunk. */
+    deeper = malloc((n ? n : 1) * sizeof(*deeper));
+    if (!deeper)
+        return -1;
+    for (j = 0; j < n; j++) {
+        if (prefixes[j].len > off + LPM_STRIDE) {
+            deeper[ndeeper++] = prefixes[j];
+            node.children |= 1ULL << chunk(prefixes[j].hi, prefixes[j].lo,
+                    off);
+        }
+    }
+
+    /* Leaves, merging runs of the same value. */
+    for (c = 0; c < LPM_CHUNKS; c++) {
+        if (c > 0 && (node.children >> c & 1 || leaf[c] == prev))
+            continue;
+        node.leaves |= 1ULL << c;
+        prev = leaf[c];
+    }
+    count = __builtin_popcountll(node.leaves);
+    if (reserve((void **)&lpm->leaves, &lpm->leaf_alloc, lpm->leaf_count,
+                count, sizeof(*lpm->leaves)) < 0)
+        goto err;
+    node.leaf_base = lpm->leaf_count;
+    for (c = 0; c < LPM_CHUNKS; c++) {
+        if (node.leaves >> c & 1)
+            lpm->leaves[lpm->leaf_count++] = leaf[c];
+    }
+
+    /* Children are allocated together, then filled recursively. */
+    count = __builtin_popcountll(node.children);
+    if (reserve((void **)&lpm->nodes, &lpm->node_alloc, lpm->node_count,
+                count, sizeof(*lpm->nodes)) < 0)
+        goto err;
+    node.child_base = lpm->node_count;
+    lpm->node_count += count;
+    lpm->nodes[index] = node;
+
+    for (i = 0, child = 0; i < ndeeper && r == 0; i = j, child++) {
+        c = chunk(deeper[i].hi, deeper[i].lo, off);
+        for (j = i + 1; j < ndeeper &&
+                chunk(deeper[j].hi, deeper[j].lo, off) == c; j++)
+            ;
+        r = build_node(lpm, node.child_base + child, deeper + i, j - i,
+                off + LPM_STRIDE, leaf[c]);
+    }
+    free(deeper);
+    return r;
+
+err:
+    free(deeper);
+    return -1;
+}
+
+/**
+ * Compiles the added prefixes into the lookup structure. No prefixes can be
+ * added afterwards. Returns -1 on error.
+ */
+int lpm_build(struct lpm *lpm)
+{
+    unsigned n4;
+
+    if (reserve((void **)&lpm->nodes, &lpm->node_alloc, 0, 2,
+                sizeof(*lpm->nodes)) < 0)
+        return -1;
+    lpm->node_count = 2;
+
+    qsort(lpm->prefixes, lpm->prefix_count, sizeof(*lpm->prefixes),
+            compare_prefix);
+    for (n4 = 0; n4 < lpm->prefix_count && !lpm->prefixes[n4].family; n4++)
+        ;
+    if (build_node(lpm, 0, lpm->prefixes, n4, 0, LPM_NO_MATCH) < 0 ||
+            build_node(lpm, 1, lpm->prefixes + n4, lpm->prefix_count - n4, 0,
+                LPM_NO_MATCH) < 0)
+        return -1;
+
+    free(lpm->prefixes);
+    lpm->prefixes = NULL;
+    lpm->prefix_count = lpm->prefix_alloc = 0;
+    return 0;
+}
+
+/**
+ * Finds the value of the longest prefix that contains 'addr'. Returns false if
+ * there is no such prefix.
+ */
+bool lpm_lookup(const struct lpm *lpm, const struct address *addr,
+        uint32_t *value)
+{
+    const struct lpm_node *node;
+    uint64_t hi, lo;
+    unsigned off, c;
+    uint32_t leaf;
+
+    make_key(addr, &hi, &lo);
+    node = &lpm->nodes[addr->family == AF_INET ? 0 : 1];
+    for (off = 0; ; off += LPM_STRIDE) {
+        c = chunk(hi, lo, off);
+        /* Valid tables have no children past the last bit. */
+        if (!(node->children >> c & 1) || off + LPM_STRIDE >= 128)
+            break;
+        node = &lpm->nodes[node->child_base +
+            __builtin_popcountll(node->children & mask_upto(c)) - 1];
+    }
+
+    leaf = lpm->leaves[node->leaf_base +
+        __builtin_popcountll(node->leaves & mask_upto(c)) - 1];
+    if (leaf == LPM_NO_MATCH)
+        return false;
+    *value = leaf - 1;
+    return true;
+}
+
+/* Returns the memory used by the lookup structure (in bytes). */
+size_t lpm_memory(const struct lpm *lpm)
+{
+    return lpm->node_count * sizeof(*lpm->nodes) +
+        lpm->leaf_count * sizeof(*lpm->leaves);
+}
+
+/* Returns the size of the image written by lpm_write_image. */
+size_t lpm_image_size(const struct lpm *lpm)
+{
+    return sizeof(struct lpm_image_header) + lpm_memory(lpm);
+}
+
+/**
+ * Writes the table of a built lpm to 'buf' (lpm_image_size bytes, aligned to
+ * eight bytes).
+ */
+void lpm_write_image(const struct lpm *lpm, void *buf)
+{
+    struct lpm_image_header hdr = {
+        .node_count = lpm->node_count,
+        .leaf_count = lpm->leaf_count,
+    };
+    char *p = buf;
+
+    memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+    memcpy(p, lpm->nodes, lpm->node_count * sizeof(*lpm->nodes));
+    p += lpm->node_count * sizeof(*lpm->nodes);
+    memcpy(p, lpm->leaves, lpm->leaf_count * sizeof(*lpm->leaves));
+}
+
+/**
+ * Uses an image written by lpm_write_image (aligned to eight bytes) without
+ * copying it. The image must stay mapped until lpm_fini. Returns NULL if the
+ * image is invalid.
+ */
+struct lpm *lpm_map(const void *buf, size_t size)
+{
+    struct lpm_image_header hdr;
+    const struct lpm_node *node;
+    struct lpm *lpm;
+    uint32_t i;
+
+    if (size < sizeof(hdr))
+        return NULL;
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.node_count < 2 || size != sizeof(hdr) +
+            (uint64_t)hdr.node_count * sizeof(struct lpm_node) +
+            (uint64_t)hdr.leaf_count * sizeof(uint32_t))
+        return NULL;
+
+    lpm = calloc(1, sizeof(*lpm));
+    if (!lpm)
+        return NULL;
+    lpm->mapped = true;
+    lpm->nodes = (struct lpm_node *)((char *)buf + sizeof(hdr));
+    lpm->node_count = hdr.node_count;
+    lpm->leaves = (uint32_t *)(lpm->nodes + hdr.node_count);
+    lpm->leaf_count = hdr.leaf_count;
+
+    /* Children follow their parent, so lookups cannot loop. */
+    for (i = 0; i < lpm->node_count; i++) {
+        node = &lpm->nodes[i];
+        if (!(node->leaves & 1) || (uint64_t)node->leaf_base +
+                __builtin_popcountll(node->leaves) > lpm->leaf_count ||
+                (node->children && (node->child_base <= i ||
+                    (uint64_t)node->child_base +
+                    __builtin_popcountll(node->children) > lpm->node_count))) {
+            lpm_fini(lpm);
+            return NULL;
+        }
+    }
+    return lpm;
+}
+
+void lpm_fini(struct lpm *lpm)
+{
+    free(lpm->prefixes);
+    if (!lpm->mapped) {
+        free(lpm->nodes);
+        free(lpm->leaves);
+    }
+    free(lpm);
+}
+
+/**
+ * Parses "ADDRESS/LEN" or "ADDRESS" (a single address). Returns -1 if the
+ * prefix is invalid.
+ */
+int parse_prefix(const char *str, struct address *prefix, unsigned *len)
+{
+    char buf[INET6_ADDRSTRLEN];
+    const char *slash = strchr(str, '/');
+    size_t n = slash ? (size_t)(slash - str) : strlen(str);
+    unsigned long l;
+    char *end;
+
+    if (n >= sizeof(buf))
+        return -1;
+    memcpy(buf, str, n);
+    buf[n] = '\0';
+
+    memset(prefix, 0, sizeof(*prefix));
+    if (inet_pton(AF_INET, buf, &prefix->ip4_addr) == 1)
+        prefix->family = AF_INET;
+    else if (inet_pton(AF_INET6, buf, &prefix->ip6_addr) == 1)
+        prefix->family = AF_INET6;
+    else
+        return -1;
+
+    *len = prefix->family == AF_INET ? 32 : 128;
+    if (slash) {
+        errno = 0;
+        l = strtoul(slash + 1, &end, 10);
+        if (errno || end == slash + 1 || *end || l > *len)
+            return -1;
+        *len = l;
+    }
+    return 0;
+}
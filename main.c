@@ -18,120 +18,1131 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "dnsallow.h"
 #include <signal.h>
-#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Number of CNAME targets remembered (shared by all workers). */
+#define DEFAULT_ALIAS_CACHE_SIZE    16384
+
+/* Number of repeated responses remembered per worker (24 bytes each). */
+#define DEFAULT_RESP_CACHE_SIZE     4096
+/* Maximum time (in seconds) that a decision for a response is reused. */
+#define RESP_CACHE_MAX_AGE          60
+
+/* Number of addresses remembered per worker (24 bytes each). */
+#define DEFAULT_ADDR_CACHE_SIZE     65536
+/* If entries do not expire, cached addresses are added again after this time
+ * (in seconds) in case the set was modified externally. */
+#define DEFAULT_ADDR_CACHE_LIFETIME 300
+
+/* Bounds for the timeout of set entries, derived from the DNS TTL. Clients may
+ * use an address a bit longer than the TTL, hence the grace period. */
+#define DEFAULT_TTL_MIN     60
+#define DEFAULT_TTL_MAX     86400
+#define DEFAULT_TTL_GRACE   60
+
+/* Limits for DNS over TCP per worker: concurrent flows and 2 KiB buffers for
+ * stream data (2 MiB). */
+#define DEFAULT_TCP_FLOWS   1024
+#define DEFAULT_TCP_BUFFERS 1024
+
+/* Number of packets per queue that can wait for the ipset writer. */
+#define DEFAULT_MAX_PENDING 1024
+
+/* Interval (in seconds) between updates of the statistics file. */
+#define DEFAULT_STATS_INTERVAL  10
+
+struct options {
+    const char *policy_file;        /* NULL to accept all names. */
+    const char *clients_file;       /* NULL if there are no client groups. */
+    int first_queue;
+    int last_queue;
+    struct queue_options queue;
+    unsigned alias_cache_size;      /* Zero disables the cache. */
+    unsigned resp_cache_size;       /* Zero disables the cache. */
+    unsigned query_table_size;      /* Zero disables query matching. */
+    const char *resolvers;          /* NULL to allow any resolver. */
+    unsigned addr_cache_size;       /* Zero disables the cache. */
+    unsigned addr_cache_lifetime;
+    unsigned ttl_min;
+    unsigned ttl_max;               /* Zero for entries that never expire. */
+    unsigned ttl_grace;
+    unsigned tcp_flows;             /* Zero disables TCP reassembly. */
+    unsigned tcp_buffers;
+    unsigned max_pending;
+    const char *stats_file;         /* NULL to disable statistics. */
+    unsigned stats_interval;
+    const char *replay_file;        /* Capture instead of NFQUEUE. */
+    bool replay_realtime;           /* Replay with the recorded timing. */
+    const char *sink;               /* Where addresses are added. */
+    const char *snapshot_file;      /* NULL to disable snapshots. */
+};
 
 struct state {
-    struct policy *policy;
-    struct ipset_state *ipset;
+    const struct options *opts;
+    struct writer_channel *writer;
+    struct addr_cache *addr_cache;  /* NULL if disabled. */
+    struct resp_cache *resp_cache;  /* NULL if disabled. */
+    struct replay_summary *summary; /* Decisions per name (replay only). */
+    struct tcp_tracker *tcp;        /* NULL if TCP is not reassembled. */
 };
 
-void hexdump(const unsigned char *data, size_t len)
+/* The policy that is shared by all workers. It can be replaced at any time
+ * (see reload_policy), workers must only use it while they are online. */
+static _Atomic(struct policy *) active_policy;
+/* Policies per client group (NULL if disabled), replaced like the policy. */
+static _Atomic(struct client_table *) active_clients;
+/* Changes whenever the policy is replaced. */
+static atomic_uint policy_generation;
+
+/* Names reached through CNAMEs from allowed names (NULL if disabled). */
+static struct alias_cache *alias_cache;
+/* Outstanding queries of all queues (NULL if responses are not matched). */
+static struct query_table *query_table;
+
+/* Returns a monotonic time in seconds. */
+static uint32_t now_seconds(void)
 {
-    size_t i, j, linelen;
+    struct timespec ts;
 
-    for (i = 0; i < len; i += 16) {
-        linelen = len - i < 16 ? len - i : 16;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
 
-        printf("%03zx: ", i);
+/* Returns the timeout for a set entry given the TTL of the DNS record. */
+static uint32_t entry_timeout(const struct options *opts, uint32_t ttl)
+{
+    if (!opts->ttl_max)
+        return 0;
 
-        for (j = 0; j < linelen; j++)
-            printf("%02x ", data[i + j]);
-        for (; j < 16; j++)
-            printf("   ");
-        putchar(' ');
-        for (j = 0; j < linelen; j++) {
-            unsigned char c = data[i + j];
-            putchar(isprint(c) ? c : '.');
-        }
-        putchar('\n');
-    }
+    if (ttl < opts->ttl_min)
+        ttl = opts->ttl_min;
+    if (ttl > opts->ttl_max)
+        ttl = opts->ttl_max;
+    return ttl + opts->ttl_grace;
+}
+
+/* Addresses of a packet that must be added before it is accepted. */
+struct pending_addrs {
+    char name[DNS_NAME_SIZE];       /* The (first) response, for snapshots. */
+    struct address addrs[DNS_MAX_ENTRIES];
+    uint32_t timeouts[DNS_MAX_ENTRIES];
+    unsigned count;
+    bool wait;                      /* Addresses are being added already. */
+};
+
+/* Returns the client group of the destination of a packet. */
+static unsigned packet_group(const unsigned char *buf, unsigned buflen)
+{
+    struct client_table *clients = atomic_load(&active_clients);
+    struct address client;
+    uint8_t protocol;
+
+    if (!clients || !parse_ip(buf, buflen, &protocol))
+        return 0;
+    ip_destination(buf, &client);
+    return client_lookup(clients, &client);
 }
 
-static void pkt_callback(const unsigned char *buf, unsigned buflen, void *data)
+/* Returns the policy for a client group. */
+static struct policy *group_policy(unsigned group)
 {
+    if (group)
+        return client_policy(atomic_load(&active_clients), group);
+    return atomic_load(&active_policy);
+}
+
+/**
+ * Checks a parsed DNS response to a client of 'group' against its policy and
+ * collects the addresses that must be added (at most DNS_MAX_ENTRIES per
+ * packet). Returns the decision and until when it may be reused for identical
+ * responses.
+ */
+static enum resp_decision check_response(struct state *state, unsigned group,
+        const struct dns_view *view, uint32_t now,
+        struct pending_addrs *pending, uint32_t *expires)
+{
+    struct policy *policy = group_policy(group);
     struct dns_info info;
-    struct state *state = data;
+    uint32_t timeout, lifetime;
+    uint64_t start;
     unsigned i;
+    bool allowed;
 
-    hexdump(buf, buflen);
-    if (parse_ip_dns(buf, buflen, &info) == 0) {
-        fprintf(stderr, "Parsing failed\n");
-        return;
+    stats_count(STAT_PARSED, 1);
+
+    start = stats_now();
+    allowed = policy_check_labels(policy, view->name,
+            &view->labels) == 0 ||
+            (alias_cache && alias_cache_check(alias_cache, group,
+                    view->name, now));
+    stats_record(STAGE_POLICY, start, 1);
+    if (state->summary)
+        replay_summary_add(state->summary, view->name, allowed);
+    if (!allowed) {
+        stats_count(STAT_REJECTED, 1);
+        log_info("Policy check failed for %s\n", view->name);
+        *expires = now + RESP_CACHE_MAX_AGE;
+        return RESP_REJECTED;
     }
 
-    if (!policy_check(state->policy, info.name) == 0) {
-        fprintf(stderr, "Policy check failed for %s\n", info.name);
+    /* Answers are only decoded for accepted names. */
+    parse_dns_answers(view, &info);
+
+    /* Names in the CNAME chain of an allowed name are allowed as well. */
+    *expires = now + RESP_CACHE_MAX_AGE;
+    for (i = 0; alias_cache && i < info.cname_count; i++) {
+        lifetime = entry_timeout(state->opts, info.cname_ttl[i]);
+        alias_cache_add(alias_cache, group, info.cnames[i],
+                now + (lifetime ? lifetime : info.cname_ttl[i]));
+        if (now + info.cname_ttl[i] / 2 < *expires)
+            *expires = now + info.cname_ttl[i] / 2;
+    }
+    if (state->opts->snapshot_file && pending->count == 0)
+        strcpy(pending->name, view->name);
+    for (i = 0; i < info.count && pending->count < DNS_MAX_ENTRIES; i++) {
+        /* Internal addresses must not be reachable by rebinding names. */
+        if (policy_check_address(policy, view->name, &view->labels,
+                    &info.entries[i])) {
+            stats_count(STAT_FILTERED, 1);
+            log_info("Filtered an address for %s\n", view->name);
+            continue;
+        }
+
+        timeout = entry_timeout(state->opts, info.ttl[i]);
+        lifetime = timeout ? timeout : state->opts->addr_cache_lifetime;
+
+        /* Identical responses are skipped until the address cache would
+         * refresh the address. */
+        if (now + lifetime / 2 < *expires)
+            *expires = now + lifetime / 2;
+
+        /* Skip addresses that were recently added (or refreshed) already,
+         * but wait for the commit of those that are still being added. */
+        if (state->addr_cache) {
+            switch (addr_cache_check(state->addr_cache, &info.entries[i],
+                        group, now, lifetime,
+                        writer_last_seq(state->writer) + 1)) {
+            case ADDR_PENDING:
+                pending->wait = true;
+                continue;
+            case ADDR_PRESENT:
+                continue;
+            case ADDR_MISSING:
+                break;
+            }
+        }
+
+        pending->timeouts[pending->count] = timeout;
+        pending->addrs[pending->count++] = info.entries[i];
+    }
+    return RESP_ALLOWED;
+}
+
+struct tcp_context {
+    struct state *state;
+    unsigned group;
+    uint32_t now;
+    uint64_t received;
+    struct pending_addrs pending;
+};
+
+/* Handles a DNS message that was reassembled from a TCP stream. */
+static void tcp_message(const unsigned char *msg, unsigned len, void *data)
+{
+    struct tcp_context *ctx = data;
+    struct dns_view view;
+    uint32_t expires;
+
+    if (parse_dns_view(msg, len, &view) == 0) {
+        stats_record(STAGE_PARSE, ctx->received, 1);
+        stats_count(STAT_PARSE_FAILED, 1);
+        log_debug("Parsing failed (TCP)\n");
         return;
     }
+    stats_record(STAGE_PARSE, ctx->received, 1);
+    check_response(ctx->state, ctx->group, &view, ctx->now, &ctx->pending,
+            &expires);
+}
+
+/**
+ * Checks a DNS response and passes its addresses to the ipset writer. Returns
+ * true if the packet must wait for the writer before it is accepted.
+ */
+static bool pkt_callback(const unsigned char *buf, unsigned buflen,
+        uint32_t pkt_id, void *data)
+{
+    struct state *state = data;
+    struct dns_view view;
+    struct tcp_context ctx;
+    struct pending_addrs *pending = &ctx.pending;
+    enum resp_decision decision = RESP_UNKNOWN;
+    uint32_t policy_gen = 0, alias_gen = 0, expires;
+    uint64_t key = 0;
+    unsigned offset;
+    uint8_t protocol;
+    bool deferred = false;
+
+    log_hexdump(buf, buflen);
+    ctx.received = stats_now();
+    ctx.now = now_seconds();
+    ctx.state = state;
+    ctx.group = packet_group(buf, buflen);
+    pending->count = 0;
+    pending->wait = false;
+
+    /* Segments of a TCP stream may complete one or more messages. */
+    if (state->tcp && (offset = parse_ip(buf, buflen, &protocol)) &&
+            protocol == IPPROTO_TCP) {
+        tcp_track(state->tcp, buf, buflen, offset, ctx.now, tcp_message, &ctx);
+    } else {
+        offset = parse_udp(buf, buflen);
+        if (offset == 0)
+            goto parse_failed;
+
+        /* Remember queries, only process responses to them. */
+        if (query_table) {
+            if (buflen - offset < 12)
+                goto parse_failed;
+            if (!(buf[offset + 2] & 0x80)) {
+                query_table_add(query_table, buf, buflen, offset, ctx.now);
+                return false;
+            }
+            if (!query_table_match(query_table, buf, buflen, offset,
+                        ctx.now)) {
+                stats_count(STAT_UNMATCHED, 1);
+                log_debug("Response without query\n");
+                return false;
+            }
+        }
+
+        /* Nothing to do for a repeated response, whatever the decision. */
+        if (state->resp_cache) {
+            policy_gen = atomic_load(&policy_generation);
+            alias_gen = alias_cache ? alias_cache_generation(alias_cache) : 0;
+            if (resp_cache_lookup(state->resp_cache, ctx.group, buf + offset,
+                        buflen - offset, ctx.now, policy_gen, alias_gen,
+                        &key) != RESP_UNKNOWN) {
+                stats_count(STAT_CACHED, 1);
+                return false;
+            }
+        }
+
+        if (parse_dns_view(buf + offset, buflen - offset, &view) == 0)
+            goto parse_failed;
+        stats_record(STAGE_PARSE, ctx.received, 1);
+        decision = check_response(state, ctx.group, &view, ctx.now, pending,
+                &expires);
+    }
+
+    /* Unless there is nothing to add, the packet waits for its request,
+     * which completes after the commit of earlier requests (even if it has
+     * no addresses). */
+    if (pending->count > 0 || pending->wait) {
+        if (!writer_submit(state->writer, pkt_id, ctx.received, ctx.group,
+                    pending->name, pending->addrs, pending->timeouts,
+                    pending->count))
+            return false;
+        deferred = true;
+    }
+
+    /* An allowed response is reused once the last request was committed. */
+    if (key)
+        resp_cache_add(state->resp_cache, key, decision, expires, policy_gen,
+                alias_gen, writer_last_seq(state->writer));
+    return deferred;
+
+parse_failed:
+    stats_record(STAGE_PARSE, ctx.received, 1);
+    stats_count(STAT_PARSE_FAILED, 1);
+    log_debug("Parsing failed\n");
+    return false;
+}
+
+/* Wakes up the ipset writer once for all packets in a batch. */
+static void batch_done(void *data)
+{
+    struct state *state = data;
+
+    writer_flush(state->writer);
+}
+
+/* The default queue number to be passed to -j NFQUEUE --queue-num X */
+#define DEFAULT_QUEUE_NUM   53
+
+/* Enough to absorb bursts of several thousands of full-size packets. */
+#define DEFAULT_RCVBUF_SIZE (8 * 1024 * 1024)
+
+/* Every queue is handled by its own thread with its own NFQUEUE socket. The
+ * policy is shared (read-only), addresses are added by a single ipset writer
+ * thread. Packets are accepted as soon as their addresses are in the set. */
+struct worker {
+    pthread_t thread;
+    int queue_num;
+    struct state state;
+    struct input_queue *iq;
+    struct rcu_reader rcu;
+};
+
+/* Read end becomes readable when workers must stop. */
+static int stop_pipe[2] = { -1, -1 };
+
+static void *worker_main(void *data)
+{
+    struct worker *worker = data;
+    struct pollfd fds[3];
+    uint32_t pkt_id;
+    uint64_t received;
+    bool ok;
+
+    fds[0].fd = queue_fd(worker->iq);
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_pipe[0];
+    fds[1].events = POLLIN;
+    fds[2].fd = writer_channel_fd(worker->state.writer);
+    fds[2].events = POLLIN;
+
+    /* Without a log ring, messages are written synchronously. */
+    log_thread_init();
+    if (worker->state.opts->stats_file)
+        stats_thread_init();
+    rcu_register(&worker->rcu);
+    for (;;) {
+        /* No shared data is used between batches. */
+        rcu_offline(&worker->rcu);
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("poll: %s\n", strerror(errno));
+            break;
+        }
+        rcu_online(&worker->rcu);
+
+        if (fds[1].revents) {
+            rcu_unregister(&worker->rcu);
+            return NULL;
+        }
+
+        if (fds[0].revents && queue_handle(worker->iq) < 0)
+            break;
+
+        /* Accept packets whose addresses were added (in any order). */
+        if (fds[2].revents)
+            writer_channel_clear(worker->state.writer);
+        while (writer_complete(worker->state.writer, &pkt_id, &received,
+                    &ok)) {
+            queue_verdict(worker->iq, pkt_id);
+            stats_record(STAGE_LATENCY, received, 1);
+            if (worker->state.addr_cache)
+                addr_cache_commit(worker->state.addr_cache, ok);
+            if (worker->state.resp_cache)
+                resp_cache_commit(worker->state.resp_cache, ok);
+        }
+    }
+    rcu_unregister(&worker->rcu);
+
+    /* Let the main thread stop the other workers. */
+    if (queue_finished(worker->iq))
+        log_info("End of capture reached.\n");
+    else
+        log_error("Queue %d stopped unexpectedly.\n", worker->queue_num);
+    kill(getpid(), SIGUSR1);
+    return NULL;
+}
+
+static int worker_init(struct worker *worker, int queue_num,
+        const struct options *opts, struct writer_channel *writer)
+{
+    worker->queue_num = queue_num;
+    worker->state.opts = opts;
+    worker->state.writer = writer;
+
+    if (opts->addr_cache_size) {
+        worker->state.addr_cache = addr_cache_init(opts->addr_cache_size);
+        if (!worker->state.addr_cache)
+            return -1;
+    }
+
+    /* Replays report every decision, so responses are never skipped. */
+    if (opts->resp_cache_size && !opts->replay_file) {
+        worker->state.resp_cache = resp_cache_init(opts->resp_cache_size);
+        if (!worker->state.resp_cache)
+            goto err_resp_cache;
+    }
+
+    if (opts->tcp_flows) {
+        worker->state.tcp = tcp_tracker_init(opts->tcp_flows,
+                opts->tcp_buffers);
+        if (!worker->state.tcp)
+            goto err_tcp;
+    }
+
+    if (opts->replay_file) {
+        worker->state.summary = replay_summary_init();
+        if (!worker->state.summary)
+            goto err_summary;
+        worker->iq = replay_init(opts->replay_file, opts->replay_realtime,
+                pkt_callback, batch_done, &worker->state);
+    } else {
+        worker->iq = queue_init(queue_num, &opts->queue, pkt_callback,
+                batch_done, &worker->state);
+    }
+    if (!worker->iq)
+        goto err_queue;
+
+    return 0;
+
+err_queue:
+    if (worker->state.summary)
+        replay_summary_fini(worker->state.summary);
+err_summary:
+    if (worker->state.tcp)
+        tcp_tracker_fini(worker->state.tcp);
+err_tcp:
+    if (worker->state.resp_cache)
+        resp_cache_fini(worker->state.resp_cache);
+err_resp_cache:
+    if (worker->state.addr_cache)
+        addr_cache_fini(worker->state.addr_cache);
+    return -1;
+}
+
+static void worker_fini(struct worker *worker)
+{
+    unsigned long hits, misses, messages, evicted;
 
-    for (i = 0; i < info.count; i++) {
-        ipset_add_ip(state->ipset, &info.entries[i]);
+    queue_fini(worker->iq);
+    if (worker->state.addr_cache) {
+        addr_cache_stats(worker->state.addr_cache, &hits, &misses);
+        log_info("Queue %d: address cache hits %lu, misses %lu\n",
+                worker->queue_num, hits, misses);
+        addr_cache_fini(worker->state.addr_cache);
+    }
+    if (worker->state.resp_cache) {
+        resp_cache_stats(worker->state.resp_cache, &hits, &misses);
+        log_info("Queue %d: response cache hits %lu, misses %lu\n",
+                worker->queue_num, hits, misses);
+        resp_cache_fini(worker->state.resp_cache);
+    }
+    if (worker->state.tcp) {
+        tcp_tracker_stats(worker->state.tcp, &messages, &evicted);
+        if (messages || evicted)
+            log_info("Queue %d: TCP messages %lu, evicted flows %lu\n",
+                    worker->queue_num, messages, evicted);
+        tcp_tracker_fini(worker->state.tcp);
+    }
+    if (worker->state.summary) {
+        replay_summary_print(worker->state.summary);
+        replay_summary_fini(worker->state.summary);
     }
 }
 
-static volatile int signalled = 0;
+/* Signals are handled synchronously by the main thread (see sigwait). Block
+ * them before starting workers such that the threads inherit the mask. */
+static int block_signals(sigset_t *set)
+{
+    sigemptyset(set);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGHUP);     /* Reload policy. */
+    sigaddset(set, SIGUSR1);    /* A worker stopped. */
+
+    return pthread_sigmask(SIG_BLOCK, set, NULL) ? -1 : 0;
+}
 
-static void sighandler(int sig)
+/**
+ * Waits for one of the signals in the set and returns it (or -1 on error).
+ * Meanwhile, the statistics file is updated periodically.
+ */
+static int wait_for_signal(const sigset_t *set, const struct options *opts)
 {
-    signalled = sig;
+    struct timespec timeout = { .tv_sec = opts->stats_interval };
+    int sig;
+
+    if (!opts->stats_file)
+        return sigwait(set, &sig) == 0 ? sig : -1;
+
+    for (;;) {
+        sig = sigtimedwait(set, NULL, &timeout);
+        if (sig >= 0)
+            return sig;
+        if (errno == EAGAIN)
+            stats_write(opts->stats_file);
+        else if (errno != EINTR)
+            return -1;
+    }
 }
 
-static int set_signal_handlers(void)
+/* Returns the elapsed time in milliseconds since start. */
+static double elapsed_ms(const struct timespec *start)
 {
-    struct sigaction sa;
+    struct timespec now;
 
-    sa.sa_handler = sighandler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 +
+        (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Whether two client tables have the same groups (the sets are fixed). */
+static bool same_groups(const struct client_table *a,
+        const struct client_table *b)
+{
+    unsigned i;
+
+    if (client_group_count(a) != client_group_count(b))
+        return false;
+    for (i = 1; i <= client_group_count(a); i++) {
+        if (strcmp(client_group_name(a, i), client_group_name(b, i)))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Loads the policy and client files again and replaces the active ones. The
+ * old ones are freed once no worker can use them anymore. On failure the old
+ * policy and clients are kept.
+ */
+static void reload_policy(const struct options *opts)
+{
+    struct policy *policy;
+    struct client_table *clients = NULL;
+    struct timespec start;
+
+    if (!opts->policy_file && !opts->clients_file) {
+        log_error("No policy file to reload.\n");
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    policy = policy_init(opts->policy_file);
+    if (!policy) {
+        log_error("Keeping the previous policy.\n");
+        return;
+    }
+    if (opts->clients_file) {
+        clients = client_table_init(opts->clients_file);
+        if (clients && !same_groups(clients, atomic_load(&active_clients))) {
+            log_error("Client groups cannot be changed without a restart\n");
+            client_table_fini(clients);
+            clients = NULL;
+        }
+        if (!clients) {
+            log_error("Keeping the previous policy.\n");
+            policy_fini(policy);
+            return;
+        }
+    }
+
+    policy = atomic_exchange(&active_policy, policy);
+    if (clients)
+        clients = atomic_exchange(&active_clients, clients);
+    rcu_synchronize();
+    policy_fini(policy);
+    if (clients)
+        client_table_fini(clients);
 
-    if (sigaction(SIGINT, &sa, NULL) < 0)
+    /* Aliases may no longer be allowed by the new policy. */
+    if (alias_cache)
+        alias_cache_clear(alias_cache);
+    /* Cached decisions for responses were made by the old policy. */
+    atomic_fetch_add(&policy_generation, 1);
+
+    if (opts->policy_file)
+        log_info("Reloaded %u rules from %s\n",
+                policy_rule_count(atomic_load(&active_policy)),
+                opts->policy_file);
+    if (opts->clients_file)
+        log_info("Reloaded %u client groups from %s\n",
+                client_group_count(atomic_load(&active_clients)),
+                opts->clients_file);
+    log_info("Reload took %.1f ms\n", elapsed_ms(&start));
+}
+
+/* Parses "X" or "X:Y" (as used by --queue-balance X:Y). */
+static int parse_queue_range(const char *arg, int *first, int *last)
+{
+    char *end;
+    long a, b;
+
+    a = b = strtol(arg, &end, 10);
+    if (*end == ':')
+        b = strtol(end + 1, &end, 10);
+    if (*end != '\0' || a < 0 || b < a || b > 65535)
         return -1;
-    if (sigaction(SIGTERM, &sa, NULL) < 0)
+
+    *first = a;
+    *last = b;
+    return 0;
+}
+
+/* Parses a number in the range 0..max (inclusive). */
+static int parse_uint(const char *arg, unsigned max, unsigned *value)
+{
+    char *end;
+    unsigned long v;
+
+    errno = 0;
+    v = strtoul(arg, &end, 0);
+    if (errno || *arg == '-' || *arg == '\0' || *end != '\0' || v > max)
         return -1;
 
+    *value = v;
     return 0;
 }
 
-int main(int argc, const char *argv[])
+static void usage(const char *progname)
 {
+    printf("Usage: %s [options]\n"
+           "\n"
+           "Options:\n"
+           "  -p, --policy FILE           Policy with allowed names (default\n"
+           "                              is to allow all names)\n"
+           "  --clients FILE              Policies and sets per client subnet\n"
+           "                              (lines of PREFIX GROUP POLICY)\n"
+           "  -q, --queue-num NUM[:LAST]  NFQUEUE number or range of queues\n"
+           "                              to consume, one thread per queue\n"
+           "                              (default %d)\n"
+           "  --copy-range BYTES          Maximum bytes copied per packet\n"
+           "                              (default and maximum %d)\n"
+           "  --rcvbuf BYTES              Netlink socket receive buffer size\n"
+           "                              (default %d, 0 keeps system\n"
+           "                              default)\n"
+           "  --queue-maxlen NUM          Kernel queue length (default 1024)\n"
+           "  --fail-open                 Accept packets when the kernel\n"
+           "                              queue is full instead of dropping\n"
+           "                              them\n"
+           "  --alias-cache NUM           Number of CNAME targets of allowed\n"
+           "                              names to remember (default %d, 0\n"
+           "                              disables CNAME support)\n"
+           "  --response-cache NUM        Number of repeated responses whose\n"
+           "                              decision is remembered per queue\n"
+           "                              (default %d, 0 disables the cache)\n"
+           "  --query-table NUM           Only process UDP responses to\n"
+           "                              queries that were queued as well,\n"
+           "                              up to NUM outstanding queries\n"
+           "                              (default 0, which processes all\n"
+           "                              responses)\n"
+           "  --resolvers LIST            Comma-separated prefixes of\n"
+           "                              resolvers whose responses are\n"
+           "                              matched (requires --query-table,\n"
+           "                              default all)\n"
+           "  --addr-cache NUM            Number of recently added addresses\n"
+           "                              to remember per queue (default %d,\n"
+           "                              0 disables the cache)\n"
+           "  --addr-cache-lifetime SECS  Time after which a cached address\n"
+           "                              is added again if entries never\n"
+           "                              expire (default %d)\n"
+           "  --ttl-min SECS              Minimum timeout for set entries\n"
+           "                              (default %d)\n"
+           "  --ttl-max SECS              Maximum timeout for set entries\n"
+           "                              (default %d, 0 to never expire)\n"
+           "  --ttl-grace SECS            Time added to the DNS TTL for the\n"
+           "                              timeout of set entries (default %d)\n"
+           "  --tcp-flows NUM             Number of DNS over TCP streams that\n"
+           "                              are reassembled concurrently per\n"
+           "                              queue (default %d, 0 disables TCP)\n"
+           "  --tcp-buffers NUM           Number of 2 KiB buffers for TCP\n"
+           "                              stream data per queue (default %d)\n"
+           "  --max-pending NUM           Number of packets per queue that\n"
+           "                              may wait for addresses to be added\n"
+           "                              (default %d)\n"
+           "  --stats FILE                Write statistics in the Prometheus\n"
+           "                              text format to FILE\n"
+           "  --stats-interval SECS       Time between updates of the\n"
+           "                              statistics file (default %d)\n"
+           "  -r, --replay FILE           Process the DNS responses in a pcap\n"
+           "                              or pcapng file instead of a queue,\n"
+           "                              then print the decisions per name\n"
+           "                              (implies --dry-run unless --sink is\n"
+           "                              given)\n"
+           "  --replay-realtime           Replay with the recorded timing\n"
+           "                              instead of as fast as possible\n"
+           "  --sink NAME                 Add addresses to ipset (default),\n"
+           "                              nftables, bpf[:PIN_DIR] (pinned BPF\n"
+           "                              maps) or memory (not to the kernel)\n"
+           "  --dry-run                   Same as --sink memory\n"
+           "  --snapshot FILE             Record added addresses in FILE and\n"
+           "                              restore the unexpired ones on\n"
+           "                              startup\n"
+           "  -v, --verbose               Log every packet (hexdump) and the\n"
+           "                              reason why it was not processed\n"
+           "  -h, --help                  Show this help\n",
+           progname, DEFAULT_QUEUE_NUM, QUEUE_MAX_COPY_RANGE,
+           DEFAULT_RCVBUF_SIZE, DEFAULT_ALIAS_CACHE_SIZE,
+           DEFAULT_RESP_CACHE_SIZE, DEFAULT_ADDR_CACHE_SIZE,
+           DEFAULT_ADDR_CACHE_LIFETIME, DEFAULT_TTL_MIN, DEFAULT_TTL_MAX,
+           DEFAULT_TTL_GRACE, DEFAULT_TCP_FLOWS, DEFAULT_TCP_BUFFERS,
+           DEFAULT_MAX_PENDING, DEFAULT_STATS_INTERVAL);
+}
+
+/* Options without a short equivalent. */
+enum {
+    OPT_COPY_RANGE = 256,
+    OPT_CLIENTS,
+    OPT_RCVBUF,
+    OPT_QUEUE_MAXLEN,
+    OPT_FAIL_OPEN,
+    OPT_ALIAS_CACHE,
+    OPT_RESP_CACHE,
+    OPT_QUERY_TABLE,
+    OPT_RESOLVERS,
+    OPT_ADDR_CACHE,
+    OPT_ADDR_CACHE_LIFETIME,
+    OPT_TTL_MIN,
+    OPT_TTL_MAX,
+    OPT_TTL_GRACE,
+    OPT_TCP_FLOWS,
+    OPT_TCP_BUFFERS,
+    OPT_MAX_PENDING,
+    OPT_STATS,
+    OPT_STATS_INTERVAL,
+    OPT_REPLAY_REALTIME,
+    OPT_DRY_RUN,
+    OPT_SINK,
+    OPT_SNAPSHOT,
+};
+
+int main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        { "policy",         required_argument,  NULL, 'p' },
+        { "clients",        required_argument,  NULL, OPT_CLIENTS },
+        { "queue-num",      required_argument,  NULL, 'q' },
+        { "copy-range",     required_argument,  NULL, OPT_COPY_RANGE },
+        { "rcvbuf",         required_argument,  NULL, OPT_RCVBUF },
+        { "queue-maxlen",   required_argument,  NULL, OPT_QUEUE_MAXLEN },
+        { "fail-open",      no_argument,        NULL, OPT_FAIL_OPEN },
+        { "alias-cache",    required_argument,  NULL, OPT_ALIAS_CACHE },
+        { "response-cache", required_argument,  NULL, OPT_RESP_CACHE },
+        { "query-table",    required_argument,  NULL, OPT_QUERY_TABLE },
+        { "resolvers",      required_argument,  NULL, OPT_RESOLVERS },
+        { "addr-cache",     required_argument,  NULL, OPT_ADDR_CACHE },
+        { "addr-cache-lifetime", required_argument, NULL,
+            OPT_ADDR_CACHE_LIFETIME },
+        { "ttl-min",        required_argument,  NULL, OPT_TTL_MIN },
+        { "ttl-max",        required_argument,  NULL, OPT_TTL_MAX },
+        { "ttl-grace",      required_argument,  NULL, OPT_TTL_GRACE },
+        { "tcp-flows",      required_argument,  NULL, OPT_TCP_FLOWS },
+        { "tcp-buffers",    required_argument,  NULL, OPT_TCP_BUFFERS },
+        { "max-pending",    required_argument,  NULL, OPT_MAX_PENDING },
+        { "stats",          required_argument,  NULL, OPT_STATS },
+        { "stats-interval", required_argument,  NULL, OPT_STATS_INTERVAL },
+        { "replay",         required_argument,  NULL, 'r' },
+        { "replay-realtime", no_argument,       NULL, OPT_REPLAY_REALTIME },
+        { "sink",           required_argument,  NULL, OPT_SINK },
+        { "dry-run",        no_argument,        NULL, OPT_DRY_RUN },
+        { "snapshot",       required_argument,  NULL, OPT_SNAPSHOT },
+        { "verbose",        no_argument,        NULL, 'v' },
+        { "help",           no_argument,        NULL, 'h' },
+        { NULL,             0,                  NULL, 0 }
+    };
+    struct options opts = {
+        .first_queue = DEFAULT_QUEUE_NUM,
+        .last_queue = DEFAULT_QUEUE_NUM,
+        .queue = {
+            .copy_range = QUEUE_MAX_COPY_RANGE,
+            .rcvbuf_size = DEFAULT_RCVBUF_SIZE,
+        },
+        .alias_cache_size = DEFAULT_ALIAS_CACHE_SIZE,
+        .resp_cache_size = DEFAULT_RESP_CACHE_SIZE,
+        .addr_cache_size = DEFAULT_ADDR_CACHE_SIZE,
+        .addr_cache_lifetime = DEFAULT_ADDR_CACHE_LIFETIME,
+        .ttl_min = DEFAULT_TTL_MIN,
+        .ttl_max = DEFAULT_TTL_MAX,
+        .ttl_grace = DEFAULT_TTL_GRACE,
+        .tcp_flows = DEFAULT_TCP_FLOWS,
+        .tcp_buffers = DEFAULT_TCP_BUFFERS,
+        .max_pending = DEFAULT_MAX_PENDING,
+        .stats_interval = DEFAULT_STATS_INTERVAL,
+    };
     int ret = 1;
+    int opt, i, sig = 0;
+    int nworkers, nstarted = 0;
+    struct client_table *clients;
     struct policy *policy;
-    struct input_queue *iq;
-    struct ipset_state *ipset_state;
-    struct state state;
+    struct worker *workers;
+    struct writer *writer;
+    sigset_t sigset;
+
+    while ((opt = getopt_long(argc, argv, "p:q:r:vh", long_options,
+                    NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            opts.policy_file = optarg;
+            break;
+        case OPT_CLIENTS:
+            opts.clients_file = optarg;
+            break;
+        case 'q':
+            if (parse_queue_range(optarg, &opts.first_queue,
+                        &opts.last_queue) < 0) {
+                log_error("Invalid queue number: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_COPY_RANGE:
+            if (parse_uint(optarg, QUEUE_MAX_COPY_RANGE,
+                        &opts.queue.copy_range) < 0 ||
+                    opts.queue.copy_range < 512) {
+                log_error("Invalid copy range: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_RCVBUF:
+            if (parse_uint(optarg, INT_MAX, &opts.queue.rcvbuf_size) < 0) {
+                log_error("Invalid receive buffer size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_QUEUE_MAXLEN:
+            if (parse_uint(optarg, UINT32_MAX, &opts.queue.max_len) < 0) {
+                log_error("Invalid queue length: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_FAIL_OPEN:
+            opts.queue.fail_open = true;
+            break;
+        case OPT_ALIAS_CACHE:
+            if (parse_uint(optarg, 1U << 24, &opts.alias_cache_size) < 0) {
+                log_error("Invalid alias cache size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_RESP_CACHE:
+            if (parse_uint(optarg, 1U << 24, &opts.resp_cache_size) < 0) {
+                log_error("Invalid response cache size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_QUERY_TABLE:
+            if (parse_uint(optarg, 1U << 24, &opts.query_table_size) < 0) {
+                log_error("Invalid query table size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_RESOLVERS:
+            opts.resolvers = optarg;
+            break;
+        case OPT_ADDR_CACHE:
+            if (parse_uint(optarg, 1U << 30, &opts.addr_cache_size) < 0) {
+                log_error("Invalid address cache size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_ADDR_CACHE_LIFETIME:
+            if (parse_uint(optarg, INT_MAX, &opts.addr_cache_lifetime) < 0) {
+                log_error("Invalid address cache lifetime: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_TTL_MIN:
+        case OPT_TTL_MAX:
+        case OPT_TTL_GRACE:
+            if (parse_uint(optarg, IPSET_MAX_TIMEOUT, opt == OPT_TTL_MIN ?
+                        &opts.ttl_min : opt == OPT_TTL_MAX ?
+                        &opts.ttl_max : &opts.ttl_grace) < 0) {
+                log_error("Invalid timeout: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_TCP_FLOWS:
+            if (parse_uint(optarg, 1U << 20, &opts.tcp_flows) < 0) {
+                log_error("Invalid number of TCP flows: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_TCP_BUFFERS:
+            if (parse_uint(optarg, 1U << 20, &opts.tcp_buffers) < 0 ||
+                    opts.tcp_buffers == 0) {
+                log_error("Invalid number of TCP buffers: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_MAX_PENDING:
+            if (parse_uint(optarg, 1U << 20, &opts.max_pending) < 0 ||
+                    opts.max_pending == 0) {
+                log_error("Invalid number of pending packets: %s\n",
+                        optarg);
+                return 1;
+            }
+            break;
+        case OPT_STATS:
+            opts.stats_file = optarg;
+            break;
+        case OPT_STATS_INTERVAL:
+            if (parse_uint(optarg, INT_MAX, &opts.stats_interval) < 0 ||
+                    opts.stats_interval == 0) {
+                log_error("Invalid statistics interval: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            opts.replay_file = optarg;
+            break;
+        case OPT_REPLAY_REALTIME:
+            opts.replay_realtime = true;
+            break;
+        case OPT_SINK:
+            if (!sink_valid(optarg)) {
+                log_error("Invalid sink: %s\n", optarg);
+                return 1;
+            }
+            opts.sink = optarg;
+            break;
+        case OPT_DRY_RUN:
+            opts.sink = "memory";
+            break;
+        case OPT_SNAPSHOT:
+            opts.snapshot_file = optarg;
+            break;
+        case 'v':
+            log_level = LOG_LEVEL_DEBUG;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    /* Replays do not modify the sets unless requested. */
+    if (!opts.sink)
+        opts.sink = opts.replay_file ? "memory" : "ipset";
+
+    if (opts.ttl_max && (opts.ttl_min > opts.ttl_max ||
+                opts.ttl_max + opts.ttl_grace > IPSET_MAX_TIMEOUT)) {
+        log_error("Invalid timeout bounds\n");
+        return 1;
+    }
+
+    if (opts.resolvers && !opts.query_table_size) {
+        log_error("--resolvers requires --query-table\n");
+        return 1;
+    }
 
-    if (set_signal_handlers() < 0)
+    if (block_signals(&sigset) < 0)
         return 1;
 
-    policy = policy_init();
-    if (!policy)
+    /* Messages from the main thread are rare and written synchronously. */
+    if (log_start() < 0)
         return 1;
 
-    ipset_state = ipset_init();
-    if (!ipset_state)
+    if (pipe(stop_pipe) < 0) {
+        log_error("pipe: %s\n", strerror(errno));
+        goto cleanup_log;
+    }
+
+    policy = policy_init(opts.policy_file);
+    if (!policy)
+        goto cleanup_pipe;
+    if (opts.policy_file)
+        log_info("Loaded %u rules from %s\n",
+                policy_rule_count(policy), opts.policy_file);
+    atomic_store(&active_policy, policy);
+
+    if (opts.clients_file) {
+        clients = client_table_init(opts.clients_file);
+        if (!clients)
+            goto cleanup_policy;
+        log_info("Loaded %u client groups from %s\n",
+                client_group_count(clients), opts.clients_file);
+        atomic_store(&active_clients, clients);
+    }
+
+    if (opts.alias_cache_size) {
+        alias_cache = alias_cache_init(opts.alias_cache_size);
+        if (!alias_cache)
+            goto cleanup_policy;
+    }
+
+    if (opts.query_table_size) {
+        query_table = query_table_init(opts.query_table_size, opts.resolvers);
+        if (!query_table)
+            goto cleanup_policy;
+    }
+
+    /* A capture is replayed by a single worker. */
+    nworkers = opts.replay_file ? 1 : opts.last_queue - opts.first_queue + 1;
+    writer = writer_init(nworkers, opts.max_pending, stop_pipe[0],
+            opts.addr_cache_size ? opts.addr_cache_size :
+            DEFAULT_ADDR_CACHE_SIZE, opts.stats_file != NULL, opts.sink,
+            atomic_load(&active_clients), opts.snapshot_file);
+    if (!writer)
         goto cleanup_policy;
 
-    state.policy = policy;
-    state.ipset = ipset_state;
-    iq = queue_init(pkt_callback, &state);
-    if (!iq)
-        goto cleanup_ipset;
+    workers = calloc(nworkers, sizeof(*workers));
+    if (!workers)
+        goto cleanup_writer;
+
+    for (i = 0; i < nworkers; i++) {
+        if (worker_init(&workers[i], opts.first_queue + i, &opts,
+                    writer_channel(writer, i)) < 0)
+            goto cleanup_workers;
+    }
 
-    while (!signalled && queue_handle(iq))
-        ;
+    if (writer_start(writer) < 0)
+        goto cleanup_workers;
 
-    if (signalled)
-        fprintf(stderr, "Exiting due to signal %d.\n", signalled);
+    for (nstarted = 0; nstarted < nworkers; nstarted++) {
+        if (pthread_create(&workers[nstarted].thread, NULL, worker_main,
+                    &workers[nstarted])) {
+            log_error("Cannot start thread for queue %d\n",
+                    workers[nstarted].queue_num);
+            goto stop_workers;
+        }
+    }
+
+    while ((sig = wait_for_signal(&sigset, &opts)) == SIGHUP)
+        reload_policy(&opts);
+
+    if (sig == SIGINT || sig == SIGTERM)
+        log_info("Exiting due to signal %d.\n", sig);
     else
-        fprintf(stderr, "Exiting.\n");
+        log_info("Exiting.\n");
     ret = 0;
 
-    queue_fini(iq);
-cleanup_ipset:
-    ipset_fini(ipset_state);
+stop_workers:
+    if (write(stop_pipe[1], "", 1) < 0)
+        log_error("write: %s\n", strerror(errno));
+    while (nstarted > 0)
+        pthread_join(workers[--nstarted].thread, NULL);
+cleanup_workers:
+    /* The writer was stopped as well, pending packets are accepted now. */
+    writer_join(writer);
+    while (i > 0)
+        worker_fini(&workers[--i]);
+    free(workers);
+    if (opts.stats_file)
+        stats_write(opts.stats_file);
+cleanup_writer:
+    writer_fini(writer);
 cleanup_policy:
-    policy_fini(policy);
+    if (query_table)
+        query_table_fini(query_table);
+    if (alias_cache)
+        alias_cache_fini(alias_cache);
+    if (atomic_load(&active_clients))
+        client_table_fini(atomic_load(&active_clients));
+    policy_fini(atomic_load(&active_policy));
+cleanup_pipe:
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+cleanup_log:
+    stats_fini();
+    log_stop();
     return ret;
 }
@@ -0,0 +1,317 @@
+/**
+ * Decoding of names in DNS messages.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Every label is copied, validated (no NUL or dot), lowercased and hashed (see
+ * policy_label_hash) in a single pass. On x86-64, 16 (SSE2) or 32 (AVX2) bytes
+ * are processed at once and hashed from the vector registers, the variant is
+ * chosen at startup based on the CPU.
+ * Vector stores may write up to 31 bytes past the end of the label, hence the
+ * DNS_NAME_SIZE for name buffers.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "dnsallow.h"
+
+/* Hashing needs 64-bit moves from vector registers. */
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_VECTORS
+#endif
+
+/* Decodes a label of 'len' bytes at src (with 'end' the end of the input) to
+ * dst, returns the hash and sets *invalid if the label contains bad bytes. */
+typedef uint32_t label_decoder(const unsigned char *src, unsigned len,
+        const unsigned char *end, char *dst, bool *invalid);
+
+static uint32_t decode_label_scalar(const unsigned char *src, unsigned len,
+        const unsigned char *end, char *dst, bool *invalid)
+{
+    uint64_t h = LABEL_HASH_SEED(len), w;
+    unsigned i, j;
+    unsigned char c;
+    (void)end;
+
+    for (i = 0; i < len; i += 8) {
+        w = 0;
+        for (j = 0; j < 8 && i + j < len; j++) {
+            c = src[i + j];
+            if (c == '\0' || c == '.')
+                *invalid = true;
+            if (c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+            dst[i + j] = c;
+            w |= (uint64_t)c << (8 * j);
+        }
+        LABEL_HASH_STEP(h, w);
+    }
+    return LABEL_HASH_FINAL(h);
+}
+
+#ifdef HAVE_X86_VECTORS
+/* Adds a word with the next 'n' bytes of the label (little-endian) to the
+ * hash. Bytes past the label are garbage, the hash uses zero padding. */
+static inline uint64_t hash_word(uint64_t h, uint64_t w, unsigned n)
+{
+    if (n < 8)
+        w &= ~0ULL >> (8 * (8 - n));
+    LABEL_HASH_STEP(h, w);
+    return h;
+}
+
+/* Hashes the first 'n' (at least one) lowercase bytes of a vector. */
+__attribute__((target("sse2")))
+static inline uint64_t hash_vector(uint64_t h, __m128i v, unsigned n)
+{
+    h = hash_word(h, _mm_cvtsi128_si64(v), n);
+    if (n > 8)
+        h = hash_word(h, _mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)), n - 8);
+    return h;
+}
+
+__attribute__((target("sse2")))
+static uint32_t decode_label_sse2(const unsigned char *src, unsigned len,
+        const unsigned char *end, char *dst, bool *invalid)
+{
+    /* Signed comparison trick: 'A'..'Z' maps to the 26 smallest values. */
+    const __m128i shift = _mm_set1_epi8((char)(0x80 - 'A'));
+    const __m128i limit = _mm_set1_epi8((char)(0x80 + 26));
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i dot = _mm_set1_epi8('.');
+    const __m128i zero = _mm_setzero_si128();
+    unsigned char tmp[16];
+    __m128i v, upper, bad;
+    unsigned i, n, mask = 0;
+    uint64_t h = LABEL_HASH_SEED(len);
+
+    for (i = 0; i < len; i += 16) {
+        n = len - i < 16 ? len - i : 16;
+        if (end - (src + i) >= 16) {
+            v = _mm_loadu_si128((const __m128i *)(src + i));
+        } else {
+            memset(tmp, 0, sizeof(tmp));
+            memcpy(tmp, src + i, n);
+            v = _mm_loadu_si128((const __m128i *)tmp);
+        }
+        upper = _mm_cmplt_epi8(_mm_add_epi8(v, shift), limit);
+        bad = _mm_or_si128(_mm_cmpeq_epi8(v, zero), _mm_cmpeq_epi8(v, dot));
+        mask |= _mm_movemask_epi8(bad) & ((1U << n) - 1);
+        v = _mm_or_si128(v, _mm_and_si128(upper, case_bit));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+        h = hash_vector(h, v, n);
+    }
+    if (mask)
+        *invalid = true;
+    return LABEL_HASH_FINAL(h);
+}
+
+__attribute__((target("avx2")))
+static uint32_t decode_label_avx2(const unsigned char *src, unsigned len,
+        const unsigned char *end, char *dst, bool *invalid)
+{
+    const __m256i shift = _mm256_set1_epi8((char)(0x80 - 'A'));
+    const __m256i limit = _mm256_set1_epi8((char)(0x80 + 26));
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    const __m256i dot = _mm256_set1_epi8('.');
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned char tmp[32];
+    __m256i v, upper, bad;
+    unsigned i, n;
+    uint32_t mask = 0;
+    uint64_t h = LABEL_HASH_SEED(len);
+
+    for (i = 0; i < len; i += 32) {
+        n = len - i < 32 ? len - i : 32;
+        if (end - (src + i) >= 32) {
+            v = _mm256_loadu_si256((const __m256i *)(src + i));
+        } else {
+            memset(tmp, 0, sizeof(tmp));
+            memcpy(tmp, src + i, n);
+            v = _mm256_loadu_si256((const __m256i *)tmp);
+        }
+        upper = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(v, shift));
+        bad = _mm256_or_si256(_mm256_cmpeq_epi8(v, zero),
+                _mm256_cmpeq_epi8(v, dot));
+        mask |= (uint32_t)_mm256_movemask_epi8(bad) &
+            (n == 32 ? ~0U : (1U << n) - 1);
+        v = _mm256_or_si256(v, _mm256_and_si256(upper, case_bit));
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+        h = hash_vector(h, _mm256_castsi256_si128(v), n);
+        if (n > 16)
+            h = hash_vector(h, _mm256_extracti128_si256(v, 1), n - 16);
+    }
+    if (mask)
+        *invalid = true;
+    return LABEL_HASH_FINAL(h);
+}
+#endif
+
+static const struct {
+    const char *name;
+    label_decoder *decode;
+} decoders[] = {
+    { "scalar", decode_label_scalar },
+#ifdef HAVE_X86_VECTORS
+    { "sse2",   decode_label_sse2 },
+    { "avx2",   decode_label_avx2 },
+#endif
+};
+
+static label_decoder *decode_label = decode_label_scalar;
+
+static bool cpu_supports(const char *name)
+{
+#ifdef HAVE_X86_VECTORS
+    __builtin_cpu_init();
+    if (!strcmp(name, "sse2"))
+        return __builtin_cpu_supports("sse2");
+    if (!strcmp(name, "avx2"))
+        return __builtin_cpu_supports("avx2");
+#endif
+    return !strcmp(name, "scalar");
+}
+
+/* Selects the fastest decoder before main runs (and threads are started). */
+__attribute__((constructor))
+static void select_decoder(void)
+{
+    unsigned i;
+
+    for (i = 0; i < sizeof(decoders) / sizeof(decoders[0]); i++) {
+        if (cpu_supports(decoders[i].name))
+            decode_label = decoders[i].decode;
+    }
+}
+
+/**
+ * Selects a decoder by name ("scalar", "sse2" or "avx2"), for tests and
+ * benchmarks. Returns -1 if the CPU does not support it.
+ */
+int name_set_decoder(const char *name)
+{
+    unsigned i;
+
+    for (i = 0; i < sizeof(decoders) / sizeof(decoders[0]); i++) {
+        if (!strcmp(decoders[i].name, name) && cpu_supports(name)) {
+            decode_label = decoders[i].decode;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Tries to parse a name at offset, returning the number of bytes that are
+ * consumed by this name on the wire (0 on failure). The lowercase name is
+ * written to 'name' (a buffer of DNS_NAME_SIZE bytes) and if 'labels' is
+ * non-NULL, the position and hash of every label are stored there. The root
+ * name is not accepted.
+ */
+unsigned parse_name(const unsigned char *buf, unsigned buflen,
+        unsigned offset, char *name, struct dns_labels *labels)
+{
+    label_decoder *decode = decode_label;
+    const unsigned orig_offset = offset;
+    unsigned len, ptr, namelen = 0, wirelen = 0, count = 0;
+    bool invalid = false;
+    uint32_t hash;
+
+    for (;;) {
+        if (offset >= buflen)
+            return 0;
+        len = buf[offset];
+
+        if (len == 0) {
+            break;
+        } else if ((len & 0xc0) == 0xc0) {  /* compressed name */
+            if (buflen - offset < 2)
+                return 0;
+
+            /* Pointers must point backwards, which also prevents loops. */
+            ptr = ((len & 0x3f) << 8) | buf[offset + 1];
+            if (ptr >= offset)
+                return 0;
+
+            /* First pointer: account for the prefix and the pointer. */
+            if (wirelen == 0)
+                wirelen = offset + 2 - orig_offset;
+            offset = ptr;
+            continue;
+        } else if (len > 63) {
+            /* Extended label types (RFC 6891) are not supported. */
+            return 0;
+        }
+        offset++;  /* skip label length */
+
+        if (buflen - offset < len || namelen + len + 1 > 256)
+            return 0;
+
+        hash = decode(buf + offset, len, buf + buflen,
+                name + namelen, &invalid);
+        if (labels) {
+            labels->offset[count] = namelen;
+            labels->len[count] = len;
+            labels->hash[count] = hash;
+        }
+        count++;
+        name[namelen + len] = '.';
+        namelen += len + 1;  /* label plus dot (or length plus name) */
+        offset += len;
+    }
+
+    /* Reject names with NUL bytes (string truncation) or dots in labels. */
+    if (namelen == 0 || invalid)
+        return 0;
+
+    /* Drop trailing dot. */
+    name[namelen - 1] = '\0';
+    if (labels)
+        labels->count = count;
+    return wirelen ? wirelen : offset + 1 - orig_offset;
+}
+
+/**
+ * Returns the number of bytes that are consumed by the name at offset on the
+ * wire (0 if the name is malformed) without decoding it. Compressed names are
+ * only checked up to the first pointer.
+ */
+unsigned skip_name(const unsigned char *buf, unsigned buflen, unsigned offset)
+{
+    const unsigned orig_offset = offset;
+    unsigned len;
+
+    for (;;) {
+        if (offset >= buflen)
+            return 0;
+        len = buf[offset];
+
+        if (len == 0)
+            return offset + 1 - orig_offset;
+        if ((len & 0xc0) == 0xc0) {
+            if (buflen - offset < 2 ||
+                    (((len & 0x3f) << 8) | buf[offset + 1]) >= offset)
+                return 0;
+            return offset + 2 - orig_offset;
+        }
+        if (len > 63)
+            return 0;
+        offset += 1 + len;
+    }
+}
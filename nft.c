@@ -0,0 +1,411 @@
+/**
+ * Address sink that adds addresses to nftables sets.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>     /* Before the kernel headers. */
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+#include <libmnl/libmnl.h>
+#include <libnftnl/common.h>
+#include <libnftnl/table.h>
+#include <libnftnl/set.h>
+#include "dnsallow.h"
+
+/* The sets can be used in rules with "ip daddr @dnsallow-ipv4" (or
+ * "@dnsallow-GROUP-ipv4" for client groups) in a chain of the "inet dnsallow"
+ * table. */
+#define NFT_TABLE           "dnsallow"
+
+/* Data types as known by nft (see "nft describe ipv4_addr"). */
+#define NFT_TYPE_IPV4_ADDR  7
+#define NFT_TYPE_IPV6_ADDR  8
+
+/* Maximum number of addresses per family that are buffered before they are
+ * sent to the kernel (same as for ipset). */
+#define NFT_BATCH_SIZE      256
+
+/* Large enough for a transaction with NFT_BATCH_SIZE elements per set (see
+ * add_elements for the messages per set). */
+#define NFT_BUFFER_SIZE     (128 * 1024)
+
+/* Messages in a transaction per set with elements. */
+#define NFT_ELEMENT_MSGS    3
+
+struct nft_batch {
+    char setname[SINK_SET_NAME_SIZE];
+    int family;                         /* AF_INET or AF_INET6 */
+    unsigned count;
+    struct address addrs[NFT_BATCH_SIZE];
+    uint32_t timeouts[NFT_BATCH_SIZE];
+};
+
+struct nft_state {
+    struct addr_sink base;
+    struct mnl_socket *nl;
+    unsigned portid;
+    uint32_t seq;
+    struct nft_batch ipv4;
+    struct nft_batch ipv6;
+    /* Replies for the current transaction (starting at first_seq). */
+    uint32_t first_seq;
+    unsigned acks;
+    int error;
+    char buf[NFT_BUFFER_SIZE];
+};
+
+/* Records the acknowledgement (or error) for a message of the transaction. */
+static int ack_cb(const struct nlmsghdr *nlh, void *data)
+{
+    const struct nlmsgerr *err = mnl_nlmsg_get_payload(nlh);
+    struct nft_state *state = data;
+
+    if (nlh->nlmsg_len < mnl_nlmsg_size(sizeof(*err))) {
+        errno = EBADMSG;
+        return MNL_CB_ERROR;
+    }
+    /* Ignore late replies to a previous (failed) transaction. */
+    if (nlh->nlmsg_seq < state->first_seq)
+        return MNL_CB_OK;
+    state->acks++;
+    if (err->error && !state->error)
+        state->error = -err->error;
+    return MNL_CB_OK;
+}
+
+static mnl_cb_t ack_callbacks[NLMSG_MIN_TYPE] = {
+    [NLMSG_ERROR] = ack_cb,
+};
+
+/**
+ * Sends a batch of 'nmsgs' messages (each requesting an acknowledgement) and
+ * waits for the replies. The kernel applies all messages or none of them.
+ * On failure, errno is set.
+ */
+static bool send_batch(struct nft_state *state, struct mnl_nlmsg_batch *batch,
+        unsigned nmsgs)
+{
+    ssize_t len;
+
+    if (mnl_socket_sendto(state->nl, mnl_nlmsg_batch_head(batch),
+                mnl_nlmsg_batch_size(batch)) < 0)
+        return false;
+
+    state->acks = 0;
+    state->error = 0;
+    while (state->acks < nmsgs) {
+        len = mnl_socket_recvfrom(state->nl, state->buf, sizeof(state->buf));
+        if (len < 0)
+            return false;
+        if (mnl_cb_run2(state->buf, len, 0, state->portid, NULL, state,
+                    ack_callbacks, NLMSG_MIN_TYPE) < 0)
+            return false;
+        /* After an error, the remaining messages are not processed. */
+        if (state->error)
+            break;
+    }
+    if (state->error) {
+        errno = state->error;
+        return false;
+    }
+    return true;
+}
+
+/* Starts a transaction in the state buffer. */
+static struct mnl_nlmsg_batch *begin_batch(struct nft_state *state,
+        char *buf, size_t size)
+{
+    struct mnl_nlmsg_batch *batch;
+
+    batch = mnl_nlmsg_batch_start(buf, size);
+    state->first_seq = state->seq;
+    nftnl_batch_begin(mnl_nlmsg_batch_current(batch), state->seq++);
+    mnl_nlmsg_batch_next(batch);
+    return batch;
+}
+
+static void end_batch(struct nft_state *state, struct mnl_nlmsg_batch *batch)
+{
+    nftnl_batch_end(mnl_nlmsg_batch_current(batch), state->seq++);
+    mnl_nlmsg_batch_next(batch);
+}
+
+/* Adds a message for a set with the given key type to the transaction. */
+static bool add_set(struct nft_state *state, struct mnl_nlmsg_batch *batch,
+        const char *setname, uint32_t key_type, uint32_t key_len, uint32_t id)
+{
+    struct nlmsghdr *nlh;
+    struct nftnl_set *set;
+
+    set = nftnl_set_alloc();
+    if (!set)
+        return false;
+    nftnl_set_set_str(set, NFTNL_SET_TABLE, NFT_TABLE);
+    nftnl_set_set_str(set, NFTNL_SET_NAME, setname);
+    nftnl_set_set_u32(set, NFTNL_SET_FAMILY, NFPROTO_INET);
+    nftnl_set_set_u32(set, NFTNL_SET_KEY_TYPE, key_type);
+    nftnl_set_set_u32(set, NFTNL_SET_KEY_LEN, key_len);
+    /* Elements expire individually, without a default timeout. */
+    nftnl_set_set_u32(set, NFTNL_SET_FLAGS, NFT_SET_TIMEOUT);
+    nftnl_set_set_u32(set, NFTNL_SET_ID, id);
+
+    nlh = nftnl_nlmsg_build_hdr(mnl_nlmsg_batch_current(batch),
+            NFT_MSG_NEWSET, NFPROTO_INET, NLM_F_CREATE | NLM_F_ACK,
+            state->seq++);
+    nftnl_set_nlmsg_build_payload(nlh, set);
+    nftnl_set_free(set);
+    mnl_nlmsg_batch_next(batch);
+    return true;
+}
+
+/* Creates the table and sets unless they exist already. */
+static bool create_sets(struct nft_state *state)
+{
+    char buf[MNL_SOCKET_BUFFER_SIZE];
+    struct mnl_nlmsg_batch *batch;
+    struct nftnl_table *table;
+    struct nlmsghdr *nlh;
+    bool ok;
+
+    table = nftnl_table_alloc();
+    if (!table)
+        return false;
+    nftnl_table_set_str(table, NFTNL_TABLE_NAME, NFT_TABLE);
+    nftnl_table_set_u32(table, NFTNL_TABLE_FAMILY, NFPROTO_INET);
+
+    batch = begin_batch(state, buf, sizeof(buf));
+    nlh = nftnl_nlmsg_build_hdr(mnl_nlmsg_batch_current(batch),
+            NFT_MSG_NEWTABLE, NFPROTO_INET, NLM_F_CREATE | NLM_F_ACK,
+            state->seq++);
+    nftnl_table_nlmsg_build_payload(nlh, table);
+    nftnl_table_free(table);
+    mnl_nlmsg_batch_next(batch);
+
+    ok = add_set(state, batch, state->ipv4.setname, NFT_TYPE_IPV4_ADDR, 4,
+            1) &&
+        add_set(state, batch, state->ipv6.setname, NFT_TYPE_IPV6_ADDR, 16, 2);
+    end_batch(state, batch);
+
+    if (ok && !send_batch(state, batch, 3)) {
+        log_error("Cannot create nftables sets in table inet %s: %s\n",
+                NFT_TABLE, strerror(errno));
+        ok = false;
+    }
+    mnl_nlmsg_batch_stop(batch);
+    return ok;
+}
+
+/* Returns a set with all buffered addresses of a family, with their timeouts
+ * if 'timeouts' is true. */
+static struct nftnl_set *build_elements(const struct nft_batch *nb,
+        bool timeouts)
+{
+    struct nftnl_set_elem *elem;
+    struct nftnl_set *set;
+    unsigned i;
+
+    set = nftnl_set_alloc();
+    if (!set)
+        return NULL;
+    nftnl_set_set_str(set, NFTNL_SET_TABLE, NFT_TABLE);
+    nftnl_set_set_str(set, NFTNL_SET_NAME, nb->setname);
+
+    for (i = 0; i < nb->count; i++) {
+        elem = nftnl_set_elem_alloc();
+        if (!elem) {
+            nftnl_set_free(set);
+            return NULL;
+        }
+        if (nb->family == AF_INET)
+            nftnl_set_elem_set(elem, NFTNL_SET_ELEM_KEY,
+                    &nb->addrs[i].ip4_addr, sizeof(struct in_addr));
+        else
+            nftnl_set_elem_set(elem, NFTNL_SET_ELEM_KEY,
+                    &nb->addrs[i].ip6_addr, sizeof(struct in6_addr));
+        /* Timeouts are in milliseconds, zero means permanent. */
+        if (timeouts && nb->timeouts[i])
+            nftnl_set_elem_set_u64(elem, NFTNL_SET_ELEM_TIMEOUT,
+                    (uint64_t)nb->timeouts[i] * 1000);
+        nftnl_set_elem_add(set, elem);
+    }
+    return set;
+}
+
+/* Adds a message for the elements of a set to the transaction. */
+static void add_message(struct nft_state *state,
+        struct mnl_nlmsg_batch *batch, uint16_t type, uint16_t flags,
+        struct nftnl_set *set)
+{
+    struct nlmsghdr *nlh;
+
+    nlh = nftnl_nlmsg_build_hdr(mnl_nlmsg_batch_current(batch), type,
+            NFPROTO_INET, flags | NLM_F_ACK, state->seq++);
+    nftnl_set_elems_nlmsg_build_payload(nlh, set);
+    mnl_nlmsg_batch_next(batch);
+}
+
+/**
+ * Adds NFT_ELEMENT_MSGS messages with all buffered addresses of a family to
+ * the transaction. Older kernels (before about 6.10) do not change the
+ * timeout of an element that is added again, so the elements are added (if
+ * missing), deleted and added again with their new timeout. Since the
+ * transaction is atomic, packets never see the elements missing.
+ */
+static bool add_elements(struct nft_state *state,
+        struct mnl_nlmsg_batch *batch, struct nft_batch *nb)
+{
+    struct nftnl_set *set, *keys;
+
+    set = build_elements(nb, true);
+    if (!set)
+        return false;
+    keys = build_elements(nb, false);
+    if (!keys) {
+        nftnl_set_free(set);
+        return false;
+    }
+
+    /* Without NLM_F_EXCL, existing elements are not an error. */
+    add_message(state, batch, NFT_MSG_NEWSETELEM, NLM_F_CREATE, set);
+    add_message(state, batch, NFT_MSG_DELSETELEM, 0, keys);
+    add_message(state, batch, NFT_MSG_NEWSETELEM, NLM_F_CREATE, set);
+    nftnl_set_free(keys);
+    nftnl_set_free(set);
+    return true;
+}
+
+static bool nft_commit(struct addr_sink *base);
+
+static void nft_add(struct addr_sink *base, const struct address *addr,
+        uint32_t timeout)
+{
+    struct nft_state *state = (struct nft_state *)base;
+    struct nft_batch *nb;
+
+    switch (addr->family) {
+    case AF_INET:
+        nb = &state->ipv4;
+        break;
+    case AF_INET6:
+        nb = &state->ipv6;
+        break;
+    default:
+        log_error("Unrecognized address family 0x%04x\n", addr->family);
+        return;
+    }
+
+    if (nb->count == NFT_BATCH_SIZE)
+        nft_commit(base);
+
+    /* Workers may submit the same address in one round, but a second delete
+     * of a key would fail the whole transaction (see add_elements). */
+    nb->count = sink_buffer_add(nb->addrs, nb->timeouts, nb->count, addr,
+            timeout);
+}
+
+/* Adds all buffered addresses to both sets in a single transaction. */
+static bool nft_commit(struct addr_sink *base)
+{
+    struct nft_state *state = (struct nft_state *)base;
+    struct mnl_nlmsg_batch *batch;
+    unsigned nmsgs = 0;
+    bool ok = true;
+
+    if (!state->ipv4.count && !state->ipv6.count)
+        return true;
+
+    batch = begin_batch(state, state->buf, sizeof(state->buf));
+    if (state->ipv4.count) {
+        ok = add_elements(state, batch, &state->ipv4);
+        nmsgs += NFT_ELEMENT_MSGS;
+    }
+    if (ok && state->ipv6.count) {
+        ok = add_elements(state, batch, &state->ipv6);
+        nmsgs += NFT_ELEMENT_MSGS;
+    }
+    end_batch(state, batch);
+
+    if (!ok)
+        log_error("nftables: cannot allocate set elements\n");
+    else if (!send_batch(state, batch, nmsgs)) {
+        log_error("Failed to add to nftables sets: %s\n", strerror(errno));
+        ok = false;
+    }
+    mnl_nlmsg_batch_stop(batch);
+
+    state->ipv4.count = state->ipv6.count = 0;
+    return ok;
+}
+
+static void nft_fini(struct addr_sink *base)
+{
+    struct nft_state *state = (struct nft_state *)base;
+
+    nft_commit(base);
+    mnl_socket_close(state->nl);
+    free(state);
+}
+
+static const struct sink_ops nft_ops = {
+    .add        = nft_add,
+    .commit     = nft_commit,
+    .fini       = nft_fini,
+};
+
+struct addr_sink *nft_sink_init(const char *group)
+{
+    struct nft_state *state;
+
+    state = calloc(1, sizeof(*state));
+    if (!state)
+        return NULL;
+    state->base.ops = &nft_ops;
+    state->seq = time(NULL);
+    sink_set_name(state->ipv4.setname, group, "ipv4");
+    state->ipv4.family = AF_INET;
+    sink_set_name(state->ipv6.setname, group, "ipv6");
+    state->ipv6.family = AF_INET6;
+
+    state->nl = mnl_socket_open(NETLINK_NETFILTER);
+    if (!state->nl) {
+        log_error("nftables: cannot open netlink socket: %s\n",
+                strerror(errno));
+        goto err_socket;
+    }
+    if (mnl_socket_bind(state->nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+        log_error("nftables: bind: %s\n", strerror(errno));
+        goto err_bind;
+    }
+    state->portid = mnl_socket_get_portid(state->nl);
+
+    if (!create_sets(state))
+        goto err_bind;
+
+    return &state->base;
+
+err_bind:
+    mnl_socket_close(state->nl);
+err_socket:
+    free(state);
+    return NULL;
+}
@@ -0,0 +1,423 @@
+/**
+ * Reader for pcap and pcapng capture files, returning IP packets.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * The file is mapped in memory and packets are returned without copying.
+ * Supported link-layer types: raw IP, Ethernet (with VLAN tags), Linux cooked
+ * capture (v1 and v2) and BSD loopback. Packets of other protocols are skipped.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dnsallow.h"
+
+/* Magic numbers of the pcap file header (microsecond/nanosecond precision). */
+#define PCAP_MAGIC_USEC     0xa1b2c3d4
+#define PCAP_MAGIC_NSEC     0xa1b23c4d
+/* pcapng block types. */
+#define PCAPNG_SHB          0x0a0d0d0a
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_PB           0x00000002  /* Obsolete Packet Block. */
+#define PCAPNG_SPB          0x00000003
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_BYTE_ORDER   0x1a2b3c4d
+#define PCAPNG_OPT_TSRESOL  9
+
+/* Link-layer header types (LINKTYPE_* values from the pcap specification). */
+#define LINKTYPE_NULL       0
+#define LINKTYPE_ETHERNET   1
+#define LINKTYPE_RAW        101
+#define LINKTYPE_LOOP       108
+#define LINKTYPE_LINUX_SLL  113
+#define LINKTYPE_IPV4       228
+#define LINKTYPE_IPV6       229
+#define LINKTYPE_LINUX_SLL2 276
+
+#define ETHERTYPE_IPV4      0x0800
+#define ETHERTYPE_IPV6      0x86dd
+#define ETHERTYPE_VLAN      0x8100
+#define ETHERTYPE_QINQ      0x88a8
+
+/* Maximum number of interfaces in a pcapng section. */
+#define PCAPNG_MAX_IFACES   64
+
+struct pcap_iface {
+    uint16_t linktype;
+    /* Timestamp resolution: units per second is 10^exp or 2^exp. */
+    bool binary;
+    uint8_t exp;
+};
+
+struct pcap_file {
+    const unsigned char *data;
+    size_t size;
+    size_t offset;
+    bool pcapng;
+    bool swapped;           /* The file uses the other byte order. */
+
+    /* pcap: a single interface. pcapng: interfaces of the current section. */
+    struct pcap_iface ifaces[PCAPNG_MAX_IFACES];
+    unsigned iface_count;
+};
+
+static uint16_t get16(const struct pcap_file *pf, const unsigned char *p)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return pf->swapped ? __builtin_bswap16(v) : v;
+}
+
+static uint32_t get32(const struct pcap_file *pf, const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return pf->swapped ? __builtin_bswap32(v) : v;
+}
+
+/* Converts a timestamp in units of the interface resolution to ns. */
+static uint64_t to_ns(const struct pcap_iface *iface, uint64_t ts)
+{
+    unsigned __int128 v = ts;
+    uint64_t div = 1;
+    unsigned i;
+
+    if (iface->binary)
+        return (uint64_t)((v * 1000000000) >> iface->exp);
+
+    for (i = 0; i < iface->exp && i < 19; i++)
+        div *= 10;
+    return (uint64_t)(v * 1000000000 / div);
+}
+
+/* Reads the pcap file header. */
+static int open_pcap(struct pcap_file *pf, uint32_t magic)
+{
+    if (pf->size < 24)
+        return -1;
+
+    pf->swapped = magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC;
+    if (pf->swapped)
+        magic = __builtin_bswap32(magic);
+    pf->iface_count = 1;
+    pf->ifaces[0].linktype = get32(pf, pf->data + 20) & 0xffff;
+    pf->ifaces[0].exp = magic == PCAP_MAGIC_NSEC ? 9 : 6;
+    pf->offset = 24;
+    return 0;
+}
+
+/* Parses an Interface Description Block (body without type and length). */
+static void parse_idb(struct pcap_file *pf, const unsigned char *body,
+        size_t len)
+{
+    struct pcap_iface *iface;
+    size_t off = 8;
+    uint16_t code, optlen;
+
+    if (pf->iface_count == PCAPNG_MAX_IFACES || len < 8)
+        return;
+
+    iface = &pf->ifaces[pf->iface_count++];
+    iface->linktype = get16(pf, body);
+    iface->binary = false;
+    iface->exp = 6;
+
+    while (off + 4 <= len) {
+        code = get16(pf, body + off);
+        optlen = get16(pf, body + off + 2);
+        off += 4;
+        if (code == 0 || off + optlen > len)
+            break;
+        if (code == PCAPNG_OPT_TSRESOL && optlen >= 1) {
+            iface->binary = body[off] & 0x80;
+            iface->exp = body[off] & 0x7f;
+            if (iface->exp > 63)
+                iface->exp = 63;
+        }
+        off += (optlen + 3) & ~3u;
+    }
+}
+
+/**
+ * Removes the link-layer header. Returns false if the frame does not contain
+ * an IPv4 or IPv6 packet.
+ */
+static bool strip_link_layer(uint16_t linktype, const unsigned char **pkt,
+        unsigned *len)
+{
+    const unsigned char *p = *pkt;
+    unsigned n = *len, hdrlen, proto, family;
+
+    switch (linktype) {
+    case LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+        hdrlen = 0;
+        break;
+    case LINKTYPE_NULL:
+    case LINKTYPE_LOOP:
+        if (n < 4)
+            return false;
+        /* Host byte order (of the capturing host) for NULL, network order
+         * for LOOP. The values are small, so check both orders. */
+        family = p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24;
+        if (family > 0xffff)
+            family = __builtin_bswap32(family);
+        /* AF_INET, and AF_INET6 as used by Linux, BSDs and macOS. */
+        if (family != 2 && family != 10 && family != 24 && family != 28 &&
+                family != 30)
+            return false;
+        hdrlen = 4;
+        break;
+    case LINKTYPE_ETHERNET:
+        hdrlen = 14;
+        if (n < hdrlen)
+            return false;
+        proto = p[12] << 8 | p[13];
+        while ((proto == ETHERTYPE_VLAN || proto == ETHERTYPE_QINQ) &&
+                n >= hdrlen + 4) {
+            proto = p[hdrlen + 2] << 8 | p[hdrlen + 3];
+            hdrlen += 4;
+        }
+        if (proto != ETHERTYPE_IPV4 && proto != ETHERTYPE_IPV6)
+            return false;
+        break;
+    case LINKTYPE_LINUX_SLL:
+        hdrlen = 16;
+        if (n < hdrlen)
+            return false;
+        proto = p[14] << 8 | p[15];
+        if (proto != ETHERTYPE_IPV4 && proto != ETHERTYPE_IPV6)
+            return false;
+        break;
+    case LINKTYPE_LINUX_SLL2:
+        hdrlen = 20;
+        if (n < hdrlen)
+            return false;
+        proto = p[0] << 8 | p[1];
+        if (proto != ETHERTYPE_IPV4 && proto != ETHERTYPE_IPV6)
+            return false;
+        break;
+    default:
+        return false;
+    }
+
+    if (n <= hdrlen)
+        return false;
+    *pkt = p + hdrlen;
+    *len = n - hdrlen;
+    return true;
+}
+
+/**
+ * Maps a capture file in memory. Returns NULL if the file cannot be read or
+ * is not a pcap or pcapng file.
+ */
+struct pcap_file *pcap_open(const char *filename)
+{
+    struct pcap_file *pf;
+    struct stat st;
+    uint32_t magic;
+    void *data;
+    int fd;
+
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("Cannot open capture %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < 4) {
+        log_error("Cannot read capture %s\n", filename);
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_error("Cannot map capture %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
+    /* Packets are read once in order. */
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    pf = calloc(1, sizeof(*pf));
+    if (!pf) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    pf->data = data;
+    pf->size = st.st_size;
+
+    memcpy(&magic, pf->data, sizeof(magic));
+    if (magic == PCAPNG_SHB) {
+        /* The byte order is determined by the section header. */
+        pf->pcapng = true;
+    } else if ((magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC ||
+                magic == __builtin_bswap32(PCAP_MAGIC_USEC) ||
+                magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) &&
+            open_pcap(pf, magic) == 0) {
+        pf->pcapng = false;
+    } else {
+        log_error("%s is not a pcap or pcapng file\n", filename);
+        pcap_close(pf);
+        return NULL;
+    }
+    return pf;
+}
+
+/* Returns the next packet from a pcap file, see pcap_next. */
+static int next_pcap(struct pcap_file *pf, const unsigned char **pkt,
+        unsigned *len, uint64_t *ts, uint16_t *linktype)
+{
+    const unsigned char *rec;
+    uint32_t caplen;
+
+    if (pf->size - pf->offset < 16)
+        return 0;
+
+    rec = pf->data + pf->offset;
+    caplen = get32(pf, rec + 8);
+    if (caplen > pf->size - pf->offset - 16) {
+        log_warning("Capture is truncated\n");
+        return 0;
+    }
+
+    *ts = to_ns(&pf->ifaces[0], (uint64_t)get32(pf, rec) *
+            (pf->ifaces[0].exp == 9 ? 1000000000 : 1000000) +
+            get32(pf, rec + 4));
+    *pkt = rec + 16;
+    *len = caplen;
+    *linktype = pf->ifaces[0].linktype;
+    pf->offset += 16 + caplen;
+    return 1;
+}
+
+/* Returns the next packet from a pcapng file, see pcap_next. */
+static int next_pcapng(struct pcap_file *pf, const unsigned char **pkt,
+        unsigned *len, uint64_t *ts, uint16_t *linktype)
+{
+    const unsigned char *block, *body;
+    uint32_t type, block_len, magic, iface, caplen;
+    size_t body_len;
+
+    while (pf->size - pf->offset >= 12) {
+        block = pf->data + pf->offset;
+        memcpy(&type, block, sizeof(type));
+
+        if (type == PCAPNG_SHB) {
+            memcpy(&magic, block + 8, sizeof(magic));
+            if (magic != PCAPNG_BYTE_ORDER &&
+                    magic != __builtin_bswap32(PCAPNG_BYTE_ORDER)) {
+                log_warning("Invalid pcapng section header\n");
+                return 0;
+            }
+            pf->swapped = magic != PCAPNG_BYTE_ORDER;
+            /* Interfaces are scoped to a section. */
+            pf->iface_count = 0;
+        } else if (pf->swapped) {
+            type = __builtin_bswap32(type);
+        }
+
+        block_len = get32(pf, block + 4);
+        if (block_len < 12 || block_len % 4 ||
+                block_len > pf->size - pf->offset) {
+            log_warning("Capture is truncated or corrupt\n");
+            return 0;
+        }
+        pf->offset += block_len;
+        body = block + 8;
+        body_len = block_len - 12;
+
+        switch (type) {
+        case PCAPNG_IDB:
+            parse_idb(pf, body, body_len);
+            continue;
+        case PCAPNG_EPB:
+        case PCAPNG_PB:
+            if (body_len < 20)
+                continue;
+            iface = type == PCAPNG_EPB ? get32(pf, body) : get16(pf, body);
+            caplen = get32(pf, body + 12);
+            if (caplen > body_len - 20)
+                continue;
+            *pkt = body + 20;
+            *len = caplen;
+            *ts = ((uint64_t)get32(pf, body + 4) << 32) | get32(pf, body + 8);
+            break;
+        case PCAPNG_SPB:
+            if (body_len < 4)
+                continue;
+            iface = 0;
+            caplen = get32(pf, body);
+            if (caplen > body_len - 4)
+                caplen = body_len - 4;
+            *pkt = body + 4;
+            *len = caplen;
+            *ts = 0;    /* No timestamp, replayed without delay. */
+            break;
+        default:
+            continue;
+        }
+
+        if (iface >= pf->iface_count)
+            continue;
+        if (*ts)
+            *ts = to_ns(&pf->ifaces[iface], *ts);
+        *linktype = pf->ifaces[iface].linktype;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Returns the next IP packet with its timestamp (in ns since the epoch, 0 if
+ * unknown). Frames without an IP packet are skipped. Returns 1 if a packet was
+ * found and 0 at the end of the file (or if the file is corrupt).
+ */
+int pcap_next(struct pcap_file *pf, const unsigned char **pkt, unsigned *len,
+        uint64_t *ts)
+{
+    uint16_t linktype;
+    int r;
+
+    for (;;) {
+        if (pf->pcapng)
+            r = next_pcapng(pf, pkt, len, ts, &linktype);
+        else
+            r = next_pcap(pf, pkt, len, ts, &linktype);
+        if (r <= 0)
+            return r;
+        if (strip_link_layer(linktype, pkt, len))
+            return 1;
+    }
+}
+
+void pcap_close(struct pcap_file *pf)
+{
+    munmap((void *)pf->data, pf->size);
+    free(pf);
+}
@@ -16,23 +16,801 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/**
+ * Policy file format: one rule per line, empty lines and lines starting with
+ * '#' are ignored.
+ *
+ *   example.com        Allows exactly this name.
+ *   *.example.com      Allows all names below example.com (not the name
+ *                      itself).
+ *   *                  Allows everything.
+ *   !10.0.0.0/8        Never adds addresses in this prefix (for any name).
+ *   +10.9.0.0/16       Exception for a more specific prefix of a '!' rule.
+ *   corp.example.com 10.1.0.0/16 fd00::/8
+ *                      Allows the name and its addresses in these prefixes,
+ *                      even if they are filtered. The prefixes of the most
+ *                      specific rule that allows a name apply (those of
+ *                      "x.example" and "*.x.example" are shared).
+ *
+ * Names are case-insensitive. Rules are stored in a trie of reversed labels
+ * ("com" -> "example" -> "www"). Nodes are numbered (the root is node 0) and
+ * every edge (parent node, label) -> child node is stored in a single open
+ * addressing hash table, so a lookup costs one probe sequence per label of the
+ * queried name, independent of the number of rules.
+ *
+ * The tables can be written to a binary image (see dnsallow-compile) which is
+ * mapped read-only by policy_init and queried in place. The image consists of
+ * a header followed by the node flags, the edge table and the labels at the
+ * offsets given in the header. All numbers are in host byte order. Offsets and
+ * indices are checked on lookup, so a corrupted image cannot cause reads
+ * outside the mapping; the data checksum is only verified on request since
+ * that would require reading the whole image on startup.
+ *
+ * The address filter is a longest prefix match table (see lpm.c), so checking
+ * an address costs the same for any number of prefixes. Overrides are only
+ * looked up for filtered addresses, in an array sorted by node.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "dnsallow.h"
 
+/* Node flags. */
+#define POLICY_EXACT        0x01    /* The name itself is allowed. */
+#define POLICY_WILDCARD     0x02    /* Names below this node are allowed. */
+
+/* Values in the address filter. */
+#define FILTER_ALLOW        0
+#define FILTER_REJECT       1
+
+struct policy_edge {
+    uint32_t parent;
+    uint32_t child;     /* Zero for unused slots (the root has no parent). */
+    uint32_t label;     /* Offset of the length-prefixed label in labels. */
+    uint32_t hash;      /* Hash of the label. */
+};
+
+/* Prefix that overrules the address filter for the names of a node. */
+struct policy_override {
+    uint32_t node;
+    uint8_t family;     /* AF_INET or AF_INET6. */
+    uint8_t len;
+    uint8_t padding[2];
+    uint8_t addr[16];
+};
+
+#define POLICY_IMAGE_MAGIC      "DNSAPOL"
+#define POLICY_IMAGE_VERSION    2
+#define POLICY_IMAGE_BYTE_ORDER 0x01020304
+
+struct policy_image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;        /* POLICY_IMAGE_BYTE_ORDER */
+    uint32_t rule_count;
+    uint32_t node_count;
+    uint32_t edge_slots;        /* A power of two. */
+    uint32_t labels_size;
+    uint64_t nodes_offset;
+    uint64_t edges_offset;
+    uint64_t labels_offset;
+    uint32_t override_count;
+    uint32_t reserved;
+    uint64_t overrides_offset;
+    uint64_t filter_offset;
+    uint64_t filter_size;       /* Zero if addresses are not filtered. */
+    uint64_t image_size;
+    uint64_t data_checksum;     /* Checksum of everything after the header. */
+    uint64_t header_checksum;   /* Checksum of the header up to this field. */
+};
+
 struct policy {
+    bool accept_all;            /* No policy file was given. */
+    unsigned rule_count;
+
+    /* Mapped image (NULL if the tables were built from a text file). */
+    void *image;
+    size_t image_size;
+
+    uint8_t *nodes;             /* Flags for every node. */
+    uint32_t node_count;
+    uint32_t node_alloc;
+
+    struct policy_edge *edges;
+    uint32_t edge_mask;         /* Number of slots minus one. */
+    uint32_t edge_count;
+
+    unsigned char *labels;
+    uint32_t labels_size;
+    uint32_t labels_alloc;
+
+    struct policy_override *overrides;  /* Sorted by node. */
+    uint32_t override_count;
+    uint32_t override_alloc;
+
+    struct lpm *filter;         /* NULL if all addresses are allowed. */
 };
 
-struct policy *policy_init(void)
+static inline char to_lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+/**
+ * Hashes a (lowercase) label. The label is processed in 8-byte little-endian
+ * words (zero-padded), which allows the hash to be computed while decoding.
+ */
+uint32_t policy_label_hash(const char *label, unsigned len)
+{
+    uint64_t h = LABEL_HASH_SEED(len);
+    uint64_t w;
+    unsigned i, j;
+
+    for (i = 0; i < len; i += 8) {
+        w = 0;
+        for (j = 0; j < 8 && i + j < len; j++)
+            w |= (uint64_t)(unsigned char)label[i + j] << (8 * j);
+        LABEL_HASH_STEP(h, w);
+    }
+    return LABEL_HASH_FINAL(h);
+}
+
+static inline uint32_t edge_slot(uint32_t parent, uint32_t hash)
+{
+    uint64_t h = ((uint64_t)parent << 32 | hash) * 0x9e3779b97f4a7c15ULL;
+    return h >> 32;
+}
+
+/* Returns the child of parent for the given lowercase label, or zero. */
+static uint32_t find_child(const struct policy *policy, uint32_t parent,
+        const char *label, unsigned len, uint32_t hash)
+{
+    const struct policy_edge *edge;
+    const unsigned char *stored;
+    uint32_t slot = edge_slot(parent, hash);
+
+    uint32_t i;
+
+    for (i = 0; i <= policy->edge_mask; i++, slot++) {
+        edge = &policy->edges[slot & policy->edge_mask];
+        if (!edge->child)
+            return 0;
+
+        if (edge->parent == parent && edge->hash == hash &&
+                (uint64_t)edge->label + 1 + len <= policy->labels_size) {
+            stored = policy->labels + edge->label;
+            if (stored[0] == len && !memcmp(stored + 1, label, len))
+                return edge->child < policy->node_count ? edge->child : 0;
+        }
+    }
+    return 0;
+}
+
+static int grow_edges(struct policy *policy)
+{
+    struct policy_edge *old = policy->edges, *edge;
+    uint32_t old_size = old ? policy->edge_mask + 1 : 0;
+    uint32_t new_size = old_size ? old_size * 2 : 1024;
+    uint32_t i, slot;
+
+    policy->edges = calloc(new_size, sizeof(*policy->edges));
+    if (!policy->edges) {
+        policy->edges = old;
+        return -1;
+    }
+    policy->edge_mask = new_size - 1;
+
+    for (i = 0; i < old_size; i++) {
+        if (!old[i].child)
+            continue;
+
+        slot = edge_slot(old[i].parent, old[i].hash);
+        for (;; slot++) {
+            edge = &policy->edges[slot & policy->edge_mask];
+            if (!edge->child)
+                break;
+        }
+        *edge = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/* Returns the child for the label, creating it if necessary (zero on error). */
+static uint32_t add_child(struct policy *policy, uint32_t parent,
+        const char *label, unsigned len)
+{
+    struct policy_edge *edge;
+    uint32_t hash = policy_label_hash(label, len);
+    uint32_t child, slot;
+    void *p;
+
+    child = find_child(policy, parent, label, len, hash);
+    if (child)
+        return child;
+
+    /* Keep the load factor below 1/2. */
+    if ((policy->edge_count + 1) * 2 > policy->edge_mask + 1 &&
+            grow_edges(policy) < 0)
+        return 0;
+
+    if (policy->node_count == policy->node_alloc) {
+        p = realloc(policy->nodes, policy->node_alloc * 2);
+        if (!p)
+            return 0;
+        policy->nodes = p;
+        policy->node_alloc *= 2;
+    }
+
+    if (policy->labels_size + 1 + len > policy->labels_alloc) {
+        p = realloc(policy->labels, policy->labels_alloc * 2);
+        if (!p)
+            return 0;
+        policy->labels = p;
+        policy->labels_alloc *= 2;
+    }
+
+    child = policy->node_count++;
+    policy->nodes[child] = 0;
+
+    slot = edge_slot(parent, hash);
+    for (;; slot++) {
+        edge = &policy->edges[slot & policy->edge_mask];
+        if (!edge->child)
+            break;
+    }
+    edge->parent = parent;
+    edge->child = child;
+    edge->label = policy->labels_size;
+    edge->hash = hash;
+    policy->edge_count++;
+
+    policy->labels[policy->labels_size] = len;
+    memcpy(policy->labels + policy->labels_size + 1, label, len);
+    policy->labels_size += 1 + len;
+    return child;
+}
+
+/* Adds a prefix that overrules the filter for the names of a node. */
+static int add_override(struct policy *policy, uint32_t node, const char *str)
+{
+    struct policy_override *o;
+    struct address prefix;
+    unsigned len, alloc;
+
+    if (parse_prefix(str, &prefix, &len) < 0)
+        return -1;
+
+    if (policy->override_count == policy->override_alloc) {
+        alloc = policy->override_alloc ? 2 * policy->override_alloc : 16;
+        o = realloc(policy->overrides, alloc * sizeof(*o));
+        if (!o)
+            return -1;
+        policy->overrides = o;
+        policy->override_alloc = alloc;
+    }
+
+    o = &policy->overrides[policy->override_count++];
+    memset(o, 0, sizeof(*o));
+    o->node = node;
+    o->family = prefix.family;
+    o->len = len;
+    if (prefix.family == AF_INET)
+        memcpy(o->addr, &prefix.ip4_addr, 4);
+    else
+        memcpy(o->addr, prefix.ip6_addr.s6_addr, 16);
+    return 0;
+}
+
+/* Adds an address filter rule ("!PREFIX" or "+PREFIX"). */
+static int add_filter(struct policy *policy, const char *rule)
+{
+    struct address prefix;
+    unsigned len;
+
+    if (parse_prefix(rule + 1, &prefix, &len) < 0)
+        return -1;
+    if (!policy->filter && !(policy->filter = lpm_init()))
+        return -1;
+    if (lpm_add(policy->filter, &prefix, len,
+                rule[0] == '!' ? FILTER_REJECT : FILTER_ALLOW) < 0)
+        return -1;
+    policy->rule_count++;
+    return 0;
+}
+
+/**
+ * Adds a rule (without comments or whitespace) and the prefixes that overrule
+ * the address filter for it (separated by whitespace, may be empty). Returns 0
+ * on success.
+ */
+static int add_rule(struct policy *policy, char *rule, char *prefixes)
+{
+    char *prefix, *saveptr;
+    uint8_t flag = POLICY_EXACT;
+    uint32_t node = 0;
+    size_t start, end, i;
+
+    if (rule[0] == '*' && (rule[1] == '.' || rule[1] == '\0')) {
+        flag = POLICY_WILDCARD;
+        rule += rule[1] ? 2 : 1;
+    }
+
+    end = strlen(rule);
+    if (end && rule[end - 1] == '.')
+        end--;      /* Accept fully qualified names. */
+    if (end > 253)
+        return -1;
+
+    for (i = 0; i < end; i++)
+        rule[i] = to_lower(rule[i]);
+
+    /* Walk labels from right to left. */
+    while (end > 0) {
+        start = end;
+        while (start > 0 && rule[start - 1] != '.')
+            start--;
+
+        if (start == end || end - start > 63)
+            return -1;
+
+        node = add_child(policy, node, rule + start, end - start);
+        if (!node)
+            return -1;
+
+        if (start == 0)
+            break;
+        end = start - 1;
+        if (end == 0)
+            return -1;  /* Empty label at the start. */
+    }
+
+    /* A plain "*" is only valid as wildcard. */
+    if (node == 0 && flag == POLICY_EXACT)
+        return -1;
+
+    for (prefix = strtok_r(prefixes, " \t\r\n", &saveptr); prefix;
+            prefix = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        if (add_override(policy, node, prefix) < 0)
+            return -1;
+    }
+
+    policy->nodes[node] |= flag;
+    policy->rule_count++;
+    return 0;
+}
+
+static int compare_override(const void *a, const void *b)
+{
+    const struct policy_override *x = a, *y = b;
+
+    return x->node < y->node ? -1 : x->node > y->node;
+}
+
+static int load_policy(struct policy *policy, const char *filename)
+{
+    FILE *fp;
+    char line[1024], *rule, *end, *prefixes;
+    unsigned lineno = 0;
+    int ret = -1, r;
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        log_error("Cannot open policy %s: %s\n", filename,
+                strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+
+        /* Strip leading and trailing whitespace. */
+        rule = line + strspn(line, " \t\r\n");
+        if (rule[0] == '\0' || rule[0] == '#')
+            continue;
+
+        end = rule + strcspn(rule, " \t\r\n");
+        prefixes = end + strspn(end, " \t\r\n");
+        if (rule[0] == '!' || rule[0] == '+') {
+            if (prefixes[0] != '\0') {
+                log_error("%s:%u: trailing garbage\n", filename, lineno);
+                goto out;
+            }
+            *end = '\0';
+            r = add_filter(policy, rule);
+        } else {
+            *end = '\0';
+            r = add_rule(policy, rule, prefixes);
+        }
+        if (r < 0) {
+            log_error("%s:%u: invalid rule\n", filename, lineno);
+            goto out;
+        }
+    }
+
+    if (ferror(fp)) {
+        log_error("Cannot read policy %s\n", filename);
+        goto out;
+    }
+    if (policy->filter && lpm_build(policy->filter) < 0) {
+        log_error("Cannot build the address filter of %s\n", filename);
+        goto out;
+    }
+    if (policy->override_count)
+        qsort(policy->overrides, policy->override_count,
+                sizeof(*policy->overrides), compare_override);
+    ret = 0;
+
+out:
+    fclose(fp);
+    return ret;
+}
+
+/* Simple word-wise hash, used to detect corrupted images. */
+static uint64_t checksum(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL, w;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    while (len--)
+        h = (h ^ *p++) * 0x100000001b3ULL;
+    return h;
+}
+
+static uint64_t header_checksum(const struct policy_image_header *hdr)
+{
+    return checksum(hdr, offsetof(struct policy_image_header, header_checksum));
+}
+
+static bool is_image(int fd)
+{
+    char magic[sizeof(POLICY_IMAGE_MAGIC)];
+
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+        !memcmp(magic, POLICY_IMAGE_MAGIC, sizeof(magic));
+}
+
+/**
+ * Whether 'count' items of 'size' bytes at 'offset' (a multiple of 'align')
+ * lie between the header and the end of the image. Values from the image are
+ * untrusted, so the checks must not overflow.
+ */
+static bool in_image(const struct policy_image_header *hdr, uint64_t offset,
+        uint64_t count, uint64_t size, uint64_t align)
+{
+    return offset >= sizeof(*hdr) && offset % align == 0 &&
+        offset <= hdr->image_size &&
+        count <= (hdr->image_size - offset) / size;
+}
+
+/* Maps a compiled policy, checking the header and the table bounds. */
+static int map_image(struct policy *policy, int fd, const char *filename)
+{
+    const struct policy_image_header *hdr;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+        log_error("Cannot read policy image %s\n", filename);
+        return -1;
+    }
+
+    policy->image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (policy->image == MAP_FAILED) {
+        policy->image = NULL;
+        log_error("Cannot map policy image %s: %s\n", filename,
+                strerror(errno));
+        return -1;
+    }
+    policy->image_size = st.st_size;
+
+    hdr = policy->image;
+    if (hdr->header_checksum != header_checksum(hdr) ||
+            hdr->byte_order != POLICY_IMAGE_BYTE_ORDER) {
+        log_error("Policy image %s is corrupt or from another "
+                "architecture\n", filename);
+        return -1;
+    }
+    if (hdr->version != POLICY_IMAGE_VERSION) {
+        log_error("Policy image %s has unsupported version %u\n",
+                filename, hdr->version);
+        return -1;
+    }
+    if (hdr->image_size != policy->image_size || hdr->node_count == 0 ||
+            hdr->edge_slots == 0 || (hdr->edge_slots & (hdr->edge_slots - 1)) ||
+            !in_image(hdr, hdr->nodes_offset, hdr->node_count, 1, 1) ||
+            !in_image(hdr, hdr->edges_offset, hdr->edge_slots,
+                sizeof(struct policy_edge), sizeof(uint32_t)) ||
+            !in_image(hdr, hdr->labels_offset, hdr->labels_size, 1, 1) ||
+            !in_image(hdr, hdr->overrides_offset, hdr->override_count,
+                sizeof(struct policy_override), sizeof(uint32_t)) ||
+            !in_image(hdr, hdr->filter_offset, hdr->filter_size, 1, 8)) {
+        log_error("Policy image %s is truncated or corrupt\n", filename);
+        return -1;
+    }
+    if (hdr->filter_size) {
+        policy->filter = lpm_map((char *)policy->image + hdr->filter_offset,
+                hdr->filter_size);
+        if (!policy->filter) {
+            log_error("Policy image %s has a corrupt address filter\n",
+                    filename);
+            return -1;
+        }
+    }
+
+    policy->rule_count = hdr->rule_count;
+    policy->nodes = (uint8_t *)policy->image + hdr->nodes_offset;
+    policy->node_count = hdr->node_count;
+    policy->edges = (struct policy_edge *)((char *)policy->image +
+            hdr->edges_offset);
+    policy->edge_mask = hdr->edge_slots - 1;
+    policy->labels = (unsigned char *)policy->image + hdr->labels_offset;
+    policy->labels_size = hdr->labels_size;
+    policy->overrides = (struct policy_override *)((char *)policy->image +
+            hdr->overrides_offset);
+    policy->override_count = hdr->override_count;
+    return 0;
+}
+
+/* Rounds up to a multiple of eight. */
+static inline uint64_t align8(uint64_t n)
+{
+    return (n + 7) & ~7ULL;
+}
+
+/**
+ * Writes the policy as binary image which can be loaded by policy_init.
+ * Returns 0 on success.
+ */
+int policy_write_image(const struct policy *policy, const char *filename)
+{
+    struct policy_image_header hdr;
+    unsigned char *image;
+    FILE *fp;
+    int ret = -1;
+
+    if (policy->accept_all)
+        return -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, POLICY_IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = POLICY_IMAGE_VERSION;
+    hdr.byte_order = POLICY_IMAGE_BYTE_ORDER;
+    hdr.rule_count = policy->rule_count;
+    hdr.node_count = policy->node_count;
+    hdr.edge_slots = policy->edge_mask + 1;
+    hdr.labels_size = policy->labels_size;
+    hdr.nodes_offset = align8(sizeof(hdr));
+    hdr.edges_offset = align8(hdr.nodes_offset + hdr.node_count);
+    hdr.labels_offset = hdr.edges_offset +
+        (uint64_t)hdr.edge_slots * sizeof(struct policy_edge);
+    hdr.override_count = policy->override_count;
+    hdr.overrides_offset = align8(hdr.labels_offset + hdr.labels_size);
+    hdr.filter_offset = align8(hdr.overrides_offset +
+            (uint64_t)hdr.override_count * sizeof(struct policy_override));
+    hdr.filter_size = policy->filter ? lpm_image_size(policy->filter) : 0;
+    hdr.image_size = hdr.filter_offset + hdr.filter_size;
+
+    image = calloc(1, hdr.image_size);
+    if (!image)
+        return -1;
+
+    memcpy(image + hdr.nodes_offset, policy->nodes, hdr.node_count);
+    memcpy(image + hdr.edges_offset, policy->edges,
+            (size_t)hdr.edge_slots * sizeof(struct policy_edge));
+    memcpy(image + hdr.labels_offset, policy->labels, hdr.labels_size);
+    if (hdr.override_count)
+        memcpy(image + hdr.overrides_offset, policy->overrides,
+                (size_t)hdr.override_count * sizeof(struct policy_override));
+    if (policy->filter)
+        lpm_write_image(policy->filter, image + hdr.filter_offset);
+    hdr.data_checksum = checksum(image + sizeof(hdr),
+            hdr.image_size - sizeof(hdr));
+    hdr.header_checksum = header_checksum(&hdr);
+    memcpy(image, &hdr, sizeof(hdr));
+
+    fp = fopen(filename, "wb");
+    if (!fp) {
+        log_error("Cannot create %s: %s\n", filename, strerror(errno));
+        goto out;
+    }
+    if (fwrite(image, hdr.image_size, 1, fp) != 1 || fclose(fp) != 0) {
+        log_error("Cannot write %s\n", filename);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    free(image);
+    return ret;
+}
+
+/**
+ * Verifies the data checksum of a mapped policy image (this reads the whole
+ * image). Returns 0 if the image is intact.
+ */
+int policy_verify_image(const struct policy *policy)
+{
+    const struct policy_image_header *hdr = policy->image;
+
+    if (!hdr)
+        return -1;
+
+    return hdr->data_checksum == checksum((char *)hdr + sizeof(*hdr),
+            hdr->image_size - sizeof(*hdr)) ? 0 : -1;
+}
+
+/**
+ * Loads the policy from the given file (text or compiled image). If no file is
+ * given, all names are accepted.
+ */
+struct policy *policy_init(const char *filename)
 {
     struct policy *policy;
+    int fd, r;
 
-    policy = malloc(sizeof(*policy));
+    policy = calloc(1, sizeof(*policy));
     if (!policy)
         return NULL;
 
-    /* TODO read policy from given file. */
+    if (!filename) {
+        policy->accept_all = true;
+        return policy;
+    }
+
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("Cannot open policy %s: %s\n", filename,
+                strerror(errno));
+        goto err;
+    }
+
+    if (is_image(fd)) {
+        r = map_image(policy, fd, filename);
+        close(fd);
+        if (r < 0)
+            goto err;
+        return policy;
+    }
+    close(fd);
+
+    policy->node_alloc = 1024;
+    policy->nodes = calloc(policy->node_alloc, 1);
+    policy->labels_alloc = 4096;
+    policy->labels = malloc(policy->labels_alloc);
+    if (!policy->nodes || !policy->labels || grow_edges(policy) < 0)
+        goto err;
+    policy->node_count = 1;     /* The root. */
+
+    if (load_policy(policy, filename) < 0)
+        goto err;
 
     return policy;
+
+err:
+    policy_fini(policy);
+    return NULL;
+}
+
+/**
+ * Returns zero if the policy accepts the name and non-zero otherwise. The name
+ * must be lowercase, 'labels' describes its labels (as filled by parse_name).
+ */
+int policy_check_labels(struct policy *policy, const char *name,
+        const struct dns_labels *labels)
+{
+    uint32_t node = 0;
+    unsigned i;
+
+    if (policy->accept_all)
+        return 0;
+
+    for (i = labels->count; i-- > 0; ) {
+        /* Names below a wildcard node are allowed. */
+        if (policy->nodes[node] & POLICY_WILDCARD)
+            return 0;
+
+        node = find_child(policy, node, name + labels->offset[i],
+                labels->len[i], labels->hash[i]);
+        if (!node)
+            return 1;
+    }
+
+    return policy->nodes[node] & POLICY_EXACT ? 0 : 1;
+}
+
+/**
+ * Finds the node of the most specific rule that allows the name. Unlike
+ * policy_check_labels, this continues below wildcards.
+ */
+static bool find_rule(const struct policy *policy, const char *name,
+        const struct dns_labels *labels, uint32_t *rule)
+{
+    uint32_t node = 0;
+    bool found = false;
+    unsigned i;
+
+    for (i = labels->count; i-- > 0; ) {
+        if (policy->nodes[node] & POLICY_WILDCARD) {
+            *rule = node;
+            found = true;
+        }
+
+        node = find_child(policy, node, name + labels->offset[i],
+                labels->len[i], labels->hash[i]);
+        if (!node)
+            return found;
+    }
+
+    if (policy->nodes[node] & POLICY_EXACT) {
+        *rule = node;
+        found = true;
+    }
+    return found;
+}
+
+/* Whether an override prefix contains the address. */
+static bool override_matches(const struct policy_override *o,
+        const struct address *addr)
+{
+    const uint8_t *a = addr->family == AF_INET ?
+        (const uint8_t *)&addr->ip4_addr : addr->ip6_addr.s6_addr;
+    unsigned bytes = o->len / 8, bits = o->len % 8;
+
+    if (o->family != addr->family ||
+            o->len > (addr->family == AF_INET ? 32 : 128))
+        return false;
+    if (memcmp(o->addr, a, bytes))
+        return false;
+    return bits == 0 || !((o->addr[bytes] ^ a[bytes]) & (0xff00 >> bits));
+}
+
+/**
+ * Returns zero if an address in the response for an allowed name may be added
+ * and non-zero if the address filter rejects it (and no prefix of the rule for
+ * the name overrules the filter).
+ */
+int policy_check_address(struct policy *policy, const char *name,
+        const struct dns_labels *labels, const struct address *addr)
+{
+    const struct policy_override *o, *end;
+    uint32_t value, node, lo, hi, mid;
+
+    if (!policy->filter || !lpm_lookup(policy->filter, addr, &value) ||
+            value == FILTER_ALLOW)
+        return 0;
+    /* Names allowed as alias have no rule. */
+    if (!policy->override_count || !find_rule(policy, name, labels, &node))
+        return 1;
+
+    lo = 0;
+    hi = policy->override_count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (policy->overrides[mid].node < node)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    end = policy->overrides + policy->override_count;
+    for (o = policy->overrides + lo; o < end && o->node == node; o++) {
+        if (override_matches(o, addr))
+            return 0;
+    }
+    return 1;
 }
 
 /**
@@ -40,11 +818,55 @@ struct policy *policy_init(void)
  */
 int policy_check(struct policy *policy, const char *dnsname)
 {
-    /* TODO apply policy */
-    return 0;
+    char name[256];
+    struct dns_labels labels;
+    unsigned i, start = 0;
+
+    if (policy->accept_all)
+        return 0;
+
+    labels.count = 0;
+    for (i = 0; ; i++) {
+        if (i == sizeof(name))
+            return 1;
+        name[i] = to_lower(dnsname[i]);
+        if (dnsname[i] != '.' && dnsname[i] != '\0')
+            continue;
+
+        if (i > 0 || dnsname[i] == '.') {
+            if (i == start || i - start > 63)
+                return 1;
+            labels.offset[labels.count] = start;
+            labels.len[labels.count] = i - start;
+            labels.hash[labels.count] = policy_label_hash(name + start,
+                    i - start);
+            labels.count++;
+        }
+        if (dnsname[i] == '\0')
+            break;
+        start = i + 1;
+    }
+
+    return policy_check_labels(policy, name, &labels);
+}
+
+/* Returns the number of rules in the policy. */
+unsigned policy_rule_count(const struct policy *policy)
+{
+    return policy->rule_count;
 }
 
 void policy_fini(struct policy *policy)
 {
+    if (policy->filter)
+        lpm_fini(policy->filter);
+    if (policy->image) {
+        munmap(policy->image, policy->image_size);
+    } else {
+        free(policy->nodes);
+        free(policy->edges);
+        free(policy->labels);
+        free(policy->overrides);
+    }
     free(policy);
 }
@@ -0,0 +1,288 @@
+/**
+ * Table of outstanding queries for matching responses.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Anyone who can send packets to a client can try to forge responses for
+ * names that the policy allows. When queries are queued as well, a response
+ * is only processed if it matches an outstanding query: same client and
+ * resolver addresses and ports, DNS ID and question.
+ *
+ * Implementation notes:
+ *  - The table is shared by all workers since a query and its response may
+ *    be queued to different queues. It has a fixed size and is lock-free:
+ *    every slot is a single 64-bit word that is replaced with compare and
+ *    swap. The upper 40 bits are a tag from the hash of the flow, the lower
+ *    24 bits the expiry time (in seconds, modulo 2^24). Zero marks a free
+ *    slot.
+ *  - A key may be stored in one of the QUERY_PROBES slots of a bucket (a
+ *    single cache line). Expired slots are reused by the next insertion
+ *    instead of being removed by a timer. When all slots of a bucket are in
+ *    use, the query that expires first is evicted.
+ *  - A response consumes its query, so a query is answered at most once.
+ *  - The hash is seeded randomly, so tags cannot be predicted from outside.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include "dnsallow.h"
+
+/* Seconds after which a query is considered lost. */
+#define QUERY_TIMEOUT       15
+
+#define QUERY_PROBES        8       /* Slots per bucket. */
+#define EXPIRY_BITS         24
+#define EXPIRY_MASK         ((1ULL << EXPIRY_BITS) - 1)
+
+struct query_table {
+    _Atomic uint64_t *slots;
+    unsigned mask;          /* Number of slots minus one. */
+    uint64_t seed;
+    struct lpm *resolvers;  /* NULL if queries to any resolver are allowed. */
+};
+
+static uint64_t random_seed(void)
+{
+    struct timespec ts;
+    uint64_t seed;
+
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) == sizeof(seed))
+        return seed;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_nsec ^ ((uint64_t)ts.tv_sec << 32) ^ getpid();
+}
+
+/* Parses a comma-separated list of prefixes. */
+static struct lpm *parse_resolvers(const char *resolvers)
+{
+    char buf[INET6_ADDRSTRLEN + 4];
+    const char *list = resolvers;
+    struct address prefix;
+    struct lpm *lpm;
+    unsigned len;
+    size_t n;
+
+    lpm = lpm_init();
+    if (!lpm)
+        return NULL;
+
+    for (;;) {
+        n = strcspn(list, ",");
+        if (n >= sizeof(buf))
+            goto err;
+        memcpy(buf, list, n);
+        buf[n] = '\0';
+        if (parse_prefix(buf, &prefix, &len) < 0 ||
+                lpm_add(lpm, &prefix, len, 0) < 0)
+            goto err;
+        if (list[n] == '\0')
+            break;
+        list += n + 1;
+    }
+    if (lpm_build(lpm) < 0)
+        goto err;
+    return lpm;
+
+err:
+    log_error("Invalid resolver list: %s\n", resolvers);
+    lpm_fini(lpm);
+    return NULL;
+}
+
+/**
+ * Creates a table for at least 'size' outstanding queries (8 bytes each).
+ * 'resolvers' is a comma-separated list of prefixes to which queries may be
+ * sent, or NULL to allow all. Returns NULL on error.
+ */
+struct query_table *query_table_init(unsigned size, const char *resolvers)
+{
+    struct query_table *table;
+    unsigned slots = QUERY_PROBES;
+
+    while (slots < size)
+        slots <<= 1;
+
+    table = calloc(1, sizeof(*table));
+    if (!table)
+        return NULL;
+
+    /* Buckets must not cross cache lines. */
+    table->slots = aligned_alloc(QUERY_PROBES * sizeof(*table->slots),
+            (size_t)slots * sizeof(*table->slots));
+    if (!table->slots)
+        goto err;
+    memset(table->slots, 0, (size_t)slots * sizeof(*table->slots));
+    if (resolvers) {
+        table->resolvers = parse_resolvers(resolvers);
+        if (!table->resolvers)
+            goto err;
+    }
+    table->mask = slots - 1;
+    table->seed = random_seed();
+    return table;
+
+err:
+    query_table_fini(table);
+    return NULL;
+}
+
+/**
+ * Hashes the flow of a query or response from the client's view with the ID
+ * and question. 'offset' is the offset of the UDP payload. Returns 0 if the
+ * message is not a DNS message with a question.
+ */
+static uint64_t flow_key(const struct query_table *table,
+        const unsigned char *buf, unsigned buflen, unsigned offset,
+        bool response)
+{
+    unsigned addrlen = buf[0] >> 4 == 4 ? 4 : 16;
+    const unsigned char *src = buf + (addrlen == 4 ? 12 : 8);
+    const unsigned char *dst = src + addrlen;
+    const unsigned char *ports = buf + offset - 8;
+    const unsigned char *client = response ? dst : src;
+    const unsigned char *resolver = response ? src : dst;
+    unsigned client_port = response ? ports[2] << 8 | ports[3] :
+        ports[0] << 8 | ports[1];
+    unsigned resolver_port = response ? ports[0] << 8 | ports[1] :
+        ports[2] << 8 | ports[3];
+    uint32_t a, b;
+    uint64_t h = table->seed;
+    unsigned i;
+
+    for (i = 0; i < addrlen; i += 4) {
+        memcpy(&a, client + i, 4);
+        memcpy(&b, resolver + i, 4);
+        LABEL_HASH_STEP(h, (uint64_t)a << 32 | b);
+    }
+    LABEL_HASH_STEP(h, (uint64_t)addrlen << 32 | client_port << 16 |
+            resolver_port);
+
+    return dns_question_hash(buf + offset, buflen - offset, h);
+}
+
+/* Returns the first slot of the bucket for a key. */
+static inline _Atomic uint64_t *find_bucket(struct query_table *table,
+        uint64_t key)
+{
+    return &table->slots[key & table->mask & ~(QUERY_PROBES - 1)];
+}
+
+/* Whether a slot holds a query that has not expired at 'now'. */
+static inline bool slot_live(uint64_t slot, uint32_t now)
+{
+    uint64_t left = (slot - now) & EXPIRY_MASK;
+
+    return slot != 0 && left != 0 && left <= QUERY_TIMEOUT;
+}
+
+/**
+ * Remembers a query in an IP packet (with the UDP payload at 'offset') until
+ * its response arrives or QUERY_TIMEOUT seconds have passed. Queries to other
+ * resolvers than the allowed ones are ignored.
+ */
+void query_table_add(struct query_table *table, const unsigned char *buf,
+        unsigned buflen, unsigned offset, uint32_t now)
+{
+    _Atomic uint64_t *bucket, *slot, *victim;
+    struct address resolver;
+    uint64_t key, tag, old, victim_old = 0, entry;
+    unsigned i, attempt;
+    uint32_t value;
+
+    if (table->resolvers) {
+        ip_destination(buf, &resolver);
+        if (!lpm_lookup(table->resolvers, &resolver, &value))
+            return;
+    }
+
+    key = flow_key(table, buf, buflen, offset, false);
+    if (key == 0)
+        return;
+    tag = key & ~EXPIRY_MASK;
+    entry = tag | ((now + QUERY_TIMEOUT) & EXPIRY_MASK);
+    bucket = find_bucket(table, key);
+
+    /* Another worker may change the slots, retry a few times. */
+    for (attempt = 0; attempt < QUERY_PROBES; attempt++) {
+        victim = NULL;
+        for (i = 0; i < QUERY_PROBES; i++) {
+            slot = &bucket[i];
+            old = atomic_load_explicit(slot, memory_order_relaxed);
+            /* A retransmission refreshes the query. */
+            if ((old & ~EXPIRY_MASK) == tag || !slot_live(old, now)) {
+                victim = slot;
+                victim_old = old;
+                break;
+            }
+            if (!victim || ((old - now) & EXPIRY_MASK) <
+                    ((victim_old - now) & EXPIRY_MASK)) {
+                victim = slot;
+                victim_old = old;
+            }
+        }
+        if (atomic_compare_exchange_strong_explicit(victim, &victim_old,
+                    entry, memory_order_relaxed, memory_order_relaxed)) {
+            if (i == QUERY_PROBES)
+                stats_count(STAT_QUERY_EVICTED, 1);
+            return;
+        }
+    }
+}
+
+/**
+ * Checks whether an IP packet with a response (with the UDP payload at
+ * 'offset') answers an outstanding query and forgets that query. Only the
+ * header and question are hashed, names are not decoded.
+ */
+bool query_table_match(struct query_table *table, const unsigned char *buf,
+        unsigned buflen, unsigned offset, uint32_t now)
+{
+    _Atomic uint64_t *bucket, *slot;
+    uint64_t key, tag, old;
+    unsigned i;
+
+    key = flow_key(table, buf, buflen, offset, true);
+    if (key == 0)
+        return false;
+    tag = key & ~EXPIRY_MASK;
+    bucket = find_bucket(table, key);
+
+    for (i = 0; i < QUERY_PROBES; i++) {
+        slot = &bucket[i];
+        old = atomic_load_explicit(slot, memory_order_relaxed);
+        if ((old & ~EXPIRY_MASK) != tag || !slot_live(old, now))
+            continue;
+        /* Fails if a duplicate response consumed the query just now. */
+        return atomic_compare_exchange_strong_explicit(slot, &old, 0,
+                memory_order_relaxed, memory_order_relaxed);
+    }
+    return false;
+}
+
+void query_table_fini(struct query_table *table)
+{
+    if (table->resolvers)
+        lpm_fini(table->resolvers);
+    free(table->slots);
+    free(table);
+}
@@ -16,54 +16,90 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE     /* for recvmmsg */
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/socket.h>
 #include <libnfnetlink/libnfnetlink.h>
 #include <libnetfilter_queue/libnetfilter_queue.h>
 #include <arpa/inet.h>
 #include <linux/netfilter.h>  /* for NF_ACCEPT */
 #include "dnsallow.h"
 
-/* The queue number to be passed to -j NFQUEUE --queue-num X */
-#define QUEUE_NUM   53
+/* Up to QUEUE_BATCH_SIZE netlink messages (packets) are received with a single
+ * recvmmsg call. All packets from such a batch are accepted at once unless
+ * the verdict for some packets was deferred. */
 
-struct input_queue {
+/* Room for the netlink and nfqueue headers and attributes besides the copied
+ * packet payload. */
+#define QUEUE_MSG_OVERHEAD  1024
+
+struct nfqueue {
+    struct input_queue base;
     struct nfq_handle *h;
     struct nfq_q_handle *qh;
+    int queue_num;
     packet_callback *pkt_callback;
+    batch_callback *batch_callback;
     void *pkt_callback_data;
+
+    /* Receive buffers for a batch of messages (QUEUE_BATCH_SIZE * msg_size). */
+    struct mmsghdr msgs[QUEUE_BATCH_SIZE];
+    struct iovec iovs[QUEUE_BATCH_SIZE];
+    unsigned msg_size;
+    char *bufs;
+
+    /* Number of times that the socket receive buffer overflowed and the number
+     * of messages that did not fit in the receive buffer. */
+    unsigned long overruns;
+    unsigned long truncated;
+
+    /* Packets from the current batch that can be accepted immediately. */
+    uint32_t immediate[QUEUE_BATCH_SIZE];
+    unsigned immediate_count;
+
+    /* Number of packets whose verdict was deferred (see queue_verdict). */
+    unsigned outstanding;
+
+    /* Highest packet ID that was received. */
+    bool seen_packets;
+    uint32_t last_pkt_id;
 };
 
+static const struct input_ops nfqueue_ops;
+
 static struct nfq_handle *init_nfq(void)
 {
     struct nfq_handle *h;
 
     h = nfq_open();
     if (!h) {
-        fprintf(stderr, "error during nfq_open()\n");
+        log_error("error during nfq_open()\n");
         return NULL;
     }
 
     /* This seems unnecessary starting with Linux 3.7 (no-op).
      * Anyway, it will fail if you are not root. */
     if (nfq_unbind_pf(h, AF_INET) < 0) {
-        fprintf(stderr, "error during nfq_unbind_pf(AF_INET)\n");
+        log_error("error during nfq_unbind_pf(AF_INET)\n");
         goto err_close;
     }
 
     if (nfq_unbind_pf(h, AF_INET6) < 0) {
-        fprintf(stderr, "error during nfq_unbind_pf(AF_INET6)\n");
+        log_error("error during nfq_unbind_pf(AF_INET6)\n");
         goto err_close;
     }
 
     if (nfq_bind_pf(h, AF_INET) < 0) {
-        fprintf(stderr, "error during nfq_bind_pf(AF_INET)\n");
+        log_error("error during nfq_bind_pf(AF_INET)\n");
         goto err_close;
     }
 
     if (nfq_bind_pf(h, AF_INET6) < 0) {
-        fprintf(stderr, "error during nfq_bind_pf(AF_INET6)\n");
+        log_error("error during nfq_bind_pf(AF_INET6)\n");
         goto err_close;
     }
 
@@ -77,10 +113,12 @@ err_close:
 static int queue_pkt_callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
         struct nfq_data *nfa, void *data)
 {
-    struct input_queue *iq = data;
+    struct nfqueue *iq = data;
     unsigned char *pktdata;
-    int pkt_id, pktlen;
+    uint32_t pkt_id;
+    int pktlen;
     struct nfqnl_msg_packet_hdr *ph = nfq_get_msg_packet_hdr(nfa);
+    (void)qh;
     (void)nfmsg;
 
     /* Should not happen, otherwise we cannot set a verdict. */
@@ -90,76 +128,260 @@ static int queue_pkt_callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
     pkt_id = ntohl(ph->packet_id);
     pktlen = nfq_get_payload(nfa, &pktdata);
 
-    iq->pkt_callback(pktdata, pktlen, iq->pkt_callback_data);
-    nfq_set_verdict(qh, pkt_id, NF_ACCEPT, 0, NULL);
+    iq->seen_packets = true;
+    iq->last_pkt_id = pkt_id;
+
+    /* The verdict is issued later by queue_handle or queue_verdict. */
+    if (iq->pkt_callback(pktdata, pktlen, pkt_id, iq->pkt_callback_data))
+        iq->outstanding++;
+    else
+        iq->immediate[iq->immediate_count++] = pkt_id;
     return 0;
 }
 
 static struct nfq_q_handle *init_nfq_queue(struct nfq_handle *h, int queue_num,
-        struct input_queue *iq)
+        const struct queue_options *opts, struct nfqueue *iq)
 {
     struct nfq_q_handle *qh;
 
     qh = nfq_create_queue(h, queue_num, &queue_pkt_callback, iq);
     if (!qh) {
-        fprintf(stderr, "error during nfq_create_queue()\n");
-        fprintf(stderr, "Is the queue already being consumed?\n");
+        log_error("error during nfq_create_queue()\n");
+        log_error("Is the queue already being consumed?\n");
         return NULL;
     }
 
-    if (nfq_set_mode(qh, NFQNL_COPY_PACKET, 1024) < 0) {
-        fprintf(stderr, "can't set packet_copy mode\n");
-        nfq_destroy_queue(qh);
-        return NULL;
+    if (nfq_set_mode(qh, NFQNL_COPY_PACKET, opts->copy_range) < 0) {
+        log_error("can't set packet_copy mode\n");
+        goto err_destroy;
+    }
+
+    if (opts->max_len && nfq_set_queue_maxlen(qh, opts->max_len) < 0) {
+        log_error("can't set queue length to %u\n", opts->max_len);
+        goto err_destroy;
+    }
+
+    /* Requires Linux 3.6. */
+    if (opts->fail_open && nfq_set_queue_flags(qh, NFQA_CFG_F_FAIL_OPEN,
+                NFQA_CFG_F_FAIL_OPEN) < 0) {
+        log_error("can't enable fail-open mode\n");
+        goto err_destroy;
     }
 
     return qh;
+
+err_destroy:
+    nfq_destroy_queue(qh);
+    return NULL;
 }
 
-struct input_queue *queue_init(packet_callback *callback, void *callback_data)
+/* Binds to NFQUEUE number queue_num (as passed to -j NFQUEUE --queue-num X or
+ * one of the queues in --queue-balance X:Y). Every queue has its own netlink
+ * socket, so different queues can be handled from different threads. */
+struct input_queue *queue_init(int queue_num, const struct queue_options *opts,
+        packet_callback *callback, batch_callback *batch_done,
+        void *callback_data)
 {
-    struct input_queue *iq;
+    struct nfqueue *iq;
+    unsigned i;
 
-    iq = malloc(sizeof(*iq));
+    iq = calloc(1, sizeof(*iq));
     if (!iq)
         return NULL;
 
+    iq->base.ops = &nfqueue_ops;
+    iq->queue_num = queue_num;
     iq->pkt_callback = callback;
+    iq->batch_callback = batch_done;
     iq->pkt_callback_data = callback_data;
 
+    iq->msg_size = opts->copy_range + QUEUE_MSG_OVERHEAD;
+    iq->bufs = malloc((size_t)QUEUE_BATCH_SIZE * iq->msg_size);
+    if (!iq->bufs)
+        goto err_bufs;
+
+    for (i = 0; i < QUEUE_BATCH_SIZE; i++) {
+        iq->iovs[i].iov_base = iq->bufs + i * iq->msg_size;
+        iq->iovs[i].iov_len = iq->msg_size;
+        iq->msgs[i].msg_hdr.msg_iov = &iq->iovs[i];
+        iq->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
     iq->h = init_nfq();
     if (!iq->h)
         goto err_init_nfq;
 
-    iq->qh = init_nfq_queue(iq->h, QUEUE_NUM, iq);
+    if (opts->rcvbuf_size &&
+            nfnl_rcvbufsiz(nfq_nfnlh(iq->h), opts->rcvbuf_size) <
+            opts->rcvbuf_size)
+        log_warning("Queue %d: receive buffer is smaller than %u bytes, "
+                "check net.core.rmem_max\n", queue_num, opts->rcvbuf_size);
+
+    iq->qh = init_nfq_queue(iq->h, queue_num, opts, iq);
     if (!iq->qh)
         goto err_init_nfq_queue;
 
-    return iq;
+    return &iq->base;
 
 err_init_nfq_queue:
     nfq_close(iq->h);
 err_init_nfq:
+    free(iq->bufs);
+err_bufs:
     free(iq);
     return NULL;
 }
 
-int queue_handle(struct input_queue *iq)
+static int nfqueue_fd(struct input_queue *base)
+{
+    struct nfqueue *iq = (struct nfqueue *)base;
+
+    return nfq_fd(iq->h);
+}
+
+/* Accepts all packets up to and including the last received one. Packet IDs
+ * are increasing, so this must only be used if no verdict is outstanding. It
+ * also accepts packets for which the netlink message was lost. */
+static void accept_all(struct nfqueue *iq)
 {
-    int r;
-    char buf[1024];
+    uint64_t start = stats_now();
+
+    if (iq->seen_packets) {
+        nfq_set_verdict_batch(iq->qh, iq->last_pkt_id, NF_ACCEPT);
+        stats_record(STAGE_VERDICT, start, 1);
+    }
+}
 
-    r = recv(nfq_fd(iq->h), buf, sizeof(buf), 0);
-    if (r < 0)
-        return r;
+/**
+ * Receives and processes all queued packets (up to QUEUE_BATCH_SIZE). After
+ * invoking the batch callback, packets that were not deferred are accepted,
+ * with a single verdict if possible. Should be called when queue_fd is
+ * readable. Returns the number of processed messages or -1 on error.
+ */
+static int nfqueue_handle(struct input_queue *base)
+{
+    struct nfqueue *iq = (struct nfqueue *)base;
+    int r, i, handled;
+    uint64_t received, start;
+
+    r = recvmmsg(nfq_fd(iq->h), iq->msgs, QUEUE_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    if (r < 0) {
+        if (errno == ENOBUFS) {
+            /* The kernel could not deliver some messages. Those packets are
+             * still queued and will be accepted by the next batch verdict. */
+            if (iq->overruns++ == 0)
+                log_warning("Queue %d: receive buffer overrun, consider "
+                        "increasing --rcvbuf\n", iq->queue_num);
+            return 0;
+        }
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    received = stats_now();
+
+    handled = 0;
+    for (i = 0; i < r; i++) {
+        if (iq->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            iq->truncated++;
+            stats_count(STAT_TRUNCATED, 1);
+            continue;
+        }
+        nfq_handle_packet(iq->h, (char *)iq->iovs[i].iov_base,
+                iq->msgs[i].msg_len);
+        handled++;
+    }
 
-    nfq_handle_packet(iq->h, buf, r);
+    /* Also needed if all packets were deferred (to submit them). */
+    if (handled)
+        iq->batch_callback(iq->pkt_callback_data);
+
+    if (iq->immediate_count) {
+        if (iq->outstanding == 0) {
+            accept_all(iq);
+        } else {
+            start = stats_now();
+            for (i = 0; i < (int)iq->immediate_count; i++)
+                nfq_set_verdict(iq->qh, iq->immediate[i], NF_ACCEPT, 0, NULL);
+            stats_record(STAGE_VERDICT, start, 1);
+        }
+        stats_record(STAGE_LATENCY, received, iq->immediate_count);
+        iq->immediate_count = 0;
+    }
     return r;
 }
 
-void queue_fini(struct input_queue *iq)
+/**
+ * Accepts a packet for which the packet callback deferred the verdict.
+ */
+static void nfqueue_verdict(struct input_queue *base, uint32_t pkt_id)
 {
+    struct nfqueue *iq = (struct nfqueue *)base;
+    uint64_t start;
+
+    if (--iq->outstanding == 0) {
+        accept_all(iq);
+    } else {
+        start = stats_now();
+        nfq_set_verdict(iq->qh, pkt_id, NF_ACCEPT, 0, NULL);
+        stats_record(STAGE_VERDICT, start, 1);
+    }
+}
+
+static void nfqueue_fini(struct input_queue *base)
+{
+    struct nfqueue *iq = (struct nfqueue *)base;
+
+    if (iq->overruns || iq->truncated)
+        log_info("Queue %d: %lu receive buffer overruns, %lu truncated "
+                "messages\n", iq->queue_num, iq->overruns, iq->truncated);
+
+    /* Do not drop packets whose verdict is still outstanding. */
+    if (iq->outstanding)
+        accept_all(iq);
+
     nfq_destroy_queue(iq->qh);
     nfq_close(iq->h);
+    free(iq->bufs);
     free(iq);
 }
+
+static const struct input_ops nfqueue_ops = {
+    .fd         = nfqueue_fd,
+    .handle     = nfqueue_handle,
+    .verdict    = nfqueue_verdict,
+    .fini       = nfqueue_fini,
+};
+
+/* Returns the file descriptor that becomes readable when packets are queued. */
+int queue_fd(struct input_queue *iq)
+{
+    return iq->ops->fd(iq);
+}
+
+/**
+ * Processes queued packets, should be called when queue_fd is readable.
+ * Returns the number of processed packets or -1 on error or at the end of the
+ * input (see queue_finished).
+ */
+int queue_handle(struct input_queue *iq)
+{
+    return iq->ops->handle(iq);
+}
+
+/**
+ * Accepts a packet for which the packet callback deferred the verdict.
+ */
+void queue_verdict(struct input_queue *iq, uint32_t pkt_id)
+{
+    iq->ops->verdict(iq, pkt_id);
+}
+
+/* Returns true if the input ended (only possible for replayed captures). */
+bool queue_finished(struct input_queue *iq)
+{
+    return iq->ops->finished && iq->ops->finished(iq);
+}
+
+void queue_fini(struct input_queue *iq)
+{
+    iq->ops->fini(iq);
+}
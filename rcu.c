@@ -0,0 +1,98 @@
+/**
+ * Quiescent-state based reclamation for data shared with the workers.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Readers (workers) access shared data (such as the policy) without locks.
+ * Between packet batches they hold no references and report a quiescent state
+ * by copying the global grace period counter. While blocked waiting for
+ * packets they are offline. A writer that replaced a pointer calls
+ * rcu_synchronize to wait until every reader has passed a quiescent state (or
+ * is offline) before freeing the old data.
+ */
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "dnsallow.h"
+
+static atomic_ulong grace_period = 1;
+
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rcu_reader *readers;
+
+void rcu_register(struct rcu_reader *reader)
+{
+    atomic_store(&reader->seen, 0);
+    pthread_mutex_lock(&readers_lock);
+    reader->next = readers;
+    readers = reader;
+    pthread_mutex_unlock(&readers_lock);
+}
+
+void rcu_unregister(struct rcu_reader *reader)
+{
+    struct rcu_reader **p;
+
+    pthread_mutex_lock(&readers_lock);
+    for (p = &readers; *p; p = &(*p)->next) {
+        if (*p == reader) {
+            *p = reader->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&readers_lock);
+}
+
+/* Called by a reader when it holds no references to shared data. */
+void rcu_quiescent(struct rcu_reader *reader)
+{
+    atomic_store(&reader->seen, atomic_load(&grace_period));
+}
+
+/* Called by a reader before blocking for an unbounded time. */
+void rcu_offline(struct rcu_reader *reader)
+{
+    atomic_store(&reader->seen, 0);
+}
+
+/* Called by a reader before accessing shared data again. */
+void rcu_online(struct rcu_reader *reader)
+{
+    rcu_quiescent(reader);
+}
+
+/* Waits until all readers stopped using data that was unpublished before. */
+void rcu_synchronize(void)
+{
+    static const struct timespec delay = { 0, 100000 };
+    struct rcu_reader *reader;
+    unsigned long gp, seen;
+
+    gp = atomic_fetch_add(&grace_period, 1) + 1;
+
+    pthread_mutex_lock(&readers_lock);
+    for (reader = readers; reader; reader = reader->next) {
+        for (;;) {
+            seen = atomic_load(&reader->seen);
+            if (seen == 0 || seen >= gp)
+                break;
+            nanosleep(&delay, NULL);
+        }
+    }
+    pthread_mutex_unlock(&readers_lock);
+}
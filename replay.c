@@ -0,0 +1,398 @@
+/**
+ * Input backend that replays DNS responses from a capture file.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "dnsallow.h"
+
+struct replay_queue {
+    struct input_queue base;
+    struct pcap_file *pcap;
+    packet_callback *pkt_callback;
+    batch_callback *batch_callback;
+    void *pkt_callback_data;
+
+    /* Readable when packets are due: an eventfd that is kept readable (as
+     * fast as possible) or a timer (recorded timing). */
+    int fd;
+    bool realtime;
+
+    /* Next packet, read ahead to know when it is due. */
+    bool have_next;
+    const unsigned char *next_pkt;
+    unsigned next_len;
+    uint64_t next_ts;
+
+    /* Offset between capture timestamps and the monotonic clock (ns). */
+    bool started;
+    uint64_t first_ts;
+    uint64_t start_time;
+
+    uint32_t next_id;
+    unsigned outstanding;
+    bool eof;
+
+    unsigned long packets;
+    unsigned long long bytes;
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Arms the timer to expire at 'due' (monotonic clock, ns). */
+static void arm_timer(struct replay_queue *rq, uint64_t due)
+{
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+    its.it_value.tv_sec = due / 1000000000;
+    its.it_value.tv_nsec = due % 1000000000;
+    /* Zero would disarm the timer. */
+    if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+        its.it_value.tv_nsec = 1;
+    if (timerfd_settime(rq->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        log_error("timerfd_settime: %s\n", strerror(errno));
+}
+
+/* Makes the fd readable such that the worker calls queue_handle. */
+static void wake(struct replay_queue *rq)
+{
+    uint64_t value = 1;
+
+    if (rq->realtime)
+        arm_timer(rq, 0);
+    else if (write(rq->fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        log_error("write eventfd: %s\n", strerror(errno));
+}
+
+/* Makes the fd no longer readable until the next wake or timer expiry. */
+static void drain(struct replay_queue *rq)
+{
+    uint64_t value;
+
+    if (read(rq->fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        log_error("read replay fd: %s\n", strerror(errno));
+}
+
+/* Reads the next packet, sets eof at the end of the capture. */
+static void read_next(struct replay_queue *rq)
+{
+    rq->have_next = pcap_next(rq->pcap, &rq->next_pkt, &rq->next_len,
+            &rq->next_ts) > 0;
+    if (!rq->have_next) {
+        rq->eof = true;
+        return;
+    }
+
+    if (!rq->started) {
+        rq->started = true;
+        rq->first_ts = rq->next_ts;
+        rq->start_time = monotonic_ns();
+    }
+    /* Packets without timestamp or out of order are not delayed. */
+    if (rq->next_ts < rq->first_ts)
+        rq->next_ts = rq->first_ts;
+}
+
+static int replay_fd(struct input_queue *base)
+{
+    struct replay_queue *rq = (struct replay_queue *)base;
+
+    return rq->fd;
+}
+
+static int replay_handle(struct input_queue *base)
+{
+    struct replay_queue *rq = (struct replay_queue *)base;
+    uint64_t now = 0;
+    int n;
+
+    if (rq->realtime) {
+        drain(rq);
+        now = monotonic_ns();
+    }
+
+    for (n = 0; n < QUEUE_BATCH_SIZE && rq->have_next; n++) {
+        if (rq->realtime &&
+                rq->start_time + (rq->next_ts - rq->first_ts) > now)
+            break;
+
+        rq->packets++;
+        rq->bytes += rq->next_len;
+        if (rq->pkt_callback(rq->next_pkt, rq->next_len, rq->next_id++,
+                    rq->pkt_callback_data))
+            rq->outstanding++;
+        read_next(rq);
+    }
+    if (n)
+        rq->batch_callback(rq->pkt_callback_data);
+
+    if (rq->eof) {
+        /* Wait for the remaining verdicts (see replay_verdict). */
+        if (rq->outstanding)
+            drain(rq);
+        return rq->outstanding ? n : -1;
+    }
+    if (rq->realtime)
+        arm_timer(rq, rq->start_time + (rq->next_ts - rq->first_ts));
+    return n;
+}
+
+static void replay_verdict(struct input_queue *base, uint32_t pkt_id)
+{
+    struct replay_queue *rq = (struct replay_queue *)base;
+    (void)pkt_id;
+
+    /* Let replay_handle report the end of the input. */
+    if (--rq->outstanding == 0 && rq->eof)
+        wake(rq);
+}
+
+static bool replay_finished(struct input_queue *base)
+{
+    struct replay_queue *rq = (struct replay_queue *)base;
+
+    return rq->eof && !rq->outstanding;
+}
+
+static void replay_fini(struct input_queue *base)
+{
+    struct replay_queue *rq = (struct replay_queue *)base;
+    double secs = (monotonic_ns() - rq->start_time) / 1e9;
+
+    if (rq->started && secs > 0)
+        log_info("Replayed %lu packets (%llu bytes) in %.3f s: %.0f packets/s, "
+                "%.1f Mbit/s\n", rq->packets, rq->bytes, secs,
+                rq->packets / secs, rq->bytes * 8 / secs / 1e6);
+    close(rq->fd);
+    pcap_close(rq->pcap);
+    free(rq);
+}
+
+static const struct input_ops replay_ops = {
+    .fd         = replay_fd,
+    .handle     = replay_handle,
+    .verdict    = replay_verdict,
+    .finished   = replay_finished,
+    .fini       = replay_fini,
+};
+
+/**
+ * Creates an input queue that passes the IP packets from a pcap or pcapng
+ * file to the callback, as fast as possible or with the recorded timing.
+ * Deferred verdicts are only counted (there is nothing to accept).
+ */
+struct input_queue *replay_init(const char *filename, bool realtime,
+        packet_callback *callback, batch_callback *batch_done,
+        void *callback_data)
+{
+    struct replay_queue *rq;
+
+    rq = calloc(1, sizeof(*rq));
+    if (!rq)
+        return NULL;
+
+    rq->base.ops = &replay_ops;
+    rq->realtime = realtime;
+    rq->pkt_callback = callback;
+    rq->batch_callback = batch_done;
+    rq->pkt_callback_data = callback_data;
+
+    rq->pcap = pcap_open(filename);
+    if (!rq->pcap)
+        goto err_pcap;
+
+    if (realtime)
+        rq->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    else
+        rq->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (rq->fd < 0) {
+        log_error("Cannot create replay timer: %s\n", strerror(errno));
+        goto err_fd;
+    }
+
+    read_next(rq);
+    wake(rq);
+    return &rq->base;
+
+err_fd:
+    pcap_close(rq->pcap);
+err_pcap:
+    free(rq);
+    return NULL;
+}
+
+/* Decisions per name, for the summary after a replay. */
+
+struct name_decision {
+    char *name;
+    unsigned long allowed;
+    unsigned long rejected;
+};
+
+struct replay_summary {
+    struct name_decision *entries;
+    unsigned size;      /* Power of two. */
+    unsigned count;
+};
+
+static uint32_t name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char)tolower((unsigned char)*name)) * 16777619;
+    return hash;
+}
+
+struct replay_summary *replay_summary_init(void)
+{
+    struct replay_summary *summary;
+
+    summary = calloc(1, sizeof(*summary));
+    if (!summary)
+        return NULL;
+    summary->size = 1024;
+    summary->entries = calloc(summary->size, sizeof(summary->entries[0]));
+    if (!summary->entries) {
+        free(summary);
+        return NULL;
+    }
+    return summary;
+}
+
+/* Doubles the table size. */
+static int grow(struct replay_summary *summary)
+{
+    struct name_decision *old = summary->entries, *e;
+    unsigned old_size = summary->size, i, j;
+
+    summary->entries = calloc(old_size * 2, sizeof(summary->entries[0]));
+    if (!summary->entries) {
+        summary->entries = old;
+        return -1;
+    }
+    summary->size = old_size * 2;
+
+    for (i = 0; i < old_size; i++) {
+        if (!old[i].name)
+            continue;
+        j = name_hash(old[i].name) & (summary->size - 1);
+        for (e = &summary->entries[j]; e->name;
+                j = (j + 1) & (summary->size - 1), e = &summary->entries[j])
+            ;
+        *e = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/* Records the policy decision for a name (compared case-insensitively). */
+void replay_summary_add(struct replay_summary *summary, const char *name,
+        bool allowed)
+{
+    struct name_decision *e;
+    unsigned i;
+
+    if (summary->count * 2 >= summary->size && grow(summary) < 0)
+        return;
+
+    i = name_hash(name) & (summary->size - 1);
+    for (;;) {
+        e = &summary->entries[i];
+        if (!e->name) {
+            e->name = strdup(name);
+            if (!e->name)
+                return;
+            summary->count++;
+            break;
+        }
+        if (!strcasecmp(e->name, name))
+            break;
+        i = (i + 1) & (summary->size - 1);
+    }
+
+    if (allowed)
+        e->allowed++;
+    else
+        e->rejected++;
+}
+
+static int compare_decisions(const void *a, const void *b)
+{
+    const struct name_decision *x = a, *y = b;
+    unsigned long nx = x->allowed + x->rejected, ny = y->allowed + y->rejected;
+
+    if (nx != ny)
+        return nx < ny ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+/**
+ * Prints the number of allowed and rejected responses per name (most frequent
+ * names first) to stdout.
+ */
+void replay_summary_print(struct replay_summary *summary)
+{
+    struct name_decision *e = summary->entries;
+    unsigned long allowed = 0, rejected = 0;
+    unsigned i, n = 0;
+
+    /* Move the used entries to the front and sort those. */
+    for (i = 0; i < summary->size; i++) {
+        if (e[i].name)
+            e[n++] = e[i];
+    }
+    for (i = n; i < summary->size; i++)
+        e[i].name = NULL;
+    qsort(e, n, sizeof(e[0]), compare_decisions);
+
+    printf("%10s %10s  %s\n", "allowed", "rejected", "name");
+    for (i = 0; i < n; i++) {
+        printf("%10lu %10lu  %s\n", e[i].allowed, e[i].rejected, e[i].name);
+        allowed += e[i].allowed;
+        rejected += e[i].rejected;
+    }
+    printf("%10lu %10lu  (total for %u names)\n", allowed, rejected, n);
+
+    /* The table is no longer a valid hash table. */
+    summary->count = n;
+}
+
+void replay_summary_fini(struct replay_summary *summary)
+{
+    unsigned i;
+
+    for (i = 0; i < summary->size; i++)
+        free(summary->entries[i].name);
+    free(summary->entries);
+    free(summary);
+}
@@ -0,0 +1,209 @@
+/**
+ * Cache of decisions for repeated DNS responses.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Resolvers return the same answer for popular names many times, only the ID
+ * and the (decreasing) TTLs differ. Such responses are recognized by their
+ * fingerprint (see dns_fingerprint) such that the previous decision can be
+ * reused without parsing the message or checking the policy again.
+ *
+ * Implementation notes:
+ *  - A hit means that there is nothing to do: either the name was rejected or
+ *    its addresses were added recently. A collision can therefore only cause
+ *    addresses to be missed, never to be added. The seed is random to make
+ *    collisions hard to provoke.
+ *  - Entries record the generations that the decision depends on. A policy
+ *    reload invalidates all entries, a new alias only rejected ones.
+ *  - An allowed response is only reused once the writer request that adds
+ *    its addresses has completed (see addrcache.c), and never if a commit
+ *    failed: the cache is then cleared.
+ *  - Set-associative: a fingerprint maps to one set of RESP_CACHE_WAYS
+ *    entries. When a set is full, the entry that expires first is replaced.
+ *  - The cache is not thread-safe, every worker has its own cache.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include "dnsallow.h"
+
+#define RESP_CACHE_WAYS     4
+
+struct resp_cache_entry {
+    uint64_t key;
+    uint32_t expires;       /* Zero for unused entries. */
+    uint32_t policy_gen;
+    uint32_t alias_gen;
+    uint32_t seq;           /* Writer request that adds the addresses. */
+    uint32_t decision;
+};
+
+struct resp_cache {
+    struct resp_cache_entry *entries;
+    unsigned set_mask;      /* Number of sets minus one. */
+    uint32_t committed;     /* Number of completed writer requests. */
+    uint64_t seed;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+static uint64_t random_seed(void)
+{
+    struct timespec ts;
+    uint64_t seed;
+
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) == sizeof(seed))
+        return seed;
+    /* Not initialized yet (early boot), better than a fixed seed. */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_nsec ^ ((uint64_t)ts.tv_sec << 32) ^ getpid();
+}
+
+/**
+ * Creates a cache for at least 'size' responses (32 bytes each).
+ */
+struct resp_cache *resp_cache_init(unsigned size)
+{
+    struct resp_cache *cache;
+    unsigned sets = 1;
+
+    while (sets * RESP_CACHE_WAYS < size)
+        sets <<= 1;
+
+    cache = calloc(1, sizeof(*cache));
+    if (!cache)
+        return NULL;
+
+    cache->entries = calloc((size_t)sets * RESP_CACHE_WAYS,
+            sizeof(*cache->entries));
+    if (!cache->entries) {
+        free(cache);
+        return NULL;
+    }
+
+    cache->set_mask = sets - 1;
+    cache->seed = random_seed();
+    return cache;
+}
+
+static inline struct resp_cache_entry *find_set(struct resp_cache *cache,
+        uint64_t key)
+{
+    return &cache->entries[(size_t)(key & cache->set_mask) * RESP_CACHE_WAYS];
+}
+
+/**
+ * Looks up the decision for a DNS message (without IP and UDP headers) to a
+ * client of the given group. The fingerprint is stored in 'key' for
+ * resp_cache_add (zero if the message cannot be cached). Returns RESP_UNKNOWN
+ * if the message must be processed.
+ */
+enum resp_decision resp_cache_lookup(struct resp_cache *cache, unsigned group,
+        const unsigned char *msg, unsigned len, uint32_t now,
+        uint32_t policy_gen, uint32_t alias_gen, uint64_t *key)
+{
+    struct resp_cache_entry *set;
+    unsigned i;
+
+    /* Groups have their own policies and sets. */
+    *key = dns_fingerprint(msg, len,
+            cache->seed ^ group * 0x9e3779b97f4a7c15ULL);
+    if (*key == 0)
+        return RESP_UNKNOWN;
+
+    set = find_set(cache, *key);
+    for (i = 0; i < RESP_CACHE_WAYS; i++) {
+        if (set[i].key != *key || set[i].expires <= now ||
+                set[i].policy_gen != policy_gen)
+            continue;
+        /* A new alias may allow a rejected name. */
+        if (set[i].decision == RESP_REJECTED && set[i].alias_gen != alias_gen)
+            break;
+        /* The addresses may not be in the set yet. */
+        if (set[i].decision == RESP_ALLOWED &&
+                (int32_t)(set[i].seq - cache->committed) > 0)
+            break;
+        cache->hits++;
+        return set[i].decision;
+    }
+
+    cache->misses++;
+    return RESP_UNKNOWN;
+}
+
+/**
+ * Remembers the decision for a message that was looked up before until
+ * 'expires' (or a change of one of the generations). An allowed decision is
+ * only used after writer request 'seq' (see writer_last_seq) was committed.
+ */
+void resp_cache_add(struct resp_cache *cache, uint64_t key,
+        enum resp_decision decision, uint32_t expires, uint32_t policy_gen,
+        uint32_t alias_gen, uint32_t seq)
+{
+    struct resp_cache_entry *set, *victim = NULL;
+    unsigned i;
+
+    if (key == 0 || decision == RESP_UNKNOWN)
+        return;
+
+    set = find_set(cache, key);
+    for (i = 0; i < RESP_CACHE_WAYS; i++) {
+        if (set[i].key == key) {
+            victim = &set[i];
+            break;
+        }
+        if (!victim || set[i].expires < victim->expires)
+            victim = &set[i];
+    }
+
+    victim->key = key;
+    victim->expires = expires;
+    victim->policy_gen = policy_gen;
+    victim->alias_gen = alias_gen;
+    victim->seq = seq;
+    victim->decision = decision;
+}
+
+/**
+ * Records that the oldest writer request in flight was completed. If its
+ * commit failed, all decisions are forgotten.
+ */
+void resp_cache_commit(struct resp_cache *cache, bool ok)
+{
+    cache->committed++;
+    if (!ok)
+        memset(cache->entries, 0, (size_t)(cache->set_mask + 1) *
+                RESP_CACHE_WAYS * sizeof(*cache->entries));
+}
+
+void resp_cache_stats(const struct resp_cache *cache, unsigned long *hits,
+        unsigned long *misses)
+{
+    *hits = cache->hits;
+    *misses = cache->misses;
+}
+
+void resp_cache_fini(struct resp_cache *cache)
+{
+    free(cache->entries);
+    free(cache);
+}
@@ -0,0 +1,106 @@
+/**
+ * Lock-free single-producer single-consumer ring buffer.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "dnsallow.h"
+
+struct ring {
+    /* Written by the producer only, kept on its own cache line. */
+    _Atomic uint32_t head;
+    char pad1[60];
+    /* Written by the consumer only. */
+    _Atomic uint32_t tail;
+    char pad2[60];
+    uint32_t mask;
+    uint32_t elem_size;
+    unsigned char *slots;
+};
+
+/**
+ * Creates a ring for at least 'size' elements (rounded up to a power of two)
+ * of elem_size bytes each.
+ */
+struct ring *ring_init(unsigned size, unsigned elem_size)
+{
+    struct ring *ring;
+    unsigned n = 1;
+
+    while (n < size)
+        n <<= 1;
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        return NULL;
+
+    ring->slots = calloc(n, elem_size);
+    if (!ring->slots) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->mask = n - 1;
+    ring->elem_size = elem_size;
+    return ring;
+}
+
+/* Returns the number of elements that fit in the ring. */
+unsigned ring_capacity(const struct ring *ring)
+{
+    return ring->mask + 1;
+}
+
+/* Copies an element into the ring (producer only). Returns false if full. */
+bool ring_push(struct ring *ring, const void *elem)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail > ring->mask)
+        return false;
+
+    memcpy(ring->slots + (size_t)(head & ring->mask) * ring->elem_size, elem,
+            ring->elem_size);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+/* Copies the oldest element out of the ring (consumer only). Returns false if
+ * the ring is empty. */
+bool ring_pop(struct ring *ring, void *elem)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail)
+        return false;
+
+    memcpy(elem, ring->slots + (size_t)(tail & ring->mask) * ring->elem_size,
+            ring->elem_size);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+void ring_fini(struct ring *ring)
+{
+    free(ring->slots);
+    free(ring);
+}
@@ -0,0 +1,197 @@
+/**
+ * Destinations for allowed addresses (ipset, nftables or memory).
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dnsallow.h"
+
+/* Only counts addresses, for dry runs and replays. */
+struct memory_sink {
+    struct addr_sink base;
+    const char *group;          /* NULL for the global sets. */
+    unsigned long pending_ipv4;
+    unsigned long pending_ipv6;
+    unsigned long added_ipv4;
+    unsigned long added_ipv6;
+};
+
+static void memory_add(struct addr_sink *base, const struct address *addr,
+        uint32_t timeout)
+{
+    struct memory_sink *ms = (struct memory_sink *)base;
+    (void)timeout;
+
+    if (addr->family == AF_INET)
+        ms->pending_ipv4++;
+    else
+        ms->pending_ipv6++;
+}
+
+static bool memory_commit(struct addr_sink *base)
+{
+    struct memory_sink *ms = (struct memory_sink *)base;
+
+    ms->added_ipv4 += ms->pending_ipv4;
+    ms->added_ipv6 += ms->pending_ipv6;
+    ms->pending_ipv4 = ms->pending_ipv6 = 0;
+    return true;
+}
+
+static void memory_fini(struct addr_sink *base)
+{
+    struct memory_sink *ms = (struct memory_sink *)base;
+
+    memory_commit(base);
+    log_info("Dry run: %lu IPv4 and %lu IPv6 addresses would have been "
+            "added%s%s\n", ms->added_ipv4, ms->added_ipv6,
+            ms->group ? " for group " : "", ms->group ? ms->group : "");
+    free(ms);
+}
+
+static const struct sink_ops memory_ops = {
+    .add        = memory_add,
+    .commit     = memory_commit,
+    .fini       = memory_fini,
+};
+
+static struct addr_sink *memory_sink_init(const char *group)
+{
+    struct memory_sink *ms;
+
+    ms = calloc(1, sizeof(*ms));
+    if (!ms)
+        return NULL;
+    ms->base.ops = &memory_ops;
+    ms->group = group;
+    return &ms->base;
+}
+
+static const struct {
+    const char *name;
+    struct addr_sink *(*init)(const char *group);
+    /* For sinks with an optional argument. */
+    struct addr_sink *(*init_arg)(const char *arg, const char *group);
+} sinks[] = {
+    { "ipset",      ipset_sink_init,    NULL },
+    { "nftables",   nft_sink_init,      NULL },
+    { "bpf",        NULL,               bpf_sink_init },
+    { "memory",     memory_sink_init,   NULL },
+};
+
+/* Finds the sink for "NAME" or "NAME:ARG", returns -1 if it is unknown. */
+static int find_sink(const char *spec, const char **arg)
+{
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+    unsigned i;
+
+    *arg = colon ? colon + 1 : NULL;
+    for (i = 0; i < sizeof(sinks) / sizeof(sinks[0]); i++) {
+        if (strlen(sinks[i].name) == len && !strncmp(sinks[i].name, spec, len))
+            return (*arg && !sinks[i].init_arg) ? -1 : (int)i;
+    }
+    return -1;
+}
+
+/* Returns true if 'spec' is a valid argument for sink_init. */
+bool sink_valid(const char *spec)
+{
+    const char *arg;
+
+    return find_sink(spec, &arg) >= 0;
+}
+
+/**
+ * Creates a sink by name: "ipset", "nftables", "bpf" or "bpf:PIN_DIR" (see
+ * bpf.c) or "memory" (nothing is added to the kernel). If 'group' is non-NULL,
+ * the sets of that client group are used instead of the global ones.
+ */
+struct addr_sink *sink_init(const char *spec, const char *group)
+{
+    const char *arg;
+    int i;
+
+    i = find_sink(spec, &arg);
+    if (i < 0) {
+        log_error("Unknown address sink: %s\n", spec);
+        return NULL;
+    }
+    return sinks[i].init_arg ? sinks[i].init_arg(arg, group) :
+        sinks[i].init(group);
+}
+
+/* Formats the name of a set: "dnsallow-FAMILY" or "dnsallow-GROUP-FAMILY". */
+void sink_set_name(char *buf, const char *group, const char *family)
+{
+    snprintf(buf, SINK_SET_NAME_SIZE, "dnsallow-%s%s%s", group ? group : "",
+            group ? "-" : "", family);
+}
+
+/**
+ * Buffers an address for addition to the set, expiring after 'timeout' seconds
+ * (zero for a permanent entry). The address is only guaranteed to be in the set
+ * after sink_commit.
+ */
+void sink_add(struct addr_sink *sink, const struct address *addr,
+        uint32_t timeout)
+{
+    sink->ops->add(sink, addr, timeout);
+}
+
+/**
+ * Appends an address to the buffer of a sink that holds 'count' addresses
+ * (with their timeouts), unless it is buffered already. Then the longer
+ * timeout is kept, zero counts as permanent. Returns the new count.
+ */
+unsigned sink_buffer_add(struct address *addrs, uint32_t *timeouts,
+        unsigned count, const struct address *addr, uint32_t timeout)
+{
+    size_t len = addr->family == AF_INET ? 4 : 16;
+    const void *key = addr->family == AF_INET ?
+        (const void *)&addr->ip4_addr : (const void *)&addr->ip6_addr;
+    const void *other;
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        other = addr->family == AF_INET ?
+            (const void *)&addrs[i].ip4_addr : (const void *)&addrs[i].ip6_addr;
+        if (addrs[i].family != addr->family || memcmp(other, key, len))
+            continue;
+        if (timeouts[i] && (!timeout || timeout > timeouts[i]))
+            timeouts[i] = timeout;
+        return count;
+    }
+    addrs[count] = *addr;
+    timeouts[count] = timeout;
+    return count + 1;
+}
+
+/* Adds all buffered addresses, returns false if some could not be added. */
+bool sink_commit(struct addr_sink *sink)
+{
+    return sink->ops->commit(sink);
+}
+
+/* Commits the remaining addresses and frees the sink. */
+void sink_fini(struct addr_sink *sink)
+{
+    sink->ops->fini(sink);
+}
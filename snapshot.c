@@ -0,0 +1,594 @@
+/**
+ * Snapshot of allowed addresses, restored into the sets on startup.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * The snapshot is a text file with one line per added address:
+ *
+ *     EXPIRES ADDRESS NAME [GROUP]
+ *
+ * EXPIRES is the time (in seconds since the epoch, such that it survives
+ * reboots) at which the set entry expires, zero for permanent entries. GROUP
+ * is the client group whose sets contain the address (see clients.c), it is
+ * omitted for the global sets. Lines are appended as addresses are committed.
+ * Of several lines for the same address and group, the one that expires last
+ * is kept (the writer never shortens the timeout of an entry). The file is
+ * compacted (duplicates and expired entries are dropped) on startup and
+ * whenever the number of appended lines exceeds the number of lines after the
+ * last compaction (plus SNAPSHOT_MIN_APPENDED).
+ *
+ * Compaction rewrites the whole file, so it runs in a separate thread to keep
+ * the writer (and thereby the verdicts) going. Meanwhile, committed lines are
+ * buffered in memory and appended afterwards.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "dnsallow.h"
+
+#define SNAPSHOT_HEADER     "# dnsallow snapshot v1\n"
+
+/* Files are not compacted before this many lines were appended. */
+#define SNAPSHOT_MIN_APPENDED   4096
+
+/* Longest line: expiry time, address, name and group. */
+#define SNAPSHOT_LINE_MAX   (20 + 1 + INET6_ADDRSTRLEN + 1 + DNS_NAME_SIZE + \
+        1 + CLIENT_GROUP_NAME_MAX + 1)
+
+struct snapshot_entry {
+    struct address addr;
+    unsigned group;
+    uint64_t expires;       /* Zero if the entry never expires. */
+    char *name;
+};
+
+/* Unexpired entries of a snapshot file, deduplicated by address. */
+struct snapshot_table {
+    struct snapshot_entry *entries;
+    unsigned count;
+    unsigned alloc;
+    unsigned *slots;        /* Index plus one of the entry, zero if free. */
+    unsigned mask;
+};
+
+/* Lines of a group that wait for the commit of their addresses. */
+struct snapshot_buffer {
+    char *data;
+    size_t len;
+    size_t alloc;
+    unsigned long lines;
+};
+
+struct snapshot {
+    char *filename;
+    const char *const *groups;  /* Names of client groups, NULL for 0. */
+    unsigned ngroups;
+    struct snapshot_buffer *pending;    /* One per group. */
+    struct snapshot_buffer committed;   /* Not yet appended to the file. */
+
+    /* The file and its line counts are protected by the lock, which is held
+     * by the compaction thread while it compacts. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool started;
+    bool compact;           /* Whether the thread must compact the file. */
+    bool stopping;
+    FILE *fp;               /* Opened for appending. */
+    unsigned long lines;    /* Number of lines in the file. */
+    unsigned long compact_at;
+};
+
+static uint64_t now_realtime(void)
+{
+    return time(NULL);
+}
+
+static inline uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static unsigned addr_hash(const struct address *addr)
+{
+    uint64_t w[2] = { 0, 0 };
+
+    if (addr->family == AF_INET)
+        memcpy(w, &addr->ip4_addr, 4);
+    else
+        memcpy(w, &addr->ip6_addr, 16);
+    return mix64(w[0] ^ mix64(w[1] + addr->family));
+}
+
+static bool addr_equal(const struct address *a, const struct address *b)
+{
+    if (a->family != b->family)
+        return false;
+    if (a->family == AF_INET)
+        return a->ip4_addr.s_addr == b->ip4_addr.s_addr;
+    return !memcmp(&a->ip6_addr, &b->ip6_addr, 16);
+}
+
+static int table_grow(struct snapshot_table *table)
+{
+    unsigned nslots = table->mask ? (table->mask + 1) * 2 : 1024;
+    struct snapshot_entry *entries;
+    unsigned *slots, i, j;
+
+    entries = realloc(table->entries, nslots / 2 * sizeof(*entries));
+    slots = calloc(nslots, sizeof(*slots));
+    if (!entries || !slots) {
+        if (entries)
+            table->entries = entries;
+        free(slots);
+        return -1;
+    }
+    table->entries = entries;
+    table->alloc = nslots / 2;
+
+    /* Rehash, the load factor is at most one half. */
+    free(table->slots);
+    table->slots = slots;
+    table->mask = nslots - 1;
+    for (i = 0; i < table->count; i++) {
+        j = (addr_hash(&entries[i].addr) ^ entries[i].group) & table->mask;
+        while (slots[j])
+            j = (j + 1) & table->mask;
+        slots[j] = i + 1;
+    }
+    return 0;
+}
+
+/* Adds or updates an entry, the later expiry time wins. */
+static int table_add(struct snapshot_table *table, const struct address *addr,
+        unsigned group, uint64_t expires, const char *name)
+{
+    struct snapshot_entry *entry;
+    unsigned i;
+    char *copy;
+
+    if (table->count == table->alloc && table_grow(table) < 0)
+        return -1;
+
+    i = (addr_hash(addr) ^ group) & table->mask;
+    for (; table->slots[i]; i = (i + 1) & table->mask) {
+        entry = &table->entries[table->slots[i] - 1];
+        if (entry->group != group || !addr_equal(&entry->addr, addr))
+            continue;
+        if (entry->expires && (!expires || expires > entry->expires)) {
+            copy = strdup(name);
+            if (!copy)
+                return -1;
+            free(entry->name);
+            entry->name = copy;
+            entry->expires = expires;
+        }
+        return 0;
+    }
+
+    entry = &table->entries[table->count];
+    entry->name = strdup(name);
+    if (!entry->name)
+        return -1;
+    entry->addr = *addr;
+    entry->group = group;
+    entry->expires = expires;
+    table->slots[i] = ++table->count;
+    return 0;
+}
+
+static void table_fini(struct snapshot_table *table)
+{
+    unsigned i;
+
+    for (i = 0; i < table->count; i++)
+        free(table->entries[i].name);
+    free(table->entries);
+    free(table->slots);
+}
+
+/* Parses "EXPIRES ADDRESS NAME [GROUP]", returns false for invalid lines. */
+static bool parse_line(char *line, struct address *addr, uint64_t *expires,
+        char **name, char **group)
+{
+    char *addr_str, *end;
+
+    *expires = strtoull(line, &end, 10);
+    if (end == line || *end != ' ')
+        return false;
+    addr_str = end + 1;
+    end = strchr(addr_str, ' ');
+    if (!end)
+        return false;
+    *end = '\0';
+    *name = end + 1;
+    (*name)[strcspn(*name, "\n")] = '\0';
+    *group = strchr(*name, ' ');
+    if (*group)
+        *(*group)++ = '\0';
+
+    if (inet_pton(AF_INET, addr_str, &addr->ip4_addr) == 1)
+        addr->family = AF_INET;
+    else if (inet_pton(AF_INET6, addr_str, &addr->ip6_addr) == 1)
+        addr->family = AF_INET6;
+    else
+        return false;
+    return true;
+}
+
+/* Returns the number of a group, or -1 if the group is unknown. */
+static int find_group(const struct snapshot *snap, const char *group)
+{
+    unsigned i;
+
+    if (!group)
+        return 0;
+    for (i = 1; i < snap->ngroups; i++) {
+        if (!strcmp(snap->groups[i], group))
+            return i;
+    }
+    return -1;
+}
+
+/* Reads the unexpired entries of a snapshot file (if it exists). */
+static int read_snapshot(const struct snapshot *snap,
+        struct snapshot_table *table, uint64_t now)
+{
+    const char *filename = snap->filename;
+    struct address addr;
+    uint64_t expires;
+    unsigned long lineno = 0;
+    char *line = NULL, *name, *group_name;
+    int group;
+    size_t size = 0;
+    FILE *fp;
+    int r = 0;
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        if (errno == ENOENT)
+            return 0;
+        log_error("Cannot open snapshot %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    while (getline(&line, &size, fp) > 0) {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (!parse_line(line, &addr, &expires, &name, &group_name)) {
+            log_warning("%s:%lu: invalid entry\n", filename, lineno);
+            continue;
+        }
+        if (expires && expires <= now)
+            continue;
+        /* Entries of removed groups are dropped. */
+        group = find_group(snap, group_name);
+        if (group < 0) {
+            log_warning("%s:%lu: unknown group %s\n", filename, lineno,
+                    group_name);
+            continue;
+        }
+        if (table_add(table, &addr, group, expires, name) < 0) {
+            log_error("Cannot allocate snapshot entries\n");
+            r = -1;
+            break;
+        }
+    }
+    free(line);
+    fclose(fp);
+    return r;
+}
+
+/* Formats the line for an entry into 'line' (SNAPSHOT_LINE_MAX bytes),
+ * returns its length. */
+static size_t format_entry(char *line, const struct address *addr,
+        uint64_t expires, const char *name, const char *group)
+{
+    char buf[INET6_ADDRSTRLEN];
+    size_t len;
+    const char *p;
+
+    inet_ntop(addr->family, addr->family == AF_INET ?
+            (const void *)&addr->ip4_addr : (const void *)&addr->ip6_addr,
+            buf, sizeof(buf));
+    len = sprintf(line, "%llu %s ", (unsigned long long)expires, buf);
+    /* Labels may contain any byte, keep the file line-based. */
+    for (p = name; *p && p - name < DNS_NAME_SIZE; p++)
+        line[len++] = (unsigned char)*p <= ' ' || *p == 0x7f ? '?' : *p;
+    if (group)
+        len += sprintf(line + len, " %s", group);
+    line[len++] = '\n';
+    return len;
+}
+
+static void write_entry(FILE *fp, const struct address *addr,
+        uint64_t expires, const char *name, const char *group)
+{
+    char line[SNAPSHOT_LINE_MAX];
+
+    fwrite(line, 1, format_entry(line, addr, expires, name, group), fp);
+}
+
+/* Replaces the file by the entries in the table, reopens it for appending. */
+static int write_snapshot(struct snapshot *snap,
+        const struct snapshot_table *table)
+{
+    char tmpname[PATH_MAX];
+    const struct snapshot_entry *entry;
+    unsigned i;
+    FILE *fp;
+
+    if (snprintf(tmpname, sizeof(tmpname), "%s.tmp", snap->filename) >=
+            (int)sizeof(tmpname)) {
+        log_error("Snapshot filename is too long\n");
+        return -1;
+    }
+    fp = fopen(tmpname, "w");
+    if (!fp) {
+        log_error("Cannot create %s: %s\n", tmpname, strerror(errno));
+        return -1;
+    }
+
+    fputs(SNAPSHOT_HEADER, fp);
+    for (i = 0; i < table->count; i++) {
+        entry = &table->entries[i];
+        write_entry(fp, &entry->addr, entry->expires, entry->name,
+                snap->groups[entry->group]);
+    }
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0 || fclose(fp) != 0 ||
+            rename(tmpname, snap->filename) < 0) {
+        log_error("Cannot write snapshot %s: %s\n", snap->filename,
+                strerror(errno));
+        unlink(tmpname);
+        return -1;
+    }
+
+    if (snap->fp)
+        fclose(snap->fp);
+    snap->fp = fopen(snap->filename, "a");
+    if (!snap->fp) {
+        log_error("Cannot open snapshot %s: %s\n", snap->filename,
+                strerror(errno));
+        return -1;
+    }
+    snap->lines = table->count;
+    snap->compact_at = 2 * table->count + SNAPSHOT_MIN_APPENDED;
+    return 0;
+}
+
+/* Drops duplicate and expired entries from the file. */
+static int compact(struct snapshot *snap, struct addr_sink *const *restore)
+{
+    struct snapshot_table table;
+    uint64_t now = now_realtime();
+    unsigned i, restored = 0;
+    uint32_t timeout;
+    int r;
+
+    memset(&table, 0, sizeof(table));
+    if (snap->fp)
+        fflush(snap->fp);
+    r = read_snapshot(snap, &table, now);
+
+    if (r == 0 && restore) {
+        for (i = 0; i < table.count; i++) {
+            if (!table.entries[i].expires)
+                timeout = 0;
+            else if (table.entries[i].expires - now > IPSET_MAX_TIMEOUT)
+                timeout = IPSET_MAX_TIMEOUT;
+            else
+                timeout = table.entries[i].expires - now;
+            sink_add(restore[table.entries[i].group], &table.entries[i].addr,
+                    timeout);
+            restored++;
+        }
+        /* All addresses are added in a single batch (per group). */
+        for (i = 0; restored && i < snap->ngroups; i++) {
+            if (!sink_commit(restore[i]))
+                log_error("Some addresses from the snapshot were not "
+                        "restored\n");
+        }
+        if (restored)
+            log_info("Restored %u addresses from %s\n", restored,
+                    snap->filename);
+    }
+
+    if (r == 0)
+        r = write_snapshot(snap, &table);
+    table_fini(&table);
+    return r;
+}
+
+/* Makes room for 'len' more bytes in a buffer. */
+static bool buffer_reserve(struct snapshot_buffer *buf, size_t len)
+{
+    size_t alloc = buf->alloc ? buf->alloc : 16 * SNAPSHOT_LINE_MAX;
+    char *data;
+
+    if (buf->len + len <= buf->alloc)
+        return true;
+    while (buf->len + len > alloc)
+        alloc *= 2;
+    data = realloc(buf->data, alloc);
+    if (!data) {
+        log_error("Cannot allocate snapshot entries\n");
+        return false;
+    }
+    buf->data = data;
+    buf->alloc = alloc;
+    return true;
+}
+
+/* Appends the committed lines to the file, the lock must be held. */
+static void append_committed(struct snapshot *snap)
+{
+    struct snapshot_buffer *buf = &snap->committed;
+
+    if (snap->fp && buf->len) {
+        fwrite(buf->data, 1, buf->len, snap->fp);
+        snap->lines += buf->lines;
+    }
+    buf->len = 0;
+    buf->lines = 0;
+}
+
+static void *compact_main(void *data)
+{
+    struct snapshot *snap = data;
+
+    pthread_mutex_lock(&snap->lock);
+    for (;;) {
+        while (!snap->compact && !snap->stopping)
+            pthread_cond_wait(&snap->cond, &snap->lock);
+        if (snap->stopping)
+            break;
+        /* On failure, retry after some more lines. */
+        if (compact(snap, NULL) < 0)
+            snap->compact_at = snap->lines + SNAPSHOT_MIN_APPENDED;
+        snap->compact = false;
+    }
+    pthread_mutex_unlock(&snap->lock);
+    return NULL;
+}
+
+/**
+ * Opens a snapshot file for appending. 'groups' are the names of the client
+ * groups (NULL for the global sets at index 0), they must stay valid until
+ * snapshot_close. If 'restore' is non-NULL, the unexpired addresses from the
+ * file are added to the sink of their group first.
+ */
+struct snapshot *snapshot_open(const char *filename,
+        const char *const *groups, unsigned ngroups,
+        struct addr_sink *const *restore)
+{
+    struct snapshot *snap;
+
+    snap = calloc(1, sizeof(*snap));
+    if (!snap)
+        return NULL;
+    snap->groups = groups;
+    snap->ngroups = ngroups;
+    snap->filename = strdup(filename);
+    snap->pending = calloc(ngroups, sizeof(*snap->pending));
+    pthread_mutex_init(&snap->lock, NULL);
+    pthread_cond_init(&snap->cond, NULL);
+    if (!snap->filename || !snap->pending || compact(snap, restore) < 0)
+        goto err;
+
+    if (pthread_create(&snap->thread, NULL, compact_main, snap)) {
+        log_error("Cannot start snapshot thread\n");
+        goto err;
+    }
+    snap->started = true;
+    return snap;
+
+err:
+    snapshot_close(snap);
+    return NULL;
+}
+
+/**
+ * Records an address that is added to the sets of a group with the given
+ * timeout (in seconds, zero for permanent entries). The entry is kept until
+ * snapshot_commit for that group.
+ */
+void snapshot_add(struct snapshot *snap, const struct address *addr,
+        unsigned group, uint32_t timeout, const char *name)
+{
+    struct snapshot_buffer *buf = &snap->pending[group];
+
+    if (!buffer_reserve(buf, SNAPSHOT_LINE_MAX))
+        return;
+    buf->len += format_entry(buf->data + buf->len, addr,
+            timeout ? now_realtime() + timeout : 0, name,
+            snap->groups[group]);
+    buf->lines++;
+}
+
+/**
+ * Keeps the entries of a group that were recorded since the last call if its
+ * addresses were committed ('ok'), drops them otherwise. The entries are
+ * buffered until snapshot_flush.
+ */
+void snapshot_commit(struct snapshot *snap, unsigned group, bool ok)
+{
+    struct snapshot_buffer *buf = &snap->pending[group];
+    struct snapshot_buffer *committed = &snap->committed;
+
+    if (ok && buf->len && buffer_reserve(committed, buf->len)) {
+        memcpy(committed->data + committed->len, buf->data, buf->len);
+        committed->len += buf->len;
+        committed->lines += buf->lines;
+    }
+    buf->len = 0;
+    buf->lines = 0;
+}
+
+/**
+ * Writes committed entries to the file and starts a compaction if it grew too
+ * large. While the file is being compacted, the entries stay buffered.
+ */
+void snapshot_flush(struct snapshot *snap)
+{
+    if (pthread_mutex_trylock(&snap->lock))
+        return;
+    append_committed(snap);
+    if (snap->fp && fflush(snap->fp) != 0)
+        log_error("Cannot write snapshot %s: %s\n", snap->filename,
+                strerror(errno));
+    if (snap->fp && snap->lines >= snap->compact_at) {
+        snap->compact = true;
+        pthread_cond_signal(&snap->cond);
+    }
+    pthread_mutex_unlock(&snap->lock);
+}
+
+void snapshot_close(struct snapshot *snap)
+{
+    unsigned i;
+
+    if (snap->started) {
+        pthread_mutex_lock(&snap->lock);
+        snap->stopping = true;
+        pthread_cond_signal(&snap->cond);
+        pthread_mutex_unlock(&snap->lock);
+        pthread_join(snap->thread, NULL);
+    }
+    append_committed(snap);
+    if (snap->fp)
+        fclose(snap->fp);
+    pthread_cond_destroy(&snap->cond);
+    pthread_mutex_destroy(&snap->lock);
+    free(snap->committed.data);
+    for (i = 0; snap->pending && i < snap->ngroups; i++)
+        free(snap->pending[i].data);
+    free(snap->pending);
+    free(snap->filename);
+    free(snap);
+}
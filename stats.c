@@ -0,0 +1,304 @@
+/**
+ * Per-thread counters and latency histograms, exported in Prometheus format.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include "dnsallow.h"
+
+/**
+ * Histograms are log-linear (like HdrHistogram): values below 2^SUB_BITS ns
+ * are exact, larger values are grouped in 2^SUB_BITS buckets per power of two
+ * (a relative error of at most 1/16). Values above 2^MAX_BITS ns (about 69 s)
+ * are put in the last bucket.
+ */
+#define SUB_BITS    4
+#define SUB_COUNT   (1 << SUB_BITS)
+#define MAX_BITS    36
+#define NBUCKETS    ((MAX_BITS - SUB_BITS + 2) * SUB_COUNT)
+
+/* Values are only written by the owning thread, but read by stats_write. */
+struct histogram {
+    _Atomic uint64_t buckets[NBUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+};
+
+struct stats {
+    _Atomic uint64_t counters[STATS_COUNTERS];
+    struct histogram stages[STATS_STAGES];
+    struct stats *next;
+};
+
+static const char *const counter_names[STATS_COUNTERS] = {
+    [STAT_PARSED]       = "parsed",
+    [STAT_REJECTED]     = "rejected",
+    [STAT_TRUNCATED]    = "truncated",
+    [STAT_PARSE_FAILED] = "parse_failed",
+    [STAT_IPSET_FAILED] = "ipset_failed",
+    [STAT_TCP_MESSAGES] = "tcp_messages",
+    [STAT_TCP_EVICTED]  = "tcp_evicted",
+    [STAT_CACHED]       = "cached",
+    [STAT_FILTERED]     = "filtered",
+    [STAT_UNMATCHED]    = "unmatched",
+    [STAT_QUERY_EVICTED] = "query_evicted",
+};
+
+static const char *const stage_names[STATS_STAGES] = {
+    [STAGE_PARSE]       = "parse",
+    [STAGE_POLICY]      = "policy",
+    [STAGE_IPSET]       = "ipset",
+    [STAGE_VERDICT]     = "verdict",
+    [STAGE_LATENCY]     = "latency",
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+/* Statistics of the current thread, NULL if statistics are disabled. */
+static __thread struct stats *thread_stats;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats *all_stats;
+
+static unsigned bucket_index(uint64_t ns)
+{
+    unsigned msb;
+
+    if (ns < SUB_COUNT)
+        return ns;
+
+    msb = 63 - __builtin_clzll(ns);
+    if (msb > MAX_BITS)
+        return NBUCKETS - 1;
+    return (msb - SUB_BITS + 1) * SUB_COUNT +
+        (unsigned)(ns >> (msb - SUB_BITS)) - SUB_COUNT;
+}
+
+/* Returns the largest value that falls in a bucket. */
+static uint64_t bucket_value(unsigned index)
+{
+    unsigned shift;
+
+    if (index < SUB_COUNT)
+        return index;
+
+    shift = index / SUB_COUNT - 1;
+    return (((uint64_t)(index % SUB_COUNT + SUB_COUNT + 1)) << shift) - 1;
+}
+
+/* Increments a value that has a single writer (avoiding a locked operation). */
+static inline void add_relaxed(_Atomic uint64_t *value, uint64_t n)
+{
+    atomic_store_explicit(value,
+            atomic_load_explicit(value, memory_order_relaxed) + n,
+            memory_order_relaxed);
+}
+
+/**
+ * Enables statistics for the calling thread. Threads that do not call this
+ * function do not record anything.
+ */
+int stats_thread_init(void)
+{
+    struct stats *stats;
+
+    stats = calloc(1, sizeof(*stats));
+    if (!stats)
+        return -1;
+
+    pthread_mutex_lock(&stats_lock);
+    stats->next = all_stats;
+    all_stats = stats;
+    pthread_mutex_unlock(&stats_lock);
+
+    thread_stats = stats;
+    return 0;
+}
+
+/* Returns a timestamp in nanoseconds, or 0 if statistics are disabled. */
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+
+    if (!thread_stats)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_count(enum stats_counter counter, unsigned n)
+{
+    if (thread_stats)
+        add_relaxed(&thread_stats->counters[counter], n);
+}
+
+/**
+ * Records 'n' events of a stage that started at 'start' (from stats_now) and
+ * ended now.
+ */
+void stats_record(enum stats_stage stage, uint64_t start, unsigned n)
+{
+    struct histogram *hist;
+    uint64_t ns;
+
+    if (!thread_stats || !n)
+        return;
+
+    ns = stats_now() - start;
+    hist = &thread_stats->stages[stage];
+    add_relaxed(&hist->buckets[bucket_index(ns)], n);
+    add_relaxed(&hist->count, n);
+    add_relaxed(&hist->sum, ns * n);
+}
+
+/* Adds the values of one thread to a (non-shared) total. */
+static void merge(struct stats *total, struct stats *stats)
+{
+    struct histogram *dst, *src;
+    unsigned i, j;
+
+    for (i = 0; i < STATS_COUNTERS; i++)
+        total->counters[i] += atomic_load(&stats->counters[i]);
+
+    for (i = 0; i < STATS_STAGES; i++) {
+        dst = &total->stages[i];
+        src = &stats->stages[i];
+        for (j = 0; j < NBUCKETS; j++)
+            dst->buckets[j] += atomic_load(&src->buckets[j]);
+        dst->count += atomic_load(&src->count);
+        dst->sum += atomic_load(&src->sum);
+    }
+}
+
+/* Returns the value (in ns) below which a fraction q of the values fall. */
+static uint64_t histogram_quantile(struct histogram *hist, double q)
+{
+    uint64_t count = 0, rank;
+    unsigned i;
+
+    /* Buckets may have been updated after count, use their own total. */
+    for (i = 0; i < NBUCKETS; i++)
+        count += hist->buckets[i];
+    if (!count)
+        return 0;
+
+    rank = q * count + 0.5;
+    if (rank < 1)
+        rank = 1;
+    for (i = 0, count = 0; i < NBUCKETS; i++) {
+        count += hist->buckets[i];
+        if (count >= rank)
+            break;
+    }
+    return bucket_value(i < NBUCKETS ? i : NBUCKETS - 1);
+}
+
+static void write_prometheus(FILE *fp, struct stats *total)
+{
+    struct histogram *hist;
+    unsigned i, j;
+
+    fprintf(fp, "# HELP dnsallow_packets_total Number of packets by result.\n"
+            "# TYPE dnsallow_packets_total counter\n");
+    for (i = 0; i < STATS_COUNTERS; i++)
+        fprintf(fp, "dnsallow_packets_total{result=\"%s\"} %llu\n",
+                counter_names[i], (unsigned long long)total->counters[i]);
+
+    fprintf(fp, "# HELP dnsallow_stage_seconds Time spent per processing "
+            "stage, latency is from receipt until the verdict.\n"
+            "# TYPE dnsallow_stage_seconds summary\n");
+    for (i = 0; i < STATS_STAGES; i++) {
+        hist = &total->stages[i];
+        for (j = 0; j < sizeof(quantiles) / sizeof(quantiles[0]); j++)
+            fprintf(fp, "dnsallow_stage_seconds{stage=\"%s\",quantile=\"%g\"}"
+                    " %.9f\n", stage_names[i], quantiles[j],
+                    histogram_quantile(hist, quantiles[j]) / 1e9);
+        fprintf(fp, "dnsallow_stage_seconds_sum{stage=\"%s\"} %.9f\n",
+                stage_names[i], hist->sum / 1e9);
+        fprintf(fp, "dnsallow_stage_seconds_count{stage=\"%s\"} %llu\n",
+                stage_names[i], (unsigned long long)hist->count);
+    }
+}
+
+/**
+ * Merges the statistics of all threads and writes them in the Prometheus text
+ * format to 'filename'. The file is replaced atomically such that a scraper
+ * (e.g. the node_exporter textfile collector) never reads a partial file.
+ */
+int stats_write(const char *filename)
+{
+    struct stats *total, *stats;
+    char tmpname[PATH_MAX];
+    FILE *fp;
+    int ret = -1;
+
+    total = calloc(1, sizeof(*total));
+    if (!total)
+        return -1;
+
+    pthread_mutex_lock(&stats_lock);
+    for (stats = all_stats; stats; stats = stats->next)
+        merge(total, stats);
+    pthread_mutex_unlock(&stats_lock);
+
+    if (snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename) >=
+            (int)sizeof(tmpname)) {
+        log_error("Statistics file name is too long\n");
+        goto out;
+    }
+
+    fp = fopen(tmpname, "w");
+    if (!fp) {
+        log_error("Cannot create %s: %s\n", tmpname, strerror(errno));
+        goto out;
+    }
+    write_prometheus(fp, total);
+    if (fclose(fp) != 0 || rename(tmpname, filename) < 0) {
+        log_error("Cannot write %s: %s\n", filename, strerror(errno));
+        unlink(tmpname);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    free(total);
+    return ret;
+}
+
+/* Frees the statistics of all threads (after they stopped). */
+void stats_fini(void)
+{
+    struct stats *stats;
+
+    pthread_mutex_lock(&stats_lock);
+    while ((stats = all_stats)) {
+        all_stats = stats->next;
+        free(stats);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    thread_stats = NULL;
+}
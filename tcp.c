@@ -0,0 +1,564 @@
+/**
+ * Reassembly of DNS messages from TCP streams.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Implementation notes:
+ *  - Flows are only tracked from the SYN (or SYN/ACK) on, such that the start
+ *    of the first length prefix (RFC 1035, section 4.2.2) is known. Every
+ *    direction is a separate flow, normally only responses are queued.
+ *  - All memory is allocated up front: a table with at most 'max_flows' flows
+ *    and a pool of fixed-size buffers for the stream data. When either is
+ *    exhausted, the least recently used flow is evicted. A single flow can
+ *    hold no more than TCP_FLOW_MAX_BUFFERS buffers (enough for the largest
+ *    message), larger backlogs indicate a broken or malicious stream.
+ *  - Buffers with in-order data are filled completely. Out-of-order segments
+ *    are kept in separate buffers (sorted by sequence number) until the gap
+ *    is filled.
+ *  - The tracker is not thread-safe, every worker has its own tracker.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dnsallow.h"
+
+/* Data per buffer, such that a buffer fits in 2 KiB. */
+#define TCP_BUFFER_DATA         (2048 - 16)
+
+/* Largest DNS message plus its length prefix, in buffers. */
+#define TCP_FLOW_MAX_BUFFERS    ((0xffff + 2 + TCP_BUFFER_DATA - 1) / \
+        TCP_BUFFER_DATA + 1)
+
+/* Segments that start further ahead are dropped. */
+#define TCP_MAX_WINDOW          (TCP_FLOW_MAX_BUFFERS * TCP_BUFFER_DATA)
+
+/* Flows without packets for this time (in seconds) are removed. */
+#define TCP_FLOW_TIMEOUT        30
+
+/* TCP header flags. */
+#define TCP_FIN     0x01
+#define TCP_SYN     0x02
+#define TCP_RST     0x04
+
+struct tcp_buffer {
+    struct tcp_buffer *next;
+    uint32_t seq;           /* Sequence number of data[0] (out-of-order). */
+    uint16_t start;         /* Data before start was consumed (in-order). */
+    uint16_t len;
+    unsigned char data[TCP_BUFFER_DATA];
+};
+
+struct tcp_key {
+    unsigned char saddr[16];
+    unsigned char daddr[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t family;
+};
+
+struct tcp_flow {
+    struct tcp_key key;
+    struct tcp_flow *hash_next;     /* Next flow in the same bucket. */
+    struct tcp_flow *lru_prev;      /* Least recently used flows first. */
+    struct tcp_flow *lru_next;
+    uint32_t isn;           /* Sequence number of the SYN. */
+    uint32_t next_seq;      /* Sequence number after the in-order data. */
+    uint32_t last_seen;
+    unsigned nbuffers;
+    unsigned stream_len;    /* Bytes in the 'stream' buffers. */
+    struct tcp_buffer *stream;      /* In-order data. */
+    struct tcp_buffer *stream_tail;
+    struct tcp_buffer *pending;     /* Out-of-order data. */
+};
+
+struct tcp_tracker {
+    struct tcp_flow *flows;
+    struct tcp_flow *free_flows;    /* Linked by hash_next. */
+    struct tcp_flow **buckets;
+    unsigned mask;                  /* Number of buckets minus one. */
+    struct tcp_flow *lru_head;
+    struct tcp_flow *lru_tail;
+    struct tcp_buffer *buffers;
+    struct tcp_buffer *free_buffers;
+    unsigned char *message;         /* A complete message (0xffff bytes). */
+    unsigned long messages;
+    unsigned long evicted;
+};
+
+/* Returns true if sequence number a comes before b. */
+static inline bool seq_before(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
+static inline uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static unsigned key_hash(const struct tcp_key *key)
+{
+    uint64_t w[4];
+
+    memcpy(w, key->saddr, 16);
+    memcpy(w + 2, key->daddr, 16);
+    return mix64(w[0] ^ mix64(w[1] ^ mix64(w[2] ^ mix64(w[3] ^
+                    ((uint64_t)key->sport << 16 | key->dport)))));
+}
+
+/**
+ * Creates a tracker for at most 'max_flows' concurrent flows, holding at most
+ * 'max_buffers' buffers of about 2 KiB with stream data.
+ */
+struct tcp_tracker *tcp_tracker_init(unsigned max_flows, unsigned max_buffers)
+{
+    struct tcp_tracker *tracker;
+    unsigned i, nbuckets = 1;
+
+    tracker = calloc(1, sizeof(*tracker));
+    if (!tracker)
+        return NULL;
+
+    while (nbuckets < max_flows)
+        nbuckets *= 2;
+    tracker->mask = nbuckets - 1;
+
+    tracker->flows = calloc(max_flows, sizeof(*tracker->flows));
+    tracker->buckets = calloc(nbuckets, sizeof(*tracker->buckets));
+    tracker->buffers = calloc(max_buffers, sizeof(*tracker->buffers));
+    tracker->message = malloc(0xffff);
+    if (!tracker->flows || !tracker->buckets || !tracker->buffers ||
+            !tracker->message) {
+        log_error("Cannot allocate TCP flow table\n");
+        tcp_tracker_fini(tracker);
+        return NULL;
+    }
+
+    for (i = max_flows; i-- > 0; ) {
+        tracker->flows[i].hash_next = tracker->free_flows;
+        tracker->free_flows = &tracker->flows[i];
+    }
+    for (i = max_buffers; i-- > 0; ) {
+        tracker->buffers[i].next = tracker->free_buffers;
+        tracker->free_buffers = &tracker->buffers[i];
+    }
+    return tracker;
+}
+
+static void free_buffers(struct tcp_tracker *tracker, struct tcp_flow *flow,
+        struct tcp_buffer *buf)
+{
+    struct tcp_buffer *next;
+
+    for (; buf; buf = next) {
+        next = buf->next;
+        buf->next = tracker->free_buffers;
+        tracker->free_buffers = buf;
+        flow->nbuffers--;
+    }
+}
+
+static void lru_unlink(struct tcp_tracker *tracker, struct tcp_flow *flow)
+{
+    if (flow->lru_prev)
+        flow->lru_prev->lru_next = flow->lru_next;
+    else
+        tracker->lru_head = flow->lru_next;
+    if (flow->lru_next)
+        flow->lru_next->lru_prev = flow->lru_prev;
+    else
+        tracker->lru_tail = flow->lru_prev;
+}
+
+static void lru_append(struct tcp_tracker *tracker, struct tcp_flow *flow)
+{
+    flow->lru_prev = tracker->lru_tail;
+    flow->lru_next = NULL;
+    if (tracker->lru_tail)
+        tracker->lru_tail->lru_next = flow;
+    else
+        tracker->lru_head = flow;
+    tracker->lru_tail = flow;
+}
+
+static void remove_flow(struct tcp_tracker *tracker, struct tcp_flow *flow)
+{
+    struct tcp_flow **pp;
+
+    pp = &tracker->buckets[key_hash(&flow->key) & tracker->mask];
+    while (*pp != flow)
+        pp = &(*pp)->hash_next;
+    *pp = flow->hash_next;
+    lru_unlink(tracker, flow);
+
+    free_buffers(tracker, flow, flow->stream);
+    free_buffers(tracker, flow, flow->pending);
+    flow->hash_next = tracker->free_flows;
+    tracker->free_flows = flow;
+}
+
+/* Removes the least recently used flow (except 'keep') to make room. */
+static bool evict_flow(struct tcp_tracker *tracker, const struct tcp_flow *keep)
+{
+    struct tcp_flow *flow = tracker->lru_head;
+
+    if (flow && flow == keep)
+        flow = flow->lru_next;
+    if (!flow)
+        return false;
+
+    remove_flow(tracker, flow);
+    tracker->evicted++;
+    stats_count(STAT_TCP_EVICTED, 1);
+    return true;
+}
+
+static void expire_flows(struct tcp_tracker *tracker, uint32_t now)
+{
+    while (tracker->lru_head &&
+            now - tracker->lru_head->last_seen > TCP_FLOW_TIMEOUT)
+        remove_flow(tracker, tracker->lru_head);
+}
+
+static struct tcp_flow *find_flow(struct tcp_tracker *tracker,
+        const struct tcp_key *key)
+{
+    struct tcp_flow *flow;
+
+    flow = tracker->buckets[key_hash(key) & tracker->mask];
+    for (; flow; flow = flow->hash_next) {
+        if (!memcmp(&flow->key, key, sizeof(*key)))
+            return flow;
+    }
+    return NULL;
+}
+
+static struct tcp_flow *add_flow(struct tcp_tracker *tracker,
+        const struct tcp_key *key, uint32_t isn)
+{
+    struct tcp_flow *flow, **bucket;
+
+    if (!tracker->free_flows && !evict_flow(tracker, NULL))
+        return NULL;
+
+    flow = tracker->free_flows;
+    tracker->free_flows = flow->hash_next;
+    memset(flow, 0, sizeof(*flow));
+    flow->key = *key;
+    flow->isn = isn;
+    flow->next_seq = isn + 1;
+
+    bucket = &tracker->buckets[key_hash(key) & tracker->mask];
+    flow->hash_next = *bucket;
+    *bucket = flow;
+    lru_append(tracker, flow);
+    return flow;
+}
+
+/* Takes a buffer from the pool, returns NULL if the flow must be dropped. */
+static struct tcp_buffer *alloc_buffer(struct tcp_tracker *tracker,
+        struct tcp_flow *flow)
+{
+    struct tcp_buffer *buf;
+
+    if (flow->nbuffers == TCP_FLOW_MAX_BUFFERS)
+        return NULL;
+    if (!tracker->free_buffers && !evict_flow(tracker, flow))
+        return NULL;
+
+    buf = tracker->free_buffers;
+    tracker->free_buffers = buf->next;
+    buf->next = NULL;
+    buf->start = buf->len = 0;
+    flow->nbuffers++;
+    return buf;
+}
+
+/* Appends in-order data to the stream. */
+static bool append_stream(struct tcp_tracker *tracker, struct tcp_flow *flow,
+        const unsigned char *data, unsigned len)
+{
+    struct tcp_buffer *buf = flow->stream_tail;
+    unsigned n;
+
+    while (len > 0) {
+        if (!buf || buf->len == TCP_BUFFER_DATA) {
+            buf = alloc_buffer(tracker, flow);
+            if (!buf)
+                return false;
+            if (flow->stream_tail)
+                flow->stream_tail->next = buf;
+            else
+                flow->stream = buf;
+            flow->stream_tail = buf;
+        }
+        n = TCP_BUFFER_DATA - buf->len;
+        if (n > len)
+            n = len;
+        memcpy(buf->data + buf->len, data, n);
+        buf->len += n;
+        flow->stream_len += n;
+        flow->next_seq += n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Keeps out-of-order data (starting at seq) until the gap is filled. */
+static bool add_pending(struct tcp_tracker *tracker, struct tcp_flow *flow,
+        uint32_t seq, const unsigned char *data, unsigned len)
+{
+    struct tcp_buffer **pp, *buf;
+    unsigned n;
+
+    while (len > 0) {
+        /* Find the first pending buffer that ends after seq. */
+        for (pp = &flow->pending;
+                *pp && !seq_before(seq, (*pp)->seq + (*pp)->len);
+                pp = &(*pp)->next)
+            ;
+        /* Skip data that is pending already (retransmissions). */
+        if (*pp && !seq_before(seq, (*pp)->seq)) {
+            n = (*pp)->seq + (*pp)->len - seq;
+            if (n > len)
+                n = len;
+            seq += n;
+            data += n;
+            len -= n;
+            continue;
+        }
+
+        n = len < TCP_BUFFER_DATA ? len : TCP_BUFFER_DATA;
+        /* Do not overlap with the next pending buffer. */
+        if (*pp && seq_before((*pp)->seq, seq + n))
+            n = (*pp)->seq - seq;
+        buf = alloc_buffer(tracker, flow);
+        if (!buf)
+            return false;
+        memcpy(buf->data, data, n);
+        buf->seq = seq;
+        buf->len = n;
+        buf->next = *pp;
+        *pp = buf;
+        seq += n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Moves pending data that has become in-order to the stream. */
+static bool merge_pending(struct tcp_tracker *tracker, struct tcp_flow *flow)
+{
+    struct tcp_buffer *buf;
+    unsigned skip;
+
+    while ((buf = flow->pending) && !seq_before(flow->next_seq, buf->seq)) {
+        flow->pending = buf->next;
+        buf->next = NULL;
+        /* Skip data that overlaps with what was received already. */
+        skip = flow->next_seq - buf->seq;
+        if (skip < buf->len && !append_stream(tracker, flow,
+                    buf->data + skip, buf->len - skip)) {
+            free_buffers(tracker, flow, buf);
+            return false;
+        }
+        free_buffers(tracker, flow, buf);
+    }
+    return true;
+}
+
+/* Copies 'len' bytes from the start of the stream to dst and consumes them. */
+static void consume_stream(struct tcp_tracker *tracker, struct tcp_flow *flow,
+        unsigned char *dst, unsigned len)
+{
+    struct tcp_buffer *buf;
+    unsigned n;
+
+    flow->stream_len -= len;
+    while (len > 0) {
+        buf = flow->stream;
+        n = buf->len - buf->start;
+        if (n > len)
+            n = len;
+        if (dst) {
+            memcpy(dst, buf->data + buf->start, n);
+            dst += n;
+        }
+        buf->start += n;
+        len -= n;
+
+        /* The last buffer is kept for subsequent data. */
+        if (buf->start == buf->len && buf->next) {
+            flow->stream = buf->next;
+            buf->next = NULL;
+            free_buffers(tracker, flow, buf);
+        } else if (buf->start == buf->len) {
+            buf->start = buf->len = 0;
+        }
+    }
+}
+
+/* Passes every complete message in the stream to the callback. */
+static void deliver_messages(struct tcp_tracker *tracker,
+        struct tcp_flow *flow, tcp_message_cb *cb, void *data)
+{
+    unsigned char prefix[2];
+    unsigned len;
+
+    while (flow->stream_len >= 2) {
+        /* The length prefix may span two buffers. */
+        if (flow->stream->len - flow->stream->start >= 2) {
+            memcpy(prefix, flow->stream->data + flow->stream->start, 2);
+        } else {
+            prefix[0] = flow->stream->data[flow->stream->start];
+            prefix[1] = flow->stream->next->data[0];
+        }
+        len = (prefix[0] << 8) | prefix[1];
+        if (flow->stream_len < 2 + len)
+            break;
+
+        consume_stream(tracker, flow, NULL, 2);
+        consume_stream(tracker, flow, tracker->message, len);
+        tracker->messages++;
+        stats_count(STAT_TCP_MESSAGES, 1);
+        if (len > 0)
+            cb(tracker->message, len, data);
+    }
+}
+
+/**
+ * Processes a TCP segment in an IP packet (offset is the start of the TCP
+ * header, as returned by parse_ip). For every DNS message that is completed
+ * by this segment, cb is called with the message (without length prefix).
+ * 'now' is a monotonic time in seconds.
+ */
+void tcp_track(struct tcp_tracker *tracker, const unsigned char *buf,
+        unsigned buflen, unsigned offset, uint32_t now, tcp_message_cb *cb,
+        void *data)
+{
+    struct tcp_key key;
+    struct tcp_flow *flow;
+    unsigned end, hdrlen, len, skip;
+    uint32_t seq;
+    uint8_t flags;
+    bool ok;
+
+    /* The end of the IP packet, excluding padding (in captures). */
+    if ((buf[0] >> 4) == 4)
+        end = (buf[2] << 8) | buf[3];
+    else
+        end = 40 + ((buf[4] << 8) | buf[5]);
+    if (end > buflen || end < offset + 20)
+        return;
+    hdrlen = (buf[offset + 12] >> 4) * 4;
+    if (hdrlen < 20 || end - offset < hdrlen)
+        return;
+
+    memset(&key, 0, sizeof(key));
+    if ((buf[0] >> 4) == 4) {
+        key.family = AF_INET;
+        memcpy(key.saddr, buf + 12, 4);
+        memcpy(key.daddr, buf + 16, 4);
+    } else {
+        key.family = AF_INET6;
+        memcpy(key.saddr, buf + 8, 16);
+        memcpy(key.daddr, buf + 24, 16);
+    }
+    key.sport = (buf[offset] << 8) | buf[offset + 1];
+    key.dport = (buf[offset + 2] << 8) | buf[offset + 3];
+    seq = ((uint32_t)buf[offset + 4] << 24) | (buf[offset + 5] << 16) |
+        (buf[offset + 6] << 8) | buf[offset + 7];
+    flags = buf[offset + 13];
+    len = end - offset - hdrlen;
+
+    expire_flows(tracker, now);
+
+    flow = find_flow(tracker, &key);
+    if (flags & TCP_RST) {
+        if (flow)
+            remove_flow(tracker, flow);
+        return;
+    }
+    if (flags & TCP_SYN) {
+        /* A new connection may reuse the addresses and ports. */
+        if (flow && flow->isn != seq) {
+            remove_flow(tracker, flow);
+            flow = NULL;
+        }
+        if (!flow)
+            flow = add_flow(tracker, &key, seq);
+        if (!flow)
+            return;
+        seq++;      /* SYN takes one sequence number. */
+    }
+    if (!flow)
+        return;
+
+    flow->last_seen = now;
+    lru_unlink(tracker, flow);
+    lru_append(tracker, flow);
+
+    /* Trim data that was received before (retransmissions). */
+    buf += offset + hdrlen;
+    if (seq_before(seq, flow->next_seq)) {
+        skip = flow->next_seq - seq;
+        buf += skip < len ? skip : len;
+        len -= skip < len ? skip : len;
+        seq = flow->next_seq;
+    }
+
+    ok = true;
+    if (len > 0 && seq == flow->next_seq)
+        ok = append_stream(tracker, flow, buf, len) &&
+            merge_pending(tracker, flow);
+    else if (len > 0 && seq - flow->next_seq < TCP_MAX_WINDOW)
+        ok = add_pending(tracker, flow, seq, buf, len);
+    if (!ok) {
+        /* The flow exceeded its limits, the stream cannot be recovered. */
+        remove_flow(tracker, flow);
+        tracker->evicted++;
+        stats_count(STAT_TCP_EVICTED, 1);
+        return;
+    }
+
+    deliver_messages(tracker, flow, cb, data);
+    if (flags & TCP_FIN)
+        remove_flow(tracker, flow);
+}
+
+void tcp_tracker_stats(const struct tcp_tracker *tracker,
+        unsigned long *messages, unsigned long *evicted)
+{
+    *messages = tracker->messages;
+    *evicted = tracker->evicted;
+}
+
+void tcp_tracker_fini(struct tcp_tracker *tracker)
+{
+    free(tracker->flows);
+    free(tracker->buckets);
+    free(tracker->buffers);
+    free(tracker->message);
+    free(tracker);
+}
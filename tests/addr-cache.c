@@ -0,0 +1,119 @@
+/**
+ * Test for the cache of recently added addresses.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "dnsallow.h"
+
+static struct address make_address(int family, const char *addrstr)
+{
+    struct address addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.family = family;
+    inet_pton(family, addrstr, family == AF_INET ?
+            (void *)&addr.ip4_addr : (void *)&addr.ip6_addr);
+    return addr;
+}
+
+int main(void)
+{
+    struct addr_cache *cache;
+    struct address addr4, addr6, other;
+    unsigned long hits, misses;
+    unsigned i;
+
+    cache = addr_cache_init(16);
+    if (!cache) {
+        fprintf(stderr, "Failed: cannot create cache\n");
+        return 1;
+    }
+
+    addr4 = make_address(AF_INET, "192.0.2.1");
+    addr6 = make_address(AF_INET6, "2001:db8::1");
+
+    if (addr_cache_check(cache, &addr4, 0, 1000, 60, 1) != ADDR_MISSING ||
+            addr_cache_check(cache, &addr6, 0, 1000, 60, 1) != ADDR_MISSING) {
+        fprintf(stderr, "Failed: unexpected hit in empty cache\n");
+        return 1;
+    }
+
+    /* Addresses are only present once their request was committed. */
+    if (addr_cache_check(cache, &addr4, 0, 1000, 60, 2) != ADDR_PENDING) {
+        fprintf(stderr, "Failed: expected address to be pending\n");
+        return 1;
+    }
+    addr_cache_commit(cache, true);
+    if (addr_cache_check(cache, &addr4, 0, 1030, 60, 2) != ADDR_PRESENT ||
+            addr_cache_check(cache, &addr6, 0, 1030, 60, 2) != ADDR_PRESENT) {
+        fprintf(stderr, "Failed: expected hit\n");
+        return 1;
+    }
+
+    /* Entries must be refreshed when less than half of the lifetime remains
+     * and are then remembered again. They remain present meanwhile. */
+    if (addr_cache_check(cache, &addr4, 0, 1031, 60, 2) != ADDR_MISSING ||
+            addr_cache_check(cache, &addr4, 0, 1031, 60, 2) != ADDR_PRESENT) {
+        fprintf(stderr, "Failed: expected entry to be refreshed\n");
+        return 1;
+    }
+
+    /* After a failed commit, addresses must be added again. */
+    addr_cache_commit(cache, false);
+    if (addr_cache_check(cache, &addr6, 0, 1031, 60, 3) != ADDR_MISSING) {
+        fprintf(stderr, "Failed: expected cache to be cleared\n");
+        return 1;
+    }
+
+    /* The cache is bounded, filling it must not fail. */
+    for (i = 0; i < 1000; i++) {
+        char addrstr[32];
+
+        snprintf(addrstr, sizeof(addrstr), "10.0.%u.%u", i >> 8, i & 0xff);
+        other = make_address(AF_INET, addrstr);
+        addr_cache_check(cache, &other, 0, 1061, 60, 3);
+    }
+
+    addr_cache_stats(cache, &hits, &misses);
+    if (hits != 4 || misses != 1004) {
+        fprintf(stderr, "Failed: unexpected stats %lu/%lu\n", hits, misses);
+        return 1;
+    }
+
+    addr_cache_fini(cache);
+
+    /* Timeouts are extended, never shortened. */
+    cache = addr_cache_init(16);
+    if (!cache) {
+        fprintf(stderr, "Failed: cannot create cache\n");
+        return 1;
+    }
+    if (addr_cache_extend(cache, &addr4, 0, 1000, 600) != 600 ||
+            addr_cache_extend(cache, &addr4, 0, 1100, 60) != 500 ||
+            addr_cache_extend(cache, &addr4, 1, 1100, 60) != 60 ||
+            addr_cache_extend(cache, &addr4, 0, 1200, 600) != 600 ||
+            addr_cache_extend(cache, &addr4, 0, 1200, 0) != 0 ||
+            addr_cache_extend(cache, &addr4, 0, 1300, 60) != 0) {
+        fprintf(stderr, "Failed: wrong timeout for extended entry\n");
+        return 1;
+    }
+    addr_cache_fini(cache);
+
+    puts("Passed");
+    return 0;
+}
@@ -0,0 +1,562 @@
+/**
+ * Microbenchmarks for packet parsing and policy checks.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Every benchmark runs for at least MIN_TIME_NS per round, the median of
+ * ROUNDS rounds is reported. Allocations are counted by wrapping malloc and
+ * friends (link with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc).
+ *
+ * Usage: bench [FILTER] - only runs benchmarks whose name contains FILTER.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "dnsallow.h"
+
+#define ROUNDS          5
+#define MIN_TIME_NS     200000000ULL
+
+/* Number of rules in the large policy. */
+#define POLICY_RULES    200000
+
+static unsigned long allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    allocations++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+struct packet {
+    unsigned char buf[1500];
+    unsigned len;
+    unsigned dns_offset;    /* Start of the DNS message. */
+    unsigned name_offset;   /* Name to parse for the parse_name benchmark. */
+};
+
+/* A set of packets, processed round robin. */
+struct corpus {
+    struct packet *packets;
+    unsigned count;
+};
+
+/* Names to check against the policy. */
+struct name_list {
+    char (*names)[256];
+    unsigned count;
+};
+
+/* Prevents the compiler from optimizing away results. */
+static volatile unsigned sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Packet construction. */
+
+static void put16(struct packet *pkt, unsigned value)
+{
+    pkt->buf[pkt->len++] = value >> 8;
+    pkt->buf[pkt->len++] = value;
+}
+
+static void put32(struct packet *pkt, uint32_t value)
+{
+    put16(pkt, value >> 16);
+    put16(pkt, value);
+}
+
+static void put_bytes(struct packet *pkt, const void *data, unsigned len)
+{
+    memcpy(pkt->buf + pkt->len, data, len);
+    pkt->len += len;
+}
+
+/* Writes an uncompressed name in wire format. */
+static void put_name(struct packet *pkt, const char *name)
+{
+    const char *dot;
+    unsigned len;
+
+    while (*name) {
+        dot = strchr(name, '.');
+        len = dot ? (unsigned)(dot - name) : strlen(name);
+        pkt->buf[pkt->len++] = len;
+        put_bytes(pkt, name, len);
+        name += len + (dot ? 1 : 0);
+    }
+    pkt->buf[pkt->len++] = 0;
+}
+
+/* Writes an IP and UDP header for a response from port 53, the DNS message
+ * follows and the lengths are fixed up by finish_packet. */
+static void start_packet(struct packet *pkt, int ipv6)
+{
+    static const unsigned char ipv4_hdr[] = {
+        0x45, 0x00, 0x00, 0x00, 0x12, 0x34, 0x00, 0x00, 0x40, 0x11, 0x00, 0x00,
+        0x08, 0x08, 0x08, 0x08, 0x0a, 0x00, 0x00, 0x02,
+    };
+    static const unsigned char ipv6_hdr[] = {
+        0x60, 0x00, 0x00, 0x00, 0x00, 0x00, 0x11, 0x40,
+        0x20, 0x01, 0x48, 0x60, 0x48, 0x60, 0, 0, 0, 0, 0, 0, 0, 0, 0x88, 0x88,
+        0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02,
+    };
+
+    pkt->len = 0;
+    if (ipv6)
+        put_bytes(pkt, ipv6_hdr, sizeof(ipv6_hdr));
+    else
+        put_bytes(pkt, ipv4_hdr, sizeof(ipv4_hdr));
+    put16(pkt, 53);
+    put16(pkt, 40000);
+    put32(pkt, 0);          /* Length and checksum, set later. */
+    pkt->dns_offset = pkt->len;
+}
+
+static void finish_packet(struct packet *pkt)
+{
+    unsigned udp_len = pkt->len - pkt->dns_offset + 8;
+    unsigned char *udp = pkt->buf + pkt->dns_offset - 8;
+
+    if ((pkt->buf[0] >> 4) == 6) {
+        pkt->buf[4] = udp_len >> 8;
+        pkt->buf[5] = udp_len;
+    } else {
+        pkt->buf[2] = pkt->len >> 8;
+        pkt->buf[3] = pkt->len;
+    }
+    udp[4] = udp_len >> 8;
+    udp[5] = udp_len;
+}
+
+static void put_header(struct packet *pkt, unsigned ancount)
+{
+    put16(pkt, 0xbeef);     /* ID */
+    put16(pkt, 0x8180);     /* Response, RD, RA */
+    put16(pkt, 1);
+    put16(pkt, ancount);
+    put16(pkt, 0);
+    put16(pkt, 0);
+}
+
+/* Question section, returns the offset of the name in the DNS message. */
+static unsigned put_question(struct packet *pkt, const char *qname,
+        unsigned qtype)
+{
+    unsigned offset = pkt->len - pkt->dns_offset;
+
+    put_name(pkt, qname);
+    put16(pkt, qtype);
+    put16(pkt, 1);
+    return offset;
+}
+
+static void put_rr(struct packet *pkt, unsigned owner_ptr, unsigned type,
+        uint32_t ttl, const void *rdata, unsigned rdlength)
+{
+    put16(pkt, 0xc000 | owner_ptr);
+    put16(pkt, type);
+    put16(pkt, 1);
+    put32(pkt, ttl);
+    put16(pkt, rdlength);
+    put_bytes(pkt, rdata, rdlength);
+}
+
+/* A simple response with 'n' A or AAAA records for the question name. */
+static void build_simple(struct packet *pkt, int ipv6, const char *qname,
+        unsigned type, unsigned n)
+{
+    unsigned char addr[16] = { 0x20, 0x01, 0x0d, 0xb8 };
+    unsigned qoff, i;
+
+    start_packet(pkt, ipv6);
+    put_header(pkt, n);
+    qoff = put_question(pkt, qname, type);
+    for (i = 0; i < n; i++) {
+        addr[type == 1 ? 3 : 15] = i + 1;
+        put_rr(pkt, qoff, type, 300, addr, type == 1 ? 4 : 16);
+    }
+    pkt->name_offset = qoff;
+    finish_packet(pkt);
+}
+
+/**
+ * A CDN-style response: a chain of 'ncnames' CNAMEs (each target shares a
+ * suffix with the previous name through compression) followed by 'n' A
+ * records for the last target.
+ */
+static void build_cname_chain(struct packet *pkt, int ipv6, const char *qname,
+        unsigned ncnames, unsigned n)
+{
+    unsigned char rdata[64], addr[4] = { 192, 0, 2, 0 };
+    unsigned owner, suffix, i;
+
+    start_packet(pkt, ipv6);
+    put_header(pkt, ncnames + n);
+    owner = put_question(pkt, qname, 1);
+    pkt->name_offset = owner;
+    for (i = 0; i < ncnames; i++) {
+        /* "eN" followed by a pointer to the owner name (skipping its first
+         * label), such that every step adds a level of indirection. */
+        rdata[0] = 2;
+        rdata[1] = 'e';
+        rdata[2] = '0' + i % 10;
+        suffix = owner + 1 + pkt->buf[pkt->dns_offset + owner];
+        rdata[3] = 0xc0 | suffix >> 8;
+        rdata[4] = suffix;
+        /* The target follows the fixed part of the record. */
+        suffix = pkt->len - pkt->dns_offset + 12;
+        put_rr(pkt, owner, 5, 300, rdata, 5);
+        owner = pkt->name_offset = suffix;
+    }
+    for (i = 0; i < n; i++) {
+        addr[3] = i + 1;
+        put_rr(pkt, owner, 1, 60, addr, 4);
+    }
+    finish_packet(pkt);
+}
+
+static void build_corpus(struct corpus *corpus)
+{
+    static struct packet packets[6];
+
+    /* example.com A (a typical small response). */
+    build_simple(&packets[0], 0, "example.com", 1, 1);
+    /* AAAA over IPv6. */
+    build_simple(&packets[1], 1, "www.example.org", 28, 2);
+    /* Many records for a single name. */
+    build_simple(&packets[2], 0, "pool.ntp.example.net", 1, 8);
+    /* CDN with CNAMEs. */
+    build_cname_chain(&packets[3], 0, "www.shop.example.com", 2, 4);
+    build_cname_chain(&packets[4], 1,
+            "static.assets.images.cdn.provider.example.co.uk", 7, 2);
+    /* Long uncompressed name. */
+    build_simple(&packets[5], 0, "a-rather-long-label-for-benchmarking."
+            "another-label.and-another-one.yet-more-labels.example.com", 1, 1);
+
+    corpus->packets = packets;
+    corpus->count = sizeof(packets) / sizeof(packets[0]);
+}
+
+/* Only the compression-heavy packets, for parse_name. */
+static void build_name_corpus(struct corpus *corpus)
+{
+    static struct packet packets[2];
+
+    build_cname_chain(&packets[0], 0,
+            "static.assets.images.cdn.provider.example.co.uk", 7, 0);
+    build_cname_chain(&packets[1], 0, "a.b.c.d.e.f.g.h.example.com", 7, 0);
+
+    corpus->packets = packets;
+    corpus->count = sizeof(packets) / sizeof(packets[0]);
+}
+
+/* Ensures that the benchmarks measure the successful paths. */
+static void verify_corpus(const struct corpus *corpus,
+        const struct corpus *name_corpus)
+{
+    const struct packet *pkt;
+    struct dns_view view;
+    struct dns_info info;
+    char name[DNS_NAME_SIZE];
+    unsigned i;
+
+    for (i = 0; i < corpus->count; i++) {
+        pkt = &corpus->packets[i];
+        if (parse_ip_dns(pkt->buf, pkt->len, &view, &info) != 1) {
+            fprintf(stderr, "Corpus packet %u cannot be parsed\n", i);
+            exit(1);
+        }
+    }
+    for (i = 0; i < name_corpus->count; i++) {
+        pkt = &name_corpus->packets[i];
+        if (!parse_name(pkt->buf + pkt->dns_offset,
+                    pkt->len - pkt->dns_offset, pkt->name_offset, name,
+                    NULL)) {
+            fprintf(stderr, "Corpus name %u cannot be parsed\n", i);
+            exit(1);
+        }
+    }
+}
+
+/* Benchmarked operations, each processes one item and returns a value that is
+ * accumulated in 'sink'. */
+
+static unsigned op_parse_ip(void *data, unsigned i)
+{
+    struct corpus *corpus = data;
+    struct packet *pkt = &corpus->packets[i % corpus->count];
+    uint8_t protocol;
+
+    return parse_ip(pkt->buf, pkt->len, &protocol) + protocol;
+}
+
+static unsigned op_parse_name(void *data, unsigned i)
+{
+    struct corpus *corpus = data;
+    struct packet *pkt = &corpus->packets[i % corpus->count];
+    char name[DNS_NAME_SIZE];
+    struct dns_labels labels;
+
+    return parse_name(pkt->buf + pkt->dns_offset, pkt->len - pkt->dns_offset,
+            pkt->name_offset, name, &labels) + labels.hash[0];
+}
+
+static unsigned op_parse_dns(void *data, unsigned i)
+{
+    struct corpus *corpus = data;
+    struct packet *pkt = &corpus->packets[i % corpus->count];
+    struct dns_view view;
+    struct dns_info info;
+
+    return parse_dns(pkt->buf + pkt->dns_offset, pkt->len - pkt->dns_offset,
+            &view, &info) + info.count;
+}
+
+/* Only the header and question, the cost for names that are rejected. */
+static unsigned op_parse_dns_view(void *data, unsigned i)
+{
+    struct corpus *corpus = data;
+    struct packet *pkt = &corpus->packets[i % corpus->count];
+    struct dns_view view;
+
+    return parse_dns_view(pkt->buf + pkt->dns_offset,
+            pkt->len - pkt->dns_offset, &view) + view.labels.count;
+}
+
+static unsigned op_parse_ip_dns(void *data, unsigned i)
+{
+    struct corpus *corpus = data;
+    struct packet *pkt = &corpus->packets[i % corpus->count];
+    struct dns_view view;
+    struct dns_info info;
+
+    return parse_ip_dns(pkt->buf, pkt->len, &view, &info) + info.count;
+}
+
+struct resp_cache_bench {
+    struct corpus *corpus;
+    struct resp_cache *cache;
+};
+
+/* The cost for repeated responses (all packets are in the cache). */
+static unsigned op_resp_cache(void *data, unsigned i)
+{
+    struct resp_cache_bench *rb = data;
+    struct packet *pkt = &rb->corpus->packets[i % rb->corpus->count];
+    uint64_t key;
+
+    return resp_cache_lookup(rb->cache, 0, pkt->buf + pkt->dns_offset,
+            pkt->len - pkt->dns_offset, 1, 0, 0, &key);
+}
+
+struct policy_bench {
+    struct policy *policy;
+    struct name_list names;
+};
+
+static unsigned op_policy_check(void *data, unsigned i)
+{
+    struct policy_bench *pb = data;
+
+    return policy_check(pb->policy, pb->names.names[i % pb->names.count]);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void run(const char *filter, const char *name,
+        unsigned (*op)(void *, unsigned), void *data)
+{
+    double ns_per_op[ROUNDS];
+    unsigned long allocs = 0;
+    uint64_t start, elapsed, n, iterations;
+    unsigned round, acc = 0;
+
+    if (filter && !strstr(name, filter))
+        return;
+
+    /* Warm up and determine the iterations per round. */
+    iterations = 1000;
+    for (;;) {
+        start = now_ns();
+        for (n = 0; n < iterations; n++)
+            acc += op(data, n);
+        elapsed = now_ns() - start;
+        if (elapsed >= MIN_TIME_NS / 10)
+            break;
+        iterations *= 4;
+    }
+    iterations = iterations * (MIN_TIME_NS / (elapsed ? elapsed : 1) + 1);
+
+    for (round = 0; round < ROUNDS; round++) {
+        allocs = allocations;
+        start = now_ns();
+        for (n = 0; n < iterations; n++)
+            acc += op(data, n);
+        elapsed = now_ns() - start;
+        allocs = allocations - allocs;
+        ns_per_op[round] = (double)elapsed / iterations;
+    }
+    sink = acc;
+
+    qsort(ns_per_op, ROUNDS, sizeof(ns_per_op[0]), compare_double);
+    printf("%-26s %10.1f ns/op %12.0f ops/s %8.3f allocs/op\n", name,
+            ns_per_op[ROUNDS / 2], 1e9 / ns_per_op[ROUNDS / 2],
+            (double)allocs / iterations);
+}
+
+/* Creates a policy file with POLICY_RULES rules and a mix of names that are
+ * allowed (exact and wildcard matches) and rejected. */
+static struct policy *load_large_policy(struct name_list *names)
+{
+    char filename[] = "/tmp/dnsallow-bench-XXXXXX";
+    struct policy *policy;
+    unsigned i;
+    FILE *fp;
+    int fd;
+
+    fd = mkstemp(filename);
+    if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+        perror("Cannot create policy file");
+        exit(1);
+    }
+    for (i = 0; i < POLICY_RULES; i++) {
+        if (i % 4 == 0)
+            fprintf(fp, "*.zone%u.example.net\n", i);
+        else
+            fprintf(fp, "host%u.site%u.example.com\n", i, i % 977);
+    }
+    fclose(fp);
+
+    policy = policy_init(filename);
+    unlink(filename);
+    if (!policy)
+        exit(1);
+
+    names->count = 1024;
+    names->names = calloc(names->count, sizeof(names->names[0]));
+    if (!names->names)
+        exit(1);
+    for (i = 0; i < names->count; i++) {
+        /* Spread over the rule set using a multiplicative hash. */
+        unsigned r = (i * 2654435761u) % POLICY_RULES;
+
+        switch (i % 4) {
+        case 0:
+            snprintf(names->names[i], 256, "cdn.www.zone%u.example.net",
+                    r & ~3u);
+            break;
+        case 1:
+            snprintf(names->names[i], 256, "host%u.site%u.example.com",
+                    r | 1, (r | 1) % 977);
+            break;
+        case 2:
+            snprintf(names->names[i], 256, "missing%u.site%u.example.com",
+                    r, r % 977);
+            break;
+        default:
+            snprintf(names->names[i], 256, "www.unknown%u.example.org", r);
+            break;
+        }
+    }
+    return policy;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = argc > 1 ? argv[1] : NULL;
+    struct corpus corpus, name_corpus;
+    struct policy_bench pb;
+    struct resp_cache_bench rb;
+    uint64_t key;
+    static const char *decoders[] = { "scalar", "sse2", "avx2" };
+    const char *best_decoder = "scalar";
+    char title[32];
+    unsigned i;
+
+    build_corpus(&corpus);
+    build_name_corpus(&name_corpus);
+    verify_corpus(&corpus, &name_corpus);
+    for (i = 0; i < sizeof(decoders) / sizeof(decoders[0]); i++) {
+        if (name_set_decoder(decoders[i]) == 0)
+            best_decoder = decoders[i];
+    }
+
+    run(filter, "parse_ip", op_parse_ip, &corpus);
+    run(filter, "parse_name/compressed", op_parse_name, &name_corpus);
+    for (i = 0; i < sizeof(decoders) / sizeof(decoders[0]); i++) {
+        snprintf(title, sizeof(title), "parse_name/%s", decoders[i]);
+        if (name_set_decoder(decoders[i]) == 0)
+            run(filter, title, op_parse_name, &name_corpus);
+    }
+    name_set_decoder(best_decoder);
+    run(filter, "parse_dns", op_parse_dns, &corpus);
+    run(filter, "parse_dns_view", op_parse_dns_view, &corpus);
+    run(filter, "parse_ip_dns", op_parse_ip_dns, &corpus);
+
+    rb.corpus = &corpus;
+    rb.cache = resp_cache_init(64);
+    if (!rb.cache)
+        return 1;
+    for (i = 0; i < corpus.count; i++) {
+        resp_cache_lookup(rb.cache, 0, corpus.packets[i].buf +
+                corpus.packets[i].dns_offset, corpus.packets[i].len -
+                corpus.packets[i].dns_offset, 1, 0, 0, &key);
+        resp_cache_add(rb.cache, key, RESP_ALLOWED, 2, 0, 0, 0);
+    }
+    run(filter, "resp_cache_lookup", op_resp_cache, &rb);
+    resp_cache_fini(rb.cache);
+
+    if (!filter || strstr("policy_check/200k", filter)) {
+        pb.policy = load_large_policy(&pb.names);
+        run(filter, "policy_check/200k", op_policy_check, &pb);
+        policy_fini(pb.policy);
+        free(pb.names.names);
+    }
+    return 0;
+}
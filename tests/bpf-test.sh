@@ -0,0 +1,98 @@
+#!/bin/bash
+# Integration test for the BPF sink and the reference tc program, using a veth
+# pair to a peer in another network namespace. Run it in a clean netns, e.g.
+#     sudo unshare -n tests/bpf-test.sh
+# Assumes that dnsallow is in ./dnsallow (override with DNSALLOW envvar) and
+# that the program was built with "make bpf".
+#
+# Resources that are modified during the test:
+# - netns: creates dnsallow-peer
+# - BPF maps: pins dnsallow_v4 and dnsallow_v6 in /sys/fs/bpf/tc/globals
+# - nfqueue: consumes queue 53
+# - dnsmasq: binds to port 53
+# - iptables: inserts a temporary rule
+
+set -e -u
+xcmds=(:)
+cleanup() {
+    local exitcode=$?
+    echo "Exit code: $?"
+    for cmd in "${xcmds[@]}"; do
+        eval "$cmd" || echo "Failed: $cmd"
+    done
+    return $?
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $1" >&2
+    exit 1
+}
+
+
+# Config
+QUEUE_NUM=53
+PEER_NS=dnsallow-peer
+PIN_DIR=/sys/fs/bpf/tc/globals
+: "${DNSALLOW:=./dnsallow}"
+: "${BPF_PROG:=bpf/dnsallow.bpf.o}"
+
+
+# Sanity check
+which "$DNSALLOW" >/dev/null || fail "dnsallow binary not found at $DNSALLOW"
+[ -e "$BPF_PROG" ] || fail "BPF program not found at $BPF_PROG"
+if [ -e "$PIN_DIR/dnsallow_v4" ]; then
+    fail "BPF maps already exist, try to run in a clean netns!"
+fi
+mountpoint -q /sys/fs/bpf || mount -t bpf bpf /sys/fs/bpf
+
+# Peer at 10.53.0.2, reachable over veth0 (10.53.0.1).
+ip netns add $PEER_NS || fail "Failed to create netns"
+xcmds+=("ip netns del $PEER_NS")
+ip link add veth0 type veth peer name veth1 netns $PEER_NS
+ip addr add 10.53.0.1/24 dev veth0
+ip link set veth0 up
+ip link set lo up
+ip -n $PEER_NS addr add 10.53.0.2/24 dev veth1
+ip -n $PEER_NS link set veth1 up
+
+# Enforce the allowlist on egress of veth0 (this pins the maps).
+tc qdisc add dev veth0 clsact
+tc filter add dev veth0 egress bpf direct-action obj "$BPF_PROG" sec tc ||
+    fail "Failed to load $BPF_PROG"
+xcmds+=("rm -f $PIN_DIR/dnsallow_v4 $PIN_DIR/dnsallow_v6")
+ping -c1 -W1 10.53.0.2 >/dev/null && fail "Peer reachable before resolving"
+
+# Dnsmasq state configuration
+tmpdir=$(mktemp -d)
+hostsfile="$tmpdir/hosts"
+policyfile="$tmpdir/policy"
+dm_pidfile="$tmpdir/dnsmasq.pid"
+xcmds+=("$(printf 'pkill -F %q' "$dm_pidfile")")
+xcmds+=("$(printf 'rm -rf %q' "$tmpdir")")
+cat >"$hostsfile" <<HOSTS
+10.53.0.2   peer.test
+HOSTS
+cat >"$policyfile" <<POLICY
+peer.test
+POLICY
+dnsmasq \
+    --log-facility=/dev/null --pid-file="$dm_pidfile" --no-hosts --no-resolv \
+    --listen-address=127.0.0.53 --no-dhcp-interface= --bind-interfaces \
+    --addn-hosts="$hostsfile" || fail "Failed to start dnsmasq"
+
+# Start daemon under test
+"$DNSALLOW" --policy "$policyfile" --sink bpf:$PIN_DIR & xcmds+=("kill $!")
+sleep .1
+
+iptables -I INPUT 1 -p udp --sport 53 -j NFQUEUE --queue-num $QUEUE_NUM ||
+    fail "Failed to configure iptables"
+xcmds+=("iptables -D INPUT -p udp --sport 53 -j NFQUEUE --queue-num $QUEUE_NUM")
+
+addr=$(dig @127.0.0.53 peer.test A +short)
+[[ "$addr" == 10.53.0.2 ]] || fail "Unexpected result: $addr"
+ping -c1 -W1 10.53.0.2 >/dev/null || fail "Peer not reachable after resolving"
+
+# Cleanup and show results
+trap '' EXIT; cleanup
+echo PASSED
@@ -47,6 +47,7 @@ fi
 # Dnsmasq state configuration
 tmpdir=$(mktemp -d)
 hostsfile="$tmpdir/hosts"
+policyfile="$tmpdir/policy"
 dm_pidfile="$tmpdir/dnsmasq.pid"
 xcmds+=("$(printf 'pkill -F %q' "$dm_pidfile")")
 xcmds+=("$(printf 'rm -rf %q' "$tmpdir")")
@@ -59,6 +60,10 @@ cat >"$hostsfile" <<HOSTS
 # An address that should be excluded by the policy.
 2001:db8::3 example.test
 HOSTS
+cat >"$policyfile" <<POLICY
+# Policy, used by integration tests
+test-net-1.test
+POLICY
 # Start dnsmasq for serving a local configuration
 dnsmasq \
     --log-facility=/dev/null --pid-file="$dm_pidfile" --no-hosts --no-resolv \
@@ -66,7 +71,7 @@ dnsmasq \
     --addn-hosts="$hostsfile" || fail "Failed to start dnsmasq"
 
 # Start daemon under test
-"$DNSALLOW" & xcmds+=("kill $!")
+"$DNSALLOW" --policy "$policyfile" & xcmds+=("kill $!")
 xcmds+=("ipset destroy dnsallow-ipv4")
 xcmds+=("ipset destroy dnsallow-ipv6")
 # Hopefully enough for the program to create ipsets and connect to the queue.
@@ -103,8 +108,7 @@ ipset test dnsallow-ipv4 $ipv4 || fail "Expected $ipv4 in set"
 ipset test dnsallow-ipv6 ${ipv6[0]} || fail "Expected ${ipv6[0]} in set"
 ipset test dnsallow-ipv6 ${ipv6[1]} || fail "Expected ${ipv6[1]} in set"
 
-# TODO: reject address according to policy
-#! ipset test dnsallow-ipv6 $ipv6_other || fail "Expected $ipv6_other not in set"
+! ipset test dnsallow-ipv6 $ipv6_other || fail "Expected $ipv6_other not in set"
 
 # Cleanup and show results
 trap '' EXIT; cleanup
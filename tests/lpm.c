@@ -0,0 +1,202 @@
+/**
+ * Test for longest prefix matching against a linear search.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dnsallow.h"
+
+#define NPREFIXES   2000
+#define NLOOKUPS    100000
+
+struct prefix {
+    struct address addr;
+    unsigned len;
+    uint32_t value;
+};
+
+static struct prefix prefixes[NPREFIXES];
+
+static uint32_t rnd(void)
+{
+    static uint64_t state = 0x853c49e6748fea9bULL;
+
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return state >> 33;
+}
+
+/* Whether the first 'len' bits of both addresses are equal. */
+static bool matches(const struct address *a, const struct address *b,
+        unsigned len)
+{
+    const uint8_t *x, *y;
+    unsigned i;
+
+    if (a->family != b->family)
+        return false;
+    x = a->family == AF_INET ? (const uint8_t *)&a->ip4_addr :
+        a->ip6_addr.s6_addr;
+    y = b->family == AF_INET ? (const uint8_t *)&b->ip4_addr :
+        b->ip6_addr.s6_addr;
+    for (i = 0; i < len; i++) {
+        if ((x[i / 8] ^ y[i / 8]) & (0x80 >> (i % 8)))
+            return false;
+    }
+    return true;
+}
+
+/* The last of the longest matching prefixes wins. */
+static bool linear_lookup(const struct address *addr, unsigned n,
+        uint32_t *value)
+{
+    int best = -1;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        if (matches(&prefixes[i].addr, addr, prefixes[i].len) &&
+                (best < 0 || prefixes[i].len >= prefixes[best].len))
+            best = i;
+    }
+    if (best >= 0)
+        *value = prefixes[best].value;
+    return best >= 0;
+}
+
+/* Random addresses from a few ranges such that prefixes overlap. */
+static void random_address(struct address *addr)
+{
+    uint32_t r = rnd();
+    unsigned i;
+
+    memset(addr, 0, sizeof(*addr));
+    if (r & 1) {
+        addr->family = AF_INET;
+        addr->ip4_addr.s_addr = htonl(0x0a000000 | (rnd() & 0x3ffff) << 6 |
+                (rnd() & 0x3f));
+    } else {
+        addr->family = AF_INET6;
+        addr->ip6_addr.s6_addr[0] = 0x20;
+        addr->ip6_addr.s6_addr[1] = 0x01;
+        for (i = 2; i < 16; i++)
+            addr->ip6_addr.s6_addr[i] = i < 6 || i > 13 ? rnd() & 3 : 0;
+    }
+}
+
+static int check_fixed(void)
+{
+    static const struct {
+        const char *prefix;
+        uint32_t value;
+    } table[] = {
+        { "0.0.0.0/0", 1 },
+        { "10.0.0.0/8", 2 },
+        { "10.1.0.0/16", 3 },
+        { "10.1.2.3", 4 },
+        { "10.1.2.3/31", 5 },
+        { "2001:db8::/32", 6 },
+        { "2001:db8::1/128", 7 },
+    };
+    static const struct {
+        const char *addr;
+        int value;          /* -1 if there is no match. */
+    } lookups[] = {
+        { "192.0.2.1", 1 }, { "10.9.9.9", 2 }, { "10.1.9.9", 3 },
+        { "10.1.2.3", 4 }, { "10.1.2.2", 5 }, { "10.1.2.4", 3 },
+        { "2001:db8::1", 7 }, { "2001:db8::2", 6 }, { "2001:db9::1", -1 },
+    };
+    struct address addr;
+    struct lpm *lpm;
+    unsigned i, len;
+    uint32_t value;
+    int failed = 0;
+
+    lpm = lpm_init();
+    for (i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+        if (parse_prefix(table[i].prefix, &addr, &len) < 0 ||
+                lpm_add(lpm, &addr, len, table[i].value) < 0) {
+            fprintf(stderr, "Failed: cannot add %s\n", table[i].prefix);
+            return 1;
+        }
+    }
+    if (lpm_build(lpm) < 0)
+        return 1;
+
+    for (i = 0; i < sizeof(lookups) / sizeof(lookups[0]); i++) {
+        parse_prefix(lookups[i].addr, &addr, &len);
+        if (!lpm_lookup(lpm, &addr, &value))
+            value = -1;
+        if ((int)value != lookups[i].value) {
+            fprintf(stderr, "Failed: %s: got %d, expected %d\n",
+                    lookups[i].addr, (int)value, lookups[i].value);
+            failed = 1;
+        }
+    }
+    lpm_fini(lpm);
+
+    if (parse_prefix("10.0.0.0/33", &addr, &len) == 0 ||
+            parse_prefix("10.0.0.0/", &addr, &len) == 0 ||
+            parse_prefix("example.com", &addr, &len) == 0) {
+        fprintf(stderr, "Failed: invalid prefix was accepted\n");
+        failed = 1;
+    }
+    return failed;
+}
+
+int main(void)
+{
+    struct address addr;
+    struct lpm *lpm;
+    uint32_t expected, value;
+    bool found;
+    unsigned i;
+    int failed;
+
+    failed = check_fixed();
+
+    lpm = lpm_init();
+    for (i = 0; i < NPREFIXES; i++) {
+        random_address(&prefixes[i].addr);
+        prefixes[i].len = prefixes[i].addr.family == AF_INET ?
+            8 + rnd() % 25 : 16 + rnd() % 113;
+        prefixes[i].value = i;
+        lpm_add(lpm, &prefixes[i].addr, prefixes[i].len, i);
+    }
+    if (lpm_build(lpm) < 0) {
+        fprintf(stderr, "Failed: cannot build table\n");
+        return 1;
+    }
+
+    for (i = 0; i < NLOOKUPS; i++) {
+        random_address(&addr);
+        found = linear_lookup(&addr, NPREFIXES, &expected);
+        if (lpm_lookup(lpm, &addr, &value) != found ||
+                (found && value != expected)) {
+            fprintf(stderr, "Failed: lookup %u: expected %d, got %d\n", i,
+                    found ? (int)expected : -1, (int)value);
+            failed = 1;
+            break;
+        }
+    }
+    lpm_fini(lpm);
+
+    if (failed)
+        return 1;
+    puts("Passed");
+    return 0;
+}
@@ -0,0 +1,127 @@
+/**
+ * Test for decoding names with every available decoder.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "dnsallow.h"
+
+/* Message with names at fixed offsets (no DNS header, parse_name does not care
+ * about it). */
+static const unsigned char msg[] = {
+    /* 0: www.Example.COM */
+    3, 'w', 'w', 'w', 7, 'E', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'C', 'O', 'M', 0,
+    /* 17: mail + pointer to 4 (example.com) */
+    4, 'm', 'a', 'i', 'l', 0xc0, 4,
+    /* 24: pointer to itself */
+    0xc0, 24,
+    /* 26: label with a NUL byte */
+    3, 'a', 0, 'b', 0,
+    /* 31: label with a dot */
+    3, 'a', '.', 'b', 0,
+    /* 36: root name */
+    0,
+    /* 37: forward pointer (to 41) */
+    0xc0, 41, 0, 0, 1, 'x', 0,
+    /* 44: 40-byte label with uppercase letters around vector boundaries,
+     * followed by a 9-byte label (truncated: no terminator) */
+    40, 'A', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'N',
+    'O', 'P', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z', '0', '1', '2',
+    '3', '4', '5', '6', '7', '8', '9', '-', '_', 'Z', '@',
+    9, 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i',
+};
+
+static const struct {
+    unsigned offset;
+    unsigned wirelen;       /* Zero if the name is invalid. */
+    const char *name;
+    unsigned label_count;
+} names[] = {
+    { 0,  17, "www.example.com", 3 },
+    { 17, 7,  "mail.example.com", 3 },
+    { 24, 0,  NULL, 0 },
+    { 26, 0,  NULL, 0 },
+    { 31, 0,  NULL, 0 },
+    { 36, 0,  NULL, 0 },
+    { 37, 0,  NULL, 0 },
+    { 44, 0,  NULL, 0 },
+};
+
+static int check_decoder(const char *decoder)
+{
+    char name[DNS_NAME_SIZE];
+    struct dns_labels labels;
+    unsigned char buf[42];
+    unsigned i, j, r;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        r = parse_name(msg, sizeof(msg), names[i].offset, name, &labels);
+        if (r != names[i].wirelen) {
+            printf("%s: name at %u: expected length %u, got %u\n", decoder,
+                    names[i].offset, names[i].wirelen, r);
+            failed = 1;
+            continue;
+        }
+        if (!r)
+            continue;
+        if (strcmp(name, names[i].name) ||
+                labels.count != names[i].label_count) {
+            printf("%s: name at %u: got %s with %u labels\n", decoder,
+                    names[i].offset, name, labels.count);
+            failed = 1;
+            continue;
+        }
+        for (j = 0; j < labels.count; j++) {
+            if (labels.hash[j] != policy_label_hash(name + labels.offset[j],
+                        labels.len[j])) {
+                printf("%s: name at %u: wrong hash for label %u\n", decoder,
+                        names[i].offset, j);
+                failed = 1;
+            }
+        }
+    }
+
+    /* The long label at the end of the buffer (no vector loads past it). */
+    memcpy(buf, msg + 44, 41);
+    buf[41] = 0;
+    r = parse_name(buf, sizeof(buf), 0, name, &labels);
+    if (r != sizeof(buf) || labels.count != 1 ||
+            strcmp(name, "abcdefghijklmnopqrstuvwxyz0123456789-_z@") ||
+            labels.hash[0] != policy_label_hash(name, 40)) {
+        printf("%s: long label was not decoded correctly\n", decoder);
+        failed = 1;
+    }
+    return failed;
+}
+
+int main()
+{
+    static const char *decoders[] = { "scalar", "sse2", "avx2" };
+    unsigned i;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(decoders) / sizeof(decoders[0]); i++) {
+        if (name_set_decoder(decoders[i]) == 0)
+            failed |= check_decoder(decoders[i]);
+    }
+
+    if (failed)
+        return 1;
+    puts("Passed");
+    return 0;
+}
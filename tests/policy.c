@@ -0,0 +1,229 @@
+/**
+ * Test for matching names against the policy.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dnsallow.h"
+
+static const char policy_text[] =
+    "# Test policy\n"
+    "example.com\n"
+    "  *.Example.NET  \n"
+    "\n"
+    "www.example.org.\n"
+    "*.deep.sub.example.org\n";
+
+static const struct {
+    const char *name;
+    int allowed;
+} names[] = {
+    { "example.com",            1 },
+    { "EXAMPLE.com",            1 },
+    { "www.example.com",        0 },
+    { "com",                    0 },
+    { "example.net",            0 },
+    { "www.example.net",        1 },
+    { "a.b.c.example.net",      1 },
+    { "www.example.org",        1 },
+    { "example.org",            0 },
+    { "sub.example.org",        0 },
+    { "deep.sub.example.org",   0 },
+    { "x.deep.sub.example.org", 1 },
+    { "example.co",             0 },
+    { "xexample.com",           0 },
+};
+
+static const char filter_text[] =
+    "*\n"
+    "!10.0.0.0/8\n"
+    "!fc00::/7\n"
+    "+10.9.0.0/16\n"
+    "*.corp.example 10.1.0.0/16  fd00:1::/48\n";
+
+static const struct {
+    const char *name;
+    const char *addr;
+    int allowed;
+} addresses[] = {
+    { "www.example.com",        "192.0.2.1",    1 },
+    { "www.example.com",        "10.1.2.3",     0 },
+    { "www.example.com",        "10.9.2.3",     1 },
+    { "www.example.com",        "fd00:1::1",    0 },
+    { "www.example.com",        "2001:db8::1",  1 },
+    { "a.corp.example",         "10.1.2.3",     1 },
+    { "a.corp.example",         "10.2.2.3",     0 },
+    { "a.corp.example",         "fd00:1::1",    1 },
+    { "a.corp.example",         "fd00:2::1",    0 },
+    { "corp.example",           "10.1.2.3",     0 },
+};
+
+/* Decodes a dotted name like the DNS parser does. */
+static void make_labels(const char *dotted, char *name,
+        struct dns_labels *labels)
+{
+    unsigned char wire[256];
+    unsigned pos = 0, len;
+
+    while (*dotted) {
+        len = strcspn(dotted, ".");
+        wire[pos++] = len;
+        memcpy(wire + pos, dotted, len);
+        pos += len;
+        dotted += len + (dotted[len] == '.');
+    }
+    wire[pos++] = 0;
+    parse_name(wire, pos, 0, name, labels);
+}
+
+static int check_addresses(struct policy *policy)
+{
+    char name[DNS_NAME_SIZE];
+    struct dns_labels labels;
+    struct address addr;
+    unsigned i, len;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(addresses) / sizeof(addresses[0]); i++) {
+        make_labels(addresses[i].name, name, &labels);
+        parse_prefix(addresses[i].addr, &addr, &len);
+        if ((policy_check_address(policy, name, &labels, &addr) == 0) !=
+                addresses[i].allowed) {
+            fprintf(stderr, "Failed: unexpected result for %s at %s\n",
+                    addresses[i].addr, addresses[i].name);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+static int check_names(struct policy *policy)
+{
+    unsigned i;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if ((policy_check(policy, names[i].name) == 0) != names[i].allowed) {
+            fprintf(stderr, "Failed: unexpected result for %s\n",
+                    names[i].name);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+static struct policy *load(const char *text)
+{
+    char filename[] = "/tmp/dnsallow-policy-XXXXXX";
+    struct policy *policy;
+    FILE *fp;
+    int fd;
+
+    fd = mkstemp(filename);
+    if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+        perror("Failed: cannot create policy file");
+        exit(1);
+    }
+    fputs(text, fp);
+    fclose(fp);
+
+    policy = policy_init(filename);
+    unlink(filename);
+    return policy;
+}
+
+int main(void)
+{
+    char image[] = "/tmp/dnsallow-image-XXXXXX";
+    char filter_image[] = "/tmp/dnsallow-image-XXXXXX";
+    struct policy *policy;
+    int failed, fd;
+
+    policy = load(policy_text);
+    if (!policy) {
+        fprintf(stderr, "Failed: cannot load policy\n");
+        return 1;
+    }
+
+    if (policy_rule_count(policy) != 4) {
+        fprintf(stderr, "Failed: unexpected rule count %u\n",
+                policy_rule_count(policy));
+        return 1;
+    }
+
+    failed = check_names(policy);
+
+    /* The compiled image must give the same results. */
+    fd = mkstemp(image);
+    if (fd < 0 || policy_write_image(policy, image) < 0) {
+        fprintf(stderr, "Failed: cannot write image\n");
+        return 1;
+    }
+    close(fd);
+    policy_fini(policy);
+
+    policy = policy_init(image);
+    unlink(image);
+    if (!policy || policy_verify_image(policy) < 0 ||
+            policy_rule_count(policy) != 4) {
+        fprintf(stderr, "Failed: cannot load image\n");
+        return 1;
+    }
+    failed |= check_names(policy);
+    policy_fini(policy);
+
+    /* Addresses are filtered the same way by the text and image policy. */
+    policy = load(filter_text);
+    if (!policy) {
+        fprintf(stderr, "Failed: cannot load filter policy\n");
+        return 1;
+    }
+    failed |= check_addresses(policy);
+    fd = mkstemp(filter_image);
+    if (fd < 0 || policy_write_image(policy, filter_image) < 0) {
+        fprintf(stderr, "Failed: cannot write image\n");
+        return 1;
+    }
+    close(fd);
+    policy_fini(policy);
+    policy = policy_init(filter_image);
+    unlink(filter_image);
+    if (!policy) {
+        fprintf(stderr, "Failed: cannot load filter image\n");
+        return 1;
+    }
+    failed |= check_addresses(policy);
+    policy_fini(policy);
+
+    /* Invalid rules must be rejected. */
+    policy = load("example..com\n");
+    if (policy) {
+        fprintf(stderr, "Failed: accepted invalid policy\n");
+        return 1;
+    }
+    policy = load("!10.0.0.0/33\n");
+    if (policy) {
+        fprintf(stderr, "Failed: accepted invalid prefix\n");
+        return 1;
+    }
+
+    if (!failed)
+        puts("Passed");
+    return failed;
+}
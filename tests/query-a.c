@@ -57,16 +57,17 @@ static int address_matches(struct address *addr, const char *addrstr_expect)
 int main(void)
 {
     int r;
+    struct dns_view view;
     struct dns_info info;
 
-    r = parse_ip_dns(ip_packet, sizeof(ip_packet), &info);
+    r = parse_ip_dns(ip_packet, sizeof(ip_packet), &view, &info);
     if (r != 1) {
         fprintf(stderr, "Failed: return code is %d\n", r);
         return 1;
     }
 
-    if (strcmp(info.name, "example.com")) {
-        fprintf(stderr, "Failed: name is \"%s\"\n", info.name);
+    if (strcmp(view.name, "example.com")) {
+        fprintf(stderr, "Failed: name is \"%s\"\n", view.name);
         return 1;
     }
 
@@ -77,6 +78,11 @@ int main(void)
 
     address_matches(&info.entries[0], "93.184.216.34");
 
+    if (info.ttl[0] != 21188) {
+        fprintf(stderr, "Failed: invalid TTL %u\n", info.ttl[0]);
+        return 1;
+    }
+
     puts("Passed");
     return 0;
 }
@@ -65,16 +65,17 @@ static int address_matches(struct address *addr, const char *addrstr_expect)
 int main(void)
 {
     int r;
+    struct dns_view view;
     struct dns_info info;
 
-    r = parse_ip_dns(ip_packet, sizeof(ip_packet), &info);
+    r = parse_ip_dns(ip_packet, sizeof(ip_packet), &view, &info);
     if (r != 1) {
         fprintf(stderr, "Failed: return code is %d\n", r);
         return 1;
     }
 
-    if (strcmp(info.name, "irc.geo.oftc.net")) {
-        fprintf(stderr, "Failed: name is \"%s\"\n", info.name);
+    if (strcmp(view.name, "irc.geo.oftc.net")) {
+        fprintf(stderr, "Failed: name is \"%s\"\n", view.name);
         return 1;
     }
 
@@ -0,0 +1,75 @@
+/**
+ * Test for a DNS response with a CNAME chain.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "dnsallow.h"
+
+/* www.example.com CNAME edge.cdn.net, stray CNAME other.cdn.net (not part of
+ * the chain), edge.cdn.net A 192.0.2.7 */
+static unsigned char ip_packet[] = {
+    0x45, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x40, 0x11, 0x00, 0x00,
+    0xc0, 0x00, 0x02, 0x35, 0x0a, 0x00, 0x00, 0x02, 0x00, 0x35, 0x9c, 0x40,
+    0x00, 0x6c, 0x00, 0x00, 0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x03,
+    0x00, 0x00, 0x00, 0x00, 0x03, 0x77, 0x77, 0x77, 0x07, 0x65, 0x78, 0x61,
+    0x6d, 0x70, 0x6c, 0x65, 0x03, 0x63, 0x6f, 0x6d, 0x00, 0x00, 0x01, 0x00,
+    0x01, 0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00,
+    0x0e, 0x04, 0x65, 0x64, 0x67, 0x65, 0x03, 0x63, 0x64, 0x6e, 0x03, 0x6e,
+    0x65, 0x74, 0x00, 0x05, 0x73, 0x74, 0x72, 0x61, 0x79, 0x00, 0x00, 0x05,
+    0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x08, 0x05, 0x6f, 0x74, 0x68,
+    0x65, 0x72, 0xc0, 0x32, 0xc0, 0x2d, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00,
+    0x00, 0x3c, 0x00, 0x04, 0xc0, 0x00, 0x02, 0x07
+};
+
+int main(void)
+{
+    int r;
+    struct dns_view view;
+    struct dns_info info;
+
+    r = parse_ip_dns(ip_packet, sizeof(ip_packet), &view, &info);
+    if (r != 1) {
+        fprintf(stderr, "Failed: return code is %d\n", r);
+        return 1;
+    }
+
+    if (strcmp(view.name, "www.example.com")) {
+        fprintf(stderr, "Failed: name is \"%s\"\n", view.name);
+        return 1;
+    }
+
+    if (info.cname_count != 1) {
+        fprintf(stderr, "Failed: invalid CNAME count %u\n", info.cname_count);
+        return 1;
+    }
+
+    if (strcmp(info.cnames[0], "edge.cdn.net") || info.cname_ttl[0] != 300) {
+        fprintf(stderr, "Failed: invalid CNAME \"%s\" (TTL %u)\n",
+                info.cnames[0], info.cname_ttl[0]);
+        return 1;
+    }
+
+    if (info.count != 1 || info.entries[0].family != AF_INET ||
+            memcmp(&info.entries[0].ip4_addr, "\xc0\x00\x02\x07", 4)) {
+        fprintf(stderr, "Failed: invalid address\n");
+        return 1;
+    }
+
+    puts("Passed");
+    return 0;
+}
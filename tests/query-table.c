@@ -0,0 +1,143 @@
+/**
+ * Test for matching responses with outstanding queries.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "dnsallow.h"
+
+/* 192.0.2.10:40000 -> 198.51.100.53:53, query for www.example.com A. */
+static const unsigned char query_pkt[] = {
+    0x45, 0x00, 0x00, 0x3d, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11, 0x00, 0x00,
+    0xc0, 0x00, 0x02, 0x0a, 0xc6, 0x33, 0x64, 0x35,
+    0x9c, 0x40, 0x00, 0x35, 0x00, 0x29, 0x00, 0x00,
+    0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x03, 0x77, 0x77, 0x77, 0x07, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65,
+    0x03, 0x63, 0x6f, 0x6d, 0x00, 0x00, 0x01, 0x00, 0x01
+};
+
+#define UDP_OFFSET      20
+#define ID_OFFSET       28
+#define QNAME_OFFSET    41
+
+/* Turns the query into its response (without answers). */
+static void make_response(unsigned char *pkt)
+{
+    unsigned char tmp[4];
+
+    memcpy(pkt, query_pkt, sizeof(query_pkt));
+    memcpy(tmp, pkt + 12, 4);
+    memcpy(pkt + 12, pkt + 16, 4);
+    memcpy(pkt + 16, tmp, 4);
+    memcpy(tmp, pkt + UDP_OFFSET, 2);
+    memcpy(pkt + UDP_OFFSET, pkt + UDP_OFFSET + 2, 2);
+    memcpy(pkt + UDP_OFFSET + 2, tmp, 2);
+    pkt[ID_OFFSET + 2] |= 0x80;
+}
+
+static bool match(struct query_table *table, const unsigned char *pkt,
+        uint32_t now)
+{
+    return query_table_match(table, pkt, sizeof(query_pkt), UDP_OFFSET + 8,
+            now);
+}
+
+static void add(struct query_table *table, const unsigned char *pkt,
+        uint32_t now)
+{
+    query_table_add(table, pkt, sizeof(query_pkt), UDP_OFFSET + 8, now);
+}
+
+int main(void)
+{
+    unsigned char response[sizeof(query_pkt)], pkt[sizeof(query_pkt)];
+    struct query_table *table;
+    int failed = 0;
+
+    table = query_table_init(64, NULL);
+    if (!table) {
+        fprintf(stderr, "Failed: cannot create table\n");
+        return 1;
+    }
+    make_response(response);
+
+    /* A response without a query is not accepted. */
+    if (match(table, response, 1000)) {
+        fprintf(stderr, "Failed: unsolicited response was matched\n");
+        failed = 1;
+    }
+
+    /* A response is accepted once. */
+    add(table, query_pkt, 1000);
+    if (!match(table, response, 1001) || match(table, response, 1001)) {
+        fprintf(stderr, "Failed: response was not matched once\n");
+        failed = 1;
+    }
+
+    /* The ID, port and question must be the same. */
+    add(table, query_pkt, 1000);
+    memcpy(pkt, response, sizeof(pkt));
+    pkt[ID_OFFSET + 1] ^= 1;
+    if (match(table, pkt, 1001)) {
+        fprintf(stderr, "Failed: response with another ID was matched\n");
+        failed = 1;
+    }
+    memcpy(pkt, response, sizeof(pkt));
+    pkt[UDP_OFFSET + 3] ^= 1;
+    if (match(table, pkt, 1001)) {
+        fprintf(stderr, "Failed: response to another port was matched\n");
+        failed = 1;
+    }
+    memcpy(pkt, response, sizeof(pkt));
+    pkt[QNAME_OFFSET] = 'v';
+    if (match(table, pkt, 1001)) {
+        fprintf(stderr, "Failed: response for another name was matched\n");
+        failed = 1;
+    }
+
+    /* Queries expire. */
+    if (match(table, response, 1100)) {
+        fprintf(stderr, "Failed: expired query was matched\n");
+        failed = 1;
+    }
+    query_table_fini(table);
+
+    /* Queries to other resolvers are not remembered. */
+    table = query_table_init(64, "203.0.113.0/24,2001:db8::53");
+    if (!table) {
+        fprintf(stderr, "Failed: cannot create table with resolvers\n");
+        return 1;
+    }
+    add(table, query_pkt, 1000);
+    if (match(table, response, 1001)) {
+        fprintf(stderr, "Failed: response from other resolver was matched\n");
+        failed = 1;
+    }
+    query_table_fini(table);
+
+    if (query_table_init(64, "203.0.113.0/24,") ||
+            query_table_init(64, "example.com")) {
+        fprintf(stderr, "Failed: invalid resolver list was accepted\n");
+        failed = 1;
+    }
+
+    if (failed)
+        return 1;
+    puts("Passed");
+    return 0;
+}
@@ -0,0 +1,185 @@
+/**
+ * Test for reading packets from pcap and pcapng files.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dnsallow.h"
+
+/* Response to an A query for example.com (see query-a.c). */
+static const unsigned char ip_packet[] = {
+    0x45, 0x00, 0x00, 0x49, 0xc7, 0xa0, 0x00, 0x00, 0x30, 0x11, 0xa8, 0xe9,
+    0x08, 0x08, 0x08, 0x08, 0x0a, 0x09, 0x00, 0x02, 0x00, 0x35, 0xd0, 0xb2,
+    0x00, 0x35, 0x9b, 0x1d, 0x77, 0x2c, 0x81, 0x80, 0x00, 0x01, 0x00, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x07, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65,
+    0x03, 0x63, 0x6f, 0x6d, 0x00, 0x00, 0x01, 0x00, 0x01, 0xc0, 0x0c, 0x00,
+    0x01, 0x00, 0x01, 0x00, 0x00, 0x52, 0xc4, 0x00, 0x04, 0x5d, 0xb8, 0xd8,
+    0x22
+};
+
+/* Ethernet header with a VLAN tag, followed by IPv4. */
+static const unsigned char eth_header[] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb,
+    0x81, 0x00, 0x00, 0x2a, 0x08, 0x00
+};
+
+static void put32(FILE *fp, uint32_t v)
+{
+    fwrite(&v, sizeof(v), 1, fp);
+}
+
+static void put16(FILE *fp, uint16_t v)
+{
+    fwrite(&v, sizeof(v), 1, fp);
+}
+
+/* Writes two Ethernet frames in the classic (microsecond) format. */
+static void write_pcap(FILE *fp)
+{
+    unsigned i, len = sizeof(eth_header) + sizeof(ip_packet);
+
+    put32(fp, 0xa1b2c3d4);
+    put16(fp, 2);
+    put16(fp, 4);
+    put32(fp, 0);
+    put32(fp, 0);
+    put32(fp, 65535);
+    put32(fp, 1);                   /* LINKTYPE_ETHERNET */
+    for (i = 0; i < 2; i++) {
+        put32(fp, 1000000000 + i);
+        put32(fp, 0);
+        put32(fp, len);
+        put32(fp, len);
+        fwrite(eth_header, sizeof(eth_header), 1, fp);
+        fwrite(ip_packet, sizeof(ip_packet), 1, fp);
+    }
+}
+
+/* Writes one raw IP packet in an enhanced packet block. */
+static void write_pcapng(FILE *fp)
+{
+    unsigned pad = (4 - sizeof(ip_packet) % 4) % 4;
+    unsigned epb_len = 32 + sizeof(ip_packet) + pad;
+
+    /* Section header block. */
+    put32(fp, 0x0a0d0d0a);
+    put32(fp, 28);
+    put32(fp, 0x1a2b3c4d);
+    put16(fp, 1);
+    put16(fp, 0);
+    put32(fp, 0xffffffff);
+    put32(fp, 0xffffffff);
+    put32(fp, 28);
+    /* Interface description block. */
+    put32(fp, 1);
+    put32(fp, 20);
+    put16(fp, 101);                 /* LINKTYPE_RAW */
+    put16(fp, 0);
+    put32(fp, 0);
+    put32(fp, 20);
+    /* Enhanced packet block. */
+    put32(fp, 6);
+    put32(fp, epb_len);
+    put32(fp, 0);
+    put32(fp, 0);
+    put32(fp, 0);
+    put32(fp, sizeof(ip_packet));
+    put32(fp, sizeof(ip_packet));
+    fwrite(ip_packet, sizeof(ip_packet), 1, fp);
+    fwrite("\0\0\0", pad, 1, fp);
+    put32(fp, epb_len);
+}
+
+static unsigned npackets;
+
+/* Defers the verdict of every packet. */
+static bool pkt_callback(const unsigned char *buf, unsigned buflen,
+        uint32_t pkt_id, void *data)
+{
+    (void)pkt_id;
+    (void)data;
+
+    if (buflen != sizeof(ip_packet) || memcmp(buf, ip_packet, buflen)) {
+        fprintf(stderr, "Failed: unexpected packet contents\n");
+        exit(1);
+    }
+    npackets++;
+    return true;
+}
+
+static void batch_done(void *data)
+{
+    (void)data;
+}
+
+static int replay(void (*write_capture)(FILE *fp), unsigned expected)
+{
+    char filename[] = "/tmp/dnsallow-replay-XXXXXX";
+    struct input_queue *iq;
+    unsigned verdicts = 0;
+    int fd, failed = 0;
+    FILE *fp;
+
+    fd = mkstemp(filename);
+    if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+        perror("Failed: cannot create capture file");
+        exit(1);
+    }
+    write_capture(fp);
+    fclose(fp);
+
+    npackets = 0;
+    iq = replay_init(filename, false, pkt_callback, batch_done, NULL);
+    unlink(filename);
+    if (!iq) {
+        fprintf(stderr, "Failed: cannot open capture\n");
+        return 1;
+    }
+
+    /* The end is only reported after all verdicts were given. */
+    while (queue_handle(iq) >= 0) {
+        if (queue_finished(iq) || verdicts == npackets) {
+            fprintf(stderr, "Failed: stuck at %u packets\n", npackets);
+            failed = 1;
+            break;
+        }
+        while (verdicts < npackets)
+            queue_verdict(iq, verdicts++);
+    }
+    if (!failed && (!queue_finished(iq) || npackets != expected)) {
+        fprintf(stderr, "Failed: got %u packets, expected %u\n", npackets,
+                expected);
+        failed = 1;
+    }
+    queue_fini(iq);
+    return failed;
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    failed |= replay(write_pcap, 2);
+    failed |= replay(write_pcapng, 1);
+
+    if (!failed)
+        puts("Passed");
+    return failed;
+}
@@ -0,0 +1,133 @@
+/**
+ * Test for recognizing repeated DNS responses.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "dnsallow.h"
+
+/* www.example.com CNAME edge.cdn.net, edge.cdn.net A 192.0.2.7 */
+static const unsigned char dns_msg[] = {
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+    0x03, 0x77, 0x77, 0x77, 0x07, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65,
+    0x03, 0x63, 0x6f, 0x6d, 0x00, 0x00, 0x01, 0x00, 0x01, 0xc0, 0x0c, 0x00,
+    0x05, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x0e, 0x04, 0x65, 0x64,
+    0x67, 0x65, 0x03, 0x63, 0x64, 0x6e, 0x03, 0x6e, 0x65, 0x74, 0x00, 0xc0,
+    0x2d, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04, 0xc0,
+    0x00, 0x02, 0x07
+};
+
+/* Offsets of the TTL of both answers and of the last address byte. */
+#define TTL1_OFFSET     39
+#define TTL2_OFFSET     65
+#define ADDR_OFFSET     74
+
+static enum resp_decision lookup(struct resp_cache *cache,
+        const unsigned char *msg, uint32_t now, uint32_t policy_gen,
+        uint32_t alias_gen, uint64_t *key)
+{
+    return resp_cache_lookup(cache, 0, msg, sizeof(dns_msg), now, policy_gen,
+            alias_gen, key);
+}
+
+int main(void)
+{
+    struct resp_cache *cache;
+    unsigned char msg[sizeof(dns_msg)];
+    uint64_t key, key2;
+    int failed = 0;
+
+    cache = resp_cache_init(16);
+    if (!cache) {
+        fprintf(stderr, "Failed: cannot create cache\n");
+        return 1;
+    }
+
+    if (lookup(cache, dns_msg, 1000, 0, 0, &key) != RESP_UNKNOWN || !key) {
+        fprintf(stderr, "Failed: unexpected hit in empty cache\n");
+        return 1;
+    }
+    resp_cache_add(cache, key, RESP_ALLOWED, 1030, 0, 0, 1);
+
+    /* Allowed responses are only reused once their addresses were
+     * committed. */
+    if (lookup(cache, dns_msg, 1000, 0, 0, &key2) != RESP_UNKNOWN) {
+        fprintf(stderr, "Failed: response was reused before the commit\n");
+        failed = 1;
+    }
+    resp_cache_commit(cache, true);
+
+    /* Another ID and lower TTLs: same response. */
+    memcpy(msg, dns_msg, sizeof(msg));
+    msg[0] ^= 0xff;
+    msg[TTL1_OFFSET + 3] = 0x01;
+    msg[TTL2_OFFSET + 3] = 0x02;
+    if (lookup(cache, msg, 1010, 0, 0, &key2) != RESP_ALLOWED || key2 != key) {
+        fprintf(stderr, "Failed: repeated response was not recognized\n");
+        failed = 1;
+    }
+
+    /* New aliases do not matter for allowed names, a new policy does. */
+    if (lookup(cache, msg, 1010, 0, 1, &key2) != RESP_ALLOWED ||
+            lookup(cache, msg, 1010, 1, 0, &key2) != RESP_UNKNOWN) {
+        fprintf(stderr, "Failed: wrong generation check for allowed name\n");
+        failed = 1;
+    }
+
+    /* Expired. */
+    if (lookup(cache, msg, 1030, 0, 0, &key2) != RESP_UNKNOWN) {
+        fprintf(stderr, "Failed: expired decision was used\n");
+        failed = 1;
+    }
+
+    /* Another address is another response. */
+    msg[ADDR_OFFSET] ^= 1;
+    if (lookup(cache, msg, 1010, 0, 0, &key2) != RESP_UNKNOWN ||
+            key2 == key) {
+        fprintf(stderr, "Failed: different response was matched\n");
+        failed = 1;
+    }
+
+    /* Rejected names may become allowed through a new alias. */
+    resp_cache_add(cache, key2, RESP_REJECTED, 1060, 0, 0, 2);
+    if (lookup(cache, msg, 1010, 0, 0, &key2) != RESP_REJECTED ||
+            lookup(cache, msg, 1010, 0, 1, &key2) != RESP_UNKNOWN) {
+        fprintf(stderr, "Failed: wrong generation check for rejected name\n");
+        failed = 1;
+    }
+
+    /* A failed commit forgets all decisions. */
+    resp_cache_commit(cache, false);
+    if (lookup(cache, msg, 1010, 0, 0, &key2) != RESP_UNKNOWN) {
+        fprintf(stderr, "Failed: decision was kept after a failed commit\n");
+        failed = 1;
+    }
+
+    /* Truncated messages are not cached. */
+    if (resp_cache_lookup(cache, 0, dns_msg, sizeof(dns_msg) - 1, 1010, 0, 0,
+                &key2) != RESP_UNKNOWN || key2 != 0) {
+        fprintf(stderr, "Failed: truncated message has a fingerprint\n");
+        failed = 1;
+    }
+
+    resp_cache_fini(cache);
+    if (failed)
+        return 1;
+    puts("Passed");
+    return 0;
+}
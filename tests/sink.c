@@ -0,0 +1,80 @@
+/**
+ * Test for merging duplicate addresses in a batch of a sink.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "dnsallow.h"
+
+#define BATCH_SIZE  4
+
+static void set_addr(struct address *addr, const char *ip)
+{
+    if (inet_pton(AF_INET, ip, &addr->ip4_addr) == 1) {
+        addr->family = AF_INET;
+    } else {
+        inet_pton(AF_INET6, ip, &addr->ip6_addr);
+        addr->family = AF_INET6;
+    }
+}
+
+int main(void)
+{
+    struct address addrs[BATCH_SIZE], addr;
+    uint32_t timeouts[BATCH_SIZE];
+    unsigned count = 0;
+    int failed = 0;
+
+    /* The same address twice in one batch keeps the longer timeout. */
+    set_addr(&addr, "192.0.2.1");
+    count = sink_buffer_add(addrs, timeouts, count, &addr, 60);
+    count = sink_buffer_add(addrs, timeouts, count, &addr, 300);
+    count = sink_buffer_add(addrs, timeouts, count, &addr, 120);
+    if (count != 1 || timeouts[0] != 300) {
+        fprintf(stderr, "Failed: IPv4 count %u timeout %u\n", count,
+                timeouts[0]);
+        failed = 1;
+    }
+
+    /* A permanent entry (zero timeout) wins over any timeout. */
+    set_addr(&addr, "2001:db8::1");
+    count = sink_buffer_add(addrs, timeouts, count, &addr, 60);
+    count = sink_buffer_add(addrs, timeouts, count, &addr, 0);
+    count = sink_buffer_add(addrs, timeouts, count, &addr, 600);
+    if (count != 2 || timeouts[1] != 0) {
+        fprintf(stderr, "Failed: IPv6 count %u timeout %u\n", count,
+                timeouts[1]);
+        failed = 1;
+    }
+
+    /* Different addresses are all kept. */
+    set_addr(&addr, "192.0.2.2");
+    count = sink_buffer_add(addrs, timeouts, count, &addr, 60);
+    set_addr(&addr, "2001:db8::2");
+    count = sink_buffer_add(addrs, timeouts, count, &addr, 60);
+    if (count != 4) {
+        fprintf(stderr, "Failed: expected 4 addresses, got %u\n", count);
+        failed = 1;
+    }
+
+    if (failed)
+        return 1;
+    puts("Passed");
+    return 0;
+}
@@ -0,0 +1,158 @@
+/**
+ * Test for restoring and compacting snapshots of allowed addresses.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "dnsallow.h"
+
+/* Remembers what was restored. */
+struct test_sink {
+    struct addr_sink base;
+    unsigned added;
+    unsigned commits;
+    char last[INET6_ADDRSTRLEN];
+    uint32_t timeouts[8];
+};
+
+static void test_add(struct addr_sink *base, const struct address *addr,
+        uint32_t timeout)
+{
+    struct test_sink *ts = (struct test_sink *)base;
+
+    inet_ntop(addr->family, addr->family == AF_INET ?
+            (const void *)&addr->ip4_addr : (const void *)&addr->ip6_addr,
+            ts->last, sizeof(ts->last));
+    if (ts->added < 8)
+        ts->timeouts[ts->added] = timeout;
+    ts->added++;
+}
+
+static bool test_commit(struct addr_sink *base)
+{
+    ((struct test_sink *)base)->commits++;
+    return true;
+}
+
+static void test_fini(struct addr_sink *base)
+{
+    (void)base;
+}
+
+static const struct sink_ops test_ops = {
+    .add        = test_add,
+    .commit     = test_commit,
+    .fini       = test_fini,
+};
+
+static unsigned count_lines(const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    unsigned lines = 0;
+    int c;
+
+    if (!fp)
+        return 0;
+    while ((c = getc(fp)) != EOF)
+        lines += c == '\n';
+    fclose(fp);
+    return lines;
+}
+
+int main(void)
+{
+    char filename[] = "/tmp/dnsallow-snapshot-XXXXXX";
+    static const char *const groups[] = { NULL, "lab" };
+    struct test_sink ts = { .base.ops = &test_ops };
+    struct test_sink lab = { .base.ops = &test_ops };
+    struct addr_sink *sinks[] = { &ts.base, &lab.base };
+    struct snapshot *snap;
+    struct address addr;
+    long now = time(NULL);
+    FILE *fp;
+    int fd, failed = 0;
+
+    fd = mkstemp(filename);
+    if (fd < 0)
+        return 1;
+    fp = fdopen(fd, "w");
+    fprintf(fp, "# comment\n");
+    fprintf(fp, "%ld 192.0.2.1 expired.example\n", now - 10);
+    fprintf(fp, "%ld 192.0.2.2 old.example\n", now + 100);
+    fprintf(fp, "%ld 192.0.2.2 new.example\n", now + 1000);
+    fprintf(fp, "%ld 192.0.2.2 older.example\n", now + 50);
+    fprintf(fp, "0 2001:db8::1 permanent.example\n");
+    fprintf(fp, "%ld 192.0.2.2 new.example lab\n", now + 1000);
+    fprintf(fp, "%ld 192.0.2.3 gone.example removed\n", now + 1000);
+    fprintf(fp, "garbage\n");
+    fclose(fp);
+
+    /* Only the unexpired entries are restored, in a single commit. */
+    snap = snapshot_open(filename, groups, 2, sinks);
+    if (!snap) {
+        unlink(filename);
+        return 1;
+    }
+    if (ts.added != 2 || ts.commits != 1 || ts.timeouts[0] < 990 ||
+            ts.timeouts[0] > 1000 || ts.timeouts[1] != 0) {
+        fprintf(stderr, "Failed: restored %u addresses in %u commits\n",
+                ts.added, ts.commits);
+        failed = 1;
+    }
+    /* Entries are restored to the sets of their group. */
+    if (lab.added != 1 || lab.commits != 1) {
+        fprintf(stderr, "Failed: restored %u group addresses\n", lab.added);
+        failed = 1;
+    }
+    /* Header and three entries. */
+    if (count_lines(filename) != 4) {
+        fprintf(stderr, "Failed: snapshot was not compacted\n");
+        failed = 1;
+    }
+
+    /* New entries are appended and restored the next time. */
+    addr.family = AF_INET;
+    inet_pton(AF_INET, "198.51.100.7", &addr.ip4_addr);
+    snapshot_add(snap, &addr, 0, 300, "www.example.com");
+    snapshot_commit(snap, 0, true);
+    /* Addresses that were not committed are not recorded. */
+    inet_pton(AF_INET, "198.51.100.8", &addr.ip4_addr);
+    snapshot_add(snap, &addr, 0, 300, "failed.example.com");
+    snapshot_commit(snap, 0, false);
+    snapshot_flush(snap);
+    snapshot_close(snap);
+
+    memset(&ts, 0, sizeof(ts));
+    ts.base.ops = &test_ops;
+    snap = snapshot_open(filename, groups, 1, sinks);
+    if (!snap || ts.added != 3 || strcmp(ts.last, "198.51.100.7")) {
+        fprintf(stderr, "Failed: appended entry was not restored\n");
+        failed = 1;
+    }
+    if (snap)
+        snapshot_close(snap);
+
+    unlink(filename);
+    if (failed)
+        return 1;
+    puts("Passed");
+    return 0;
+}
@@ -0,0 +1,195 @@
+/**
+ * Test for reassembling DNS messages from TCP segments.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "dnsallow.h"
+
+/* www.example.com CNAME edge.cdn.net, edge.cdn.net A 192.0.2.7 */
+static const unsigned char dns_msg[] = {
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+    0x03, 0x77, 0x77, 0x77, 0x07, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65,
+    0x03, 0x63, 0x6f, 0x6d, 0x00, 0x00, 0x01, 0x00, 0x01, 0xc0, 0x0c, 0x00,
+    0x05, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x0e, 0x04, 0x65, 0x64,
+    0x67, 0x65, 0x03, 0x63, 0x64, 0x6e, 0x03, 0x6e, 0x65, 0x74, 0x00, 0xc0,
+    0x2d, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04, 0xc0,
+    0x00, 0x02, 0x07
+};
+
+#define ISN         0xfffffff0  /* Tests wrapping of sequence numbers. */
+#define TCP_FIN     0x01
+#define TCP_SYN     0x02
+#define TCP_RST     0x04
+#define TCP_ACK     0x10
+
+/* The stream: two messages with their length prefixes. */
+static unsigned char stream[2 * (2 + sizeof(dns_msg))];
+
+static unsigned messages;
+static unsigned addresses;
+
+static void on_message(const unsigned char *msg, unsigned len, void *data)
+{
+    struct dns_view view;
+    struct dns_info info;
+    (void)data;
+
+    messages++;
+    if (parse_dns(msg, len, &view, &info) == 1 &&
+            !strcmp(view.name, "www.example.com"))
+        addresses += info.count;
+}
+
+/* Builds an IPv4/TCP packet from 192.0.2.53:53 to 10.0.0.2:40000 (port in
+ * 'sport' to distinguish flows), returns its length. */
+static unsigned make_segment(unsigned char *pkt, uint16_t sport, uint32_t seq,
+        uint8_t flags, const unsigned char *data, unsigned len)
+{
+    static const unsigned char ip_hdr[20] = {
+        0x45, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x40, 0x06, 0x00, 0x00,
+        0xc0, 0x00, 0x02, 0x35, 0x0a, 0x00, 0x00, 0x02,
+    };
+    unsigned total = 40 + len;
+
+    memcpy(pkt, ip_hdr, 20);
+    pkt[2] = total >> 8;
+    pkt[3] = total;
+    memset(pkt + 20, 0, 20);
+    pkt[20] = sport >> 8;
+    pkt[21] = sport;
+    pkt[22] = 40000 >> 8;
+    pkt[23] = 40000 & 0xff;
+    pkt[24] = seq >> 24;
+    pkt[25] = seq >> 16;
+    pkt[26] = seq >> 8;
+    pkt[27] = seq;
+    pkt[32] = 5 << 4;
+    pkt[33] = flags;
+    if (len)
+        memcpy(pkt + 40, data, len);
+    return total;
+}
+
+/* Sends stream[start..start+len) as one segment. */
+static void send_data(struct tcp_tracker *tracker, uint16_t sport,
+        unsigned start, unsigned len, uint8_t flags)
+{
+    unsigned char pkt[40 + sizeof(stream)];
+    unsigned pktlen;
+
+    pktlen = make_segment(pkt, sport, ISN + 1 + start, TCP_ACK | flags,
+            stream + start, len);
+    tcp_track(tracker, pkt, pktlen, 20, 1, on_message, NULL);
+}
+
+static void send_syn(struct tcp_tracker *tracker, uint16_t sport)
+{
+    unsigned char pkt[40];
+    unsigned pktlen;
+
+    pktlen = make_segment(pkt, sport, ISN, TCP_SYN | TCP_ACK, NULL, 0);
+    tcp_track(tracker, pkt, pktlen, 20, 1, on_message, NULL);
+}
+
+static int check(const char *what, unsigned expected_messages)
+{
+    if (messages != expected_messages || addresses != expected_messages) {
+        fprintf(stderr, "Failed: %s: %u messages and %u addresses, "
+                "expected %u\n", what, messages, addresses,
+                expected_messages);
+        return 1;
+    }
+    messages = addresses = 0;
+    return 0;
+}
+
+int main(void)
+{
+    struct tcp_tracker *tracker;
+    const unsigned n = 2 + sizeof(dns_msg);
+    unsigned i;
+    int failed = 0;
+
+    for (i = 0; i < 2; i++) {
+        stream[i * n] = sizeof(dns_msg) >> 8;
+        stream[i * n + 1] = sizeof(dns_msg) & 0xff;
+        memcpy(stream + i * n + 2, dns_msg, sizeof(dns_msg));
+    }
+
+    tracker = tcp_tracker_init(4, 16);
+    if (!tracker)
+        return 1;
+
+    /* Both messages in one segment. */
+    send_syn(tracker, 53);
+    send_data(tracker, 53, 0, 2 * n, TCP_FIN);
+    failed |= check("single segment", 2);
+
+    /* Without SYN, the start of a message is unknown. */
+    send_data(tracker, 53, 0, 2 * n, 0);
+    failed |= check("no SYN", 0);
+
+    /* Byte by byte, with the length prefix split as well. */
+    send_syn(tracker, 53);
+    for (i = 0; i < 2 * n; i++)
+        send_data(tracker, 53, i, 1, 0);
+    failed |= check("byte by byte", 2);
+    send_data(tracker, 53, 0, 0, TCP_RST);
+
+    /* Out of order, with a retransmission that overlaps both. */
+    send_syn(tracker, 53);
+    send_data(tracker, 53, n, n, 0);
+    send_data(tracker, 53, 10, n - 10, 0);
+    failed |= check("out of order", 0);
+    send_data(tracker, 53, 0, 20, 0);
+    failed |= check("gap filled", 2);
+    send_data(tracker, 53, 0, 2 * n, 0);
+    failed |= check("retransmission", 0);
+    send_data(tracker, 53, 0, 0, TCP_RST);
+
+    /* Retransmitted out-of-order data does not take more buffers. */
+    send_syn(tracker, 53);
+    for (i = 0; i < 64; i++)
+        send_data(tracker, 53, n, n, 0);
+    send_data(tracker, 53, 5, n + 10, 0);
+    failed |= check("retransmitted out of order", 0);
+    send_data(tracker, 53, 0, 10, 0);
+    failed |= check("retransmission gap filled", 2);
+    send_data(tracker, 53, 0, 0, TCP_RST);
+
+    /* Interleaved flows. */
+    send_syn(tracker, 53);
+    send_syn(tracker, 5353);
+    send_data(tracker, 53, 0, 3, 0);
+    send_data(tracker, 5353, 0, n + 3, 0);
+    send_data(tracker, 53, 3, n, 0);
+    failed |= check("interleaved", 2);
+
+    /* More flows than fit in the table: the least recently used is evicted. */
+    for (i = 0; i < 4; i++)
+        send_syn(tracker, 1000 + i);
+    send_data(tracker, 53, n + 3, n - 3, 0);
+    failed |= check("evicted", 0);
+
+    tcp_tracker_fini(tracker);
+    if (failed)
+        return 1;
+    puts("Passed");
+    return 0;
+}
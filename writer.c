@@ -0,0 +1,532 @@
+/**
+ * Asynchronous ipset writer, decoupling set updates from packet processing.
+ * Copyright (C) 2016 Peter Wu <peter@lekensteyn.nl>
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "dnsallow.h"
+
+/* Addresses of a single packet that must be in the set before the packet is
+ * accepted. */
+struct writer_request {
+    uint32_t pkt_id;
+    uint64_t received;          /* Opaque to the writer (see stats_now). */
+    unsigned group;             /* Client group, selects the sink. */
+    char name[DNS_NAME_SIZE];   /* Only set if there is a snapshot. */
+    unsigned count;
+    struct address addrs[DNS_MAX_ENTRIES];
+    uint32_t timeouts[DNS_MAX_ENTRIES];
+};
+
+struct writer_completion {
+    uint32_t pkt_id;
+    uint64_t received;
+    bool ok;                    /* Whether the addresses were committed. */
+};
+
+/**
+ * Every worker has its own channel such that the rings have a single producer
+ * and consumer. At most ring_capacity requests are in flight, so completions
+ * always fit in the completion ring. The backlog is emptied after every batch
+ * of packets, so it holds at most the requests that were in flight at the
+ * start of a batch plus those submitted during the batch. Requests of a
+ * channel complete in the order in which they were submitted.
+ */
+struct writer_channel {
+    struct writer *writer;
+    struct ring *requests;      /* Worker -> writer. */
+    struct ring *completions;   /* Writer -> worker. */
+    int event_fd;               /* Readable if completions are available. */
+
+    /* Owned by the worker. */
+    unsigned in_flight;
+    uint32_t last_seq;          /* Sequence number of the last request. */
+    bool submitted;             /* Requests were added since the last flush. */
+    struct writer_completion *backlog; /* Taken while waiting for room. */
+    unsigned backlog_size;
+    unsigned backlog_count;
+    unsigned backlog_pos;
+
+    /* Owned by the writer thread. */
+    struct writer_completion *done;
+    unsigned done_count;
+};
+
+struct writer {
+    pthread_t thread;
+    bool started;
+    bool stats;                 /* Whether the writer records statistics. */
+    /* A sink per client group, the global sets are group 0. */
+    unsigned ngroups;
+    struct addr_sink **sinks;
+    bool *dirty;                /* Whether a sink has uncommitted addresses. */
+    char (*group_names)[CLIENT_GROUP_NAME_MAX + 1];
+    const char **groups;        /* NULL or a group name, for snapshots. */
+    struct snapshot *snapshot;  /* NULL if disabled. */
+    /* Expiry times of added addresses, such that timeouts are never
+     * shortened by a later response with a lower TTL. */
+    struct addr_cache *expiry;
+    int event_fd;               /* Readable if requests are available. */
+    int stop_fd;                /* Readable if the writer must stop. */
+    unsigned nchannels;
+    struct writer_channel channels[];
+};
+
+/* Wakes up the reader of an eventfd. */
+static void notify(int fd)
+{
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        log_error("write eventfd: %s\n", strerror(errno));
+}
+
+/* Resets an eventfd after it became readable. */
+static void clear_notification(int fd)
+{
+    uint64_t value;
+
+    if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        log_error("read eventfd: %s\n", strerror(errno));
+}
+
+static uint32_t now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/* Takes all pending requests from a channel and adds their addresses. */
+static void process_requests(struct writer *writer, struct writer_channel *ch)
+{
+    struct writer_request req;
+    uint32_t now = now_seconds(), timeout;
+    unsigned i;
+
+    while (ch->done_count < ring_capacity(ch->requests) &&
+            ring_pop(ch->requests, &req)) {
+        for (i = 0; i < req.count; i++) {
+            /* Adding an address replaces the timeout of its entry. */
+            timeout = addr_cache_extend(writer->expiry, &req.addrs[i],
+                    req.group, now, req.timeouts[i]);
+            sink_add(writer->sinks[req.group], &req.addrs[i], timeout);
+            /* Only recorded once committed, see snapshot_commit. */
+            if (writer->snapshot)
+                snapshot_add(writer->snapshot, &req.addrs[i], req.group,
+                        timeout, req.name);
+        }
+        writer->dirty[req.group] |= req.count > 0;
+        ch->done[ch->done_count].pkt_id = req.pkt_id;
+        ch->done[ch->done_count++].received = req.received;
+    }
+}
+
+static void *writer_main(void *data)
+{
+    struct writer *writer = data;
+    struct writer_channel *ch;
+    struct pollfd fds[2];
+    unsigned i, j, processed;
+    uint64_t start;
+    bool ok, committed;
+
+    fds[0].fd = writer->event_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = writer->stop_fd;
+    fds[1].events = POLLIN;
+
+    log_thread_init();
+    if (writer->stats)
+        stats_thread_init();
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("poll: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents)
+            break;
+
+        /* Requests submitted after this point will trigger a new event. */
+        clear_notification(writer->event_fd);
+
+        for (;;) {
+            processed = 0;
+            for (i = 0; i < writer->nchannels; i++) {
+                process_requests(writer, &writer->channels[i]);
+                processed += writer->channels[i].done_count;
+            }
+            if (!processed)
+                break;
+
+            /* The addresses are in the sets once committed, only then can
+             * the packets be accepted. */
+            start = stats_now();
+            ok = true;
+            for (i = 0; i < writer->ngroups; i++) {
+                if (writer->dirty[i]) {
+                    writer->dirty[i] = false;
+                    committed = sink_commit(writer->sinks[i]);
+                    if (writer->snapshot)
+                        snapshot_commit(writer->snapshot, i, committed);
+                    ok &= committed;
+                }
+            }
+            if (!ok)
+                stats_count(STAT_IPSET_FAILED, processed);
+            stats_record(STAGE_IPSET, start, 1);
+
+            for (i = 0; i < writer->nchannels; i++) {
+                ch = &writer->channels[i];
+                if (!ch->done_count)
+                    continue;
+                for (j = 0; j < ch->done_count; j++) {
+                    ch->done[j].ok = ok;
+                    ring_push(ch->completions, &ch->done[j]);
+                }
+                ch->done_count = 0;
+                notify(ch->event_fd);
+            }
+
+            /* Does not wait for a compaction, see snapshot.c. */
+            if (writer->snapshot)
+                snapshot_flush(writer->snapshot);
+        }
+    }
+    return NULL;
+}
+
+static void channel_fini(struct writer_channel *ch)
+{
+    if (ch->requests)
+        ring_fini(ch->requests);
+    if (ch->completions)
+        ring_fini(ch->completions);
+    if (ch->event_fd >= 0)
+        close(ch->event_fd);
+    free(ch->backlog);
+    free(ch->done);
+}
+
+static int channel_init(struct writer *writer, struct writer_channel *ch,
+        unsigned depth)
+{
+    ch->writer = writer;
+    ch->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ch->event_fd < 0) {
+        log_error("eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+
+    ch->requests = ring_init(depth, sizeof(struct writer_request));
+    if (!ch->requests)
+        return -1;
+    /* Same capacity for completions, see struct writer_channel. */
+    depth = ring_capacity(ch->requests);
+    ch->completions = ring_init(depth, sizeof(struct writer_completion));
+    ch->backlog_size = depth + QUEUE_BATCH_SIZE;
+    ch->backlog = calloc(ch->backlog_size, sizeof(struct writer_completion));
+    ch->done = calloc(depth, sizeof(struct writer_completion));
+    if (!ch->completions || !ch->backlog || !ch->done)
+        return -1;
+    return 0;
+}
+
+/* Creates a sink for the global sets and for every client group. */
+static int sinks_init(struct writer *writer, const char *sink,
+        const struct client_table *clients)
+{
+    unsigned i;
+
+    writer->ngroups = clients ? client_group_count(clients) + 1 : 1;
+    writer->sinks = calloc(writer->ngroups, sizeof(*writer->sinks));
+    writer->dirty = calloc(writer->ngroups, sizeof(*writer->dirty));
+    writer->group_names = calloc(writer->ngroups,
+            sizeof(*writer->group_names));
+    writer->groups = calloc(writer->ngroups, sizeof(*writer->groups));
+    if (!writer->sinks || !writer->dirty || !writer->group_names ||
+            !writer->groups) {
+        log_error("Cannot allocate sinks\n");
+        return -1;
+    }
+
+    for (i = 0; i < writer->ngroups; i++) {
+        if (i > 0) {
+            strcpy(writer->group_names[i], client_group_name(clients, i));
+            writer->groups[i] = writer->group_names[i];
+        }
+        writer->sinks[i] = sink_init(sink, writer->groups[i]);
+        if (!writer->sinks[i])
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Creates a writer with its own address sinks (see sink_init) for 'nchannels'
+ * workers, each having up to 'depth' requests in flight. The expiry times of
+ * up to 'tracked' addresses are remembered to avoid shortening timeouts.
+ * There is a sink for the global sets and one for every group in 'clients'
+ * (which may be NULL).
+ * The writer stops when stop_fd becomes readable. If 'snapshot' is non-NULL,
+ * the addresses from that file are restored and added addresses are recorded
+ * there.
+ */
+struct writer *writer_init(unsigned nchannels, unsigned depth, int stop_fd,
+        unsigned tracked, bool stats, const char *sink,
+        const struct client_table *clients, const char *snapshot)
+{
+    struct writer *writer;
+    unsigned i;
+
+    writer = calloc(1, sizeof(*writer) +
+            nchannels * sizeof(writer->channels[0]));
+    if (!writer) {
+        log_error("calloc writer: %s\n", strerror(errno));
+        return NULL;
+    }
+    writer->stop_fd = stop_fd;
+    writer->stats = stats;
+    writer->nchannels = nchannels;
+    for (i = 0; i < nchannels; i++)
+        writer->channels[i].event_fd = -1;
+
+    writer->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (writer->event_fd < 0) {
+        log_error("eventfd: %s\n", strerror(errno));
+        goto err;
+    }
+
+    for (i = 0; i < nchannels; i++) {
+        if (channel_init(writer, &writer->channels[i], depth) < 0) {
+            log_error("Cannot allocate writer channel\n");
+            goto err;
+        }
+    }
+
+    writer->expiry = addr_cache_init(tracked);
+    if (!writer->expiry) {
+        log_error("Cannot allocate writer address cache\n");
+        goto err;
+    }
+
+    if (sinks_init(writer, sink, clients) < 0)
+        goto err;
+
+    if (snapshot) {
+        writer->snapshot = snapshot_open(snapshot, writer->groups,
+                writer->ngroups, writer->sinks);
+        if (!writer->snapshot)
+            goto err;
+    }
+
+    return writer;
+
+err:
+    writer_fini(writer);
+    return NULL;
+}
+
+/* Starts the writer thread. */
+int writer_start(struct writer *writer)
+{
+    if (pthread_create(&writer->thread, NULL, writer_main, writer)) {
+        log_error("Cannot start ipset writer thread\n");
+        return -1;
+    }
+    writer->started = true;
+    return 0;
+}
+
+/* Waits for the writer thread to stop (after stop_fd became readable). */
+void writer_join(struct writer *writer)
+{
+    if (writer->started) {
+        pthread_join(writer->thread, NULL);
+        writer->started = false;
+    }
+}
+
+void writer_fini(struct writer *writer)
+{
+    unsigned i;
+
+    writer_join(writer);
+    for (i = 0; i < writer->nchannels; i++)
+        channel_fini(&writer->channels[i]);
+    if (writer->event_fd >= 0)
+        close(writer->event_fd);
+    for (i = 0; writer->sinks && i < writer->ngroups; i++) {
+        if (writer->sinks[i])
+            sink_fini(writer->sinks[i]);
+    }
+    if (writer->snapshot)
+        snapshot_close(writer->snapshot);
+    if (writer->expiry)
+        addr_cache_fini(writer->expiry);
+    free(writer->sinks);
+    free(writer->dirty);
+    free(writer->group_names);
+    free(writer->groups);
+    free(writer);
+}
+
+/* Returns the channel for the worker with the given index. */
+struct writer_channel *writer_channel(struct writer *writer, unsigned index)
+{
+    return &writer->channels[index];
+}
+
+/* Returns a file descriptor that is readable if writer_complete may return
+ * more packet IDs. */
+int writer_channel_fd(struct writer_channel *ch)
+{
+    return ch->event_fd;
+}
+
+/* Wakes up the writer if requests were submitted. */
+void writer_flush(struct writer_channel *ch)
+{
+    if (ch->submitted) {
+        ch->submitted = false;
+        notify(ch->writer->event_fd);
+    }
+}
+
+/* Blocks until a completion is available and moves the completions to the
+ * backlog. Returns false if the writer is stopping. */
+static bool wait_for_room(struct writer_channel *ch)
+{
+    struct pollfd fds[2];
+    struct writer_completion completion;
+
+    fds[0].fd = ch->event_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = ch->writer->stop_fd;
+    fds[1].events = POLLIN;
+
+    writer_flush(ch);
+    for (;;) {
+        while (ch->backlog_count < ch->backlog_size &&
+                ring_pop(ch->completions, &completion)) {
+            ch->backlog[ch->backlog_count++] = completion;
+            ch->in_flight--;
+        }
+        if (ch->in_flight < ring_capacity(ch->requests))
+            return true;
+
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            log_error("poll: %s\n", strerror(errno));
+            return false;
+        }
+        if (fds[1].revents)
+            return false;
+        if (fds[0].revents)
+            clear_notification(ch->event_fd);
+    }
+}
+
+/**
+ * Queues the addresses from a packet (a response for 'name') for addition to
+ * the sets of a client group. pkt_id and 'received' are returned by
+ * writer_complete once the addresses are committed. If too many
+ * requests are in flight, this waits for the writer. Returns false if the
+ * request cannot be submitted because the writer is stopping.
+ */
+bool writer_submit(struct writer_channel *ch, uint32_t pkt_id,
+        uint64_t received, unsigned group, const char *name,
+        const struct address *addrs, const uint32_t *timeouts, unsigned count)
+{
+    struct writer_request req;
+    unsigned i;
+
+    if (ch->in_flight == ring_capacity(ch->requests) && !wait_for_room(ch))
+        return false;
+
+    req.pkt_id = pkt_id;
+    req.received = received;
+    req.group = group;
+    req.count = count;
+    if (ch->writer->snapshot)
+        strcpy(req.name, name);
+    for (i = 0; i < count; i++) {
+        req.addrs[i] = addrs[i];
+        req.timeouts[i] = timeouts[i];
+    }
+
+    /* Cannot fail, the writer has taken at least as many requests. */
+    ring_push(ch->requests, &req);
+    ch->in_flight++;
+    ch->last_seq++;
+    ch->submitted = true;
+    return true;
+}
+
+/**
+ * Returns the sequence number of the last submitted request. Requests are
+ * numbered from one and complete in order, so a worker can tell whether a
+ * request was completed by counting the calls of writer_complete.
+ */
+uint32_t writer_last_seq(const struct writer_channel *ch)
+{
+    return ch->last_seq;
+}
+
+/**
+ * Takes the ID of a packet whose request was completed, 'ok' is false if its
+ * addresses could not be committed. Returns false if there are no (more)
+ * completed requests. If writer_channel_fd was readable, call
+ * writer_channel_clear first.
+ */
+bool writer_complete(struct writer_channel *ch, uint32_t *pkt_id,
+        uint64_t *received, bool *ok)
+{
+    struct writer_completion completion;
+
+    if (ch->backlog_pos < ch->backlog_count) {
+        completion = ch->backlog[ch->backlog_pos++];
+        if (ch->backlog_pos == ch->backlog_count)
+            ch->backlog_pos = ch->backlog_count = 0;
+    } else if (ring_pop(ch->completions, &completion)) {
+        ch->in_flight--;
+    } else {
+        return false;
+    }
+
+    *pkt_id = completion.pkt_id;
+    *received = completion.received;
+    *ok = completion.ok;
+    return true;
+}
+
+/* Resets the readiness of writer_channel_fd before calling writer_complete. */
+void writer_channel_clear(struct writer_channel *ch)
+{
+    clear_notification(ch->event_fd);
+}